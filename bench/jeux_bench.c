@@ -0,0 +1,1619 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <semaphore.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <arpa/inet.h>
+#include <sys/wait.h>
+#include <netinet/tcp.h>
+
+#include "protocol.h"
+#include "client_registry.h"
+#include "player_registry.h"
+#include "player_registry_ext.h"
+#include "client_registry_ext.h"
+#include "intern.h"
+#include "id_scan.h"
+#include "client.h"
+#include "client_ext.h"
+#include "player.h"
+#include "game.h"
+#include "game_ext.h"
+#include "protocol_ext.h"
+#include "timer_wheel.h"
+#include "rating.h"
+#include "spectator.h"
+#include "glicko.h"
+#include "server.h"
+#include "server_ext.h"
+#include "uring.h"
+#include "coro.h"
+#include "workq.h"
+#include "shard.h"
+#include "cluster.h"
+#include "upgrade.h"
+#include "checkpoint.h"
+#include "session.h"
+#include "invitation.h"
+#include "csapp.h"
+#include "jeux_globals.h"
+
+/*
+ * Microbenchmarks for the hot paths of the Jeux server.
+ *
+ * Usage: jeux_bench [-t <threads>] [-s <scale>] [-f <filter>]
+ *
+ * Every benchmark is run once single-threaded and once with <threads>
+ * threads hammering the same shared state (the "contended" variant).
+ * Results are written to stdout as a single JSON document so that they
+ * can be collected per commit and compared mechanically.
+ */
+
+#define BENCH_DEFAULT_THREADS 4
+#define BENCH_DEFAULT_ITERS 200000
+#define BENCH_NAMES 48
+#define BENCH_TIMERS (1 << 20)
+#define BENCH_GLICKO_PLAYERS (1 << 20)
+#define BENCH_GLICKO_PERIODS 20
+#define BENCH_SCAN_IDS 100000
+#define BENCH_PIPELINE_DEPTH 64
+#define BENCH_NOTICE_BATCH 16
+#define BENCH_LOAD_CONNS 16
+#define BENCH_SESSIONS MAX_CLIENTS
+#define BENCH_CHECKPOINT_GAMES 100000
+#define BENCH_CHECKPOINT_PLAYERS 32
+#define BENCH_CLUSTER_SECRET "bench"
+#define BENCH_STRANDS 16
+#define BENCH_HEAVY_EVERY 64
+#define BENCH_HEAVY_COST 256
+
+typedef struct bench_case {
+    char *name;
+    long iters;                     /* Per-thread iterations at scale 1 */
+    void (*setup)(int nthreads);
+    void (*run)(int tid, long iters);
+    void (*teardown)(void);
+} BENCH_CASE;
+
+typedef struct bench_thread {
+    BENCH_CASE *bc;
+    int tid;
+    long iters;
+    pthread_barrier_t *start;
+} BENCH_THREAD;
+
+static char *names[BENCH_NAMES];
+static CLIENT *clients[BENCH_NAMES];
+static PLAYER *players[BENCH_NAMES];
+static int pairs[64][2];
+static TIMER *timers;
+static GLICKO *glickos[64];
+static int glicko_players;
+static int32_t *scan_ids;
+static volatile long sink;
+static int first_result = 1;
+static char *extra_key;                  /* An extra figure reported by a teardown */
+static double extra_value;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * Registry fixtures: BENCH_NAMES players registered in the player registry
+ * and logged in through the client registry with dummy file descriptors.
+ */
+static void registry_setup(int nthreads) {
+    client_registry = creg_init();
+    player_registry = preg_init();
+    for (int i = 0; i < BENCH_NAMES; i++) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "player%02d", i);
+        names[i] = strdup(buf);
+        players[i] = preg_register(player_registry, strdup(buf));
+        clients[i] = creg_register(client_registry, -1);
+        client_login(clients[i], players[i]);
+    }
+}
+
+static void registry_teardown(void) {
+    for (int i = 0; i < BENCH_NAMES; i++) {
+        creg_unregister(client_registry, clients[i]);
+        player_unref(players[i], "bench teardown");
+        free(names[i]);
+    }
+    creg_fini(client_registry);
+    preg_fini(player_registry);
+}
+
+static void bench_creg_lookup(int tid, long iters) {
+    for (long i = 0; i < iters; i++) {
+        CLIENT *client = creg_lookup(client_registry, names[(i + tid) % BENCH_NAMES]);
+        if (client) {
+            client_unref(client, "bench lookup");
+        }
+    }
+}
+
+static void bench_preg_register(int tid, long iters) {
+    for (long i = 0; i < iters; i++) {
+        PLAYER *player = preg_register(player_registry, strdup(names[(i + tid) % BENCH_NAMES]));
+        player_unref(player, "bench register");
+    }
+}
+
+static void bench_creg_all_players(int tid, long iters) {
+    for (long i = 0; i < iters; i++) {
+        PLAYER **list = creg_all_players(client_registry);
+        for (int j = 0; list[j]; j++) {
+            player_unref(list[j], "bench all players");
+        }
+        free(list);
+    }
+}
+
+/*
+ * Name resolution as done by LOGIN and INVITE, straight from the bytes of
+ * a packet payload.
+ */
+static void bench_login_name(int tid, long iters) {
+    for (long i = 0; i < iters; i++) {
+        char *name = names[(i + tid) % BENCH_NAMES];
+        PLAYER *player = preg_register_interned(player_registry, intern(name, 8));
+        player_unref(player, "bench login");
+    }
+}
+
+static void bench_invite_name(int tid, long iters) {
+    for (long i = 0; i < iters; i++) {
+        char *name = names[(i + tid) % BENCH_NAMES];
+        CLIENT *client = creg_lookup_interned(client_registry, intern_find(name, 8));
+        if (client) {
+            client_unref(client, "bench invite");
+        }
+    }
+}
+
+/*
+ * The scan behind USERS: every registered player that is logged in.
+ */
+static void bench_preg_online_players(int tid, long iters) {
+    for (long i = 0; i < iters; i++) {
+        PLAYER **list = preg_online_players(player_registry);
+        for (int j = 0; list[j]; j++) {
+            player_unref(list[j], "bench online players");
+        }
+        free(list);
+    }
+}
+
+static void bench_player_post_result(int tid, long iters) {
+    for (long i = 0; i < iters; i++) {
+        PLAYER *p1 = players[(i + tid) % BENCH_NAMES];
+        PLAYER *p2 = players[(i + tid + 1) % BENCH_NAMES];
+        player_post_result(p1, p2, i % 3);
+    }
+}
+
+/*
+ * The same results, posted to the rating thread.  The time measured is the
+ * time to post, which is what the thread finishing a game pays; teardown
+ * then waits for the queue to drain.
+ */
+static void rating_setup(int nthreads) {
+    registry_setup(nthreads);
+    rating_init(RATING_ELO, 0);
+}
+
+static void rating_teardown(void) {
+    rating_fini();
+    registry_teardown();
+}
+
+/*
+ * Plays complete games X:5 O:1 X:3 O:7 X:4 O:6 X:9 O:2 X:8 (a draw), so
+ * every move goes through game_apply_move and its win_check.
+ */
+static void bench_game_apply_move(int tid, long iters) {
+    static const char *moves[] = { "5", "1", "3", "7", "4", "6", "9", "2", "8" };
+    GAME *game = NULL;
+    int ply = 0;
+    for (long i = 0; i < iters; i++) {
+        if (!game) {
+            game = game_create();
+            ply = 0;
+        }
+        GAME_ROLE role = (ply % 2) ? SECOND_PLAYER_ROLE : FIRST_PLAYER_ROLE;
+        GAME_MOVE *move = game_parse_move(game, role, (char *)moves[ply]);
+        game_apply_move(game, move);
+        free(move);
+        if (++ply == 9 || game_is_over(game)) {
+            game_unref(game, "bench game over");
+            game = NULL;
+        }
+    }
+    if (game) {
+        game_unref(game, "bench game over");
+    }
+}
+
+static void bench_game_unparse_state(int tid, long iters) {
+    GAME *game = game_create();
+    GAME_MOVE *move = game_parse_move(game, FIRST_PLAYER_ROLE, "5");
+    game_apply_move(game, move);
+    free(move);
+    for (long i = 0; i < iters; i++) {
+        char *state = game_unparse_state(game);
+        sink += state[0];
+        free(state);
+    }
+    game_unref(game, "bench unparse");
+}
+
+static void bench_game_pack_state(int tid, long iters) {
+    GAME *game = game_create();
+    GAME_MOVE *move = game_parse_move(game, FIRST_PLAYER_ROLE, "5");
+    game_apply_move(game, move);
+    free(move);
+    for (long i = 0; i < iters; i++) {
+        unsigned char state[JEUX_PACKED_STATE_SIZE];
+        game_pack_state(game, state);
+        sink += state[0];
+    }
+    game_unref(game, "bench pack");
+}
+
+/*
+ * Every thread posts to the mailbox of one shared game and waits for its
+ * message to be handled, as the players of a game do with their moves.
+ * The handler's count is not atomic: the mailbox is what keeps it right.
+ */
+static GAME *mailbox_game;
+static long mailbox_handled;
+
+static void mailbox_setup(int nthreads) {
+    mailbox_game = game_create();
+    mailbox_handled = 0;
+}
+
+static void mailbox_teardown(void) {
+    sink += mailbox_handled;
+    game_unref(mailbox_game, "bench mailbox");
+}
+
+static void mailbox_count(GAME_MSG *msg) {
+    mailbox_handled++;
+}
+
+static void bench_game_mailbox(int tid, long iters) {
+    for (long i = 0; i < iters; i++) {
+        GAME_MSG msg = { .handle = mailbox_count };
+        game_call(mailbox_game, &msg);
+    }
+}
+
+/*
+ * Each thread owns one socketpair and ping-pongs a MOVED-sized packet
+ * through proto_send_packet and proto_recv_packet.
+ */
+static void proto_setup(int nthreads) {
+    for (int i = 0; i < nthreads; i++) {
+        socketpair(AF_UNIX, SOCK_STREAM, 0, pairs[i]);
+    }
+}
+
+static void proto_teardown(void) {
+    for (int i = 0; i < 64; i++) {
+        if (pairs[i][0] > 0) {
+            close(pairs[i][0]);
+            close(pairs[i][1]);
+        }
+        pairs[i][0] = pairs[i][1] = 0;
+    }
+}
+
+/*
+ * USERS with every registry fixture player logged in: each thread has a
+ * client on its own socketpair, and reads back the response.
+ */
+void show_users(CLIENT *client);
+
+static CLIENT *users_clients[64];
+
+static void users_setup(int nthreads) {
+    registry_setup(nthreads);
+    proto_setup(nthreads);
+    for (int i = 0; i < nthreads; i++) {
+        users_clients[i] = creg_register(client_registry, pairs[i][0]);
+    }
+}
+
+static void users_teardown(void) {
+    for (int i = 0; i < 64 && users_clients[i]; i++) {
+        creg_unregister(client_registry, users_clients[i]);
+        users_clients[i] = NULL;
+    }
+    proto_teardown();
+    registry_teardown();
+}
+
+static void bench_show_users(int tid, long iters) {
+    if (!users_clients[tid]) {
+        return;
+    }
+    for (long i = 0; i < iters; i++) {
+        show_users(users_clients[tid]);
+        JEUX_PACKET_HEADER hdr;
+        void *data = NULL;
+        proto_recv_packet(pairs[tid][1], &hdr, &data);
+        free(data);
+    }
+}
+
+/*
+ * Notifications through a client's mailbox: each thread has a client on
+ * its own socketpair, posts MOVED-sized notices to it as another client's
+ * thread would, and every BENCH_NOTICE_BATCH of them serves the client as
+ * its I/O thread does, writing them out, then reads them back.
+ */
+static int notice_fds[64];
+
+static void notice_setup(int nthreads) {
+    users_setup(nthreads);
+    for (int i = 0; i < nthreads; i++) {
+        notice_fds[i] = client_open_mailbox(users_clients[i]);
+    }
+}
+
+static void bench_notice_mailbox(int tid, long iters) {
+    CLIENT *client = users_clients[tid];
+    char state[JEUX_PACKED_STATE_SIZE] = {0};
+    char buf[BENCH_NOTICE_BATCH * (sizeof(JEUX_PACKET_HEADER) + sizeof(state))];
+    JEUX_PACKET_HEADER hdr = {0};
+    hdr.type = JEUX_MOVED_PKT;
+    hdr.size = htons(sizeof(state));
+    for (long i = 0; i < iters; i += BENCH_NOTICE_BATCH) {
+        int n = iters - i < BENCH_NOTICE_BATCH ? iters - i : BENCH_NOTICE_BATCH;
+        for (int k = 0; k < n; k++) {
+            client_post_notice(client, &hdr, state);
+        }
+        eventfd_t count;
+        eventfd_read(notice_fds[tid], &count);
+        client_flush_notices(client);
+        rio_readn(pairs[tid][1], buf, n * (sizeof(JEUX_PACKET_HEADER) + sizeof(state)));
+    }
+}
+
+static void bench_proto_send_recv(int tid, long iters) {
+    char payload[56];
+    memset(payload, 'x', sizeof(payload));
+    for (long i = 0; i < iters; i++) {
+        JEUX_PACKET_HEADER hdr = {0};
+        hdr.type = JEUX_MOVED_PKT;
+        hdr.size = htons(sizeof(payload));
+        proto_send_packet(pairs[tid][0], &hdr, payload);
+        void *data = NULL;
+        proto_recv_packet(pairs[tid][1], &hdr, &data);
+        free(data);
+    }
+}
+
+/*
+ * A bot's requests through a real service thread on a socketpair: each
+ * thread logs in with JEUX_CAP_CORRELATION and then sends REVOKEs that
+ * are NACKed, either waiting for each reply before sending the next
+ * request, or BENCH_PIPELINE_DEPTH requests at a time in one write.
+ */
+static int bot_fds[64];
+static PROTO_READER *bot_readers[64];
+
+static void bot_setup(int nthreads) {
+    client_registry = creg_init();
+    player_registry = preg_init();
+    for (int i = 0; i < nthreads; i++) {
+        int sv[2];
+        socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+        int *connfd = malloc(sizeof(int));
+        *connfd = sv[0];
+        pthread_t thread;
+        pthread_create(&thread, NULL, jeux_client_service, connfd);
+        bot_fds[i] = sv[1];
+        bot_readers[i] = proto_reader_create(sv[1]);
+        char name[32];
+        JEUX_PACKET_HEADER hdr = {0};
+        hdr.type = JEUX_LOGIN_PKT;
+        hdr.role = JEUX_CAP_CORRELATION;
+        hdr.size = htons(snprintf(name, sizeof(name), "bot%02d", i));
+        proto_send_packet(sv[1], &hdr, name);
+        void *data = NULL;
+        proto_reader_recv(bot_readers[i], &hdr, &data);
+        free(data);
+    }
+}
+
+static void bot_teardown(void) {
+    for (int i = 0; i < 64 && bot_readers[i]; i++) {
+        proto_reader_free(bot_readers[i]);
+        bot_readers[i] = NULL;
+        close(bot_fds[i]);
+    }
+    creg_wait_for_empty(client_registry);
+    creg_fini(client_registry);
+    preg_fini(player_registry);
+}
+
+static void bot_request(JEUX_PACKET_HEADER *hdr, long tag) {
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->type = JEUX_REVOKE_PKT;
+    hdr->id = 255;
+    hdr->timestamp_sec = htonl(tag);
+}
+
+static void bot_reply(int tid, long tag) {
+    JEUX_PACKET_HEADER hdr;
+    void *data = NULL;
+    proto_reader_recv(bot_readers[tid], &hdr, &data);
+    free(data);
+    if (ntohl(hdr.timestamp_sec) != (uint32_t)tag) {
+        fprintf(stderr, "reply to request %ld out of order\n", tag);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void bench_requests_lockstep(int tid, long iters) {
+    for (long i = 0; i < iters; i++) {
+        JEUX_PACKET_HEADER hdr;
+        bot_request(&hdr, i);
+        proto_send_packet(bot_fds[tid], &hdr, NULL);
+        bot_reply(tid, i);
+    }
+}
+
+static void bench_requests_pipelined(int tid, long iters) {
+    JEUX_PACKET_HEADER batch[BENCH_PIPELINE_DEPTH];
+    for (long i = 0; i < iters; i += BENCH_PIPELINE_DEPTH) {
+        int n = iters - i < BENCH_PIPELINE_DEPTH ? iters - i : BENCH_PIPELINE_DEPTH;
+        for (int j = 0; j < n; j++) {
+            bot_request(&batch[j], i + j);
+        }
+        if (write(bot_fds[tid], batch, n * sizeof(JEUX_PACKET_HEADER)) < 0) {
+            return;
+        }
+        for (int j = 0; j < n; j++) {
+            bot_reply(tid, i + j);
+        }
+    }
+}
+
+/*
+ * Load test of the I/O backends over loopback TCP: each thread keeps
+ * BENCH_LOAD_CONNS logged-in connections busy with one REVOKE (NACKed)
+ * in flight on each.  Besides throughput, the read and write system
+ * calls made by the server, plus the io_uring_enter calls made by the
+ * io_uring event loop, are reported per request.  They are the calls
+ * made by the whole process, as counted in /proc/self/io, less those
+ * made by the bench threads themselves.  With load_pooled, the io_uring
+ * event loop hands the requests to as many workers as threads.
+ *
+ * The game cases use the same connections in pairs, each pair playing
+ * whole games of tic-tac-toe (won by the first player in five moves),
+ * all pairs of a thread in step; an op is one game.  They compare the
+ * pooled backend with and without game affinity.
+ */
+static int load_listen_fd;
+static int load_uring;
+static int load_flags;                  /* For uring_start() */
+static char load_names[64][BENCH_LOAD_CONNS][32];
+static pthread_t load_acceptor;
+static int load_fds[64][BENCH_LOAD_CONNS];
+static PROTO_READER *load_readers[64][BENCH_LOAD_CONNS];
+static long load_process_syscalls;
+static long load_enters;
+static atomic_long load_client_syscalls;
+static atomic_long load_ops;
+
+static long io_syscalls(const char *path) {
+    FILE *f = fopen(path, "r");
+    char key[32];
+    long value, total = 0;
+    while (f && fscanf(f, "%31s %ld", key, &value) == 2) {
+        if (!strcmp(key, "syscr:") || !strcmp(key, "syscw:")) {
+            total += value;
+        }
+    }
+    if (f) {
+        fclose(f);
+    }
+    return total;
+}
+
+static void *load_accept(void *arg) {
+    while (1) {
+        int *connfd = malloc(sizeof(int));
+        *connfd = accept(load_listen_fd, NULL, NULL);
+        if (*connfd < 0) {
+            free(connfd);
+            return NULL;
+        }
+        pthread_t thread;
+        pthread_create(&thread, NULL, jeux_client_service, connfd);
+    }
+}
+
+static void load_setup(int nthreads) {
+    static int generation;
+    generation++;
+    client_registry = creg_init();
+    player_registry = preg_init();
+    load_listen_fd = Open_listenfd("0");
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    getsockname(load_listen_fd, (struct sockaddr *)&addr, &len);
+    if (load_flags & URING_POOLED) {
+        workq_init(nthreads, WORKQ_STEALING);
+    }
+    if (load_uring && uring_start(load_listen_fd, load_flags)) {
+        fprintf(stderr, "io_uring is not available, loading the threads backend\n");
+    }
+    else if (!load_uring) {
+        pthread_create(&load_acceptor, NULL, load_accept, NULL);
+    }
+    for (int i = 0; i < nthreads; i++) {
+        for (int j = 0; j < BENCH_LOAD_CONNS; j++) {
+            int fd = socket(AF_INET, SOCK_STREAM, 0);
+            connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+            load_fds[i][j] = fd;
+            load_readers[i][j] = proto_reader_create(fd);
+            char *name = load_names[i][j];
+            JEUX_PACKET_HEADER hdr = {0};
+            hdr.type = JEUX_LOGIN_PKT;
+            hdr.role = JEUX_CAP_CORRELATION;
+            hdr.size = htons(snprintf(name, sizeof(load_names[i][j]), "load%d_%02d_%02d", generation, i, j));
+            proto_send_packet(fd, &hdr, name);
+            void *data = NULL;
+            proto_reader_recv(load_readers[i][j], &hdr, &data);
+            free(data);
+        }
+    }
+    atomic_store(&load_client_syscalls, 0);
+    atomic_store(&load_ops, 0);
+    load_process_syscalls = io_syscalls("/proc/self/io");
+    load_enters = uring_enter_count();
+}
+
+static void load_setup_threads(int nthreads) {
+    load_uring = 0;
+    load_flags = 0;
+    load_setup(nthreads);
+}
+
+static void load_setup_uring(int nthreads) {
+    load_uring = 1;
+    load_flags = 0;
+    load_setup(nthreads);
+}
+
+static void load_setup_pooled(int nthreads) {
+    load_uring = 1;
+    load_flags = URING_POOLED;
+    load_setup(nthreads);
+}
+
+static void load_teardown(void) {
+    long server = io_syscalls("/proc/self/io") - load_process_syscalls -
+                  atomic_load(&load_client_syscalls) + uring_enter_count() - load_enters;
+    extra_key = "syscalls_per_op";
+    extra_value = (double)server / atomic_load(&load_ops);
+    for (int i = 0; i < 64; i++) {
+        for (int j = 0; j < BENCH_LOAD_CONNS && load_readers[i][j]; j++) {
+            proto_reader_free(load_readers[i][j]);
+            load_readers[i][j] = NULL;
+            close(load_fds[i][j]);
+        }
+    }
+    creg_wait_for_empty(client_registry);
+    if (load_uring) {
+        uring_stop();
+        workq_fini();
+    }
+    else {
+        shutdown(load_listen_fd, SHUT_RDWR);
+        pthread_join(load_acceptor, NULL);
+    }
+    close(load_listen_fd);
+    creg_fini(client_registry);
+    preg_fini(player_registry);
+}
+
+/*
+ * Games post results and publish states, so they need the services that
+ * the server starts for them.
+ */
+static void games_setup(int nthreads, int flags) {
+    rating_init(RATING_ELO, 0);
+    spectator_init(0);
+    load_uring = 1;
+    load_flags = flags;
+    load_setup(nthreads);
+}
+
+static void games_setup_pooled(int nthreads) {
+    games_setup(nthreads, URING_POOLED);
+}
+
+static void games_setup_affinity(int nthreads) {
+    games_setup(nthreads, URING_POOLED | URING_AFFINITY);
+}
+
+static void games_teardown(void) {
+    load_teardown();
+    spectator_fini();
+    rating_fini();
+}
+
+static void bench_load(int tid, long iters) {
+    long before = io_syscalls("/proc/thread-self/io");
+    long rounds = iters > BENCH_LOAD_CONNS ? iters / BENCH_LOAD_CONNS : 1;
+    for (long r = 0; r < rounds; r++) {
+        for (int j = 0; j < BENCH_LOAD_CONNS; j++) {
+            JEUX_PACKET_HEADER hdr;
+            bot_request(&hdr, r);
+            proto_send_packet(load_fds[tid][j], &hdr, NULL);
+        }
+        for (int j = 0; j < BENCH_LOAD_CONNS; j++) {
+            JEUX_PACKET_HEADER hdr;
+            void *data = NULL;
+            proto_reader_recv(load_readers[tid][j], &hdr, &data);
+            free(data);
+        }
+    }
+    atomic_fetch_add(&load_ops, rounds * BENCH_LOAD_CONNS);
+    //the /proc reads themselves count as one read each
+    atomic_fetch_add(&load_client_syscalls, io_syscalls("/proc/thread-self/io") - before + 1);
+}
+
+/*
+ * Read n packets from a connection, returning the id of the last.
+ */
+static int game_recv(PROTO_READER *reader, int n) {
+    JEUX_PACKET_HEADER hdr = {0};
+    for (int i = 0; i < n; i++) {
+        void *data = NULL;
+        proto_reader_recv(reader, &hdr, &data);
+        free(data);
+    }
+    return hdr.id;
+}
+
+static void game_send(int fd, int type, int id, int role, char *payload) {
+    JEUX_PACKET_HEADER hdr = {0};
+    hdr.type = type;
+    hdr.id = id;
+    hdr.role = role;
+    hdr.size = htons(payload ? strlen(payload) : 0);
+    proto_send_packet(fd, &hdr, payload);
+}
+
+static void bench_games(int tid, long iters) {
+    static char *moves[] = { "1", "4", "2", "5", "3" };
+    int pairs = BENCH_LOAD_CONNS / 2;
+    int *fds = load_fds[tid];
+    PROTO_READER **readers = load_readers[tid];
+    int ids[BENCH_LOAD_CONNS];
+    long games = iters > pairs ? iters / pairs : 1;
+    for (long g = 0; g < games; g++) {
+        //the first of each pair invites the second to play second
+        for (int p = 0; p < pairs; p++) {
+            game_send(fds[2 * p], JEUX_INVITE_PKT, 0, SECOND_PLAYER_ROLE, load_names[tid][2 * p + 1]);
+        }
+        for (int p = 0; p < pairs; p++) {
+            ids[2 * p] = game_recv(readers[2 * p], 1);
+            ids[2 * p + 1] = game_recv(readers[2 * p + 1], 1);
+            game_send(fds[2 * p + 1], JEUX_ACCEPT_PKT, ids[2 * p + 1], 0, NULL);
+        }
+        for (int p = 0; p < pairs; p++) {
+            game_recv(readers[2 * p], 1);
+            game_recv(readers[2 * p + 1], 1);
+        }
+        for (int m = 0; m < 5; m++) {
+            int mover = m % 2;
+            for (int p = 0; p < pairs; p++) {
+                game_send(fds[2 * p + mover], JEUX_MOVE_PKT, ids[2 * p + mover], 0, moves[m]);
+            }
+            //the last move also ends the game for both
+            for (int p = 0; p < pairs; p++) {
+                game_recv(readers[2 * p], m < 4 ? 1 : 2);
+                game_recv(readers[2 * p + 1], m < 4 ? 1 : 2);
+            }
+        }
+    }
+    atomic_fetch_add(&load_ops, games * pairs * 7);
+}
+
+/*
+ * The sharded cases play the same games against a server forked as many
+ * shards as threads, each serving connections with a thread per client.
+ * The players of each thread belong to one shard, so that the shards
+ * share nothing; with games_sharded_cross, the second player of each
+ * pair belongs to the next shard, so that every game is kept by one
+ * shard and copied to another.
+ */
+static int sharded_cross;
+
+static void serve_init(void) {
+    client_registry = creg_init();
+    player_registry = preg_init();
+    rating_init(RATING_ELO, 0);
+    spectator_init(0);
+}
+
+/*
+ * Serve connections with a thread per client, until killed by the
+ * teardown, once the forked server has said it is ready.
+ */
+static void serve_forever(int ready_fd, int (*next)(int listen_fd)) {
+    if (write(ready_fd, "", 1) < 0) {
+        _exit(EXIT_FAILURE);
+    }
+    close(ready_fd);
+    while (1) {
+        int *connfd = malloc(sizeof(int));
+        *connfd = next(load_listen_fd);
+        if (*connfd < 0) {
+            free(connfd);
+            continue;
+        }
+        //as with the pooled backend, notifications are written by other
+        //threads than the replies, and Nagle's algorithm would hold them back
+        int one = 1;
+        setsockopt(*connfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        pthread_t thread;
+        pthread_create(&thread, NULL, jeux_client_service, connfd);
+    }
+}
+
+static void sharded_serve(int ready_fd) {
+    serve_init();
+    shard_start(0);
+    serve_forever(ready_fd, shard_accept);
+}
+
+static void sharded_setup(int nthreads) {
+    static int generation;
+    generation++;
+    //the port is found with a socket of the parent's own, which it closes
+    //once every shard listens on the port too
+    int probe = shard_listen("0");
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    getsockname(probe, (struct sockaddr *)&addr, &len);
+    char port[8];
+    snprintf(port, sizeof(port), "%d", ntohs(addr.sin_port));
+    int ready[2];
+    if (pipe(ready) || shard_init(nthreads)) {
+        exit(EXIT_FAILURE);
+    }
+    int index = shard_fork();
+    if (index >= 0) {
+        close(probe);
+        close(ready[0]);
+        load_listen_fd = shard_listen(port);
+        sharded_serve(ready[1]);
+    }
+    close(ready[1]);
+    for (int i = 0; i < nthreads; i++) {
+        char byte;
+        if (read(ready[0], &byte, 1) != 1) {
+            exit(EXIT_FAILURE);
+        }
+    }
+    close(ready[0]);
+    close(probe);
+    for (int i = 0; i < nthreads; i++) {
+        int k = 0;
+        for (int j = 0; j < BENCH_LOAD_CONNS; j++) {
+            int home = sharded_cross && j % 2 ? (i + 1) % nthreads : i;
+            char *name = load_names[i][j];
+            do {
+                snprintf(name, sizeof(load_names[i][j]), "shard%d_%02d_%d", generation, i, k++);
+            } while (shard_home(name, strlen(name)) != home);
+            int fd = socket(AF_INET, SOCK_STREAM, 0);
+            connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+            load_fds[i][j] = fd;
+            load_readers[i][j] = proto_reader_create(fd);
+            JEUX_PACKET_HEADER hdr = {0};
+            hdr.type = JEUX_LOGIN_PKT;
+            hdr.role = JEUX_CAP_CORRELATION;
+            hdr.size = htons(strlen(name));
+            proto_send_packet(fd, &hdr, name);
+            void *data = NULL;
+            proto_reader_recv(load_readers[i][j], &hdr, &data);
+            free(data);
+        }
+    }
+}
+
+static void sharded_setup_local(int nthreads) {
+    sharded_cross = 0;
+    sharded_setup(nthreads);
+}
+
+static void sharded_setup_cross(int nthreads) {
+    sharded_cross = 1;
+    sharded_setup(nthreads);
+}
+
+static void sharded_teardown(void) {
+    for (int i = 0; i < 64; i++) {
+        for (int j = 0; j < BENCH_LOAD_CONNS && load_readers[i][j]; j++) {
+            proto_reader_free(load_readers[i][j]);
+            load_readers[i][j] = NULL;
+            close(load_fds[i][j]);
+        }
+    }
+    shard_finish(SIGKILL);
+}
+
+/*
+ * The cluster case plays the same games against a cluster of as many
+ * nodes as threads, each serving connections with a thread per client,
+ * and a directory.  The first player of each pair connects to the node
+ * of its thread and the second to the next node, so that with more than
+ * one thread every invitation is found through the directory and every
+ * game is kept by one node and copied to another.
+ */
+static pid_t cluster_pids[65];
+static int cluster_nprocs;
+
+static int accept_conn(int listen_fd) {
+    return accept(listen_fd, NULL, NULL);
+}
+
+static int listen_port(int fd) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    getsockname(fd, (struct sockaddr *)&addr, &len);
+    return ntohs(addr.sin_port);
+}
+
+static void cluster_setup(int nthreads) {
+    static int generation;
+    generation++;
+    int dir_fd = open_listenfd("0");
+    char directory[32];
+    snprintf(directory, sizeof(directory), "127.0.0.1:%d", listen_port(dir_fd));
+    int node_fds[64];
+    for (int i = 0; i < nthreads; i++) {
+        node_fds[i] = open_listenfd("0");
+    }
+    int ready[2];
+    if (pipe(ready)) {
+        exit(EXIT_FAILURE);
+    }
+    cluster_nprocs = 0;
+    for (int i = -1; i < nthreads; i++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            exit(EXIT_FAILURE);
+        }
+        if (pid > 0) {
+            cluster_pids[cluster_nprocs++] = pid;
+            continue;
+        }
+        close(ready[0]);
+        if (i < 0) {
+            //the directory is ready as soon as it listens
+            close(ready[1]);
+            while (1) {
+                cluster_directory(dir_fd, BENCH_CLUSTER_SECRET);
+            }
+        }
+        load_listen_fd = node_fds[i];
+        serve_init();
+        if (cluster_join(directory, "127.0.0.1", BENCH_CLUSTER_SECRET)) {
+            _exit(EXIT_FAILURE);
+        }
+        serve_forever(ready[1], accept_conn);
+    }
+    close(ready[1]);
+    for (int i = 0; i < nthreads; i++) {
+        char byte;
+        if (read(ready[0], &byte, 1) != 1) {
+            exit(EXIT_FAILURE);
+        }
+    }
+    close(ready[0]);
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for (int i = 0; i < nthreads; i++) {
+        for (int j = 0; j < BENCH_LOAD_CONNS; j++) {
+            char *name = load_names[i][j];
+            snprintf(name, sizeof(load_names[i][j]), "node%d_%02d_%d", generation, i, j);
+            addr.sin_port = htons(listen_port(node_fds[j % 2 ? (i + 1) % nthreads : i]));
+            int fd = socket(AF_INET, SOCK_STREAM, 0);
+            connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+            load_fds[i][j] = fd;
+            load_readers[i][j] = proto_reader_create(fd);
+            JEUX_PACKET_HEADER hdr = {0};
+            hdr.type = JEUX_LOGIN_PKT;
+            hdr.role = JEUX_CAP_CORRELATION;
+            hdr.size = htons(strlen(name));
+            proto_send_packet(fd, &hdr, name);
+            void *data = NULL;
+            proto_reader_recv(load_readers[i][j], &hdr, &data);
+            free(data);
+        }
+    }
+    close(dir_fd);
+    for (int i = 0; i < nthreads; i++) {
+        close(node_fds[i]);
+    }
+}
+
+static void cluster_teardown(void) {
+    for (int i = 0; i < 64; i++) {
+        for (int j = 0; j < BENCH_LOAD_CONNS && load_readers[i][j]; j++) {
+            proto_reader_free(load_readers[i][j]);
+            load_readers[i][j] = NULL;
+            close(load_fds[i][j]);
+        }
+    }
+    for (int i = 0; i < cluster_nprocs; i++) {
+        kill(cluster_pids[i], SIGKILL);
+        waitpid(cluster_pids[i], NULL, 0);
+    }
+}
+
+/*
+ * Handing a server with a full registry, BENCH_UPGRADE_CLIENTS clients
+ * playing half as many games, over to a new process (see upgrade.h), as
+ * many times as there are iterations, one after the other.  Each handoff
+ * is timed from forking the new server until it serves the clients, which
+ * is all the time the clients wait; the figure per session is reported
+ * too.  Afterwards every client is checked to be served still.
+ */
+#define BENCH_UPGRADE_CLIENTS MAX_CLIENTS
+
+static char upgrade_path[64];
+static pid_t upgrade_pid;
+static int upgrade_fds[BENCH_UPGRADE_CLIENTS];
+static PROTO_READER *upgrade_readers[BENCH_UPGRADE_CLIENTS];
+static pthread_mutex_t upgrade_lock = PTHREAD_MUTEX_INITIALIZER;
+static double upgrade_ns;
+static long upgrade_count;
+
+/*
+ * Fork a server that takes over from the current one, if any, and wait
+ * until it serves.
+ */
+static pid_t upgrade_fork(int listen_fd) {
+    int ready[2];
+    if (pipe(ready)) {
+        exit(EXIT_FAILURE);
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0) {
+        close(ready[0]);
+        serve_init();
+        int fd = upgrade_takeover(upgrade_path);
+        load_listen_fd = fd == -1 ? listen_fd : fd;
+        if (fd < -1 || upgrade_listen(upgrade_path, load_listen_fd)) {
+            _exit(EXIT_FAILURE);
+        }
+        serve_forever(ready[1], accept_conn);
+    }
+    close(ready[1]);
+    char byte;
+    if (read(ready[0], &byte, 1) != 1) {
+        fprintf(stderr, "upgrade: the new server failed\n");
+        if (upgrade_pid > 0) {
+            kill(upgrade_pid, SIGKILL);
+        }
+        exit(EXIT_FAILURE);
+    }
+    close(ready[0]);
+    return pid;
+}
+
+static void upgrade_setup(int nthreads) {
+    snprintf(upgrade_path, sizeof(upgrade_path), "/tmp/jeux_bench_%d.sock", getpid());
+    int listen_fd = open_listenfd("0");
+    upgrade_pid = upgrade_fork(listen_fd);
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(listen_port(listen_fd));
+    close(listen_fd);
+    for (int i = 0; i < BENCH_UPGRADE_CLIENTS; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "upgrade_%02d", i);
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+        upgrade_fds[i] = fd;
+        upgrade_readers[i] = proto_reader_create(fd);
+        game_send(fd, JEUX_LOGIN_PKT, 0, 0, name);
+        game_recv(upgrade_readers[i], 1);
+        //every other client invites the one before it, which accepts and moves
+        if (i % 2) {
+            char other[32];
+            snprintf(other, sizeof(other), "upgrade_%02d", i - 1);
+            game_send(fd, JEUX_INVITE_PKT, 0, FIRST_PLAYER_ROLE, other);
+            game_recv(upgrade_readers[i], 1);
+            int id = game_recv(upgrade_readers[i - 1], 1);
+            game_send(upgrade_fds[i - 1], JEUX_ACCEPT_PKT, id, 0, NULL);
+            game_recv(upgrade_readers[i - 1], 1);
+            game_recv(upgrade_readers[i], 1);
+            game_send(upgrade_fds[i - 1], JEUX_MOVE_PKT, id, 0, "5");
+            game_recv(upgrade_readers[i - 1], 1);
+            game_recv(upgrade_readers[i], 1);
+        }
+    }
+    upgrade_ns = 0;
+    upgrade_count = 0;
+}
+
+static void upgrade_teardown(void) {
+    //the second player of each game moves, on the game it was invited to
+    int lost = 0;
+    for (int i = 1; i < BENCH_UPGRADE_CLIENTS; i += 2) {
+        JEUX_PACKET_HEADER hdr = {0};
+        void *data = NULL;
+        game_send(upgrade_fds[i], JEUX_MOVE_PKT, 0, 0, "1");
+        if (proto_reader_recv(upgrade_readers[i], &hdr, &data) || hdr.type != JEUX_ACK_PKT) {
+            lost++;
+        }
+        free(data);
+    }
+    if (lost) {
+        fprintf(stderr, "upgrade: %d games lost\n", lost);
+    }
+    for (int i = 0; i < BENCH_UPGRADE_CLIENTS; i++) {
+        proto_reader_free(upgrade_readers[i]);
+        close(upgrade_fds[i]);
+    }
+    kill(upgrade_pid, SIGKILL);
+    waitpid(upgrade_pid, NULL, 0);
+    unlink(upgrade_path);
+    extra_key = "ns_per_session";
+    extra_value = upgrade_ns / upgrade_count / BENCH_UPGRADE_CLIENTS;
+}
+
+static void bench_upgrade(int tid, long iters) {
+    for (long i = 0; i < iters; i++) {
+        pthread_mutex_lock(&upgrade_lock);
+        double t0 = now_ns();
+        pid_t pid = upgrade_fork(-1);
+        upgrade_ns += now_ns() - t0;
+        upgrade_count++;
+        //the old server exits once the new one has taken over
+        waitpid(upgrade_pid, NULL, 0);
+        upgrade_pid = pid;
+        pthread_mutex_unlock(&upgrade_lock);
+    }
+}
+
+/*
+ * Restarting with BENCH_CHECKPOINT_GAMES games in progress, between
+ * BENCH_CHECKPOINT_PLAYERS players, recorded in a checkpoint file (see
+ * checkpoint.h).  Each restart recovers the games and restores them all,
+ * and is timed until the server would be ready for the players to
+ * reconnect; the figure per game is reported too.  The restored games are
+ * then dropped with the checkpoint writer stopped, so that the next
+ * restart finds them in the file still.
+ */
+static char checkpoint_path[64];
+static pthread_mutex_t checkpoint_lock = PTHREAD_MUTEX_INITIALIZER;
+static double checkpoint_ns;
+static long checkpoint_games;
+
+static void checkpoint_setup(int nthreads) {
+    client_registry = creg_init();
+    player_registry = preg_init();
+    timer_wheel_init(100);
+    //long enough that no restored session expires on its own
+    session_init(3600000);
+    snprintf(checkpoint_path, sizeof(checkpoint_path), "/tmp/jeux_bench_%d.ckpt", getpid());
+    unlink(checkpoint_path);
+    checkpoint_init(checkpoint_path);
+    CLIENT *players[BENCH_CHECKPOINT_PLAYERS];
+    for (int i = 0; i < BENCH_CHECKPOINT_PLAYERS; i++) {
+        char name[32], token[SESSION_TOKEN_LEN + 1];
+        snprintf(name, sizeof(name), "checkpoint_%02d", i);
+        players[i] = creg_register(client_registry, -1);
+        client_login(players[i], preg_register(player_registry, strdup(name)));
+        session_begin(players[i], token);
+    }
+    INVITATION **invs = malloc(BENCH_CHECKPOINT_GAMES * sizeof(INVITATION *));
+    for (long g = 0; g < BENCH_CHECKPOINT_GAMES; g++) {
+        //in pairs, so that both players of a game list it in the same place,
+        //and dropping the games takes time linear in their number
+        int i = 2 * (g % (BENCH_CHECKPOINT_PLAYERS / 2));
+        invs[g] = inv_create(players[i], players[i + 1], SECOND_PLAYER_ROLE, FIRST_PLAYER_ROLE);
+        inv_accept(invs[g]);
+        checkpoint_game(invs[g]);
+    }
+    //everything posted is written
+    checkpoint_fini();
+    for (long g = 0; g < BENCH_CHECKPOINT_GAMES; g++) {
+        inv_unref(invs[g], "bench game recorded");
+    }
+    free(invs);
+    for (int i = 0; i < BENCH_CHECKPOINT_PLAYERS; i++) {
+        session_end(players[i]);
+        client_logout(players[i]);
+        creg_unregister(client_registry, players[i]);
+    }
+    checkpoint_ns = 0;
+    checkpoint_games = 0;
+}
+
+static void checkpoint_teardown(void) {
+    unlink(checkpoint_path);
+    session_fini();
+    timer_wheel_fini();
+    creg_fini(client_registry);
+    preg_fini(player_registry);
+    extra_key = "ns_per_game";
+    extra_value = checkpoint_ns / checkpoint_games;
+}
+
+static void bench_checkpoint_restart(int tid, long iters) {
+    for (long i = 0; i < iters; i++) {
+        pthread_mutex_lock(&checkpoint_lock);
+        double t0 = now_ns();
+        int n = checkpoint_init(checkpoint_path);
+        checkpoint_ns += now_ns() - t0;
+        checkpoint_games += n;
+        if (n != BENCH_CHECKPOINT_GAMES) {
+            fprintf(stderr, "checkpoint: %d of %d games restored\n", n, BENCH_CHECKPOINT_GAMES);
+        }
+        checkpoint_fini();
+        session_expire_parked();
+        pthread_mutex_unlock(&checkpoint_lock);
+    }
+}
+
+/*
+ * Requests run as tasks on as many workers as threads, with work
+ * stealing or through one shared queue.  Each thread plays
+ * BENCH_STRANDS clients, posting requests to their strands in turn; one
+ * request in BENCH_HEAVY_EVERY is a burst, such as a USERS request from
+ * a full registry, costing BENCH_HEAVY_COST times as much as the others.
+ * The requests of each client are checked to run in order.
+ */
+static sem_t bench_done[64];            /* Posted when a thread's work has been done */
+
+typedef struct bench_request {
+    WORKQ_TASK task;
+    struct bench_client *client;
+    long seq;
+    int cost;
+} BENCH_REQUEST;
+
+typedef struct bench_client {
+    WORKQ_STRAND strand;
+    long last_seq;
+    atomic_long *remaining;
+    sem_t *done;
+} BENCH_CLIENT;
+
+static BENCH_CLIENT workq_clients[64][BENCH_STRANDS];
+static atomic_long workq_remaining[64];
+static atomic_long workq_sink;
+
+static void bench_request_run(WORKQ_TASK *task) {
+    BENCH_REQUEST *req = (BENCH_REQUEST *)task;
+    BENCH_CLIENT *client = req->client;
+    if (req->seq <= client->last_seq) {
+        fprintf(stderr, "request %ld ran after request %ld\n", req->seq, client->last_seq);
+        exit(EXIT_FAILURE);
+    }
+    client->last_seq = req->seq;
+    long x = req->seq;
+    for (int i = 0; i < req->cost * 64; i++) {
+        x = x * 6364136223846793005L + 1442695040888963407L;
+    }
+    atomic_store_explicit(&workq_sink, x, memory_order_relaxed);
+    sem_t *done = client->done;
+    if (atomic_fetch_sub(client->remaining, 1) == 1) {
+        sem_post(done);
+    }
+    free(req);
+}
+
+static void workq_setup(int nthreads, WORKQ_MODE mode) {
+    workq_init(nthreads, mode);
+    for (int i = 0; i < nthreads; i++) {
+        sem_init(&bench_done[i], 0, 0);
+        for (int j = 0; j < BENCH_STRANDS; j++) {
+            BENCH_CLIENT *client = &workq_clients[i][j];
+            workq_strand_init(&client->strand);
+            client->last_seq = -1;
+            client->remaining = &workq_remaining[i];
+            client->done = &bench_done[i];
+        }
+    }
+}
+
+static void workq_setup_stealing(int nthreads) {
+    workq_setup(nthreads, WORKQ_STEALING);
+}
+
+static void workq_setup_shared(int nthreads) {
+    workq_setup(nthreads, WORKQ_SHARED);
+}
+
+static void workq_teardown(void) {
+    workq_fini();
+    for (int i = 0; i < 64; i++) {
+        sem_destroy(&bench_done[i]);
+        for (int j = 0; j < BENCH_STRANDS; j++) {
+            if (workq_clients[i][j].remaining) {
+                pthread_mutex_destroy(&workq_clients[i][j].strand.lock);
+                workq_clients[i][j].remaining = NULL;
+            }
+        }
+    }
+}
+
+static void bench_workq(int tid, long iters) {
+    atomic_store(&workq_remaining[tid], iters);
+    for (long i = 0; i < iters; i++) {
+        BENCH_REQUEST *req = malloc(sizeof(BENCH_REQUEST));
+        req->task.run = bench_request_run;
+        req->client = &workq_clients[tid][i % BENCH_STRANDS];
+        req->seq = i;
+        req->cost = i % BENCH_HEAVY_EVERY ? 1 : BENCH_HEAVY_COST;
+        workq_strand_post(&req->client->strand, &req->task);
+    }
+    sem_wait(&bench_done[tid]);
+}
+
+/*
+ * Coroutines on as many workers as threads: each thread has a coroutine
+ * that gives up its worker and is resumed again, over and over.
+ */
+typedef struct coro_yielder {
+    long iters;
+    sem_t *done;
+} CORO_YIELDER;
+
+static void coro_yielder(void *arg) {
+    CORO_YIELDER *y = arg;
+    for (long i = 0; i < y->iters; i++) {
+        coro_yield();
+    }
+    sem_post(y->done);
+}
+
+static void coro_setup(int nthreads) {
+    coro_init(nthreads);
+    for (int i = 0; i < nthreads; i++) {
+        sem_init(&bench_done[i], 0, 0);
+    }
+}
+
+static void coro_teardown(void) {
+    coro_fini();
+    for (int i = 0; i < 64; i++) {
+        sem_destroy(&bench_done[i]);
+    }
+}
+
+static void bench_coro_yield(int tid, long iters) {
+    CORO_YIELDER y = { iters, &bench_done[tid] };
+    coro_spawn(coro_yielder, &y);
+    sem_wait(&bench_done[tid]);
+}
+
+/*
+ * Client sessions as coroutines, each on its own socketpair and logged
+ * in, all kept open until the end, up to as many as the client registry
+ * holds.  Besides the time to start a session, the memory that each
+ * session takes up while waiting for a request is reported.
+ */
+static int *session_fds;
+static atomic_long session_count;
+static long session_rss;
+
+static long resident_bytes(void) {
+    FILE *f = fopen("/proc/self/statm", "r");
+    long size = 0, resident = 0;
+    if (f) {
+        if (fscanf(f, "%ld %ld", &size, &resident) != 2) {
+            resident = 0;
+        }
+        fclose(f);
+    }
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+static void session_setup(int nthreads) {
+    client_registry = creg_init();
+    player_registry = preg_init();
+    coro_init(nthreads);
+    session_fds = calloc(BENCH_SESSIONS, sizeof(int));
+    atomic_store(&session_count, 0);
+    session_rss = resident_bytes();
+}
+
+static void session_teardown(void) {
+    long n = atomic_load(&session_count);
+    extra_key = "bytes_per_session";
+    extra_value = (double)(resident_bytes() - session_rss) / n;
+    for (long i = 0; i < n; i++) {
+        close(session_fds[i]);
+    }
+    creg_wait_for_empty(client_registry);
+    coro_fini();
+    free(session_fds);
+    creg_fini(client_registry);
+    preg_fini(player_registry);
+}
+
+static void bench_coro_sessions(int tid, long iters) {
+    for (long i = 0; i < iters; i++) {
+        long k = atomic_fetch_add(&session_count, 1);
+        if (k >= BENCH_SESSIONS) {
+            atomic_fetch_sub(&session_count, 1);
+            return;
+        }
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+            atomic_fetch_sub(&session_count, 1);
+            return;
+        }
+        session_fds[k] = sv[1];
+        coro_spawn(jeux_client_coroutine, (void *)(intptr_t)sv[0]);
+        char name[32];
+        JEUX_PACKET_HEADER hdr = {0};
+        hdr.type = JEUX_LOGIN_PKT;
+        hdr.size = htons(snprintf(name, sizeof(name), "session%ld", k));
+        proto_send_packet(sv[1], &hdr, name);
+        void *data = NULL;
+        proto_recv_packet(sv[1], &hdr, &data);
+        free(data);
+    }
+}
+
+/*
+ * A million timers are armed across delays from a tick to a day, so that
+ * every level of the wheel is populated, and then each thread re-arms and
+ * cancels timers from its own share of them.
+ */
+static void noop_timer(void *arg) {
+}
+
+static void timer_setup(int nthreads) {
+    static int started;
+    if (!started) {
+        timer_wheel_init(100);
+        started = 1;
+    }
+    timers = calloc(BENCH_TIMERS, sizeof(TIMER));
+    for (long i = 0; i < BENCH_TIMERS; i++) {
+        timer_init(&timers[i], noop_timer, NULL);
+        timer_arm(&timers[i], 100 + (i * 7919) % 86400000);
+    }
+}
+
+static void timer_teardown(void) {
+    for (long i = 0; i < BENCH_TIMERS; i++) {
+        timer_cancel(&timers[i]);
+    }
+    free(timers);
+}
+
+static void bench_timer_arm_cancel(int tid, long iters) {
+    long share = BENCH_TIMERS / 64;
+    TIMER *mine = &timers[tid * share];
+    for (long i = 0; i < iters; i++) {
+        TIMER *timer = &mine[(i * 31) % share];
+        timer_arm(timer, 1000 + (i * 104729) % 3600000);
+        if (i & 1) {
+            timer_cancel(timer);
+        }
+    }
+}
+
+/*
+ * Glicko-2 rating periods over a million players, split evenly between
+ * one engine per thread.  Each operation records two games for every
+ * player of the thread's engine and then closes the period.
+ */
+static void glicko_setup(int nthreads) {
+    glicko_players = BENCH_GLICKO_PLAYERS / nthreads;
+    for (int i = 0; i < nthreads; i++) {
+        glickos[i] = glicko_create(0.5);
+        glicko_reserve(glickos[i], glicko_players);
+    }
+}
+
+static void glicko_teardown(void) {
+    for (int i = 0; i < 64 && glickos[i]; i++) {
+        glicko_fini(glickos[i]);
+        glickos[i] = NULL;
+    }
+}
+
+static void bench_glicko_period(int tid, long iters) {
+    GLICKO *glicko = glickos[tid];
+    for (long i = 0; i < iters; i++) {
+        for (int a = 0; a < glicko_players; a++) {
+            int b = (a + 1 + i * 7919) % glicko_players;
+            glicko_record(glicko, a, b, (a + i) % 3 * 0.5);
+        }
+        glicko_close_period(glicko);
+    }
+    sink += glicko_rating(glicko, 0);
+}
+
+/*
+ * Finding one name id among 100k logged-in players, one id at a time and
+ * with the vector scan that creg_lookup uses.  Each lookup is for an id at
+ * a pseudo-random position, so on average half the array is scanned.
+ */
+static void scan_setup(int nthreads) {
+    scan_ids = malloc(BENCH_SCAN_IDS * sizeof(int32_t));
+    for (int i = 0; i < BENCH_SCAN_IDS; i++) {
+        scan_ids[i] = i * 7 + 3;
+    }
+    fprintf(stderr, "id_scan: %s\n", id_scan_impl());
+}
+
+static void scan_teardown(void) {
+    free(scan_ids);
+}
+
+static void bench_id_scan_scalar(int tid, long iters) {
+    for (long i = 0; i < iters; i++) {
+        sink += id_scan_scalar(scan_ids, BENCH_SCAN_IDS, scan_ids[(i * 7919 + tid) % BENCH_SCAN_IDS]);
+    }
+}
+
+static void bench_id_scan_vector(int tid, long iters) {
+    for (long i = 0; i < iters; i++) {
+        sink += id_scan(scan_ids, BENCH_SCAN_IDS, scan_ids[(i * 7919 + tid) % BENCH_SCAN_IDS]);
+    }
+}
+
+static void no_setup(int nthreads) {
+}
+
+static void no_teardown(void) {
+}
+
+static BENCH_CASE cases[] = {
+    { "creg_lookup", BENCH_DEFAULT_ITERS, registry_setup, bench_creg_lookup, registry_teardown },
+    { "preg_register", BENCH_DEFAULT_ITERS, registry_setup, bench_preg_register, registry_teardown },
+    { "login_name", BENCH_DEFAULT_ITERS, registry_setup, bench_login_name, registry_teardown },
+    { "invite_name", BENCH_DEFAULT_ITERS, registry_setup, bench_invite_name, registry_teardown },
+    { "creg_all_players", BENCH_DEFAULT_ITERS / 4, registry_setup, bench_creg_all_players, registry_teardown },
+    { "preg_online_players", BENCH_DEFAULT_ITERS / 4, registry_setup, bench_preg_online_players, registry_teardown },
+    { "game_apply_move", BENCH_DEFAULT_ITERS, no_setup, bench_game_apply_move, no_teardown },
+    { "game_unparse_state", BENCH_DEFAULT_ITERS, no_setup, bench_game_unparse_state, no_teardown },
+    { "game_pack_state", BENCH_DEFAULT_ITERS, no_setup, bench_game_pack_state, no_teardown },
+    { "game_mailbox", BENCH_DEFAULT_ITERS, mailbox_setup, bench_game_mailbox, mailbox_teardown },
+    { "player_post_result", BENCH_DEFAULT_ITERS, registry_setup, bench_player_post_result, registry_teardown },
+    { "player_post_result_queued", BENCH_DEFAULT_ITERS, rating_setup, bench_player_post_result, rating_teardown },
+    { "proto_send_recv", BENCH_DEFAULT_ITERS / 4, proto_setup, bench_proto_send_recv, proto_teardown },
+    { "show_users", BENCH_DEFAULT_ITERS / 4, users_setup, bench_show_users, users_teardown },
+    { "notice_mailbox", BENCH_DEFAULT_ITERS, notice_setup, bench_notice_mailbox, users_teardown },
+    { "requests_lockstep", BENCH_DEFAULT_ITERS / 4, bot_setup, bench_requests_lockstep, bot_teardown },
+    { "requests_pipelined", BENCH_DEFAULT_ITERS / 4, bot_setup, bench_requests_pipelined, bot_teardown },
+    { "load_threads", BENCH_DEFAULT_ITERS / 4, load_setup_threads, bench_load, load_teardown },
+    { "load_uring", BENCH_DEFAULT_ITERS / 4, load_setup_uring, bench_load, load_teardown },
+    { "load_pooled", BENCH_DEFAULT_ITERS / 4, load_setup_pooled, bench_load, load_teardown },
+    { "games_pooled", BENCH_DEFAULT_ITERS / 100, games_setup_pooled, bench_games, games_teardown },
+    { "games_affinity", BENCH_DEFAULT_ITERS / 100, games_setup_affinity, bench_games, games_teardown },
+    { "games_sharded", BENCH_DEFAULT_ITERS / 100, sharded_setup_local, bench_games, sharded_teardown },
+    { "games_sharded_cross", BENCH_DEFAULT_ITERS / 100, sharded_setup_cross, bench_games, sharded_teardown },
+    { "games_cluster", BENCH_DEFAULT_ITERS / 100, cluster_setup, bench_games, cluster_teardown },
+    { "upgrade_handoff", BENCH_DEFAULT_ITERS / 2000, upgrade_setup, bench_upgrade, upgrade_teardown },
+    { "checkpoint_restart", BENCH_DEFAULT_ITERS / 40000, checkpoint_setup, bench_checkpoint_restart, checkpoint_teardown },
+    { "workq_stealing", BENCH_DEFAULT_ITERS, workq_setup_stealing, bench_workq, workq_teardown },
+    { "workq_shared", BENCH_DEFAULT_ITERS, workq_setup_shared, bench_workq, workq_teardown },
+    { "coro_yield", BENCH_DEFAULT_ITERS, coro_setup, bench_coro_yield, coro_teardown },
+    { "coro_sessions", BENCH_SESSIONS, session_setup, bench_coro_sessions, session_teardown },
+    { "timer_arm_cancel", BENCH_DEFAULT_ITERS, timer_setup, bench_timer_arm_cancel, timer_teardown },
+    { "id_scan_scalar", BENCH_DEFAULT_ITERS / 100, scan_setup, bench_id_scan_scalar, scan_teardown },
+    { "id_scan_vector", BENCH_DEFAULT_ITERS / 100, scan_setup, bench_id_scan_vector, scan_teardown },
+    { "glicko_period", BENCH_GLICKO_PERIODS, glicko_setup, bench_glicko_period, glicko_teardown },
+};
+
+static void *bench_thread(void *arg) {
+    BENCH_THREAD *bt = arg;
+    pthread_barrier_wait(bt->start);
+    bt->bc->run(bt->tid, bt->iters);
+    return NULL;
+}
+
+static void run_case(BENCH_CASE *bc, int nthreads, double scale) {
+    long iters = bc->iters * scale;
+    if (iters < 1) {
+        iters = 1;
+    }
+    pthread_t tids[nthreads];
+    BENCH_THREAD bts[nthreads];
+    pthread_barrier_t start;
+    pthread_barrier_init(&start, NULL, nthreads + 1);
+    bc->setup(nthreads);
+    for (int i = 0; i < nthreads; i++) {
+        bts[i].bc = bc;
+        bts[i].tid = i;
+        bts[i].iters = iters;
+        bts[i].start = &start;
+        pthread_create(&tids[i], NULL, bench_thread, &bts[i]);
+    }
+    double t0 = now_ns();
+    pthread_barrier_wait(&start);
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    double elapsed = now_ns() - t0;
+    bc->teardown();
+    pthread_barrier_destroy(&start);
+
+    long total = iters * nthreads;
+    printf("%s\n    {\"name\": \"%s\", \"variant\": \"%s\", \"threads\": %d, "
+           "\"ops\": %ld, \"elapsed_ns\": %.0f, \"ns_per_op\": %.2f, \"ops_per_sec\": %.0f",
+           first_result ? "" : ",", bc->name, nthreads == 1 ? "single" : "contended",
+           nthreads, total, elapsed, elapsed / total, total / (elapsed / 1e9));
+    if (extra_key) {
+        printf(", \"%s\": %.2f", extra_key, extra_value);
+        extra_key = NULL;
+    }
+    printf("}");
+    first_result = 0;
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[]) {
+    int nthreads = BENCH_DEFAULT_THREADS;
+    double scale = 1.0;
+    char *filter = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:s:f:")) != -1) {
+        switch (opt) {
+            case 't':
+                nthreads = atoi(optarg);
+                break;
+            case 's':
+                scale = atof(optarg);
+                break;
+            case 'f':
+                filter = optarg;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-t <threads>] [-s <scale>] [-f <filter>]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (nthreads < 1 || nthreads > 64) {
+        fprintf(stderr, "Thread count must be between 1 and 64\n");
+        return EXIT_FAILURE;
+    }
+    printf("{\n  \"threads\": %d,\n  \"scale\": %g,\n  \"results\": [", nthreads, scale);
+    for (int i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        if (filter && !strstr(cases[i].name, filter)) {
+            continue;
+        }
+        run_case(&cases[i], 1, scale);
+        if (nthreads > 1) {
+            run_case(&cases[i], nthreads, scale / nthreads);
+        }
+    }
+    printf("\n  ]\n}\n");
+    return EXIT_SUCCESS;
+}
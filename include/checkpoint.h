@@ -0,0 +1,77 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include "invitation.h"
+
+/*
+ * Checkpoints let the games in progress survive a crash of the server.
+ * When a game starts, and after every move, its state -- the players'
+ * names and resume tokens (see session.h), their roles and the packed
+ * board with the side to move -- is posted to a checkpoint writer thread,
+ * which appends it as a fixed-size record to a ring of slots in a file
+ * mapped into memory, and then clears the game's previous record, so that
+ * each game has one record in the ring.  A slot that holds a record is
+ * skipped over as the ring wraps, and a record is never overwritten
+ * until its successor has been written, so a crash in the middle of a
+ * write loses at most that move.  If every slot holds a record, the new
+ * state is not written: the game keeps its previous record, and so would
+ * be restored as it was before that move, and the refusal is reported on
+ * the standard error.  When a game ends, its record is
+ * cleared.  Posting only pushes onto a lock-free queue, as for the rating
+ * service, so the move path does no file I/O.
+ *
+ * On startup, the records in the ring are recovered: the two players of
+ * each game are logged in again as parked sessions under their old resume
+ * tokens, with the game restored between them, so that a player who
+ * reconnects and resumes its session finds its games where they were,
+ * the state of each being sent as MOVED.  Invitation IDs are assigned
+ * afresh, in the order the games started.  A player who does not come
+ * back within the grace period is logged out, which resigns its games as
+ * usual.  A game whose last move ended it has its result posted.  No more
+ * players are restored than leave the client registry room for them to
+ * reconnect; the games of any others are dropped.  Spectators and
+ * invitations not yet accepted are not recovered, and the move clocks of
+ * the games restored start afresh.
+ *
+ * The records survive the death of the process, being in the page cache,
+ * but are only forced to disk when the writer is stopped.
+ */
+
+/* Number of slots in a new checkpoint file. */
+#define CHECKPOINT_SLOTS (1 << 18)
+
+/*
+ * Open or create a checkpoint file, restore the games recorded in it and
+ * start the checkpoint writer thread.  The registries, sessions and timer
+ * wheel must already have been set up.
+ *
+ * @param path  The path of the checkpoint file.
+ * @return the number of games restored, or -1 if the file could not be
+ * opened.
+ */
+int checkpoint_init(char *path);
+
+/*
+ * Write out everything that has been posted, stop the checkpoint writer
+ * thread and close the checkpoint file.  Games posted from then on are not
+ * recorded.
+ */
+void checkpoint_fini(void);
+
+/*
+ * Post the state of a game in progress, which has just started or in
+ * which a move has just been made.  Called from the game's mailbox, or
+ * when the invitation has just been accepted.
+ *
+ * @param inv  The accepted INVITATION of the game.
+ */
+void checkpoint_game(INVITATION *inv);
+
+/*
+ * Post that a game has ended, so that it is no longer recovered.
+ *
+ * @param inv  The INVITATION of the game.
+ */
+void checkpoint_ended(INVITATION *inv);
+
+#endif
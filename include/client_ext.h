@@ -0,0 +1,443 @@
+#ifndef CLIENT_EXT_H
+#define CLIENT_EXT_H
+
+#include <sys/uio.h>
+#include "client_registry.h"
+#include "game.h"
+#include "invitation.h"
+
+/*
+ * Additional CLIENT operations, implemented in client.c, that are not
+ * part of the interface fixed by client.h.
+ */
+
+/*
+ * Attempt to send a packet to a client without blocking.  The packet is
+ * either sent completely or not at all: if the socket cannot accept any
+ * data, or another thread is currently writing to the client, nothing is
+ * sent.  This never blocks: if the socket accepts only part of the packet,
+ * the client is not keeping up with its output, and as the rest could not
+ * be sent without blocking, nor anything else after it, the connection is
+ * shut down and the send fails.
+ *
+ * @param client  The CLIENT to which the packet is to be sent.
+ * @param pkt  The header of the packet, with multi-byte fields in network
+ * byte order.
+ * @param data  The payload, or NULL if there is none.
+ * @return 0 if the packet was sent, 1 if sending would have blocked,
+ * or -1 if there was an error on the connection.
+ */
+int client_try_send_packet(CLIENT *client, JEUX_PACKET_HEADER *pkt, void *data);
+
+/*
+ * Send an ACK packet whose payload is gathered from several buffers,
+ * which are written straight to the connection together with the header,
+ * without first being copied into one buffer.
+ *
+ * @param client  The CLIENT to which the packet is to be sent.
+ * @param iov  The buffers making up the payload, in order.  Their total
+ * length must fit in the size field of a packet header.
+ * @param iovcnt  The number of buffers.
+ * @return 0 if successful, -1 otherwise.
+ */
+int client_send_ack_iov(CLIENT *client, struct iovec *iov, int iovcnt);
+
+/*
+ * Find a game in progress in which a CLIENT is playing.
+ *
+ * @param client  The CLIENT whose games are to be searched.
+ * @param index  Which of the client's games in progress to return,
+ * counting from zero in the order their invitations were made.
+ * @return the GAME, with its reference count incremented to account for
+ * the returned pointer, or NULL if there is no such game.
+ */
+GAME *client_find_game(CLIENT *client, int index);
+
+/*
+ * Detach a client from its connection.  Packets subsequently sent to the
+ * client are discarded.  The connection itself is not closed.
+ *
+ * @param client  The CLIENT to be detached.
+ * @return the file descriptor the client was using, or -1 if none.
+ */
+int client_detach(CLIENT *client);
+
+/*
+ * Park a client whose connection has been lost, so that it can later be
+ * resumed on a new connection.  Packets sent to a parked client are held,
+ * up to a limit, and are delivered when the client is resumed.  Packets
+ * beyond the limit are discarded.  The connection itself is not closed.
+ *
+ * @param client  The CLIENT to be parked.
+ * @param limit  The maximum number of packets to hold.
+ * @return the file descriptor the client was using, or -1 if none.
+ */
+int client_park(CLIENT *client, int limit);
+
+/*
+ * Resume a parked client on a new connection.  Held packets are sent on
+ * the new connection.  If any packets had to be discarded, the current
+ * state of each of the client's games in progress is then sent as a MOVED
+ * notification, so that the client's view of its games is up to date.
+ *
+ * @param client  The parked CLIENT.
+ * @param fd  The file descriptor of the new connection.
+ */
+void client_unpark(CLIENT *client, int fd);
+
+/*
+ * Record that notifications for a parked client have been lost, as for a
+ * client whose games have been recovered after a crash (see
+ * checkpoint.h), so that the state of each of its games in progress is
+ * sent when it is resumed.
+ *
+ * @param client  The parked CLIENT.
+ */
+void client_lose_notices(CLIENT *client);
+
+/*
+ * Each CLIENT has a mailbox of notifications posted to it by other
+ * threads, which are written to its connection by the I/O thread serving
+ * it, so that no thread ever blocks on another client's connection.  The
+ * mailbox is open while a thread is serving the connection; that thread
+ * waits on an eventfd, which is written when a notification is posted to
+ * an empty mailbox.  While the mailbox is closed, as before the connection
+ * is served and after it has been detached or parked, a notification is
+ * sent as by client_send_packet(), which then cannot block.
+ */
+
+/*
+ * Open the mailbox of a CLIENT, as a thread starts serving its connection.
+ *
+ * @param client  The CLIENT.
+ * @return the eventfd that the thread is to wait on, which is closed when
+ * the CLIENT is freed.  Once it is readable, the thread reads it and then
+ * calls client_flush_notices().
+ */
+int client_open_mailbox(CLIENT *client);
+
+/*
+ * Open the mailbox of a CLIENT that has been resumed on the connection of
+ * another, which has been detached, handing it the other's eventfd, so
+ * that the thread serving the connection can go on waiting on the same
+ * one.
+ *
+ * @param client  The resumed CLIENT.
+ * @param from  The CLIENT whose connection it was.
+ */
+void client_move_mailbox(CLIENT *client, CLIENT *from);
+
+/*
+ * Write out the notifications in the mailbox of a CLIENT.  Must only be
+ * called by the thread serving its connection.  Replies sent by that
+ * thread write them out first anyway.
+ *
+ * @param client  The CLIENT.
+ */
+void client_flush_notices(CLIENT *client);
+
+/*
+ * Wake the thread serving the connection of a CLIENT, as if a
+ * notification had been posted to it, so that it looks again at whatever
+ * it should stop for.
+ *
+ * @param client  The CLIENT.
+ */
+void client_wake(CLIENT *client);
+
+/*
+ * Post a notification to a CLIENT, to be written to its connection by
+ * the thread serving it.  The packet and its payload are copied.
+ *
+ * @param client  The CLIENT to notify.
+ * @param pkt  The header of the packet.
+ * @param data  The payload, if any, of the size given in the header.
+ * @return 0 if successful, -1 otherwise.
+ */
+int client_post_notice(CLIENT *client, JEUX_PACKET_HEADER *pkt, void *data);
+
+/*
+ * Set the timeouts that apply to all clients.  A timeout of zero is
+ * disabled.
+ *
+ * @param login_ms  How long a new connection has to log in.
+ * @param idle_ms  How long a connection may go without sending a packet.
+ * @param move_ms  How long a player has to make each move in a game.
+ */
+void client_set_timeouts(long login_ms, long idle_ms, long move_ms);
+
+/*
+ * Set functions to be called when a game between two clients starts, as
+ * its invitation is accepted, and when it ends, however it ends.  They
+ * are called with no locks held, on whichever thread started or ended
+ * the game.  An I/O backend uses them to keep the two connections of a
+ * game together.
+ *
+ * @param started  Called when a game starts, or NULL.
+ * @param ended  Called when a game ends, or NULL.
+ */
+void client_set_game_hooks(void (*started)(CLIENT *source, CLIENT *target),
+                           void (*ended)(CLIENT *source, CLIENT *target));
+
+/*
+ * Set a function to be called when a player logs out, after the logout,
+ * with no locks held.  A cluster node uses it to tell the directory.
+ *
+ * @param logged_out  Called with the PLAYER, or NULL.
+ */
+void client_set_logout_hook(void (*logged_out)(PLAYER *player));
+
+/*
+ * Associate an I/O backend's state for a connection with the CLIENT that
+ * it serves.  The backend is responsible for synchronizing access to it.
+ *
+ * @param client  The CLIENT.
+ * @param io  The backend's state, or NULL.
+ */
+void client_set_io(CLIENT *client, void *io);
+
+/*
+ * Get what client_set_io() associated with a CLIENT.
+ *
+ * @param client  The CLIENT.
+ * @return the backend's state, or NULL if there is none.
+ */
+void *client_get_io(CLIENT *client);
+
+/*
+ * Start the watchdog that enforces the login deadline and idle timeout on
+ * a client's connection.  When a timeout is exceeded, the connection is
+ * shut down for reading, so that the thread serving it sees end-of-file.
+ *
+ * @param client  The CLIENT, which must be attached to a connection.
+ */
+void client_start_watchdog(CLIENT *client);
+
+/*
+ * Record that a packet has been received from a client.
+ *
+ * @param client  The CLIENT.
+ */
+void client_touch(CLIENT *client);
+
+/*
+ * Stop the watchdog of a client.  This must be done before its connection
+ * is closed or detached.
+ *
+ * @param client  The CLIENT.
+ */
+void client_stop_watchdog(CLIENT *client);
+
+/*
+ * Get the invitations of a CLIENT, in the order of their IDs.
+ *
+ * @param client  The CLIENT.
+ * @return a NULL-terminated array of INVITATIONs, each of whose reference
+ * count has been incremented.  The caller must decrement the reference
+ * counts and free the array.
+ */
+INVITATION **client_get_invitations(CLIENT *client);
+
+/*
+ * Stop the move clocks of the games in progress of the invitations that a
+ * CLIENT has made, as while the games are handed over to another process
+ * (see upgrade.h).
+ *
+ * @param client  The CLIENT.
+ */
+void client_stop_clocks(CLIENT *client);
+
+/*
+ * Start afresh the move clocks of the games in progress of the
+ * invitations that a CLIENT has made, if moves are timed.
+ *
+ * @param client  The CLIENT.
+ */
+void client_start_clocks(CLIENT *client);
+
+/*
+ * Set the protocol capabilities that a client asked for when it logged
+ * in (see protocol_ext.h).
+ *
+ * @param client  The CLIENT.
+ * @param caps  The capability flags.
+ */
+void client_set_caps(CLIENT *client, int caps);
+
+/*
+ * Get the protocol capabilities of a client.
+ *
+ * @param client  The CLIENT.
+ * @return the capability flags.
+ */
+int client_get_caps(CLIENT *client);
+
+/*
+ * Record the header of the request that is about to be served for a
+ * client, so that its reply can echo the request's correlation tag.
+ * Only the thread that serves the client's requests may call this.
+ *
+ * @param client  The CLIENT.
+ * @param req  The header of the request.
+ */
+void client_set_request(CLIENT *client, JEUX_PACKET_HEADER *req);
+
+/*
+ * Put the correlation tag of the request being served into the header of
+ * its ACK or NACK, if the client has JEUX_CAP_CORRELATION.  client_send_ack
+ * and client_send_nack do this themselves.
+ *
+ * @param client  The CLIENT.
+ * @param hdr  The header of the reply.
+ */
+void client_tag_reply(CLIENT *client, JEUX_PACKET_HEADER *hdr);
+
+/*
+ * Cork a client's connection: packets sent to the client are held back,
+ * up to a limit, and written together when the connection is uncorked.
+ * The thread serving a client's requests corks it while it has pipelined
+ * requests waiting, so that their replies go out in one write.
+ *
+ * @param client  The CLIENT.
+ */
+void client_cork(CLIENT *client);
+
+/*
+ * Uncork a client's connection, writing out anything held back.
+ *
+ * @param client  The CLIENT.
+ */
+void client_uncork(CLIENT *client);
+
+/*
+ * Take what a corked client has held back, so that an event loop can send
+ * it asynchronously.  Until this is next called and finds nothing to take,
+ * output keeps being held back, however much of it there is, so that it
+ * cannot overtake what is being sent; a client that lets too much back up
+ * is disconnected.
+ *
+ * @param client  The CLIENT, which must be corked.
+ * @param bufp  Where to store the held-back bytes, which the caller must
+ * free once they have been sent.
+ * @param lenp  Where to store the number of bytes.
+ * @return 1 if anything was taken, otherwise 0.
+ */
+int client_take_output(CLIENT *client, char **bufp, size_t *lenp);
+
+/*
+ * Encode the state of a GAME as a payload for a client: packed if the
+ * client has JEUX_CAP_PACKED_STATE, otherwise as a string.
+ *
+ * @param client  The CLIENT to which the state is to be sent.
+ * @param game  The GAME.
+ * @param sizep  Where to store the size of the payload.
+ * @return the payload, which the caller must free.
+ */
+char *client_encode_state(CLIENT *client, GAME *game, size_t *sizep);
+
+/*
+ * End a game whose move clock has run out, the player to move forfeiting
+ * it.  Both players are sent ENDED, and the result is posted as if the
+ * player had resigned.  The forfeit is posted to the game's mailbox, so
+ * it may be handled after this returns, in turn with the moves; nothing
+ * happens if by then the player has moved, or the game has ended.
+ *
+ * @param inv  The INVITATION of the game.
+ */
+void client_forfeit_game(INVITATION *inv);
+
+/*
+ * A player served by another process, such as another shard (see
+ * shard.h), takes part in invitations and games here through a CLIENT
+ * that stands in for it.  A stand-in has no connection; what would be
+ * sent to it goes instead to the process that serves the player, through
+ * the functions below, and so do the requests of local clients on an
+ * invitation that is kept by that process.
+ *
+ * An invitation between players of two processes is kept by the process
+ * of its source, where the target is a stand-in, and is copied to the
+ * process of its target, where the source is a stand-in.  The copy gives
+ * the target an ID for the invitation and a copy of the game to show to
+ * spectators; everything that happens to the invitation is decided by
+ * the process that keeps it, and is then applied to the copy with
+ * client_remote_notice().
+ */
+typedef struct client_remote {
+    /*
+     * Pass on a notification about an INVITATION kept here to the player
+     * that a stand-in is the target of.  The ID in the header is not
+     * meaningful elsewhere.
+     */
+    void (*notify)(CLIENT *client, INVITATION *inv, JEUX_PACKET_HEADER *hdr, void *data);
+    /*
+     * Pass on the state of a game kept here after a move by the player
+     * that a stand-in is the target of.
+     */
+    void (*moved)(CLIENT *client, INVITATION *inv);
+    /*
+     * Carry out a request (JEUX_ACCEPT_PKT, JEUX_DECLINE_PKT,
+     * JEUX_MOVE_PKT or JEUX_RESIGN_PKT) of a local client on a copy of
+     * an INVITATION whose source a stand-in is, in the process that keeps
+     * the INVITATION, returning as the local function would.
+     */
+    int (*request)(CLIENT *client, INVITATION *inv, int type, char *move, char **strp);
+} CLIENT_REMOTE;
+
+/*
+ * Create a CLIENT that stands in for a player served by another process.
+ *
+ * @param remote  How to reach the process serving the player.
+ * @param player  The PLAYER that the stand-in plays as here, a reference
+ * to which is passed to the CLIENT.
+ * @return the CLIENT, with a reference count of one, or NULL.
+ */
+CLIENT *client_create_remote(const CLIENT_REMOTE *remote, PLAYER *player);
+
+/*
+ * Determine whether a CLIENT stands in for a player of another process.
+ *
+ * @param client  The CLIENT.
+ * @return 1 if it does, otherwise 0.
+ */
+int client_is_remote(CLIENT *client);
+
+/*
+ * Add a copy of an INVITATION, whose source is a stand-in and whose
+ * target is a local client, to the target's table, sending the target
+ * INVITED.
+ *
+ * @param inv  The copy of the INVITATION.
+ * @return the ID of the INVITATION for the target.
+ */
+int client_remote_invited(INVITATION *inv);
+
+/*
+ * Apply to a copy of an INVITATION a notification passed on from the
+ * process that keeps it, and send the notification to the target.
+ * REVOKED, RESIGNED and ENDED close the copy and remove it from the
+ * target's table; ENDED has the winner in the role field.  MOVED, and a
+ * header of type JEUX_NO_PKT, which is not sent, update the copy of the
+ * game.
+ *
+ * @param inv  The copy of the INVITATION.
+ * @param hdr  The header of the notification.
+ * @param data  Its payload, if any.
+ * @param state  For MOVED and JEUX_NO_PKT, the packed state of the game.
+ * @return 0 if the copy is still open, or 1 if it has been closed.
+ */
+int client_remote_notice(INVITATION *inv, JEUX_PACKET_HEADER *hdr, void *data, unsigned char *state);
+
+/*
+ * Carry out a request passed on from the process of the player whose
+ * stand-in is the target of an INVITATION kept here.
+ *
+ * @param inv  The INVITATION.
+ * @param type  JEUX_ACCEPT_PKT, JEUX_DECLINE_PKT, JEUX_MOVE_PKT or
+ * JEUX_RESIGN_PKT.
+ * @param move  For JEUX_MOVE_PKT, the move.
+ * @param strp  For JEUX_ACCEPT_PKT, as for client_accept_invitation().
+ * @return 0 if successful, otherwise -1.
+ */
+int client_remote_request(INVITATION *inv, int type, char *move, char **strp);
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef CLIENT_REGISTRY_EXT_H
+#define CLIENT_REGISTRY_EXT_H
+
+#include "client_registry.h"
+
+/*
+ * Additional client registry operations, implemented in
+ * client_registry.c, that are not part of the interface fixed by
+ * client_registry.h.
+ */
+
+/*
+ * Record the username that a registered CLIENT has logged in under, or
+ * that it has logged out.  The registry keeps the name ids of logged-in
+ * clients packed in an array of MAX_CLIENTS entries, which lookups scan
+ * with id_scan() (see id_scan.h).  Called by client_login() and
+ * client_logout().
+ *
+ * @param cr  The registry in which the CLIENT is registered.
+ * @param client  The CLIENT.
+ * @param name_id  The id of the interned username, or -1 on logout.
+ */
+void creg_set_name(CLIENT_REGISTRY *cr, CLIENT *client, int name_id);
+
+/*
+ * Given the id of an interned username (see intern.h), return the CLIENT
+ * that is logged in under that username.  Behaves as creg_lookup(), but
+ * compares name ids rather than strings.
+ *
+ * @param cr  The registry in which the lookup is to be performed.
+ * @param name_id  The id of the username that is to be looked up.
+ * @return the CLIENT currently registered under the specified username,
+ * if there is one, otherwise NULL.
+ */
+CLIENT *creg_lookup_interned(CLIENT_REGISTRY *cr, int name_id);
+
+/*
+ * Get a list of every registered CLIENT, logged in or not, in the order
+ * in which they were registered.
+ *
+ * @param cr  The registry.
+ * @return a NULL-terminated array of CLIENTs, each of whose reference
+ * count has been incremented.  The caller must decrement the reference
+ * counts and free the array.
+ */
+CLIENT **creg_all_clients(CLIENT_REGISTRY *cr);
+
+#endif
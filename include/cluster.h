@@ -0,0 +1,60 @@
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+/*
+ * Cluster: several servers, the nodes, on any ports or hosts, each
+ * serving whichever players connect to it, together with a directory
+ * that knows which node each player is logged in on.  The directory is a
+ * jeux process of its own, started with -D.
+ *
+ * A node connects to the directory when it starts, and tells it the port
+ * on which it listens for other nodes; the directory gives it a number,
+ * never given to another node.  A player may log in on one node at a
+ * time, as the directory decides.  To find a player who is not logged in
+ * locally, a node asks the directory, and keeps the answer until the
+ * directory tells it the player has logged out.
+ *
+ * The nodes are peers of each other (see peer.h), which talk over TCP
+ * connections made when first needed, so that a player can invite, play
+ * against or decline a player of another node just as one of the same.
+ * A USERS request lists the players of every node.  A game can only be
+ * watched by players of the same node as the player named in the WATCH.
+ *
+ * The directory and the nodes share a secret.  The first message on a
+ * connection to the directory or to a node is a HELLO that carries it,
+ * and a connection whose first message does not is closed, so that
+ * nobody who does not know the secret can join or pass as a node.  The
+ * secret is sent as it is, so it keeps out strangers, not eavesdroppers;
+ * the nodes should talk over a private network.  A node listens for
+ * other nodes only on the address it is given, or else on the one it
+ * reaches the directory from.
+ */
+
+/*
+ * Serve as the directory, until interrupted by a signal.
+ *
+ * @param listen_fd  The listening socket for nodes.
+ * @param secret  The secret shared with the nodes, a nonempty string.
+ * @return 0 if interrupted, or -1 on failure.
+ */
+int cluster_directory(int listen_fd, char *secret);
+
+/*
+ * Join a cluster as a node, once the registries are up.
+ *
+ * @param directory  The address of the directory, as host:port.
+ * @param host  The address on which to listen for other nodes, or NULL
+ * for that of the connection to the directory.
+ * @param secret  The secret shared with the directory and the other
+ * nodes, a nonempty string.
+ * @return 0 if successful, otherwise -1.
+ */
+int cluster_join(char *directory, char *host, char *secret);
+
+/*
+ * Leave the cluster, once every client has been logged out.  Does
+ * nothing if cluster_join() has not succeeded.
+ */
+void cluster_leave(void);
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef CORO_H
+#define CORO_H
+
+/*
+ * Stackful coroutines multiplexed over a small pool of worker threads.
+ *
+ * A coroutine runs sequential code on its own small stack, taken from a
+ * pool, and gives up its worker only at the points where it would block
+ * waiting for input.  Each worker has its own run queue; a worker whose
+ * queue is empty steals from the others before it sleeps.  A coroutine
+ * waiting for input is left with a poller thread, which puts it back on
+ * the run queue of the worker it last ran on once its file descriptor
+ * becomes readable.
+ *
+ * A coroutine may take locks, but must not hold one across a point where
+ * it gives up its worker, since it may resume on a different worker.
+ */
+
+/*
+ * Start the workers and the poller.
+ *
+ * @param nworkers  The number of worker threads.
+ * @return 0 if successful, otherwise -1.
+ */
+int coro_init(int nworkers);
+
+/*
+ * Stop the workers and the poller.  Every coroutine must already have
+ * finished.  Does nothing if coro_init() has not succeeded.
+ */
+void coro_fini(void);
+
+/*
+ * Start a coroutine.
+ *
+ * @param fn  The function that the coroutine runs; the coroutine finishes
+ * when it returns.
+ * @param arg  The argument passed to fn.
+ * @return 0 if successful, or -1 if a stack could not be allocated.
+ */
+int coro_spawn(void (*fn)(void *), void *arg);
+
+/*
+ * Give up the worker until a file descriptor is readable (or has reached
+ * end-of-file or an error).  Must be called from a coroutine.
+ *
+ * @param fd  The file descriptor.
+ */
+void coro_wait_readable(int fd);
+
+/*
+ * Give up the worker to any other coroutines that are ready to run.
+ * Must be called from a coroutine.
+ */
+void coro_yield(void);
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stddef.h>
+
+/*
+ * A FRAME is an immutable, reference-counted packet payload.  It lets a
+ * payload that is sent to many clients (for example the game state that
+ * follows each move) be encoded once and then shared by reference from
+ * every outbound queue that needs it.  A FRAME is freed, along with its
+ * data, when its reference count reaches zero.
+ */
+typedef struct frame FRAME;
+
+/*
+ * Create a FRAME wrapping a malloc'ed buffer.  The FRAME takes ownership
+ * of the buffer, which will be freed together with the FRAME.  The newly
+ * created FRAME has a reference count of one.
+ *
+ * @param data  The payload buffer.
+ * @param size  The number of bytes of payload in the buffer.
+ * @return  The newly created FRAME, or NULL if allocation failed.
+ */
+FRAME *frame_create(char *data, size_t size);
+
+/*
+ * Increase the reference count on a FRAME by one.
+ *
+ * @param frame  The FRAME whose reference count is to be increased.
+ * @param why  A string describing the reason why the reference count is
+ * being increased.  This is used for debugging printout.
+ * @return  The same FRAME object that was passed as a parameter.
+ */
+FRAME *frame_ref(FRAME *frame, char *why);
+
+/*
+ * Decrease the reference count on a FRAME by one, freeing the FRAME and
+ * its data if the count reaches zero.
+ *
+ * @param frame  The FRAME whose reference count is to be decreased.
+ * @param why  A string describing the reason why the reference count is
+ * being decreased.  This is used for debugging printout.
+ */
+void frame_unref(FRAME *frame, char *why);
+
+/*
+ * Get the payload bytes of a FRAME.
+ */
+char *frame_data(FRAME *frame);
+
+/*
+ * Get the payload size of a FRAME.
+ */
+size_t frame_size(FRAME *frame);
+
+#endif
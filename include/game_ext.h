@@ -0,0 +1,82 @@
+#ifndef GAME_EXT_H
+#define GAME_EXT_H
+
+#include <stdatomic.h>
+
+#include "game.h"
+
+/*
+ * Additional GAME operations, implemented in game.c, that are not part
+ * of the interface fixed by game.h.
+ */
+
+/*
+ * Get the GAME_ROLE of the player whose turn it is to move.
+ *
+ * @param game  The GAME.
+ * @return the GAME_ROLE of the player to move, or NULL_ROLE if the game
+ * is over.
+ */
+GAME_ROLE game_get_turn(GAME *game);
+
+/*
+ * Encode the state of a GAME in the packed form described in
+ * protocol_ext.h under JEUX_CAP_PACKED_STATE.
+ *
+ * @param game  The GAME.
+ * @param buf  Buffer of JEUX_PACKED_STATE_SIZE bytes to hold the state.
+ */
+void game_pack_state(GAME *game, unsigned char *buf);
+
+/*
+ * Set the state of a GAME from its packed form, as for a copy of a game
+ * that is played in another process.  If the packed state shows no
+ * player to move, the game is over if the board decides it; a game that
+ * ended otherwise is ended by game_resign().
+ *
+ * @param game  The GAME.
+ * @param buf  Buffer of JEUX_PACKED_STATE_SIZE bytes holding the state.
+ */
+void game_unpack_state(GAME *game, const unsigned char *buf);
+
+/*
+ * Each GAME has a mailbox through which whatever changes the course of
+ * the game -- a move, a resignation, a move clock running out -- is
+ * handled, one message at a time, in the order the messages were posted.
+ * There is no thread behind the mailbox: a thread that posts to an idle
+ * mailbox handles its message there and then, along with any that are
+ * posted to the same GAME meanwhile, while a thread that posts to a busy
+ * one leaves its message to the thread already handling them.  So the
+ * players of a game never wait for each other's locks, and the
+ * notifications that come of their moves go out in a definite order.
+ *
+ * A message is embedded in whatever its handler needs, and must stay
+ * valid until it has been handled.  A handler must not post to the
+ * mailbox of the GAME it is handling.
+ */
+typedef struct game_msg {
+    void (*handle)(struct game_msg *msg);
+    struct game_msg *next;          /* For the mailbox it is in */
+    int waited;                     /* Posted by game_call() */
+    atomic_int done;                /* Waited on by game_call(), as a futex */
+} GAME_MSG;
+
+/*
+ * Post a message to a GAME, without waiting for it to be handled.  The
+ * handler may free the message.
+ *
+ * @param game  The GAME, to which the caller holds a reference.
+ * @param msg  The message, which the caller has set handle on.
+ */
+void game_post(GAME *game, GAME_MSG *msg);
+
+/*
+ * Post a message to a GAME and wait for it to have been handled, which
+ * may be done by this thread or another.
+ *
+ * @param game  The GAME, to which the caller holds a reference.
+ * @param msg  The message, which the caller has set handle on.
+ */
+void game_call(GAME *game, GAME_MSG *msg);
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef GLICKO_H
+#define GLICKO_H
+
+/*
+ * A Glicko-2 rating engine.  Players are identified by dense integer
+ * slots.  Games are recorded as they are played, against the ratings that
+ * were in force at the start of the current rating period, and every
+ * player's rating, rating deviation and volatility are then recomputed
+ * together when the period is closed.  The state of all players is kept
+ * as a structure of arrays, so that closing a period is a sequential pass
+ * over memory that the compiler can vectorize.
+ *
+ * A GLICKO is not thread-safe: all calls on one GLICKO must be made by
+ * one thread at a time.
+ */
+
+typedef struct glicko GLICKO;
+
+/*
+ * Create a Glicko-2 engine with no players.
+ *
+ * @param tau  The system constant, which constrains changes in volatility
+ * (typically between 0.3 and 1.2).
+ * @return the new GLICKO, or NULL if allocation failed.
+ */
+GLICKO *glicko_create(double tau);
+
+/*
+ * Free a GLICKO and all its state.
+ */
+void glicko_fini(GLICKO *glicko);
+
+/*
+ * Make sure that slots 0 through nslots - 1 exist.  New slots start with
+ * the default rating of 1500, deviation of 350 and volatility of 0.06.
+ *
+ * @return 0 if successful, -1 if allocation failed.
+ */
+int glicko_reserve(GLICKO *glicko, int nslots);
+
+/*
+ * Set the state of a player, as when its rating is carried over from
+ * elsewhere.  Must not be called during a rating period in which the
+ * player has played.
+ *
+ * @param slot  The slot of the player, which must exist.
+ * @param rating  The rating, on the usual scale.
+ * @param deviation  The rating deviation, on the usual scale.
+ * @param volatility  The volatility.
+ */
+void glicko_set(GLICKO *glicko, int slot, double rating, double deviation, double volatility);
+
+/*
+ * Record a game played in the current rating period.
+ *
+ * @param a  The slot of one player.
+ * @param b  The slot of the other player.
+ * @param score  The score of player a: 1 for a win, 0.5 for a draw, 0 for
+ * a loss.
+ */
+void glicko_record(GLICKO *glicko, int a, int b, double score);
+
+/*
+ * Close the current rating period, updating every player.  The deviation
+ * of a player who did not play grows, but never beyond 350.
+ */
+void glicko_close_period(GLICKO *glicko);
+
+/*
+ * Get the rating of a player, on the usual (Elo-like) scale.
+ */
+double glicko_rating(GLICKO *glicko, int slot);
+
+/*
+ * Get the rating deviation of a player, on the usual scale.
+ */
+double glicko_deviation(GLICKO *glicko, int slot);
+
+/*
+ * Get the volatility of a player.
+ */
+double glicko_volatility(GLICKO *glicko, int slot);
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef ID_SCAN_H
+#define ID_SCAN_H
+
+#include <stdint.h>
+
+/*
+ * Linear search of a packed array of 32-bit ids, such as the name ids of
+ * the clients that are logged in (see intern.h).  The search compares
+ * eight ids at a time with AVX2, or four at a time with SSE2, using a
+ * vector compare and a movemask to find the first match.  The widest
+ * implementation that the CPU supports is chosen the first time id_scan()
+ * is called.
+ */
+
+/*
+ * Find the first occurrence of an id.
+ *
+ * @param ids  The array to be searched.
+ * @param n  The number of ids in the array.
+ * @param id  The id to look for.
+ * @return the index of the first occurrence of id, or -1 if there is none.
+ */
+int id_scan(const int32_t *ids, int n, int32_t id);
+
+/*
+ * As id_scan(), but always one id at a time, for comparison.
+ */
+int id_scan_scalar(const int32_t *ids, int n, int32_t id);
+
+/*
+ * Get the name of the implementation that id_scan() uses: "avx2", "sse2"
+ * or "scalar".
+ */
+const char *id_scan_impl(void);
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef INTERN_H
+#define INTERN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The intern table maps each distinct username to a small integer id, so
+ * that names can be compared by comparing ids.  The bytes of an interned
+ * name are copied once into an arena, NUL-terminated, along with their
+ * length and hash, and stay at the same address for as long as the server
+ * runs.  Ids are dense, starting from zero, in order of interning.
+ *
+ * Interning takes a name as a pointer and a length, so that a name can be
+ * interned or found straight out of a packet payload.  A name ends at its
+ * first NUL byte, if it contains one.
+ */
+
+/*
+ * Intern a name, adding it to the table if it is not already there.
+ *
+ * @param name  The name, which need not be NUL-terminated.
+ * @param len  The length of the name.
+ * @return the id of the name, or -1 if the table is full or allocation
+ * failed.
+ */
+int intern(const char *name, size_t len);
+
+/*
+ * Find the id of a name that has already been interned.
+ *
+ * @param name  The name, which need not be NUL-terminated.
+ * @param len  The length of the name.
+ * @return the id of the name, or -1 if the name has never been interned.
+ */
+int intern_find(const char *name, size_t len);
+
+/*
+ * Get the interned bytes of a name, NUL-terminated.
+ */
+const char *intern_name(int id);
+
+/*
+ * Get the length of an interned name.
+ */
+size_t intern_len(int id);
+
+/*
+ * Get the hash of an interned name.
+ */
+uint32_t intern_hash(int id);
+
+#endif
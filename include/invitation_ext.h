@@ -0,0 +1,90 @@
+#ifndef INVITATION_EXT_H
+#define INVITATION_EXT_H
+
+#include <stdint.h>
+
+#include "invitation.h"
+
+/*
+ * Additional INVITATION operations, implemented in invitation.c, that are
+ * not part of the interface fixed by invitation.h.
+ */
+
+/*
+ * Close an INVITATION that is still in the OPEN state, as when it is
+ * revoked or declined.  Of any number of concurrent attempts to accept,
+ * revoke or decline the same INVITATION, exactly one succeeds.
+ *
+ * @param inv  The INVITATION to be closed.
+ * @return 0 if the INVITATION was OPEN and has been closed, otherwise -1.
+ */
+int inv_withdraw(INVITATION *inv);
+
+/*
+ * Start (or restart) the move clock of an INVITATION whose game is in
+ * progress.  If the clock runs out before it is restarted or stopped,
+ * the player to move forfeits the game by way of client_forfeit_game().
+ * The armed clock holds a reference to the INVITATION.  Closing the
+ * INVITATION stops its clock.
+ *
+ * @param inv  The INVITATION, which must be in the ACCEPTED state.
+ * @param delay_ms  The time the player now to move has to make a move.
+ */
+void inv_start_clock(INVITATION *inv, long delay_ms);
+
+/*
+ * Determine whether the move clock of an INVITATION is running.  Once
+ * the clock has run out it is no longer running, unless it has been
+ * restarted since.
+ *
+ * @param inv  The INVITATION.
+ * @return 1 if the clock is running, otherwise 0.
+ */
+int inv_clock_running(INVITATION *inv);
+
+/*
+ * Stop the move clock of an INVITATION, if it is running.  If the clock
+ * has just run out, this waits for the forfeit to have been posted to
+ * the game's mailbox.
+ *
+ * @param inv  The INVITATION.
+ */
+void inv_stop_clock(INVITATION *inv);
+
+/*
+ * Set the tag of an INVITATION, by which another process that has a copy
+ * of it refers to it (see shard.h).  The tag must be set before the
+ * INVITATION is shared with other threads.
+ *
+ * @param inv  The INVITATION.
+ * @param tag  The tag.
+ */
+void inv_set_tag(INVITATION *inv, uint64_t tag);
+
+/*
+ * Get the tag of an INVITATION.
+ *
+ * @param inv  The INVITATION.
+ * @return the tag, or 0 if none has been set.
+ */
+uint64_t inv_get_tag(INVITATION *inv);
+
+/*
+ * Set the serial by which the checkpoints of an INVITATION's game are
+ * known (see checkpoint.h).  Only the checkpoint writer, and recovery
+ * before the writer has started, set it.
+ *
+ * @param inv  The INVITATION.
+ * @param serial  The serial.
+ */
+void inv_set_serial(INVITATION *inv, uint64_t serial);
+
+/*
+ * Get the checkpoint serial of an INVITATION's game.
+ *
+ * @param inv  The INVITATION.
+ * @return the serial, or 0 if none has been set.
+ */
+uint64_t inv_get_serial(INVITATION *inv);
+
+#endif
@@ -0,0 +1,183 @@
+#ifndef PEER_H
+#define PEER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "client_registry.h"
+#include "protocol_ext.h"
+
+/*
+ * Players served by peers: the other processes of the same server, such
+ * as the other shards of a sharded server (see shard.h) or the other
+ * nodes of a cluster (see cluster.h).
+ *
+ * An invitation to a player of a peer is made to a CLIENT that stands in
+ * for the player (see client_ext.h).  The invitation is kept by the
+ * process of its source, and copied to the process of its target, where
+ * the source is a stand-in in turn; both name it by a tag given to it by
+ * the process that keeps it.  Notifications from the one go to the
+ * other, as do the target's requests on the invitation, which are
+ * carried out where it is kept.
+ *
+ * How messages get from one process to another is up to a transport.
+ * It must hand the messages from each peer to peer_receive() in the
+ * order they were sent, and should not make calls itself while doing so.
+ * The messages are handled, in that order, by a thread of the peer layer,
+ * which may send replies and notifications but never makes calls; so a
+ * transport's receiving thread never waits on a send.  A transport's send
+ * should not wait for the peer either, but queue what the peer cannot
+ * yet take, or the handler threads of two peers sending to each other
+ * could each wait for the other.
+ */
+
+/* Most peers, numbered from 0; a tag leaves 8 bits for the peer. */
+#define PEER_MAX 256
+
+/*
+ * Operations of a PEER_MSG.  Those from PEER_OP_TRANSPORT up are left to
+ * the transport, and are ignored by peer_receive().
+ */
+typedef enum {
+    PEER_REPLY = 1,                 /* To a message with a seq */
+    PEER_PRESENCE,                  /* Is a player logged in, and with what caps */
+    PEER_USERS,                     /* The lines of a USERS response */
+    PEER_NOTICE,                    /* A notification on an invitation kept by the sender */
+    PEER_SYNC,                      /* The state of a game kept by the sender */
+    PEER_REQUEST,                   /* A request on an invitation kept by the receiver */
+    PEER_OP_TRANSPORT = 32
+} PEER_OP;
+
+/*
+ * A message between peers, followed by its payload.
+ */
+typedef struct peer_msg {
+    uint32_t len;                   /* Set by the transport */
+    uint16_t op;
+    uint16_t from;
+    uint64_t seq;                   /* To be replied to, if not 0 */
+    uint64_t tag;
+    int32_t ret;
+    uint8_t type;                   /* Of the notification or request */
+    uint8_t role;
+    uint8_t state[JEUX_PACKED_STATE_SIZE];
+    uint16_t size;                  /* Of the payload */
+} PEER_MSG;
+
+typedef struct peer_transport {
+    /*
+     * Send a message with msg->size bytes of payload, returning -1 if
+     * the peer has gone.
+     */
+    int (*send)(int peer, PEER_MSG *msg, const void *data);
+    /*
+     * Determine whether a peer has gone, so that calls to it are not
+     * going to be answered.
+     */
+    int (*gone)(int peer);
+    /*
+     * Find the peer that a player belongs to or is logged in on,
+     * returning -1 if it is this process, or if there is none.
+     */
+    int (*locate)(const char *name, size_t len);
+    /*
+     * Determine whether a player may log in here, returning 0 if so.  A
+     * player that has logged in is later passed to logout, if set.
+     */
+    int (*login)(const char *name, size_t len);
+    void (*logout)(const char *name, size_t len);
+    /*
+     * Get the peers that players may be logged in on, returning how
+     * many have been stored.
+     */
+    int (*peers)(int *peers, int max);
+} PEER_TRANSPORT;
+
+/*
+ * Start working with peers, once the registries are up, starting the
+ * thread that handles the messages they send.
+ *
+ * @param transport  The transport, which must stay valid.
+ * @param self  The number of this process among its peers.
+ * @return 0 if successful, otherwise -1.
+ */
+int peer_init(const PEER_TRANSPORT *transport, int self);
+
+/*
+ * Stop working with peers, once every client has been logged out and
+ * the transport no longer calls peer_receive().  Stops the handler
+ * thread, dropping any messages it has not yet handled, and releases the
+ * stand-ins and what is left of the invitations shared with peers.  Does
+ * nothing if peer_init() has not succeeded.
+ */
+void peer_fini(void);
+
+/*
+ * Take a message from a peer, to be handled by the handler thread.  The
+ * message and its payload are copied, and may be reused at once.
+ *
+ * @param msg  The message.
+ * @param data  Its payload.
+ */
+void peer_receive(PEER_MSG *msg, char *data);
+
+/*
+ * Send a message to a peer.
+ *
+ * @param peer  The peer.
+ * @param msg  The message, whose from and size are filled in.
+ * @param data  The payload.
+ * @param size  Its size.
+ * @return 0 if successful, or -1 if the peer has gone.
+ */
+int peer_send(int peer, PEER_MSG *msg, const void *data, size_t size);
+
+/*
+ * Send a message to a peer and wait for the reply, whose return value and
+ * tag are left in the message.  The transport passes the reply to peer_receive()
+ * like any other message.
+ *
+ * @param peer  The peer.
+ * @param msg  The message, whose from, seq and size are filled in.
+ * @param data  The payload.
+ * @param size  Its size.
+ * @param datap  Where to store the payload of the reply, NUL-terminated,
+ * which the caller must free, or NULL if there is none; or NULL if it is
+ * not wanted.
+ * @param sizep  Where to store the size of the reply's payload.
+ * @return 0 if there was a reply, or -1 if the peer has gone.
+ */
+int peer_call(int peer, PEER_MSG *msg, const void *data, size_t size, char **datap, size_t *sizep);
+
+/*
+ * Determine whether a player may log in here.  Always true if there are
+ * no peers.
+ *
+ * @param name  The username, which need not be NUL-terminated.
+ * @param len  Its length.
+ * @return 0 if the player may log in, otherwise -1.
+ */
+int peer_login(const char *name, size_t len);
+
+/*
+ * Find a player who is logged in on a peer.
+ *
+ * @param name  The username, which need not be NUL-terminated.
+ * @param len  Its length.
+ * @return a CLIENT that stands in for the player, with its reference
+ * count incremented, or NULL if the player is not logged in on a peer.
+ */
+CLIENT *peer_lookup(const char *name, size_t len);
+
+/*
+ * Get the lines of a USERS response for the players logged in on the
+ * peers.
+ *
+ * @param limit  The most bytes to return.
+ * @param lenp  Where to store the number of bytes.
+ * @return the lines, which the caller must free, or NULL if there are
+ * none.
+ */
+char *peer_users(size_t limit, size_t *lenp);
+
+#endif
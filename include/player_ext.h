@@ -0,0 +1,100 @@
+#ifndef PLAYER_EXT_H
+#define PLAYER_EXT_H
+
+#include "player.h"
+#include "frame.h"
+
+/*
+ * Additional PLAYER operations, implemented in player.c, that are not
+ * part of the interface fixed by player.h.  A player's rating may be read
+ * at any time without locking; it is only ever written by the rating
+ * service (see rating.h).
+ */
+
+/*
+ * Create a new PLAYER whose username has already been interned (see
+ * intern.h), without copying it.
+ *
+ * @param name_id  The id of the interned username.
+ * @return  A reference to the newly created PLAYER, if initialization
+ * was successful, otherwise NULL.
+ */
+PLAYER *player_create_interned(int name_id);
+
+/*
+ * Get the id of a player's interned username.  Two players have the same
+ * username if and only if their name ids are equal.
+ *
+ * @param player  The PLAYER that is to be queried.
+ * @return the id of the username.
+ */
+int player_get_name_id(PLAYER *player);
+
+/*
+ * Get the id of a player.  Ids are small integers, assigned in order of
+ * creation starting from zero, which the rating service uses to index
+ * per-player state.
+ *
+ * @param player  The PLAYER that is to be queried.
+ * @return the id of the player.
+ */
+int player_get_id(PLAYER *player);
+
+/*
+ * Get the exact rating of a player.
+ *
+ * @param player  The PLAYER that is to be queried.
+ * @return the rating of the player.
+ */
+double player_get_rating_exact(PLAYER *player);
+
+/*
+ * Set the rating of a player.  Must only be called by the rating service.
+ *
+ * @param player  The PLAYER that is to be updated.
+ * @param rating  The new rating.
+ */
+void player_set_rating(PLAYER *player, double rating);
+
+/*
+ * Get the line that represents a player in a USERS response, that is the
+ * username, a tab, the rating and a newline.  The line is rendered when
+ * the player is created and again only when the rating shown changes.
+ *
+ * @param player  The PLAYER that is to be queried.
+ * @return a FRAME holding the line, whose reference count has been
+ * incremented, or NULL if it could not be rendered.
+ */
+FRAME *player_get_fragment(PLAYER *player);
+
+/*
+ * Record that a client has logged in or out as a player.  A player may be
+ * logged in on several clients at once.
+ *
+ * @param player  The PLAYER that is to be updated.
+ * @param online  Nonzero for a login, zero for a logout.
+ */
+void player_set_online(PLAYER *player, int online);
+
+/*
+ * Determine whether a player is logged in on any client.
+ *
+ * @param player  The PLAYER that is to be queried.
+ * @return nonzero if the player is logged in, otherwise zero.
+ */
+int player_is_online(PLAYER *player);
+
+/*
+ * Find which of a list of players are logged in, reading only the online
+ * column of the player table.  The list is read in order, so a list in
+ * increasing id order reads the column sequentially.
+ *
+ * @param ids  The ids of the players (see player_get_id()).
+ * @param n  The number of ids.
+ * @param hits  Where to store the index in the list of each player that
+ * is logged in, in order; room for n indices.
+ * @return the number of indices stored.
+ */
+int player_scan_online(const int *ids, int n, int *hits);
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef PLAYER_REGISTRY_EXT_H
+#define PLAYER_REGISTRY_EXT_H
+
+#include "player_registry.h"
+
+/*
+ * Additional player registry operations, implemented in
+ * player_registry.c, that are not part of the interface fixed by
+ * player_registry.h.
+ */
+
+/*
+ * Register a player whose username has already been interned (see
+ * intern.h).  Behaves as preg_register(), without copying the name.
+ *
+ * @param name_id  The id of the interned username.
+ * @return A pointer to a PLAYER object, in case of success, otherwise NULL.
+ */
+PLAYER *preg_register_interned(PLAYER_REGISTRY *preg, int name_id);
+
+/*
+ * Get a list of the registered players that are currently logged in, each
+ * listed once however many clients it is logged in on.
+ *
+ * @param preg  The PLAYER_REGISTRY that is to be scanned.
+ * @return a NULL-terminated array of PLAYERs, each of whose reference
+ * count has been incremented.  The caller must decrement the reference
+ * counts and free the array.
+ */
+PLAYER **preg_online_players(PLAYER_REGISTRY *preg);
+
+/*
+ * Get a list of every registered player, whether logged in or not, in the
+ * order in which they were registered.
+ *
+ * @param preg  The PLAYER_REGISTRY that is to be scanned.
+ * @return a NULL-terminated array of PLAYERs, each of whose reference
+ * count has been incremented.  The caller must decrement the reference
+ * counts and free the array.
+ */
+PLAYER **preg_all_players(PLAYER_REGISTRY *preg);
+
+#endif
@@ -0,0 +1,168 @@
+#ifndef PROTOCOL_EXT_H
+#define PROTOCOL_EXT_H
+
+#include <sys/uio.h>
+#include "protocol.h"
+
+/*
+ * Extensions to the "Jeux" protocol described in protocol.h.
+ *
+ * protocol.h is fixed, so packet types added since then are numbered
+ * after JEUX_ENDED_PKT here.  Packet headers and byte order are the same
+ * as for the original packet types.
+ *
+ * Client-to-server requests:
+ *   WATCH:    Watch a game in progress as a spectator
+ *             Header: index of the game among the named player's games
+ *                     in progress (normally zero)
+ *             Payload: username of one of the players in the game
+ *   UNWATCH:  Stop watching a game
+ *             Header: watch ID assigned by the server
+ *
+ * Server-to-client responses (synchronous):
+ *   ACK:      (for WATCH request)
+ *             Header: watch ID
+ *             Payload: string showing current game state
+ *
+ * Server-to-client notifications (asynchronous):
+ *   WATCH_MOVED  Sent to a spectator when a move is made in a watched game
+ *             Header: watch ID
+ *             Payload: string showing game state after the move
+ *   WATCH_ENDED  Sent to a spectator when a watched game has ended.
+ *             The watch ID is no longer valid after this notification.
+ *             Header: watch ID
+ *                     GAME_ROLE (none, first, second) of winner
+ *
+ * Capabilities:
+ *   A client may ask for optional behavior by setting capability flags in
+ *   the role field of its LOGIN request, which the original protocol
+ *   leaves unused.  Unknown flags are ignored.
+ *
+ *   JEUX_CAP_PACKED_STATE
+ *             Every payload that would show a game state as a string
+ *             (ACCEPTED, MOVED, WATCH_MOVED, and the ACKs for ACCEPT and
+ *             WATCH) instead carries the state packed into
+ *             JEUX_PACKED_STATE_SIZE bytes.  Taken as a big-endian 24-bit
+ *             number, bits 2k and 2k+1 hold square k of the board (row by
+ *             row from the top left) as 0 for empty, 1 for X or 2 for O,
+ *             and bits 18 and 19 hold the GAME_ROLE to move, or 0 if the
+ *             game is over.
+ *
+ *   JEUX_CAP_CORRELATION
+ *             Every ACK or NACK carries, in its timestamp_sec and
+ *             timestamp_nsec fields, the values that the request it
+ *             answers carried there, so that a client can tag its
+ *             requests and match the replies to them.  The LOGIN ACK
+ *             already does.
+ *
+ * Pipelining:
+ *   A client need not wait for the reply to one request before sending
+ *   the next.  Requests are served one at a time, in the order they were
+ *   sent, and their ACKs and NACKs are sent in the same order, although
+ *   notifications may arrive in between.
+ */
+#define JEUX_CAP_PACKED_STATE 0x01
+#define JEUX_CAP_CORRELATION 0x02
+
+#define JEUX_PACKED_STATE_SIZE 3
+
+typedef enum {
+    /* Client-to-server */
+    JEUX_WATCH_PKT = JEUX_ENDED_PKT + 1,
+    JEUX_UNWATCH_PKT,
+    /* Server-to-client notifications (asynchronous) */
+    JEUX_WATCH_MOVED_PKT,
+    JEUX_WATCH_ENDED_PKT
+} JEUX_PACKET_TYPE_EXT;
+
+/*
+ * A buffered reader of packets from a connection, for a thread that
+ * serves requests.  Packets that arrive back to back are taken from the
+ * connection with one read, rather than with two reads each.
+ */
+typedef struct proto_reader PROTO_READER;
+
+/*
+ * Create a reader for a connection.
+ *
+ * @param fd  The file descriptor of the connection, which is not closed
+ * when the reader is freed, or -1 for a reader that never reads by
+ * itself, but is fed with proto_reader_feed() by an event loop.
+ * @return the reader, or NULL if memory could not be allocated.
+ */
+PROTO_READER *proto_reader_create(int fd);
+
+/*
+ * Free a reader, discarding anything that it has buffered.
+ *
+ * @param reader  The reader.
+ */
+void proto_reader_free(PROTO_READER *reader);
+
+/*
+ * Receive the next packet, as proto_recv_packet does, but from the
+ * reader's buffer whenever possible.
+ *
+ * @param reader  The reader.
+ * @param hdr  Where to store the header, with multi-byte fields in network
+ * byte order.  At end-of-file, its type is set to JEUX_NO_PKT.
+ * @param payloadp  Where to store a pointer to the payload, which the
+ * caller must free, if there is one.
+ * @return 0 if successful, -1 otherwise.
+ */
+int proto_reader_recv(PROTO_READER *reader, JEUX_PACKET_HEADER *hdr, void **payloadp);
+
+/*
+ * Append bytes received from the connection to a reader's buffer, which
+ * grows to hold them.
+ *
+ * @param reader  The reader.
+ * @param data  The bytes.
+ * @param len  The number of bytes.
+ * @return 0 if successful, -1 if memory could not be allocated.
+ */
+int proto_reader_feed(PROTO_READER *reader, void *data, size_t len);
+
+/*
+ * Receive whatever has arrived on a reader's connection, without waiting
+ * if nothing has.  The connection itself is left in blocking mode, so
+ * that other threads can go on writing to it.
+ *
+ * @param reader  The reader, which must have a connection.
+ * @return the number of bytes received, 0 at end-of-file, or -1 on error,
+ * with errno EAGAIN or EWOULDBLOCK if nothing has arrived.
+ */
+int proto_reader_pull(PROTO_READER *reader);
+
+/*
+ * Check whether a reader already has a whole packet buffered, so that
+ * proto_reader_recv will not have to wait for one.
+ *
+ * @param reader  The reader.
+ * @return nonzero if a whole packet is buffered, otherwise 0.
+ */
+int proto_reader_ready(PROTO_READER *reader);
+
+/*
+ * Get the bytes that a reader has buffered but not yet returned as
+ * packets, such as the start of a request that is still arriving.
+ *
+ * @param reader  The reader.
+ * @param lenp  Where to store the number of bytes.
+ * @return the bytes, which remain owned by the reader and are valid until
+ * it is next used.
+ */
+char *proto_reader_unread(PROTO_READER *reader, size_t *lenp);
+
+/*
+ * Write all of a gather list to a connection, resuming after partial
+ * writes.  The list is consumed in the process.
+ *
+ * @param fd  The file descriptor of the connection.
+ * @param iov  The buffers to write, in order.
+ * @param iovcnt  The number of buffers.
+ * @return 0 if successful, -1 otherwise.
+ */
+int proto_writev(int fd, struct iovec *iov, int iovcnt);
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef RATING_H
+#define RATING_H
+
+#include "player.h"
+
+/*
+ * The rating service applies the results of finished games to players'
+ * ratings.  Posting a result only pushes it onto a lock-free queue, so
+ * that the thread that finished the game can notify the players at once;
+ * a rating thread drains the queue in batches and applies the results in
+ * the order they were posted.  Until the rating thread has been started
+ * (and once it has been stopped) results are applied immediately, in the
+ * thread that posts them.
+ *
+ * By default ratings are updated after every game with a system of a
+ * type devised by Arpad Elo, the expected score of each player being
+ * looked up in a table indexed by the difference between the players'
+ * ratings.  Alternatively the Glicko-2 system (see glicko.h) may be used,
+ * in which case the games played are accumulated over a rating period and
+ * the ratings of all players are recomputed together, by the rating
+ * thread, at the end of each period.
+ */
+
+typedef enum rating_engine {
+    RATING_ELO, RATING_GLICKO2
+} RATING_ENGINE;
+
+/*
+ * Start the rating thread.
+ *
+ * @param engine  The rating system to use.
+ * @param period_ms  For RATING_GLICKO2, the length of a rating period.
+ * Ignored for RATING_ELO.
+ * @return 0 if the thread was started, otherwise -1.
+ */
+int rating_init(RATING_ENGINE engine, long period_ms);
+
+/*
+ * Apply all results that have been posted and stop the rating thread.
+ * With RATING_GLICKO2, the current rating period is closed.
+ */
+void rating_fini(void);
+
+/*
+ * Post the result of a game between two players.  The players'
+ * reference counts are incremented until the result has been applied.
+ *
+ * @param player1  One of the PLAYERs that is to be updated.
+ * @param player2  The other PLAYER that is to be updated.
+ * @param result   0 if draw, 1 if player1 won, 2 if player2 won.
+ */
+void rating_post(PLAYER *player1, PLAYER *player2, int result);
+
+/*
+ * Wait until every result posted before the call has been applied.  With
+ * RATING_GLICKO2, an applied result is only reflected in the players'
+ * ratings once its rating period has closed.
+ */
+void rating_flush(void);
+
+#endif
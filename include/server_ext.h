@@ -0,0 +1,87 @@
+#ifndef SERVER_EXT_H
+#define SERVER_EXT_H
+
+#include "server.h"
+#include "protocol.h"
+
+/*
+ * The parts of the client service loop, implemented in server.c, for
+ * use by I/O backends other than the thread per client that runs
+ * jeux_client_service().
+ */
+
+/*
+ * Carry out one request from a client, sending the reply.
+ *
+ * @param client  The CLIENT that the request came from.
+ * @param hdr  The header of the request, with multi-byte fields in
+ * network byte order.  The header may be changed.
+ * @param payload  The payload of the request, or NULL if there is none.
+ * It remains owned by the caller.
+ * @return the CLIENT that later requests on the same connection belong
+ * to, which differs from the one passed once a LOGIN has resumed a parked
+ * session, or NULL if the packet ends the connection.  In that case the
+ * caller must call jeux_end_connection().
+ */
+CLIENT *jeux_serve_request(CLIENT *client, JEUX_PACKET_HEADER *hdr, void *payload);
+
+/*
+ * Release a client whose connection has ended, and close the connection.
+ * A client that is logged in is parked until its session expires, if
+ * sessions are enabled, and is otherwise logged out and unregistered.
+ *
+ * @param client  The CLIENT.
+ */
+void jeux_end_connection(CLIENT *client);
+
+/*
+ * Serve a client that is registered, and attached to its connection, with
+ * a thread of its own, as jeux_client_service() serves a new connection.
+ *
+ * @param client  The CLIENT.
+ * @param unread  Bytes of requests from the client that have already been
+ * read from the connection, to be served first, or NULL.  They are copied.
+ * @param len  The number of bytes.
+ * @return 0 if a thread was started, otherwise -1.
+ */
+int jeux_serve_client(CLIENT *client, const void *unread, size_t len);
+
+/*
+ * Stop the threads that serve clients, as before the clients are handed
+ * over to another process (see upgrade.h).  Each finishes the request it
+ * is carrying out, writes out its client's notifications, stops its
+ * client's watchdog and leaves the connection open and the client
+ * registered, keeping what it had read of later requests for
+ * jeux_take_unread().  Threads started meanwhile wait until
+ * jeux_resume().  Returns once no thread is serving a client.
+ */
+void jeux_quiesce(void);
+
+/*
+ * Let threads serve clients again after jeux_quiesce().  The clients that
+ * were being served must be served anew with jeux_serve_client().
+ */
+void jeux_resume(void);
+
+/*
+ * Take what the thread that served a client had read of its later
+ * requests when it was stopped by jeux_quiesce().
+ *
+ * @param client  The CLIENT.
+ * @param lenp  Where to store the number of bytes.
+ * @return the bytes, which the caller must free, or NULL if there are
+ * none.
+ */
+char *jeux_take_unread(CLIENT *client, size_t *lenp);
+
+/*
+ * Coroutine function for the coroutine that handles a particular client
+ * (see coro.h).  It runs the same service loop as jeux_client_service(),
+ * but gives up its worker thread whenever it has to wait for a request.
+ *
+ * @param arg  The file descriptor of the client connection, cast to a
+ * pointer.
+ */
+void jeux_client_coroutine(void *arg);
+
+#endif
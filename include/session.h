@@ -0,0 +1,111 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stddef.h>
+#include "client_registry.h"
+
+/*
+ * A session lets a logged-in client survive the loss of its connection.
+ * Each successful LOGIN starts a session identified by a random resume
+ * token, which is returned as the payload of the ACK.  When the client's
+ * connection is lost, rather than being logged out (which resigns its
+ * games and revokes or declines its invitations), the CLIENT is parked
+ * for a grace period, during which its games and invitations stay intact
+ * and notifications sent to it are held.  A LOGIN whose payload is the
+ * username followed by a NUL byte and the resume token reattaches the new
+ * connection to the parked CLIENT.  If the grace period expires first, the
+ * CLIENT is logged out and unregistered as if it had disconnected
+ * normally.  Grace periods are timed on the timer wheel.
+ */
+
+/* Length of a resume token, as sent to the client. */
+#define SESSION_TOKEN_LEN 16
+
+/* Maximum number of notifications held for a parked client. */
+#define SESSION_HELD_PACKETS 64
+
+/*
+ * Enable sessions.
+ *
+ * @param grace_ms  How long a client whose connection was lost stays
+ * parked before it is logged out.  Zero disables sessions, in which case
+ * clients are logged out as soon as their connection is lost.
+ */
+void session_init(long grace_ms);
+
+/*
+ * Stop parking clients and log out every client that is currently
+ * parked, as part of server shutdown.
+ */
+void session_fini(void);
+
+/*
+ * Log out every client that is currently parked, without waiting for the
+ * grace periods to expire, as before the server's clients are handed over
+ * to another process (see upgrade.h).
+ */
+void session_expire_parked(void);
+
+/*
+ * Start a session for a CLIENT that has just logged in.
+ *
+ * @param client  The CLIENT.
+ * @param token  Buffer of at least SESSION_TOKEN_LEN + 1 bytes, into which
+ * the NUL-terminated resume token for the session is stored.
+ * @return 0 if a session was started, -1 if sessions are disabled.
+ */
+int session_begin(CLIENT *client, char *token);
+
+/*
+ * Get the resume token of the session of a CLIENT.
+ *
+ * @param client  The CLIENT.
+ * @param token  Buffer of at least SESSION_TOKEN_LEN + 1 bytes, into which
+ * the NUL-terminated resume token is stored.
+ * @return 0 if the CLIENT has a session, otherwise -1.
+ */
+int session_get_token(CLIENT *client, char *token);
+
+/*
+ * Start a session for a CLIENT that is logged in, under the resume token
+ * of a session that it had in another process (see upgrade.h).
+ *
+ * @param client  The CLIENT.
+ * @param token  The NUL-terminated resume token.
+ * @return 0 if a session was started, or -1 if sessions are disabled or
+ * the token is not valid.
+ */
+int session_adopt(CLIENT *client, const char *token);
+
+/*
+ * End the session of a CLIENT that is being logged out, if it has one.
+ *
+ * @param client  The CLIENT.
+ */
+void session_end(CLIENT *client);
+
+/*
+ * Park a CLIENT whose connection has been lost.  The CLIENT is detached
+ * from its connection, which the caller should then close.  A CLIENT that
+ * has been parked must not be logged out or unregistered by the caller.
+ *
+ * @param client  The CLIENT.
+ * @return the file descriptor of the lost connection if the CLIENT was
+ * parked, or -1 if it has no session (in which case the CLIENT is left
+ * untouched).
+ */
+int session_park(CLIENT *client);
+
+/*
+ * Look up a parked session by resume token and username, and claim it for
+ * a new connection.  The returned CLIENT stays parked, holding
+ * notifications, until the caller resumes it with client_unpark().
+ *
+ * @param token  The resume token presented by the client.
+ * @param len  The length of the token.
+ * @param name  The username presented by the client.
+ * @return the parked CLIENT if the session was found, otherwise NULL.
+ */
+CLIENT *session_resume(char *token, size_t len, char *name);
+
+#endif
@@ -0,0 +1,97 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <stddef.h>
+
+/*
+ * Sharded server: several processes, each serving its own partition of
+ * the players, chosen by a hash of the username.
+ *
+ * Each shard listens on the same port with SO_REUSEPORT, so the kernel
+ * spreads new connections over the shards.  A connection first waits in
+ * the shard's gate, which looks at its first packet without reading it:
+ * if it is a LOGIN for a player of another shard, the connection is
+ * passed to that shard over a Unix socket, so that every player is
+ * served by the shard it belongs to (its home) and the shard can look it
+ * up in its own registries.
+ *
+ * The shards are peers of each other (see peer.h), which talk through
+ * single-producer single-consumer rings in memory shared by all of them,
+ * one for each ordered pair of shards.  Each shard has a thread that
+ * takes what the others send it from its rings, waking on an eventfd
+ * when one of them was empty.  A USERS request lists the players of
+ * every shard.
+ *
+ * A player's rating is kept by its home.  A game between players of two
+ * shards is rated by each shard against its own record of the opponent,
+ * so ratings are approximate across shards.  A game can only be watched
+ * by players of the same shard as the player named in the WATCH.
+ */
+
+/*
+ * Set up what the shards share, before they are forked.
+ *
+ * @param nshards  The number of shards.
+ * @return 0 if successful, otherwise -1.
+ */
+int shard_init(int nshards);
+
+/*
+ * Fork the shard processes.
+ *
+ * @return in each shard, its index; in the parent, -1 once every shard
+ * has been forked.
+ */
+int shard_fork(void);
+
+/*
+ * In the parent, send a signal to every shard and wait for them all to
+ * exit, then release what they shared.
+ *
+ * @param sig  The signal.
+ */
+void shard_finish(int sig);
+
+/*
+ * Open the listening socket of a shard, shared with the other shards.
+ *
+ * @param port  The port.
+ * @return the socket, or -1 if it could not be opened.
+ */
+int shard_listen(char *port);
+
+/*
+ * Start taking messages from the other shards, once the registries are
+ * up.  Connections waiting in the gate to send a LOGIN are closed after
+ * the given time.
+ *
+ * @param login_ms  How long a connection has to log in, or 0 for ever.
+ * @return 0 if successful, otherwise -1.
+ */
+int shard_start(long login_ms);
+
+/*
+ * Stop taking messages from the other shards, once every client has
+ * been logged out.  Does nothing if shard_start() has not succeeded.
+ */
+void shard_stop(void);
+
+/*
+ * Wait for the next connection that this shard is to serve: one that
+ * has passed the gate, or one passed on by another shard.
+ *
+ * @param listen_fd  The listening socket.
+ * @return the connection, or -1 if the wait was interrupted by a signal.
+ */
+int shard_accept(int listen_fd);
+
+/*
+ * Determine which shard a player belongs to.
+ *
+ * @param name  The username, which need not be NUL-terminated.
+ * @param len  Its length.
+ * @return the index of the shard.
+ */
+int shard_home(const char *name, size_t len);
+
+#endif
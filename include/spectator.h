@@ -0,0 +1,109 @@
+#ifndef SPECTATOR_H
+#define SPECTATOR_H
+
+#include "client_registry.h"
+#include "game.h"
+#include "frame.h"
+
+/*
+ * Spectators are clients that have subscribed to a GAME in progress
+ * without being one of its players.  After every move the game state is
+ * encoded once, wrapped in a FRAME, and handed to the spectator service,
+ * which stores a reference to that FRAME in every subscription and writes
+ * it to the subscriber's socket when the socket becomes writable.  Each
+ * subscription keeps only the newest unsent state, so a spectator that
+ * cannot keep up skips intermediate boards instead of accumulating them.
+ * All fan-out and spectator I/O is done by a single service thread, so the
+ * cost of a move to the player making it does not depend on the number of
+ * spectators.
+ */
+
+/*
+ * Start the spectator service thread.
+ *
+ * @param interval_ms  The minimum time between two game states sent to
+ * the same subscriber, or zero to send each state as soon as possible.
+ * States published within the interval are coalesced into the newest one.
+ * @return 0 if the service was started, otherwise -1.
+ */
+int spectator_init(long interval_ms);
+
+/*
+ * Stop the spectator service thread and discard any remaining
+ * subscriptions.  Should be called only once no clients remain.
+ */
+void spectator_fini(void);
+
+/*
+ * Subscribe a CLIENT to a GAME in progress.  The subscription holds
+ * references to both the CLIENT and the GAME until it is removed.
+ *
+ * @param client  The spectating CLIENT.
+ * @param game  The GAME to be watched.
+ * @return the watch ID assigned to the subscription, which identifies it
+ * in notifications and UNWATCH requests, or -1 if the GAME is already
+ * over or the subscription could not be made.
+ */
+int spectator_watch(CLIENT *client, GAME *game);
+
+/*
+ * Subscribe a CLIENT to a GAME in progress under a given watch ID, as for
+ * a subscription that the CLIENT had in another process (see upgrade.h).
+ * @param client  The spectating CLIENT.
+ * @param game  The GAME to be watched.
+ * @param id  The watch ID, which the CLIENT must not be using already.
+ * @return 0 if the subscription was made, otherwise -1.
+ */
+int spectator_watch_id(CLIENT *client, GAME *game, int id);
+
+/*
+ * List the subscriptions of a CLIENT to games that have not ended.
+ * @param client  The spectating CLIENT.
+ * @param games  Where to store the watched GAMEs, each with its
+ * reference count incremented.
+ * @param ids  Where to store the corresponding watch IDs.
+ * @param max  The most subscriptions to store.
+ * @return the number of subscriptions stored.
+ */
+int spectator_list(CLIENT *client, GAME **games, int *ids, int max);
+
+/*
+ * Cancel a subscription.  Any state not yet sent to the subscriber is
+ * discarded.
+ *
+ * @param client  The spectating CLIENT.
+ * @param id  The watch ID of the subscription.
+ * @return 0 if the subscription was cancelled, otherwise -1.
+ */
+int spectator_unwatch(CLIENT *client, int id);
+
+/*
+ * Cancel all of a CLIENT's subscriptions, as when the client disconnects.
+ *
+ * @param client  The spectating CLIENT.
+ */
+void spectator_unwatch_all(CLIENT *client);
+
+/*
+ * Publish the state of a GAME after a move to the game's spectators.
+ * If anything is being watched, the state is encoded once as a string and
+ * once packed (see protocol_ext.h), and each subscriber is sent whichever
+ * its client asked for.  This function only queues the encoded states for
+ * the service thread and returns immediately.  A state that has not been
+ * sent to a subscriber by the time a newer one is published is dropped
+ * for that subscriber.
+ *
+ * @param game  The GAME in which a move was made.
+ */
+void spectator_publish(GAME *game);
+
+/*
+ * Notify the spectators of a GAME that the game has ended, after which
+ * their subscriptions are removed.
+ *
+ * @param game  The GAME that has ended.
+ * @param winner  The GAME_ROLE of the winner, or NULL_ROLE for a draw.
+ */
+void spectator_game_ended(GAME *game, GAME_ROLE winner);
+
+#endif
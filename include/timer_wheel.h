@@ -0,0 +1,82 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdint.h>
+
+/*
+ * A timer wheel runs callbacks after a delay.  Timers are kept in a
+ * hierarchy of rings of slots indexed by expiry tick, so that arming and
+ * cancelling a timer take constant time regardless of how many timers are
+ * armed or how far in the future they expire.  A single
+ * thread advances the wheel one tick at a time and runs the callbacks of
+ * expired timers.  There is one timer wheel per server.
+ *
+ * A TIMER is meant to be embedded in the object it times, so that arming
+ * it never allocates.
+ */
+
+typedef void TIMER_FUNC(void *arg);
+
+typedef struct timer {
+    struct timer *next;             /* NULL if not armed */
+    struct timer *prev;
+    uint64_t expires;               /* Tick at which the timer fires */
+    TIMER_FUNC *func;
+    void *arg;
+} TIMER;
+
+/*
+ * Start the timer wheel thread.
+ *
+ * @param tick_ms  The resolution of the wheel in milliseconds.
+ * @return 0 if the wheel was started, otherwise -1.
+ */
+int timer_wheel_init(long tick_ms);
+
+/*
+ * Stop the timer wheel thread.  Timers that are still armed never fire.
+ */
+void timer_wheel_fini(void);
+
+/*
+ * Initialize a TIMER in the unarmed state.
+ *
+ * @param timer  The TIMER to be initialized.
+ * @param func  The function to be called when the timer fires.  It is
+ * called on the timer wheel thread, with no locks held.
+ * @param arg  The argument to be passed to func.
+ */
+void timer_init(TIMER *timer, TIMER_FUNC *func, void *arg);
+
+/*
+ * Arm a TIMER to fire after a delay.  If the TIMER is already armed, it
+ * is re-armed with the new delay.
+ *
+ * @param timer  The TIMER to be armed.
+ * @param delay_ms  The delay in milliseconds, rounded up to whole ticks.
+ * @return 1 if the TIMER was already armed, otherwise 0.
+ */
+int timer_arm(TIMER *timer, long delay_ms);
+
+/*
+ * Determine whether a TIMER is armed.  A TIMER whose callback is running
+ * is no longer armed, unless it has been armed again since it fired.
+ *
+ * @param timer  The TIMER.
+ * @return 1 if the TIMER is armed, otherwise 0.
+ */
+int timer_pending(TIMER *timer);
+
+/*
+ * Cancel a TIMER.  If the TIMER's callback is running on the timer wheel
+ * thread at the time of the call, this function waits for it to return,
+ * so that once it returns the TIMER may be freed.  When called from a
+ * timer callback (including the TIMER's own), it never waits.
+ *
+ * @param timer  The TIMER to be cancelled.
+ * @return 1 if the TIMER was armed and has been cancelled, 0 if it was not
+ * armed.
+ */
+int timer_cancel(TIMER *timer);
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+/*
+ * Upgrade: hand the clients of a running server over to a new server
+ * process, such as one running a new binary, without closing their
+ * connections.
+ *
+ * A server started with -u listens on a Unix socket at the given path.  A
+ * new server started with the same -u connects to it and takes over.  The
+ * old server stops serving requests (see jeux_quiesce()), sends its
+ * players, clients, invitations, games and watches, then its listening
+ * socket and every client connection, and exits as soon as the new server
+ * has restored them.  The new server then listens on the path in its turn.
+ * Clients keep their connections, logins, invitation and watch IDs and
+ * resume tokens; requests that arrive meanwhile are served once the new
+ * server has taken over.  If the new server fails before then, the old
+ * one goes on serving.
+ *
+ * Only a server that serves clients with a thread per client, and rates
+ * them with Elo, can be upgraded.  Clients whose sessions are parked are
+ * logged out at the handoff, and the move clocks of the games in
+ * progress start afresh.
+ */
+
+/*
+ * Take over the clients of a server listening for a successor, once the
+ * registries and services are up.
+ *
+ * @param path  The path of the Unix socket the old server listens on.
+ * @return the listening socket for clients, handed over by the old
+ * server, -1 if there is no server to take over from, or -2 on failure.
+ */
+int upgrade_takeover(char *path);
+
+/*
+ * Listen for a successor, and hand the server over to the first that
+ * connects.
+ *
+ * @param path  The path of the Unix socket to listen on, which replaces
+ * any file of that name.
+ * @param listen_fd  The listening socket for clients.
+ * @return 0 if successful, otherwise -1.
+ */
+int upgrade_listen(char *path, int listen_fd);
+
+#endif
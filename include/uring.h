@@ -0,0 +1,80 @@
+#ifndef URING_H
+#define URING_H
+
+/*
+ * An io_uring backend for serving clients, as an alternative to a thread
+ * per client.  One event loop thread owns a ring on which it keeps a
+ * multishot accept armed on the listening socket and a multishot recv
+ * armed on every connection, the kernel picking a buffer for each recv
+ * from a ring of provided buffers.  Completions are reaped in batches;
+ * the requests they complete are carried out on the event loop thread,
+ * through jeux_serve_request(), with each connection corked so that the
+ * replies to a batch are gathered and sent with one send SQE.  So the
+ * I/O of many clients is submitted and completed with one io_uring_enter
+ * per batch, rather than with a read and a write per request.
+ *
+ * Alternatively, the event loop only does the I/O, and hands the requests
+ * it receives to a pool of workers (see workq.h), the requests of each
+ * connection going on the connection's own strand so that they are still
+ * carried out in order.  A worker then writes the replies to the requests
+ * that were handed over together once it has carried them all out.
+ * With game affinity, the two connections of a game also share a strand
+ * while the game goes on, so that its moves are carried out by one worker
+ * at a time, with the game, its invitation and both clients staying in
+ * that worker's cache and their locks uncontended.
+ *
+ * Packets sent to a client by other threads (notifications) are written
+ * directly while the event loop has nothing in progress for the client,
+ * and are otherwise gathered with the replies.  While a send is in
+ * progress, no further requests of the client are carried out.
+ *
+ * io_uring needs Linux 5.19 or later for multishot recv and provided
+ * buffer rings; where it is not available, uring_start() fails, and the
+ * server falls back to a thread per client.
+ */
+
+/* Flags for uring_start(). */
+#define URING_POOLED 0x1            /* Carry out requests on the workq's workers */
+#define URING_AFFINITY 0x2          /* Carry out the requests of a game's players together */
+
+/*
+ * Start serving clients that connect to a listening socket.
+ *
+ * @param listen_fd  The listening socket, or -1 if connections are only
+ * to be handed over with uring_adopt().
+ * @param flags  URING_POOLED if requests are to be carried out by the
+ * workers of the workq, which must have been started, rather than by the
+ * event loop thread, together with URING_AFFINITY if both players of a
+ * game are to be served together.
+ * @return 0 if the event loop was started, or -1 if io_uring could not
+ * be set up.
+ */
+int uring_start(int listen_fd, int flags);
+
+/*
+ * Stop the event loop.  The clients must already have gone, as during
+ * server shutdown once creg_wait_for_empty() has returned; the workers,
+ * if any, are stopped only after this.  Does nothing
+ * if the event loop was not started.
+ */
+void uring_stop(void);
+
+/*
+ * Hand the event loop a connection accepted elsewhere, such as by the
+ * gate of a shard (see shard.h), to be served as if it had accepted it.
+ *
+ * @param fd  The connection.
+ * @return 0 if successful, otherwise -1.
+ */
+int uring_adopt(int fd);
+
+/*
+ * Get the number of io_uring_enter system calls that the event loop has
+ * made, for comparing the system calls made per packet with the thread
+ * per client backend.
+ *
+ * @return the number of calls.
+ */
+long uring_enter_count(void);
+
+#endif
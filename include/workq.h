@@ -0,0 +1,99 @@
+#ifndef WORKQ_H
+#define WORKQ_H
+
+#include <pthread.h>
+
+/*
+ * A pool of worker threads that run tasks, with work stealing.
+ *
+ * Each worker has a Chase-Lev deque of tasks: a task submitted by a
+ * worker goes on the bottom of its own deque, from which it takes tasks
+ * in LIFO order without contention, while an idle worker steals from the
+ * top of another worker's deque.  Tasks submitted by threads that are not
+ * workers, such as an event loop, go on a queue shared by all workers,
+ * as do tasks that do not fit on a full deque.  So a burst of work that
+ * lands on one worker is soon spread over the others.
+ *
+ * For comparison, the pool can instead be run with every task going
+ * through the shared queue (WORKQ_SHARED).
+ *
+ * Tasks that must run one at a time, in order, such as the requests of
+ * one client, are posted to a strand.  A strand runs as a task itself,
+ * carrying out the tasks posted to it so far, so different strands run
+ * in parallel while the tasks of each remain serial.
+ */
+
+/*
+ * A task.  It is embedded in whatever the task works on, and must stay
+ * valid until it runs.
+ */
+typedef struct workq_task {
+    void (*run)(struct workq_task *task);
+    struct workq_task *next;        /* For the queue it is on */
+} WORKQ_TASK;
+
+/*
+ * A queue of tasks that are run in order, one at a time.
+ */
+typedef struct workq_strand {
+    WORKQ_TASK task;                /* Runs the strand */
+    pthread_mutex_t lock;           /* Protects the fields below */
+    WORKQ_TASK *head;
+    WORKQ_TASK *tail;
+    WORKQ_TASK *last;               /* Posted by workq_strand_finish() */
+    int scheduled;                  /* The strand is submitted or running */
+} WORKQ_STRAND;
+
+typedef enum {
+    WORKQ_STEALING,                 /* A deque per worker, with stealing */
+    WORKQ_SHARED                    /* One queue shared by all workers */
+} WORKQ_MODE;
+
+/*
+ * Start the workers.
+ *
+ * @param nworkers  The number of worker threads.
+ * @param mode  How tasks are queued.
+ * @return 0 if successful, otherwise -1.
+ */
+int workq_init(int nworkers, WORKQ_MODE mode);
+
+/*
+ * Stop the workers, once they have run every task submitted so far.
+ * Does nothing if workq_init() has not succeeded.
+ */
+void workq_fini(void);
+
+/*
+ * Submit a task to be run by a worker.
+ *
+ * @param task  The task, which the caller has set run on.
+ */
+void workq_submit(WORKQ_TASK *task);
+
+/*
+ * Initialize a strand.
+ *
+ * @param strand  The strand.
+ */
+void workq_strand_init(WORKQ_STRAND *strand);
+
+/*
+ * Post a task to a strand, to run after those already posted to it.
+ *
+ * @param strand  The strand.
+ * @param task  The task, which the caller has set run on.
+ */
+void workq_strand_post(WORKQ_STRAND *strand, WORKQ_TASK *task);
+
+/*
+ * Post the last task to a strand.  Once that task starts running, the
+ * strand is no longer used, so the task may free the memory it is in.
+ * Nothing may be posted to the strand afterwards.
+ *
+ * @param strand  The strand.
+ * @param task  The task, which the caller has set run on.
+ */
+void workq_strand_finish(WORKQ_STRAND *strand, WORKQ_TASK *task);
+
+#endif
@@ -0,0 +1,606 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+
+#include "protocol_ext.h"
+#include "jeux_globals.h"
+#include "client_ext.h"
+#include "checkpoint.h"
+#include "player_registry_ext.h"
+#include "player_ext.h"
+#include "invitation_ext.h"
+#include "game_ext.h"
+#include "session.h"
+#include "intern.h"
+#include "debug.h"
+
+#define CHECKPOINT_MAGIC 0x4a58434b
+#define CHECKPOINT_VERSION 1
+
+/* Size of a record, and of the header that takes the place of one. */
+#define CHECKPOINT_RECORD_SIZE 128
+
+/* Longest username that is recorded; games of players with longer ones are not. */
+#define CHECKPOINT_NAME_MAX 32
+
+/* Registry slots left free by recovery, for players to reconnect through. */
+#define CHECKPOINT_SPARE_CLIENTS 8
+#define CHECKPOINT_PLAYERS (MAX_CLIENTS - CHECKPOINT_SPARE_CLIENTS)
+
+typedef struct checkpoint_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t nslots;
+    uint8_t pad[CHECKPOINT_RECORD_SIZE - 16];
+} CHECKPOINT_HEADER;
+
+/*
+ * The record of a game, the source of its invitation first.  A slot whose
+ * seq is zero is free; a record that fails its check was being written
+ * when the process died, and is dropped.
+ */
+typedef struct checkpoint_record {
+    uint64_t seq;                           /* Order in which records were written */
+    uint64_t game;                          /* Serial of the game */
+    char tokens[2][SESSION_TOKEN_LEN];
+    uint8_t roles[2];
+    uint8_t state[JEUX_PACKED_STATE_SIZE];  /* Board and side to move */
+    uint8_t name_len[2];
+    char names[2][CHECKPOINT_NAME_MAX];
+    uint32_t check;                         /* Of the bytes before it */
+} CHECKPOINT_RECORD;
+
+_Static_assert(sizeof(CHECKPOINT_RECORD) <= CHECKPOINT_RECORD_SIZE, "checkpoint record too large");
+
+typedef union checkpoint_slot {
+    CHECKPOINT_HEADER header;
+    CHECKPOINT_RECORD record;
+} CHECKPOINT_SLOT;
+
+/*
+ * The state of a game, or its end, waiting to be written.
+ */
+typedef struct checkpoint_post {
+    INVITATION *inv;
+    int ended;
+    uint8_t state[JEUX_PACKED_STATE_SIZE];
+    struct checkpoint_post *next;
+} CHECKPOINT_POST;
+
+/*
+ * Where the record of a game is, in an open-addressed table keyed by
+ * serial.
+ */
+typedef struct checkpoint_entry {
+    uint64_t game;                  /* Zero for an empty entry */
+    long slot;
+} CHECKPOINT_ENTRY;
+
+/*
+ * Posting pushes onto a lock-free stack, which the writer thread takes
+ * whole with a single exchange and reverses, and is woken through an
+ * eventfd when a post is pushed onto an empty stack.  Everything below
+ * pending belongs to the writer thread, or to recovery before the thread
+ * has started.
+ */
+static struct {
+    pthread_t thread;
+    int running;
+    atomic_int stopping;
+    int wake_fd;
+    _Atomic(CHECKPOINT_POST *) pending;
+    int fd;
+    CHECKPOINT_SLOT *map;           /* The header, then the ring */
+    size_t map_len;
+    CHECKPOINT_RECORD **records;    /* Into the ring, by slot */
+    long nslots;
+    long head;                      /* Next slot to try */
+    long nlive;                     /* Slots holding records */
+    long refused;                   /* Records not written, the ring being full */
+    uint64_t seq;
+    uint64_t serial;                /* Last serial given to a game */
+    CHECKPOINT_ENTRY *index;
+    size_t index_mask;
+} ckpt = {
+    .wake_fd = -1,
+    .fd = -1
+};
+
+static uint32_t checksum(const CHECKPOINT_RECORD *rec){
+    //FNV-1a
+    const uint8_t *p = (const uint8_t *)rec;
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < offsetof(CHECKPOINT_RECORD, check); i++) {
+        hash = (hash ^ p[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * Count the marks on a packed board, which only ever grows in a game.
+ */
+static int marks(const uint8_t *state){
+    uint32_t packed = (uint32_t)state[0] << 16 | (uint32_t)state[1] << 8 | state[2];
+    int n = 0;
+    for (int k = 0; k < 9; k++) {
+        n += ((packed >> (2 * k)) & 3) != 0;
+    }
+    return n;
+}
+
+static size_t index_hash(uint64_t game){
+    return (game * 11400714819323198485ull >> 32) & ckpt.index_mask;
+}
+
+/*
+ * Find the entry of a game, or the empty entry where it would go.
+ */
+static CHECKPOINT_ENTRY *index_lookup(uint64_t game){
+    size_t i = index_hash(game);
+    while (ckpt.index[i].game && ckpt.index[i].game != game) {
+        i = (i + 1) & ckpt.index_mask;
+    }
+    return &ckpt.index[i];
+}
+
+/*
+ * Remove an entry, moving back the entries after it that would otherwise
+ * no longer be found.
+ */
+static void index_remove(CHECKPOINT_ENTRY *entry){
+    size_t hole = entry - ckpt.index;
+    size_t i = hole;
+    while (ckpt.index[i = (i + 1) & ckpt.index_mask].game) {
+        size_t home = index_hash(ckpt.index[i].game);
+        //unless its home lies cyclically after the hole, up to where it is
+        if (((i - home) & ckpt.index_mask) >= ((i - hole) & ckpt.index_mask)) {
+            ckpt.index[hole] = ckpt.index[i];
+            hole = i;
+        }
+    }
+    ckpt.index[hole].game = 0;
+}
+
+/*
+ * Clear the record of a game, if it has one.
+ */
+static void erase(uint64_t game){
+    CHECKPOINT_ENTRY *entry = game ? index_lookup(game) : NULL;
+    if (!entry || !entry->game) {
+        return;
+    }
+    ckpt.records[entry->slot]->seq = 0;
+    index_remove(entry);
+    ckpt.nlive--;
+}
+
+/*
+ * Take the next free slot of the ring, or -1 if every slot is taken.
+ */
+static long free_slot(void){
+    if (ckpt.nlive == ckpt.nslots) {
+        return -1;
+    }
+    while (ckpt.records[ckpt.head]->seq) {
+        ckpt.head = (ckpt.head + 1) % ckpt.nslots;
+    }
+    long slot = ckpt.head;
+    ckpt.head = (ckpt.head + 1) % ckpt.nslots;
+    return slot;
+}
+
+/*
+ * Append the record of a game in progress, and clear its previous one.
+ */
+static void write_game(INVITATION *inv, const uint8_t *state){
+    CLIENT *clients[2] = { inv_get_source(inv), inv_get_target(inv) };
+    CHECKPOINT_RECORD rec = {0};
+    for (int i = 0; i < 2; i++) {
+        char token[SESSION_TOKEN_LEN + 1];
+        PLAYER *player = client_get_player(clients[i]);
+        char *name = player ? player_get_name(player) : NULL;
+        size_t len = name ? strlen(name) : 0;
+        //a game that could not be resumed is not worth recording
+        if (!name || len > CHECKPOINT_NAME_MAX || session_get_token(clients[i], token)) {
+            return;
+        }
+        memcpy(rec.tokens[i], token, SESSION_TOKEN_LEN);
+        memcpy(rec.names[i], name, len);
+        rec.name_len[i] = len;
+    }
+    rec.roles[0] = inv_get_source_role(inv);
+    rec.roles[1] = inv_get_target_role(inv);
+    memcpy(rec.state, state, JEUX_PACKED_STATE_SIZE);
+    uint64_t game = inv_get_serial(inv);
+    CHECKPOINT_ENTRY *entry = game ? index_lookup(game) : NULL;
+    long prev = entry && entry->game ? entry->slot : -1;
+    //the state posted as the game started may follow that of its first move
+    if (prev >= 0 && marks(state) < marks(ckpt.records[prev]->state)) {
+        return;
+    }
+    //the previous record stays until this one has been written elsewhere
+    long slot = free_slot();
+    if (slot < 0) {
+        if (!ckpt.refused++) {
+            fprintf(stderr, "checkpoint ring is full, games are not being checkpointed\n");
+        }
+        debug("checkpoint ring is full, game %lu not checkpointed", (unsigned long)game);
+        return;
+    }
+    if (!game) {
+        game = ++ckpt.serial;
+        inv_set_serial(inv, game);
+        entry = index_lookup(game);
+    }
+    rec.game = game;
+    rec.seq = ++ckpt.seq;
+    rec.check = checksum(&rec);
+    memcpy(ckpt.records[slot], &rec, sizeof(rec));
+    if (prev < 0) {
+        ckpt.nlive++;
+    }
+    else if (prev != slot) {
+        ckpt.records[prev]->seq = 0;
+    }
+    entry->game = game;
+    entry->slot = slot;
+}
+
+/*
+ * Take and write everything that has been posted.
+ */
+static void write_pending(void){
+    CHECKPOINT_POST *batch = atomic_exchange_explicit(&ckpt.pending, NULL, memory_order_acquire);
+    CHECKPOINT_POST *fifo = NULL;
+    while (batch) {
+        CHECKPOINT_POST *next = batch->next;
+        batch->next = fifo;
+        fifo = batch;
+        batch = next;
+    }
+    while (fifo) {
+        CHECKPOINT_POST *next = fifo->next;
+        if (fifo->ended) {
+            erase(inv_get_serial(fifo->inv));
+        }
+        else {
+            write_game(fifo->inv, fifo->state);
+        }
+        inv_unref(fifo->inv, "checkpoint written");
+        free(fifo);
+        fifo = next;
+    }
+}
+
+static void *checkpoint_thread(void *arg){
+    uint64_t count;
+    struct pollfd pfd = { .fd = ckpt.wake_fd, .events = POLLIN };
+    while (!atomic_load(&ckpt.stopping)) {
+        if (poll(&pfd, 1, -1) > 0 && read(ckpt.wake_fd, &count, sizeof(count)) > 0) {
+            write_pending();
+        }
+    }
+    write_pending();
+    return NULL;
+}
+
+static void post(INVITATION *inv, int ended){
+    if (!ckpt.running) {
+        return;
+    }
+    CHECKPOINT_POST *p = malloc(sizeof(CHECKPOINT_POST));
+    p->inv = inv_ref(inv, "checkpoint posted");
+    p->ended = ended;
+    if (!ended) {
+        game_pack_state(inv_get_game(inv), p->state);
+    }
+    CHECKPOINT_POST *head = atomic_load_explicit(&ckpt.pending, memory_order_relaxed);
+    do {
+        p->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&ckpt.pending, &head, p,
+                                                    memory_order_release, memory_order_relaxed));
+    if (!head) {
+        uint64_t one = 1;
+        if (write(ckpt.wake_fd, &one, sizeof(one)) < 0) {
+            debug("checkpoint wakeup failed");
+        }
+    }
+}
+
+void checkpoint_game(INVITATION *inv){
+    post(inv, 0);
+}
+
+void checkpoint_ended(INVITATION *inv){
+    post(inv, 1);
+}
+
+/*
+ * Open the checkpoint file and map it, starting it afresh unless it holds
+ * a ring written by this version.  Returns 0 if successful, otherwise -1.
+ */
+static int open_file(char *path){
+    ckpt.fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (ckpt.fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    CHECKPOINT_HEADER header;
+    size_t nslots = CHECKPOINT_SLOTS;
+    if (fstat(ckpt.fd, &st) == 0 &&
+        pread(ckpt.fd, &header, sizeof(header), 0) == sizeof(header) &&
+        header.magic == CHECKPOINT_MAGIC && header.version == CHECKPOINT_VERSION &&
+        header.record_size == CHECKPOINT_RECORD_SIZE && header.nslots > 0 &&
+        st.st_size == (off_t)(header.nslots + 1) * CHECKPOINT_RECORD_SIZE) {
+        nslots = header.nslots;
+    }
+    else if (ftruncate(ckpt.fd, 0) || ftruncate(ckpt.fd, (off_t)(nslots + 1) * CHECKPOINT_RECORD_SIZE)) {
+        close(ckpt.fd);
+        ckpt.fd = -1;
+        return -1;
+    }
+    ckpt.map_len = (nslots + 1) * CHECKPOINT_RECORD_SIZE;
+    ckpt.map = mmap(NULL, ckpt.map_len, PROT_READ | PROT_WRITE, MAP_SHARED, ckpt.fd, 0);
+    if (ckpt.map == MAP_FAILED) {
+        close(ckpt.fd);
+        ckpt.fd = -1;
+        return -1;
+    }
+    ckpt.map[0].header = (CHECKPOINT_HEADER){
+        .magic = CHECKPOINT_MAGIC,
+        .version = CHECKPOINT_VERSION,
+        .record_size = CHECKPOINT_RECORD_SIZE,
+        .nslots = nslots
+    };
+    ckpt.nslots = nslots;
+    ckpt.records = malloc(nslots * sizeof(CHECKPOINT_RECORD *));
+    for (size_t i = 0; i < nslots; i++) {
+        ckpt.records[i] = &ckpt.map[i + 1].record;
+    }
+    size_t size = 1;
+    while (size < 2 * nslots) {
+        size <<= 1;
+    }
+    ckpt.index = calloc(size, sizeof(CHECKPOINT_ENTRY));
+    ckpt.index_mask = size - 1;
+    return 0;
+}
+
+/*
+ * Index the records in the ring, keeping the newest of each game and
+ * clearing the rest, and continue the ring after the newest record.
+ */
+static void recover(void){
+    ckpt.head = ckpt.nlive = 0;
+    ckpt.seq = ckpt.serial = 0;
+    for (long slot = 0; slot < ckpt.nslots; slot++) {
+        CHECKPOINT_RECORD *rec = ckpt.records[slot];
+        if (!rec->seq) {
+            continue;
+        }
+        if (rec->check != checksum(rec) || !rec->game ||
+            rec->name_len[0] > CHECKPOINT_NAME_MAX || rec->name_len[1] > CHECKPOINT_NAME_MAX) {
+            rec->seq = 0;
+            continue;
+        }
+        CHECKPOINT_ENTRY *entry = index_lookup(rec->game);
+        if (!entry->game) {
+            entry->game = rec->game;
+            entry->slot = slot;
+            ckpt.nlive++;
+        }
+        //the process died between writing a record and clearing the one before
+        else if (rec->seq > ckpt.records[entry->slot]->seq) {
+            ckpt.records[entry->slot]->seq = 0;
+            entry->slot = slot;
+        }
+        else {
+            rec->seq = 0;
+            continue;
+        }
+        if (rec->seq > ckpt.seq) {
+            ckpt.seq = rec->seq;
+            ckpt.head = (slot + 1) % ckpt.nslots;
+        }
+        if (rec->game > ckpt.serial) {
+            ckpt.serial = rec->game;
+        }
+    }
+}
+
+/*
+ * Find or restore, as a parked session, one of the players of a recorded
+ * game.  Returns its CLIENT, or NULL if it cannot be restored.
+ */
+static CLIENT *restore_player(CLIENT **clients, int *nclients, CHECKPOINT_RECORD *rec, int i){
+    char token[SESSION_TOKEN_LEN + 1];
+    memcpy(token, rec->tokens[i], SESSION_TOKEN_LEN);
+    token[SESSION_TOKEN_LEN] = '\0';
+    int name_id = intern(rec->names[i], rec->name_len[i]);
+    if (name_id < 0) {
+        return NULL;
+    }
+    for (int j = 0; j < *nclients; j++) {
+        if (player_get_name_id(client_get_player(clients[j])) == name_id) {
+            char other[SESSION_TOKEN_LEN + 1];
+            session_get_token(clients[j], other);
+            //a player has one session at a time
+            return strcmp(token, other) ? NULL : clients[j];
+        }
+    }
+    if (*nclients == CHECKPOINT_PLAYERS) {
+        return NULL;
+    }
+    PLAYER *player = preg_register_interned(player_registry, name_id);
+    CLIENT *client = player ? creg_register(client_registry, -1) : NULL;
+    if (!client) {
+        if (player) {
+            player_unref(player, "player not restored");
+        }
+        return NULL;
+    }
+    client_login(client, player);
+    if (session_adopt(client, token)) {
+        client_logout(client);
+        creg_unregister(client_registry, client);
+        return NULL;
+    }
+    session_park(client);
+    clients[(*nclients)++] = client;
+    return client;
+}
+
+/*
+ * Post the result of a recorded game that its last move ended.
+ */
+static void post_ended(CHECKPOINT_RECORD *rec, GAME_ROLE winner){
+    PLAYER *players[2] = { NULL, NULL };
+    for (int i = 0; i < 2; i++) {
+        int name_id = intern(rec->names[i], rec->name_len[i]);
+        players[i] = name_id < 0 ? NULL : preg_register_interned(player_registry, name_id);
+    }
+    if (players[0] && players[1]) {
+        player_post_result(players[0], players[1],
+                           winner == NULL_ROLE ? 0 : winner == rec->roles[0] ? 1 : 2);
+    }
+    for (int i = 0; i < 2; i++) {
+        if (players[i]) {
+            player_unref(players[i], "recovered result posted");
+        }
+    }
+}
+
+/*
+ * Restore a recorded game between its players.  Returns 0 if the game was
+ * restored, otherwise -1.
+ */
+static int restore_game(CLIENT **clients, int *nclients, CHECKPOINT_RECORD *rec){
+    GAME *game = game_create();
+    game_unpack_state(game, rec->state);
+    int over = game_is_over(game);
+    GAME_ROLE winner = game_get_winner(game);
+    game_unref(game, "recorded game checked");
+    if (over) {
+        post_ended(rec, winner);
+        return -1;
+    }
+    CLIENT *source = restore_player(clients, nclients, rec, 0);
+    CLIENT *target = source ? restore_player(clients, nclients, rec, 1) : NULL;
+    INVITATION *inv = target ? inv_create(source, target, rec->roles[0], rec->roles[1]) : NULL;
+    if (!inv) {
+        return -1;
+    }
+    inv_accept(inv);
+    game_unpack_state(inv_get_game(inv), rec->state);
+    inv_set_serial(inv, rec->game);
+    client_add_invitation(source, inv);
+    client_add_invitation(target, inv);
+    inv_unref(inv, "invitation restored");
+    return 0;
+}
+
+static int compare_game(const void *a, const void *b){
+    uint64_t x = ckpt.records[*(const long *)a]->game;
+    uint64_t y = ckpt.records[*(const long *)b]->game;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Restore the recovered games, in the order they started, clearing the
+ * records of those that cannot be.  Returns the number restored.
+ */
+static int restore(CLIENT **clients, int *nclients){
+    long *slots = malloc((ckpt.nlive + 1) * sizeof(long));
+    long n = 0;
+    for (size_t i = 0; i <= ckpt.index_mask; i++) {
+        if (ckpt.index[i].game) {
+            slots[n++] = ckpt.index[i].slot;
+        }
+    }
+    qsort(slots, n, sizeof(long), compare_game);
+    int restored = 0;
+    for (long i = 0; i < n; i++) {
+        CHECKPOINT_RECORD *rec = ckpt.records[slots[i]];
+        if (restore_game(clients, nclients, rec) == 0) {
+            restored++;
+        }
+        else {
+            erase(rec->game);
+        }
+    }
+    free(slots);
+    if (restored < n) {
+        debug("%ld recorded games not restored", n - restored);
+    }
+    return restored;
+}
+
+static void close_file(void){
+    msync(ckpt.map, ckpt.map_len, MS_SYNC);
+    munmap(ckpt.map, ckpt.map_len);
+    close(ckpt.fd);
+    ckpt.fd = -1;
+    free(ckpt.records);
+    ckpt.records = NULL;
+    free(ckpt.index);
+    ckpt.index = NULL;
+}
+
+int checkpoint_init(char *path){
+    if (open_file(path)) {
+        return -1;
+    }
+    recover();
+    CLIENT *clients[CHECKPOINT_PLAYERS];
+    int nclients = 0;
+    int restored = restore(clients, &nclients);
+    atomic_store(&ckpt.stopping, 0);
+    ckpt.wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (ckpt.wake_fd < 0 || pthread_create(&ckpt.thread, NULL, checkpoint_thread, NULL)) {
+        if (ckpt.wake_fd >= 0) {
+            close(ckpt.wake_fd);
+            ckpt.wake_fd = -1;
+        }
+        close_file();
+        return -1;
+    }
+    ckpt.running = 1;
+    //once games can be written, and so ended by their clocks
+    for (int i = 0; i < nclients; i++) {
+        client_lose_notices(clients[i]);
+        client_start_clocks(clients[i]);
+    }
+    return restored;
+}
+
+void checkpoint_fini(void){
+    if (!ckpt.running) {
+        return;
+    }
+    atomic_store(&ckpt.stopping, 1);
+    uint64_t one = 1;
+    if (write(ckpt.wake_fd, &one, sizeof(one)) < 0) {
+        debug("checkpoint wakeup failed");
+    }
+    pthread_join(ckpt.thread, NULL);
+    ckpt.running = 0;
+    close(ckpt.wake_fd);
+    ckpt.wake_fd = -1;
+    //anything posted during shutdown
+    write_pending();
+    if (ckpt.refused) {
+        fprintf(stderr, "%ld checkpoints refused, the ring being full\n", ckpt.refused);
+        ckpt.refused = 0;
+    }
+    close_file();
+}
@@ -1,15 +1,32 @@
 #include "protocol.h"
+#include "protocol_ext.h"
 #include "player.h"
+#include "player_ext.h"
 #include "client_registry.h"
+#include "client_registry_ext.h"
 #include "jeux_globals.h"
 #include "client.h"
 #include "game.h"
 #include "invitation.h"
+#include "client_ext.h"
+#include "invitation_ext.h"
+#include "game_ext.h"
+#include "timer_wheel.h"
+#include "spectator.h"
+#include "checkpoint.h"
+#include "csapp.h"
 #include <stdlib.h>
 #include <stddef.h>
 #include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <stdatomic.h>
 #include "pthread.h"
 #include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
 #include "debug.h"
 
 typedef struct invitation_node {
@@ -17,60 +34,259 @@ typedef struct invitation_node {
     struct invitation_node *next;
 } INVITATION_NODE;
 
+/*
+ * A packet held for a client whose connection has been parked.
+ */
+typedef struct held_packet {
+    JEUX_PACKET_HEADER hdr;
+    char *data;
+    struct held_packet *next;
+} HELD_PACKET;
+
+/*
+ * A notification posted to a client by another thread, with a copy of
+ * its payload.
+ */
+typedef struct notice {
+    struct notice *next;
+    JEUX_PACKET_HEADER hdr;
+    char data[];
+} NOTICE;
+
+/*
+ * The mailbox of a client whose connection no I/O thread is serving.
+ */
+#define NOTICES_CLOSED ((NOTICE *)1)
+
+/*
+ * Amount of output that a corked client holds back before writing it
+ * anyway.
+ */
+#define CLIENT_CORK_LIMIT 16384
+
+/*
+ * Amount of output that may back up behind a send in progress before the
+ * client is disconnected.
+ */
+#define CLIENT_BACKLOG_LIMIT (1 << 20)
+
 typedef struct client{
 	PLAYER *player;
 	int ref_count; 
-    int fd;
-    INVITATION_NODE *head;
+    CLIENT_REGISTRY *registry;      /* Told of logins and logouts */
+    atomic_int caps;                /* Protocol capabilities */
+    uint32_t tag_sec;               /* Correlation tag of the request being */
+    uint32_t tag_nsec;              /* served, only used by its thread */
+    int corked;                     /* Output held back in out, under client_lock */
+    int out_taken;                  /* An event loop is sending earlier output */
+    char *out;
+    size_t out_len;
+    size_t out_cap;
+    int fd;                         /* -1 once detached or parked */
+    INVITATION_NODE *head;          /* Invitation table, under inv_lock */
     INVITATION_NODE *tail;
     size_t len;
+    pthread_mutex_t inv_lock;
+    int parked;
+    int held_limit;
+    int held_count;
+    int held_overflow;
+    HELD_PACKET *held_head;
+    HELD_PACKET *held_tail;
+    TIMER watchdog;                 /* Login deadline and idle timeout */
+    long connected_ms;
+    atomic_long active_ms;          /* Time of the last packet received */
+    void *io;                       /* Owned by the I/O backend serving the connection */
+    NOTICE *_Atomic notices;        /* Mailbox, most recent first, or NOTICES_CLOSED */
+    int notify_fd;                  /* Eventfd written as the mailbox fills, under notify_lock */
+    pthread_mutex_t notify_lock;
+    const CLIENT_REMOTE *remote;    /* Set for a stand-in for a player elsewhere */
     pthread_mutex_t client_lock;
 }CLIENT;
 
-int get_invitation_index_by_client(CLIENT *client, INVITATION *inv) {
-    if (!client) {
-        return -1;
+/*
+ * Timeouts applied to every client, in milliseconds.  Zero disables a
+ * timeout.
+ */
+static struct {
+    long login_ms;
+    long idle_ms;
+    long move_ms;
+} timeouts;
+
+/*
+ * Told when games start and end, if set.
+ */
+static struct {
+    void (*started)(CLIENT *source, CLIENT *target);
+    void (*ended)(CLIENT *source, CLIENT *target);
+} game_hooks;
+
+/*
+ * Told when a player logs out, if set.
+ */
+static void (*logout_hook)(PLAYER *player);
+
+static void client_watchdog_expired(void *arg);
+
+/*
+ * Locking.  Each CLIENT has two locks: inv_lock protects its table of
+ * invitations, and client_lock serializes writes to its connection and
+ * protects the rest of its state.  An INVITATION has no lock of its own:
+ * it moves from one state to another by compare-and-swap on its state
+ * word, in inv_accept(), inv_close() and inv_withdraw(), so that of two
+ * clients racing to accept, decline or revoke it, exactly one wins and the
+ * other fails at once.  Accepting passes through the transient
+ * INV_ACCEPTING state while the GAME is published, and inv_close() waits
+ * that out.  Whichever thread wins a transition is the one that updates
+ * the tables of both clients, each under that client's inv_lock, and
+ * notifies them.  No thread ever holds the locks of two clients, or a
+ * client's inv_lock together with its client_lock, so there is no lock
+ * ordering between clients to get wrong, and a slow connection never
+ * holds up invitation bookkeeping.
+ *
+ * Nor does a thread ever write to another client's connection.  What it
+ * has to tell another client goes into that client's mailbox, without
+ * taking a lock, and is written by the I/O thread serving that client's
+ * connection, which waits on the eventfd that the mailbox's first notice
+ * writes.  The serving thread also writes whatever is in the mailbox
+ * before each reply of its own, so a notice never overtakes or falls
+ * behind a reply that was written after or before it was posted.
+ */
+
+/* The following functions each take and release a client's inv_lock. */
+
+static int table_add(CLIENT *client, INVITATION *inv){
+    INVITATION_NODE *node = malloc(sizeof(INVITATION_NODE));
+    node->invitation = inv_ref(inv, "inv added");
+    node->next = NULL;
+    pthread_mutex_lock(&client->inv_lock);
+    if (client->tail) {
+        client->tail->next = node;
     }
+    else {
+        client->head = node;
+    }
+    client->tail = node;
+    int index = client->len++;
+    pthread_mutex_unlock(&client->inv_lock);
+    return index;
+}
+
+/*
+ * Look up an invitation by its ID, returning it with its reference count
+ * incremented, so that it stays valid however the table changes.
+ */
+static INVITATION *table_get(CLIENT *client, int index){
+    INVITATION *inv = NULL;
+    pthread_mutex_lock(&client->inv_lock);
     INVITATION_NODE *curr = client->head;
+    for (int i = 0; curr && i < index; i++) {
+        curr = curr->next;
+    }
+    if (curr && index >= 0) {
+        inv = inv_ref(curr->invitation, "inv looked up");
+    }
+    pthread_mutex_unlock(&client->inv_lock);
+    return inv;
+}
+
+static int table_index(CLIENT *client, INVITATION *inv){
     int index = 0;
-    while (curr) {
-        if (curr->invitation == inv) {
-            return index;
-        }
+    pthread_mutex_lock(&client->inv_lock);
+    INVITATION_NODE *curr = client->head;
+    while (curr && curr->invitation != inv) {
         curr = curr->next;
         index++;
     }
-    return -1;
+    pthread_mutex_unlock(&client->inv_lock);
+    return curr ? index : -1;
 }
 
-INVITATION *get_invitation_by_index(CLIENT *client, int index) {
-    if (!client || index < 0 || index >= client->len) {
-        return NULL;
+static int table_remove(CLIENT *client, INVITATION *inv){
+    int index = 0;
+    pthread_mutex_lock(&client->inv_lock);
+    INVITATION_NODE **np = &client->head;
+    INVITATION_NODE *prev = NULL;
+    while (*np && (*np)->invitation != inv) {
+        prev = *np;
+        np = &(*np)->next;
+        index++;
     }
-    INVITATION_NODE *curr = client->head;
-    int i = 0;
-    while (curr) {
-        if (i == index) {
-            return curr->invitation;
+    INVITATION_NODE *node = *np;
+    if (node) {
+        *np = node->next;
+        if (client->tail == node) {
+            client->tail = prev;
         }
-        curr = curr->next;
-        i++;
+        client->len--;
     }
-    return NULL;
+    pthread_mutex_unlock(&client->inv_lock);
+    if (!node) {
+        return -1;
+    }
+    free(node);
+    inv_unref(inv, "inv removed from list");
+    return index;
 }
 
+/*
+ * Take a snapshot of a client's invitations, each with its reference
+ * count incremented.  The array is NULL-terminated.
+ */
+static INVITATION **table_snapshot(CLIENT *client){
+    pthread_mutex_lock(&client->inv_lock);
+    INVITATION **invs = calloc(client->len + 1, sizeof(INVITATION *));
+    int i = 0;
+    for (INVITATION_NODE *curr = client->head; curr; curr = curr->next) {
+        invs[i++] = inv_ref(curr->invitation, "inv snapshot");
+    }
+    pthread_mutex_unlock(&client->inv_lock);
+    return invs;
+}
+
+static void snapshot_free(INVITATION **invs){
+    for (int i = 0; invs[i]; i++) {
+        inv_unref(invs[i], "inv snapshot done");
+    }
+    free(invs);
+}
 
 CLIENT *client_create(CLIENT_REGISTRY *creg, int fd){
     CLIENT *client = (CLIENT *) calloc(1, sizeof(CLIENT));
     client->ref_count = 0;
+    client->registry = creg;
     client->fd = fd;
     client->head = NULL;
     client->tail = NULL;
     client->len = 0;
+    timer_init(&client->watchdog, client_watchdog_expired, client);
+    atomic_init(&client->notices, NOTICES_CLOSED);
+    client->notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (client->notify_fd < 0) {
+        free(client);
+        return NULL;
+    }
+    pthread_mutex_init(&client->notify_lock, NULL);
+    pthread_mutex_init(&client->inv_lock, NULL);
     pthread_mutex_init(&client->client_lock, NULL);
     return client;
 }
 
+CLIENT *client_create_remote(const CLIENT_REMOTE *remote, PLAYER *player){
+    CLIENT *client = client_create(NULL, -1);
+    if (!client) {
+        return NULL;
+    }
+    client->remote = remote;
+    client->player = player;
+    return client_ref(client, "stand-in created");
+}
+
+int client_is_remote(CLIENT *client){
+    return client->remote != NULL;
+}
+
 CLIENT *client_ref(CLIENT *client, char *why){
     pthread_mutex_lock(&client->client_lock);
     client->ref_count++;
@@ -82,7 +298,28 @@ void client_unref(CLIENT *client, char *why){
 	pthread_mutex_lock(&client->client_lock);
     client->ref_count--;
     if(client->ref_count == 0) {
+        while (client->held_head) {
+            HELD_PACKET *held = client->held_head;
+            client->held_head = held->next;
+            free(held->data);
+            free(held);
+        }
+        NOTICE *notice = atomic_load(&client->notices);
+        while (notice && notice != NOTICES_CLOSED) {
+            NOTICE *next = notice->next;
+            free(notice);
+            notice = next;
+        }
+        close(client->notify_fd);
+        free(client->out);
+        if (client->remote) {
+            //a stand-in plays as its player for as long as it exists
+            player_unref(client->player, "stand-in freed");
+        }
+        pthread_mutex_unlock(&client->client_lock);
         pthread_mutex_destroy(&client->client_lock);
+        pthread_mutex_destroy(&client->notify_lock);
+        pthread_mutex_destroy(&client->inv_lock);
         // close(client->fd);
         // debug("about to free client");
         free(client);
@@ -96,35 +333,50 @@ int client_login(CLIENT *client, PLAYER *player){
 	if (player) { //if there is a player
 		pthread_mutex_lock(&client->client_lock);
 		client->player = player; //assign player to login
+		player_set_online(player, 1);
 		pthread_mutex_unlock(&client->client_lock);
+		if (client->registry) {
+			creg_set_name(client->registry, client, player_get_name_id(player));
+		}
 		return 0;
     }
 	return -1;
 }
 
+static int revoke_invitation(CLIENT *client, INVITATION *inv);
+static int decline_invitation(CLIENT *client, INVITATION *inv);
+static int resign_game(CLIENT *client, INVITATION *inv);
+
 int client_logout(CLIENT *client){
 	if(!client || !client->player){
 		return -1;
 	}
-    INVITATION_NODE *curr = client->head;
-    int index = 0;
-    while(curr){
-        if(inv_get_game(curr->invitation)){
-            client_resign_game(client, index);
+    //work from a snapshot: handling an invitation removes it from the table
+    INVITATION **invs = table_snapshot(client);
+    for(int i = 0; invs[i]; i++){
+        if(inv_get_game(invs[i])){
+            resign_game(client, invs[i]);
         }
-        else if(inv_get_source(curr->invitation) == client){
-            client_revoke_invitation(client, index);
+        else if(inv_get_source(invs[i]) == client){
+            revoke_invitation(client, invs[i]);
         }
         else{
-            client_decline_invitation(client, index);
+            decline_invitation(client, invs[i]);
         }
-        index++;
-        curr = curr->next;
+    }
+    snapshot_free(invs);
+    if(client->registry){
+        creg_set_name(client->registry, client, -1);
     }
     pthread_mutex_lock(&client->client_lock);
-    player_unref(client->player, "client logged out");
+    PLAYER *player = client->player;
+    player_set_online(player, 0);
     client->player = NULL;
     pthread_mutex_unlock(&client->client_lock);
+    if (logout_hook && !client->remote) {
+        logout_hook(player);
+    }
+    player_unref(player, "client logged out");
     return 0;
 }
 
@@ -132,10 +384,161 @@ PLAYER *client_get_player(CLIENT *client){
     return client->player;
 }
 
+void client_set_caps(CLIENT *client, int caps){
+    atomic_store_explicit(&client->caps, caps, memory_order_relaxed);
+}
+
+int client_get_caps(CLIENT *client){
+    return atomic_load_explicit(&client->caps, memory_order_relaxed);
+}
+
+void client_set_request(CLIENT *client, JEUX_PACKET_HEADER *req){
+    client->tag_sec = req->timestamp_sec;
+    client->tag_nsec = req->timestamp_nsec;
+}
+
+void client_tag_reply(CLIENT *client, JEUX_PACKET_HEADER *hdr){
+    if (client_get_caps(client) & JEUX_CAP_CORRELATION) {
+        hdr->timestamp_sec = client->tag_sec;
+        hdr->timestamp_nsec = client->tag_nsec;
+    }
+}
+
+char *client_encode_state(CLIENT *client, GAME *game, size_t *sizep){
+    if (client_get_caps(client) & JEUX_CAP_PACKED_STATE) {
+        unsigned char *buf = malloc(JEUX_PACKED_STATE_SIZE);
+        game_pack_state(game, buf);
+        *sizep = JEUX_PACKED_STATE_SIZE;
+        return (char *)buf;
+    }
+    char *state = game_unparse_state(game);
+    *sizep = strlen(state);
+    return state;
+}
+
 int client_get_fd(CLIENT *client){
 	return client->fd;
 }
 
+void client_set_timeouts(long login_ms, long idle_ms, long move_ms){
+    timeouts.login_ms = login_ms;
+    timeouts.idle_ms = idle_ms;
+    timeouts.move_ms = move_ms;
+}
+
+void client_set_game_hooks(void (*started)(CLIENT *, CLIENT *), void (*ended)(CLIENT *, CLIENT *)){
+    game_hooks.started = started;
+    game_hooks.ended = ended;
+}
+
+void client_set_logout_hook(void (*logged_out)(PLAYER *player)){
+    logout_hook = logged_out;
+}
+
+void client_set_io(CLIENT *client, void *io){
+    client->io = io;
+}
+
+void *client_get_io(CLIENT *client){
+    return client->io;
+}
+
+static long monotonic_ms(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Time left before a client should be reaped, or LONG_MAX if never.  A
+ * client that has not logged in is held to the login deadline, if there
+ * is one; otherwise it is held to the idle timeout.
+ */
+static long watchdog_remaining(CLIENT *client, long now){
+    if (!client->player && timeouts.login_ms) {
+        return client->connected_ms + timeouts.login_ms - now;
+    }
+    if (timeouts.idle_ms) {
+        return atomic_load_explicit(&client->active_ms, memory_order_relaxed) +
+            timeouts.idle_ms - now;
+    }
+    return LONG_MAX;
+}
+
+/*
+ * The watchdog is not re-armed on every packet.  Instead, each packet just
+ * records the time it arrived, and when the watchdog fires it re-arms
+ * itself for whatever time is left, so that a busy client costs one timer
+ * operation per timeout period rather than one per packet.
+ */
+static void client_watchdog_expired(void *arg){
+    CLIENT *client = arg;
+    long left = watchdog_remaining(client, monotonic_ms());
+    if (left == LONG_MAX) {
+        return;
+    }
+    if (left > 0) {
+        timer_arm(&client->watchdog, left);
+        return;
+    }
+    //the service thread sees EOF and cleans up as if the client had left;
+    //the fd stays open until that thread has stopped the watchdog
+    pthread_mutex_lock(&client->client_lock);
+    if (client->fd >= 0) {
+        debug("reaping %s client on fd %d", client->player ? "idle" : "unauthenticated", client->fd);
+        shutdown(client->fd, SHUT_RD);
+    }
+    pthread_mutex_unlock(&client->client_lock);
+}
+
+void client_start_watchdog(CLIENT *client){
+    long now = monotonic_ms();
+    client->connected_ms = now;
+    atomic_store_explicit(&client->active_ms, now, memory_order_relaxed);
+    long left = watchdog_remaining(client, now);
+    if (left != LONG_MAX) {
+        timer_arm(&client->watchdog, left > 0 ? left : 1);
+    }
+}
+
+void client_touch(CLIENT *client){
+    if (timeouts.idle_ms) {
+        atomic_store_explicit(&client->active_ms, monotonic_ms(), memory_order_relaxed);
+    }
+}
+
+void client_stop_watchdog(CLIENT *client){
+    timer_cancel(&client->watchdog);
+}
+
+INVITATION **client_get_invitations(CLIENT *client){
+    return table_snapshot(client);
+}
+
+void client_stop_clocks(CLIENT *client){
+    INVITATION **invs = table_snapshot(client);
+    for (int i = 0; invs[i]; i++) {
+        if (inv_get_source(invs[i]) == client && inv_get_game(invs[i])) {
+            inv_stop_clock(invs[i]);
+        }
+    }
+    snapshot_free(invs);
+}
+
+void client_start_clocks(CLIENT *client){
+    if (!timeouts.move_ms) {
+        return;
+    }
+    INVITATION **invs = table_snapshot(client);
+    for (int i = 0; invs[i]; i++) {
+        GAME *game = inv_get_game(invs[i]);
+        if (inv_get_source(invs[i]) == client && game && !game_is_over(game)) {
+            inv_start_clock(invs[i], timeouts.move_ms);
+        }
+    }
+    snapshot_free(invs);
+}
+
 void set_time(JEUX_PACKET_HEADER hdr){
 	struct timespec current_time;
     uint32_t seconds, nanoseconds;
@@ -147,336 +550,927 @@ void set_time(JEUX_PACKET_HEADER hdr){
 	return;
 }
 
+/*
+ * Write out what a corked client has held back.  Must be called with
+ * client_lock held.
+ */
+static int cork_flush(CLIENT *client){
+    int ret = 0;
+    if (client->out_len && client->fd >= 0) {
+        ret = rio_writen(client->fd, client->out, client->out_len) < 0 ? -1 : 0;
+    }
+    client->out_len = 0;
+    return ret;
+}
+
+/*
+ * Hold back packet data for a corked client, flushing once there is
+ * CLIENT_CORK_LIMIT of it.  Must be called with client_lock held.
+ */
+static int cork_append(CLIENT *client, struct iovec *iov, int iovcnt){
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        total += iov[i].iov_len;
+    }
+    if (client->out_taken && client->out_len + total > CLIENT_BACKLOG_LIMIT) {
+        debug("client on fd %d is not reading, disconnecting", client->fd);
+        shutdown(client->fd, SHUT_RDWR);
+        return -1;
+    }
+    if (client->out_len + total > client->out_cap) {
+        size_t cap = client->out_cap ? client->out_cap : CLIENT_CORK_LIMIT;
+        while (cap < client->out_len + total) {
+            cap *= 2;
+        }
+        char *out = realloc(client->out, cap);
+        if (!out) {
+            //write what there is, then this packet straight through
+            int ret = cork_flush(client);
+            return proto_writev(client->fd, iov, iovcnt) || ret ? -1 : 0;
+        }
+        client->out = out;
+        client->out_cap = cap;
+    }
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(client->out + client->out_len, iov[i].iov_base, iov[i].iov_len);
+        client->out_len += iov[i].iov_len;
+    }
+    //what is written here would overtake output being sent by an event loop
+    if (client->out_taken || client->out_len < CLIENT_CORK_LIMIT) {
+        return 0;
+    }
+    return cork_flush(client);
+}
+
+void client_cork(CLIENT *client){
+    pthread_mutex_lock(&client->client_lock);
+    client->corked = 1;
+    pthread_mutex_unlock(&client->client_lock);
+}
+
+int client_take_output(CLIENT *client, char **bufp, size_t *lenp){
+    pthread_mutex_lock(&client->client_lock);
+    int taken = client->out_len && client->fd >= 0;
+    if (taken) {
+        *bufp = client->out;
+        *lenp = client->out_len;
+        client->out = NULL;
+        client->out_len = client->out_cap = 0;
+    }
+    client->out_taken = taken;
+    pthread_mutex_unlock(&client->client_lock);
+    return taken;
+}
+
+void client_uncork(CLIENT *client){
+    pthread_mutex_lock(&client->client_lock);
+    client->corked = 0;
+    cork_flush(client);
+    pthread_mutex_unlock(&client->client_lock);
+}
+
+/*
+ * Write a packet to a client's connection.  If the connection is parked,
+ * a copy of the packet is held to be sent when the connection is resumed;
+ * if it has been detached, the packet is discarded.  Must be called with
+ * client_lock held.
+ */
+static int client_write(CLIENT *client, JEUX_PACKET_HEADER *pkt, void *data){
+    if (client->fd >= 0 && client->corked) {
+        struct iovec iov[2] = {{pkt, sizeof(JEUX_PACKET_HEADER)}, {data, data ? ntohs(pkt->size) : 0}};
+        return cork_append(client, iov, 2);
+    }
+    if (client->fd >= 0) {
+        return proto_send_packet(client->fd, pkt, data);
+    }
+    if (!client->parked) {
+        return -1;
+    }
+    if (client->held_count == client->held_limit) {
+        client->held_overflow = 1;
+        return -1;
+    }
+    HELD_PACKET *held = malloc(sizeof(HELD_PACKET));
+    held->hdr = *pkt;
+    held->data = NULL;
+    held->next = NULL;
+    if (data && pkt->size) {
+        held->data = malloc(ntohs(pkt->size));
+        memcpy(held->data, data, ntohs(pkt->size));
+    }
+    if (client->held_tail) {
+        client->held_tail->next = held;
+    }
+    else {
+        client->held_head = held;
+    }
+    client->held_tail = held;
+    client->held_count++;
+    return 0;
+}
+
+/*
+ * Write out, in the order they were posted, the notices in a batch taken
+ * from a client's mailbox.  Must be called with client_lock held.
+ */
+static void write_batch(CLIENT *client, NOTICE *batch){
+    NOTICE *fifo = NULL;
+    while (batch) {
+        NOTICE *next = batch->next;
+        batch->next = fifo;
+        fifo = batch;
+        batch = next;
+    }
+    while (fifo) {
+        NOTICE *next = fifo->next;
+        client_write(client, &fifo->hdr, fifo->hdr.size ? fifo->data : NULL);
+        free(fifo);
+        fifo = next;
+    }
+}
+
+/*
+ * Write out what has been posted to a client's mailbox.  Must be called
+ * with client_lock held, by the thread serving the client's connection.
+ */
+static void write_notices(CLIENT *client){
+    NOTICE *batch = atomic_load_explicit(&client->notices, memory_order_acquire);
+    do {
+        if (!batch || batch == NOTICES_CLOSED) {
+            return;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&client->notices, &batch, NULL,
+                                                    memory_order_acquire, memory_order_acquire));
+    write_batch(client, batch);
+}
+
+/*
+ * Close a client's mailbox as its connection is detached or parked, and
+ * write out what was left in it.  Must be called with client_lock held.
+ */
+static void close_mailbox(CLIENT *client){
+    NOTICE *batch = atomic_exchange_explicit(&client->notices, NOTICES_CLOSED, memory_order_acquire);
+    if (batch != NOTICES_CLOSED) {
+        write_batch(client, batch);
+    }
+}
+
+int client_open_mailbox(CLIENT *client){
+    NOTICE *closed = NOTICES_CLOSED;
+    atomic_compare_exchange_strong(&client->notices, &closed, NULL);
+    pthread_mutex_lock(&client->notify_lock);
+    int fd = client->notify_fd;
+    pthread_mutex_unlock(&client->notify_lock);
+    return fd;
+}
+
+void client_move_mailbox(CLIENT *client, CLIENT *from){
+    //the new connection's thread goes on waiting on the eventfd it has,
+    //while a thread that posted to the old mailbox may still write its own
+    pthread_mutex_lock(&from->notify_lock);
+    int fd = from->notify_fd;
+    pthread_mutex_unlock(&from->notify_lock);
+    pthread_mutex_lock(&client->notify_lock);
+    int old = client->notify_fd;
+    client->notify_fd = fd;
+    pthread_mutex_unlock(&client->notify_lock);
+    pthread_mutex_lock(&from->notify_lock);
+    from->notify_fd = old;
+    pthread_mutex_unlock(&from->notify_lock);
+    client_open_mailbox(client);
+}
+
+void client_flush_notices(CLIENT *client){
+    pthread_mutex_lock(&client->client_lock);
+    //a batch of notices goes out in one write
+    int corked = client->corked;
+    client->corked = 1;
+    write_notices(client);
+    client->corked = corked;
+    if (!corked) {
+        cork_flush(client);
+    }
+    pthread_mutex_unlock(&client->client_lock);
+}
+
+void client_wake(CLIENT *client){
+    pthread_mutex_lock(&client->notify_lock);
+    eventfd_write(client->notify_fd, 1);
+    pthread_mutex_unlock(&client->notify_lock);
+}
+
+int client_post_notice(CLIENT *client, JEUX_PACKET_HEADER *pkt, void *data){
+    size_t size = data ? ntohs(pkt->size) : 0;
+    NOTICE *notice = malloc(sizeof(NOTICE) + size);
+    if (!notice) {
+        return -1;
+    }
+    notice->hdr = *pkt;
+    notice->hdr.size = htons(size);
+    if (size) {
+        memcpy(notice->data, data, size);
+    }
+    NOTICE *head = atomic_load_explicit(&client->notices, memory_order_relaxed);
+    do {
+        if (head == NOTICES_CLOSED) {
+            //no thread is serving the connection, so none can be blocked on it
+            free(notice);
+            return client_send_packet(client, pkt, data);
+        }
+        notice->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&client->notices, &head, notice,
+                                                    memory_order_release, memory_order_relaxed));
+    if (!head) {
+        //the mailbox was empty, so the serving thread may be waiting
+        pthread_mutex_lock(&client->notify_lock);
+        eventfd_write(client->notify_fd, 1);
+        pthread_mutex_unlock(&client->notify_lock);
+    }
+    return 0;
+}
+
 int client_send_packet(CLIENT *player, JEUX_PACKET_HEADER *pkt, void *data){
 	CLIENT *client = player;
     pthread_mutex_lock(&client->client_lock);
 	set_time(*pkt);
-    proto_send_packet(client_get_fd(client), pkt, data);
+    write_notices(client);
+    client_write(client, pkt, data);
     pthread_mutex_unlock(&client->client_lock);
     return 0;
 }
 
+int client_detach(CLIENT *client){
+    pthread_mutex_lock(&client->client_lock);
+    close_mailbox(client);
+    cork_flush(client);
+    client->corked = 0;
+    int fd = client->fd;
+    client->fd = -1;
+    client->parked = 0;
+    pthread_mutex_unlock(&client->client_lock);
+    return fd;
+}
+
+int client_park(CLIENT *client, int limit){
+    pthread_mutex_lock(&client->client_lock);
+    cork_flush(client);
+    client->corked = 0;
+    int fd = client->fd;
+    client->fd = -1;
+    client->parked = 1;
+    client->held_limit = limit;
+    client->held_count = 0;
+    client->held_overflow = 0;
+    //what was posted but not yet written is held like what is posted later
+    close_mailbox(client);
+    pthread_mutex_unlock(&client->client_lock);
+    return fd;
+}
+
+void client_unpark(CLIENT *client, int fd){
+    //some notifications may have been lost, so bring every game up to date;
+    //the states are taken before client_lock, which is never held with inv_lock
+    INVITATION **invs = table_snapshot(client);
+    int n = 0;
+    while (invs[n]) {
+        n++;
+    }
+    char **states = calloc(n + 1, sizeof(char *));
+    size_t *sizes = calloc(n + 1, sizeof(size_t));
+    for (int i = 0; i < n; i++) {
+        GAME *game = inv_get_game(invs[i]);
+        if (game && !game_is_over(game)) {
+            states[i] = client_encode_state(client, game, &sizes[i]);
+        }
+    }
+    snapshot_free(invs);
+    pthread_mutex_lock(&client->client_lock);
+    client->fd = fd;
+    client->parked = 0;
+    while (client->held_head) {
+        HELD_PACKET *held = client->held_head;
+        client->held_head = held->next;
+        proto_send_packet(fd, &held->hdr, held->data);
+        free(held->data);
+        free(held);
+    }
+    client->held_tail = NULL;
+    client->held_count = 0;
+    for (int i = 0; i < n; i++) {
+        if (client->held_overflow && states[i]) {
+            JEUX_PACKET_HEADER hdr = {0};
+            hdr.type = JEUX_MOVED_PKT;
+            hdr.id = i;
+            hdr.size = htons(sizes[i]);
+            proto_send_packet(fd, &hdr, states[i]);
+        }
+        free(states[i]);
+    }
+    free(states);
+    free(sizes);
+    client->held_overflow = 0;
+    pthread_mutex_unlock(&client->client_lock);
+}
+
+void client_lose_notices(CLIENT *client){
+    pthread_mutex_lock(&client->client_lock);
+    if (client->parked) {
+        client->held_overflow = 1;
+    }
+    pthread_mutex_unlock(&client->client_lock);
+}
+
+int client_try_send_packet(CLIENT *client, JEUX_PACKET_HEADER *pkt, void *data){
+    if (pthread_mutex_trylock(&client->client_lock)) {
+        return 1;
+    }
+    size_t hdr_size = sizeof(JEUX_PACKET_HEADER);
+    size_t data_size = data ? ntohs(pkt->size) : 0;
+    struct iovec iov[2] = {{pkt, hdr_size}, {data, data_size}};
+    struct msghdr msg = {0};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = data ? 2 : 1;
+    int ret = 0;
+    if (client->fd < 0) {
+        pthread_mutex_unlock(&client->client_lock);
+        return -1;
+    }
+    if (client->corked) {
+        //the service thread flushes it before it next waits for a request
+        ret = cork_append(client, iov, msg.msg_iovlen);
+        pthread_mutex_unlock(&client->client_lock);
+        return ret;
+    }
+    ssize_t n = sendmsg(client->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n < 0) {
+        ret = (errno == EAGAIN || errno == EWOULDBLOCK) ? 1 : -1;
+    }
+    else if (n < hdr_size + data_size) {
+        //the rest cannot be finished without blocking, and nothing else can
+        //follow a partial packet; a client whose socket is this full is not
+        //reading, so it is disconnected, as when its backlog grows too long
+        debug("client on fd %d is not reading, disconnecting", client->fd);
+        shutdown(client->fd, SHUT_RDWR);
+        ret = -1;
+    }
+    pthread_mutex_unlock(&client->client_lock);
+    return ret;
+}
+
 int client_send_ack(CLIENT *client, void *data, size_t datalen){
 	pthread_mutex_lock(&client->client_lock);
     JEUX_PACKET_HEADER hdr = {0};
     hdr.type = JEUX_ACK_PKT;
     hdr.size = htons(datalen);
 	set_time(hdr);
-    proto_send_packet(client_get_fd(client), &hdr, data);
+    client_tag_reply(client, &hdr);
+    write_notices(client);
+    client_write(client, &hdr, data);
     pthread_mutex_unlock(&client->client_lock);
     return 0;
 }
 
+int client_send_ack_iov(CLIENT *client, struct iovec *iov, int iovcnt){
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        total += iov[i].iov_len;
+    }
+    JEUX_PACKET_HEADER hdr = {0};
+    hdr.type = JEUX_ACK_PKT;
+    hdr.size = htons(total);
+    struct iovec *vec = malloc((iovcnt + 1) * sizeof(struct iovec));
+    if (!vec) {
+        return -1;
+    }
+    vec[0].iov_base = &hdr;
+    vec[0].iov_len = sizeof(hdr);
+    memcpy(&vec[1], iov, iovcnt * sizeof(struct iovec));
+    int ret = 0;
+    pthread_mutex_lock(&client->client_lock);
+    set_time(hdr);
+    client_tag_reply(client, &hdr);
+    write_notices(client);
+    if (client->fd >= 0 && client->corked) {
+        ret = cork_append(client, vec, iovcnt + 1);
+    }
+    else if (client->fd >= 0) {
+        ret = proto_writev(client->fd, vec, iovcnt + 1);
+    }
+    else if (!client->parked) {
+        ret = -1;
+    }
+    else {
+        //held while parked, so it has to be gathered into a copy after all
+        char *data = malloc(total);
+        char *p = data;
+        for (int i = 0; data && i < iovcnt; i++) {
+            memcpy(p, iov[i].iov_base, iov[i].iov_len);
+            p += iov[i].iov_len;
+        }
+        ret = data ? client_write(client, &hdr, data) : -1;
+        free(data);
+    }
+    pthread_mutex_unlock(&client->client_lock);
+    free(vec);
+    return ret;
+}
+
 int client_send_nack(CLIENT *client){
 	pthread_mutex_lock(&client->client_lock);
     JEUX_PACKET_HEADER hdr = {0};
     hdr.type = JEUX_NACK_PKT;
     hdr.size = 0;
 	set_time(hdr);
-    proto_send_packet(client->fd, &hdr, NULL);
-	//use client_send_packet?
+    client_tag_reply(client, &hdr);
+    write_notices(client);
+    client_write(client, &hdr, NULL);
     pthread_mutex_unlock(&client->client_lock);
     return 0;
 }
 
 int client_add_invitation(CLIENT *client, INVITATION *inv){
-	pthread_mutex_lock(&client->client_lock);
-    INVITATION_NODE *new_inv = (INVITATION_NODE*)malloc(sizeof(INVITATION_NODE));
-    new_inv->invitation = inv;
-    new_inv->next = NULL;
-    if (client->head == NULL) {
-        client->head = new_inv;
-        client->tail = new_inv;
-    } else {
-        client->tail->next = new_inv;
-        client->tail = new_inv;
-    }
-    client->len++;
-    inv_ref(inv, "inv added");
-    pthread_mutex_unlock(&client->client_lock);
-    return 0;
+    return table_add(client, inv);
 }
 
 int client_remove_invitation(CLIENT *client, INVITATION *inv){
     if(!client){
-        return-1;
+        return -1;
     }
-	CLIENT *search = client;
-	if(client != inv_get_source(inv)){
-		search = inv_get_target(inv);
-	}
-    pthread_mutex_lock(&search->client_lock);
-    INVITATION_NODE *curr = search->head;
-    INVITATION_NODE *prev = NULL;
+    return table_remove(client, inv);
+}
+
+GAME *client_find_game(CLIENT *client, int index){
+    GAME *found = NULL;
+    pthread_mutex_lock(&client->inv_lock);
+    INVITATION_NODE *curr = client->head;
     while (curr) {
-        if (curr->invitation == inv) {
-            if (prev) {
-                prev->next = curr->next;
-            } else {
-                search->head = curr->next;
-            }
-            if (!curr->next) {
-                search->tail = prev;
-            }
-            free(curr);
-            search->len--;
-            inv_unref(inv, "inv removed from list");
-            pthread_mutex_unlock(&search->client_lock);
-            return 0;
+        GAME *game = inv_get_game(curr->invitation);
+        if (game && !game_is_over(game) && index-- == 0) {
+            found = game_ref(game, "game found for client");
+            break;
         }
-        prev = curr;
         curr = curr->next;
     }
-    pthread_mutex_unlock(&search->client_lock);
-    return -1;
+    pthread_mutex_unlock(&client->inv_lock);
+    return found;
 }
 
-//check
-int client_make_invitation(CLIENT *source, CLIENT *target, GAME_ROLE source_role, GAME_ROLE target_role){
-    CLIENT *client = source;
-    INVITATION *inv = inv_create(client, target, source_role, target_role);
-	if (inv && (client_add_invitation(client, inv) == 0) && (client_add_invitation(target, inv) == 0)) {
-		//first packet
-		JEUX_PACKET_HEADER hdr_one = {0};
-		hdr_one.type = JEUX_ACK_PKT;
-        hdr_one.id = get_invitation_index_by_client(client, inv);
-		client_send_packet(client, &hdr_one, NULL);
-		//second packet
-		JEUX_PACKET_HEADER hdr_two = {0};
-		char *name = player_get_name(client_get_player(client));
-		hdr_two.type = JEUX_INVITED_PKT;
-		hdr_two.role = inv_get_target_role(inv);
-		hdr_two.size = htons(strlen(name));
-        hdr_two.id = get_invitation_index_by_client(target, inv);
-		client_send_packet(target, &hdr_two, (void*) name);
-		return 0;
-	}
-	return -1;
+/*
+ * Post a notification about an invitation to one of its clients, or pass
+ * it on if the client is a stand-in.
+ */
+static void notify(CLIENT *client, INVITATION *inv, JEUX_PACKET_HEADER *hdr, void *data){
+    if (client->remote) {
+        client->remote->notify(client, inv, hdr, data);
+        return;
+    }
+    client_post_notice(client, hdr, data);
 }
 
-void remove_inv(CLIENT *client, INVITATION *inv){
-    INVITATION_NODE *curr = client->head;
-    INVITATION_NODE *prev = NULL;
-    while (curr) {
-        if (curr->invitation == inv) {
-            if (prev) {
-                prev->next = curr->next;
-            } else {
-                client->head = curr->next;
-            }
-            if (!curr->next) {
-                client->tail = prev;
-            }
-            free(curr);
-            inv_unref(inv, "inv removed");
-            client->len--;
-            return ;
-        }
-        prev = curr;
-        curr = curr->next;
+static void send_notice(CLIENT *client, INVITATION *inv, int type, int id, int role){
+    if (id < 0) {
+        //the client has already dropped the invitation
+        return;
     }
-    return;
+    JEUX_PACKET_HEADER hdr = {0};
+    hdr.type = type;
+    hdr.id = id;
+    hdr.role = role;
+    notify(client, inv, &hdr, NULL);
 }
 
-int client_revoke_invitation(CLIENT *client, int id){
-	int target_id;
-	int exit = 1;
-	INVITATION *inv = get_invitation_by_index(client, id);
-    CLIENT *target = inv_get_target(inv);
-    if (!inv || (inv_get_source(inv) != client) || !client_get_player(client) || inv_get_game(inv) || !target) {
+static CLIENT *opponent(CLIENT *client, INVITATION *inv){
+    return (inv_get_source(inv) == client) ? inv_get_target(inv) : inv_get_source(inv);
+}
+
+static GAME_ROLE role_of(CLIENT *client, INVITATION *inv){
+    return (inv_get_source(inv) == client) ? inv_get_source_role(inv) : inv_get_target_role(inv);
+}
+
+/*
+ * Post the result of a finished game, with the source of its invitation
+ * as the first player to player_post_result().
+ */
+static void post_result(INVITATION *inv, GAME_ROLE winner){
+    int result = 0;
+    if (winner != NULL_ROLE) {
+        result = (winner == inv_get_source_role(inv)) ? 1 : 2;
+    }
+    player_post_result(client_get_player(inv_get_source(inv)),
+                       client_get_player(inv_get_target(inv)), result);
+}
+
+/*
+ * Determine whether an invitation is a copy of one kept by another
+ * process, which is where its source is.
+ */
+static int is_copy(INVITATION *inv){
+    return inv_get_source(inv)->remote != NULL;
+}
+
+/*
+ * Have the process that keeps an invitation carry out a request on it.
+ */
+static int forward(INVITATION *inv, int type, char *move, char **strp){
+    CLIENT *source = inv_get_source(inv);
+    return source->remote->request(source, inv, type, move, strp);
+}
+
+int client_make_invitation(CLIENT *source, CLIENT *target, GAME_ROLE source_role, GAME_ROLE target_role){
+    INVITATION *inv = inv_create(source, target, source_role, target_role);
+    if (!inv) {
         return -1;
     }
-    target_id = get_invitation_index_by_client(target, inv);
-    inv_close(inv, NULL_ROLE);
-    if (client > target) {
-		pthread_mutex_lock(&target->client_lock);
-        pthread_mutex_lock(&client->client_lock);
+    int source_id = table_add(source, inv);
+    int target_id = table_add(target, inv);
+    //first packet
+    JEUX_PACKET_HEADER hdr_one = {0};
+    hdr_one.type = JEUX_ACK_PKT;
+    hdr_one.id = source_id;
+    client_tag_reply(source, &hdr_one);
+    client_send_packet(source, &hdr_one, NULL);
+    //second packet
+    JEUX_PACKET_HEADER hdr_two = {0};
+    char *name = player_get_name(client_get_player(source));
+    hdr_two.type = JEUX_INVITED_PKT;
+    hdr_two.role = target_role;
+    hdr_two.size = htons(strlen(name));
+    hdr_two.id = target_id;
+    notify(target, inv, &hdr_two, (void*) name);
+    //the tables now hold the invitation
+    inv_unref(inv, "invitation made");
+    return source_id;
+}
+
+static int revoke_invitation(CLIENT *client, INVITATION *inv){
+    if (inv_get_source(inv) != client || inv_withdraw(inv)) {
+        return -1;
     }
-    else {
-		pthread_mutex_lock(&client->client_lock);
-        pthread_mutex_lock(&target->client_lock);
+    CLIENT *target = inv_get_target(inv);
+    int target_id = table_remove(target, inv);
+    table_remove(client, inv);
+    send_notice(target, inv, JEUX_REVOKED_PKT, target_id, 0);
+    return 0;
+}
+
+static int decline_invitation(CLIENT *client, INVITATION *inv){
+    if (inv_get_target(inv) == client && is_copy(inv)) {
+        if (forward(inv, JEUX_DECLINE_PKT, NULL, NULL)) {
+            return -1;
+        }
+        inv_withdraw(inv);
+        table_remove(client, inv);
+        return 0;
     }
-    remove_inv(client, inv);
-    INVITATION *inv_two = get_invitation_by_index(target, target_id);
-    if (inv_two == inv) {
-        remove_inv(target, inv);
-		exit = 0;
+    if (inv_get_target(inv) != client || inv_withdraw(inv)) {
+        return -1;
     }
-    if (client > target) {
-		pthread_mutex_unlock(&client->client_lock);
-        pthread_mutex_unlock(&target->client_lock);
+    CLIENT *source = inv_get_source(inv);
+    int source_id = table_remove(source, inv);
+    table_remove(client, inv);
+    send_notice(source, inv, JEUX_DECLINED_PKT, source_id, 0);
+    return 0;
+}
+
+/*
+ * A message to the mailbox of a game, on behalf of one of its players or
+ * of its move clock.  Everything that changes the course of a game goes
+ * through its mailbox, so the game is never changed by two threads at
+ * once, and what the players are sent follows the order of their moves.
+ */
+typedef struct game_request {
+    GAME_MSG msg;
+    CLIENT *client;
+    INVITATION *inv;
+    char *move;
+    int ret;
+} GAME_REQUEST;
+
+static void handle_resign(GAME_MSG *msg){
+    GAME_REQUEST *req = (GAME_REQUEST *)msg;
+    CLIENT *client = req->client;
+    INVITATION *inv = req->inv;
+    GAME_ROLE role = role_of(client, inv);
+    if (inv_close(inv, role)) {
+        req->ret = -1;
+        return;
     }
-    else {
-        pthread_mutex_unlock(&target->client_lock);
-        pthread_mutex_unlock(&client->client_lock); 
-    }
-    if (!exit) {
-        JEUX_PACKET_HEADER hdr = {0};
-		hdr.type = JEUX_REVOKED_PKT;
-		hdr.id = target_id;
-		client_send_packet(target, &hdr, NULL);
-		return 0;
+    CLIENT *target = opponent(client, inv);
+    GAME_ROLE winner = role_of(target, inv);
+    post_result(inv, winner);
+    spectator_game_ended(inv_get_game(inv), winner);
+    checkpoint_ended(inv);
+    int target_id = table_remove(target, inv);
+    table_remove(client, inv);
+    send_notice(target, inv, JEUX_RESIGNED_PKT, target_id, 0);
+    if (game_hooks.ended) {
+        game_hooks.ended(inv_get_source(inv), inv_get_target(inv));
     }
-	return -1;
+    req->ret = 0;
 }
 
-int client_decline_invitation(CLIENT *client, int id){
-	int source_id;
-	int exit = 1;
-	INVITATION *inv = get_invitation_by_index(client, id);
-    CLIENT *target = inv_get_target(inv);
-    if (!inv || !client->player || (target != client) || inv_get_game(inv)) {
+static int resign_game(CLIENT *client, INVITATION *inv){
+    GAME *game = inv_get_game(inv);
+    if (!game) {
         return -1;
     }
-    source_id = get_invitation_index_by_client(client, inv);
-    inv_close(inv, NULL_ROLE);
-    CLIENT *source = inv_get_source(inv);
-
-    if (client > source) {
-        pthread_mutex_lock(&source->client_lock);
-        pthread_mutex_lock(&client->client_lock);
+    if (is_copy(inv)) {
+        if (forward(inv, JEUX_RESIGN_PKT, NULL, NULL)) {
+            return -1;
+        }
+        //the game was in progress where it is kept, so it still is here
+        GAME_ROLE winner = role_of(inv_get_source(inv), inv);
+        if (inv_close(inv, role_of(client, inv)) == 0) {
+            post_result(inv, winner);
+            spectator_game_ended(game, winner);
+        }
+        table_remove(client, inv);
+        return 0;
     }
-    else {
-        pthread_mutex_lock(&client->client_lock);
-        pthread_mutex_lock(&source->client_lock);
+    GAME_REQUEST req = { .msg.handle = handle_resign, .client = client, .inv = inv };
+    game_call(game, &req.msg);
+    return req.ret;
+}
+
+/*
+ * Finish a game that has just ended, by a move or on the clock, once its
+ * invitation has been closed.
+ */
+static void end_game(INVITATION *inv, GAME *game){
+    GAME_ROLE winner = game_get_winner(game);
+    CLIENT *source = inv_get_source(inv);
+    CLIENT *target = inv_get_target(inv);
+    int source_id = table_remove(source, inv);
+    int target_id = table_remove(target, inv);
+    post_result(inv, winner);
+    spectator_game_ended(game, winner);
+    checkpoint_ended(inv);
+    send_notice(source, inv, JEUX_ENDED_PKT, source_id, winner);
+    send_notice(target, inv, JEUX_ENDED_PKT, target_id, winner);
+    if (game_hooks.ended) {
+        game_hooks.ended(source, target);
     }
-    remove_inv(client, inv);
-    INVITATION *inv_two = get_invitation_by_index(source, source_id);
-    if (inv_two == inv) {
-        remove_inv(source, inv);
-		exit = 0;
+}
+
+int client_revoke_invitation(CLIENT *client, int id){
+    INVITATION *inv = table_get(client, id);
+    if (!inv) {
+        return -1;
     }
-    if (client > source) {
-        pthread_mutex_unlock(&client->client_lock);
-        pthread_mutex_unlock(&source->client_lock);
+    int ret = client_get_player(client) ? revoke_invitation(client, inv) : -1;
+    inv_unref(inv, "revoke done");
+    return ret;
+}
+
+int client_decline_invitation(CLIENT *client, int id){
+    INVITATION *inv = table_get(client, id);
+    if (!inv) {
+        return -1;
     }
-    else {
-        pthread_mutex_unlock(&source->client_lock);
-        pthread_mutex_unlock(&client->client_lock);
+    int ret = client_get_player(client) ? decline_invitation(client, inv) : -1;
+    inv_unref(inv, "decline done");
+    return ret;
+}
+
+static int accept_invitation(CLIENT *client, INVITATION *inv, char **strp){
+    if (!client->player || inv_get_target(inv) != client) {
+        return -1;
     }
-    if (!exit) {
-		JEUX_PACKET_HEADER hdr = {0};
-		hdr.type = JEUX_DECLINED_PKT;
-		hdr.id = source_id;
-		client_send_packet(source, &hdr, NULL);
+    if (is_copy(inv)) {
+        if (forward(inv, JEUX_ACCEPT_PKT, NULL, strp)) {
+            return -1;
+        }
+        //unless a move that was passed on first has accepted it already
+        inv_accept(inv);
         return 0;
     }
-    return -1;
-}
-
-int client_accept_invitation(CLIENT *client, int id, char **strp){
-	INVITATION *inv = get_invitation_by_index(client, id);
-    if (!inv || !client->player || inv_accept(inv)) {
+    if (inv_accept(inv)) {
         return -1;
     }
-    char *game_state = game_unparse_state(inv_get_game(inv));
+    checkpoint_game(inv);
+    if (timeouts.move_ms) {
+        inv_start_clock(inv, timeouts.move_ms);
+    }
+    CLIENT *source = inv_get_source(inv);
+    if (game_hooks.started) {
+        game_hooks.started(source, client);
+    }
     JEUX_PACKET_HEADER hdr ={0};
     hdr.type = JEUX_ACCEPTED_PKT;
-    hdr.id = get_invitation_index_by_client(client, inv);
+    hdr.id = table_index(source, inv);
+    size_t size;
     if (inv_get_target_role(inv) == FIRST_PLAYER_ROLE) {
-		client_send_packet(inv_get_source(inv), &hdr, NULL);
-        *strp = game_state;
+		notify(source, inv, &hdr, NULL);
+        *strp = client_encode_state(client, inv_get_game(inv), &size);
     }
     else {
-        hdr.size = htons(strlen(game_state));
-        client_send_packet(inv_get_source(inv), &hdr, game_state);   
+        char *game_state = client_encode_state(source, inv_get_game(inv), &size);
+        hdr.size = htons(size);
+        notify(source, inv, &hdr, game_state);
         free(game_state);
     }
     return 0;
 }
 
-int client_resign_game(CLIENT *client, int id) {
-    if (!client->player) {
+int client_accept_invitation(CLIENT *client, int id, char **strp){
+    INVITATION *inv = table_get(client, id);
+    if (!inv) {
         return -1;
     }
-    INVITATION *inv = get_invitation_by_index(client, id);
-    if(!inv){
+    int ret = accept_invitation(client, inv, strp);
+    inv_unref(inv, ret ? "accept failed" : "accept done");
+    return ret;
+}
+
+int client_resign_game(CLIENT *client, int id) {
+    INVITATION *inv = table_get(client, id);
+    if (!inv) {
         return -1;
     }
-    int role;
-	GAME_ROLE winner;
-	CLIENT *target;
-    int target_id;
-    //identify role
-    role = (inv_get_source(inv) != client) ? inv_get_target_role(inv) : inv_get_source_role(inv);
-    target = (inv_get_source(inv) != client) ? inv_get_source(inv) : inv_get_target(inv);
-    target_id = get_invitation_index_by_client(target, inv);
-    if (inv_close(inv, role) || !inv_get_game(inv)) {
-        return -1;
+    int ret = client_get_player(client) ? resign_game(client, inv) : -1;
+    inv_unref(inv, "resign done");
+    return ret;
+}
+
+static void handle_move(GAME_MSG *msg){
+    GAME_REQUEST *req = (GAME_REQUEST *)msg;
+    CLIENT *client = req->client;
+    INVITATION *inv = req->inv;
+    GAME *game = inv_get_game(inv);
+    GAME_ROLE role = role_of(client, inv);
+    CLIENT *target = opponent(client, inv);
+    //parse game move
+    GAME_MOVE *game_move = game_parse_move(game, role, req->move);
+    if (!game_move || game_apply_move(game, game_move) == -1) {
+        free(game_move);
+        req->ret = -1;
+        return;
     }
-    //identify winner
-    winner = (inv_get_source(inv) != client) ? inv_get_source_role(inv) : inv_get_target_role(inv);
-    player_post_result(client_get_player(inv_get_source(inv)), client_get_player(inv_get_target(inv)), winner);
-    client_remove_invitation(target, inv);
-	client_remove_invitation(client, inv);
+    free(game_move);
+    //spectators first, so that the state they get is the state after this
+    //move even if the opponent answers at once
+    spectator_publish(game);
+    checkpoint_game(inv);
     JEUX_PACKET_HEADER hdr = {0};
-    hdr.type = JEUX_RESIGNED_PKT;
-    hdr.id = target_id;
-    client_send_packet(target, &hdr, NULL);
-    return 0;
-}
-void display_game_results(INVITATION *inv, int winner){
-    PLAYER *source_player = client_get_player(inv_get_source(inv));
-    PLAYER *target_player = client_get_player(inv_get_target(inv));
-    int target_role = inv_get_target_role(inv);
-    if(winner == target_role){
-        player_post_result(target_player, source_player, winner);
+    hdr.type = JEUX_MOVED_PKT;
+    hdr.id = table_index(target, inv);
+    size_t size;
+    char *game_state = client_encode_state(target, game, &size);
+    hdr.size = htons(size);
+    notify(target, inv, &hdr, game_state);
+    free(game_state);
+    if (client->remote) {
+        client->remote->moved(client, inv);
     }
-    else{
-        player_post_result(source_player, target_player, winner);
+    if (game_is_over(game)) {
+        if (inv_close(inv, NULL_ROLE) == 0) {
+            end_game(inv, game);
+        }
+    }
+    else if (timeouts.move_ms) {
+        inv_start_clock(inv, timeouts.move_ms);
     }
-    return;
+    req->ret = 0;
 }
-int determine_winner(INVITATION *inv, GAME *game){
-    int winner = game_get_winner(game);
-    JEUX_PACKET_HEADER hdr = {0};
-    hdr.type = JEUX_ENDED_PKT;
-    hdr.role = winner;
-    hdr.size = 0;
-    hdr.id = get_invitation_index_by_client(inv_get_source(inv), inv);
-    client_send_packet(inv_get_source(inv), &hdr, NULL);
-    hdr.id = get_invitation_index_by_client(inv_get_target(inv), inv);
-    client_send_packet(inv_get_target(inv), &hdr, NULL);
-    return winner;
+
+static int make_move(CLIENT *client, INVITATION *inv, char *move){
+    GAME *game = inv_get_game(inv);
+    if (!game) {
+        return -1;
+    }
+    if (is_copy(inv)) {
+        //the copy of the game is brought up to date by the process that keeps it
+        return forward(inv, JEUX_MOVE_PKT, move, NULL);
+    }
+    GAME_REQUEST req = { .msg.handle = handle_move, .client = client, .inv = inv, .move = move };
+    game_call(game, &req.msg);
+    return req.ret;
 }
 
 int client_make_move(CLIENT *client, int id, char *move){
 	if (!client->player) {
         return -1;
     }
-    //get invitation and game
-    INVITATION *inv = get_invitation_by_index(client, id);
-    GAME *game = inv_get_game(inv);
-    if(!inv || !game) {
+    INVITATION *inv = table_get(client, id);
+    if (!inv) {
         return -1;
     }
-	int role;
-    CLIENT *target;
-    int id_two;
-    //identify client role and target client
-    role = (inv_get_source(inv) != client) ? inv_get_target_role(inv) : inv_get_source_role(inv);
-    target = (inv_get_source(inv) != client) ? inv_get_source(inv) : inv_get_target(inv);
-    id_two = get_invitation_index_by_client(target, inv);
+    int ret = make_move(client, inv, move);
+    inv_unref(inv, "move done");
+    return ret;
+}
 
-    //parse game move
-    GAME_MOVE *game_move = game_parse_move(game, role, move);
-    if (!game_move || game_apply_move(game, game_move) == -1) {
-        return -1;
+static void handle_forfeit(GAME_MSG *msg){
+    GAME_REQUEST *req = (GAME_REQUEST *)msg;
+    INVITATION *inv = req->inv;
+    GAME *game = inv_get_game(inv);
+    //a player who has moved since the clock ran out has restarted it
+    GAME_ROLE role = game_get_turn(game);
+    if (!inv_clock_running(inv) && role != NULL_ROLE && inv_close(inv, role) == 0) {
+        debug("move clock ran out for role %d", role);
+        end_game(inv, game);
     }
-    free(game_move);
-    //send packet of updated game
+    inv_unref(inv, "forfeit handled");
+    free(req);
+}
+
+void client_forfeit_game(INVITATION *inv){
+    GAME *game = inv_get_game(inv);
+    GAME_REQUEST *req = game ? calloc(1, sizeof(GAME_REQUEST)) : NULL;
+    if (!req) {
+        return;
+    }
+    //not waited for: whoever handles it may be stopping this very clock
+    req->msg.handle = handle_forfeit;
+    req->inv = inv_ref(inv, "forfeit posted");
+    game_post(game, &req->msg);
+}
+
+int client_remote_invited(INVITATION *inv){
+    CLIENT *source = inv_get_source(inv);
+    CLIENT *target = inv_get_target(inv);
+    int target_id = table_add(target, inv);
     JEUX_PACKET_HEADER hdr = {0};
-    hdr.type = JEUX_MOVED_PKT;
-    hdr.id = id_two;
-    char *game_state = game_unparse_state(game);
-    hdr.size = htons(strlen(game_state));
-    client_send_packet(target, &hdr, (void *)game_state);
-    free(game_state);
-    //check for winner if game is over
-    if (game_is_over(game)) {
-        display_game_results(inv, determine_winner(inv, game));
-        client_remove_invitation(target, inv);
-        client_remove_invitation(client, inv);
+    char *name = player_get_name(client_get_player(source));
+    hdr.type = JEUX_INVITED_PKT;
+    hdr.role = inv_get_target_role(inv);
+    hdr.size = htons(strlen(name));
+    hdr.id = target_id;
+    client_post_notice(target, &hdr, name);
+    return target_id;
+}
+
+int client_remote_notice(INVITATION *inv, JEUX_PACKET_HEADER *hdr, void *data, unsigned char *state){
+    CLIENT *source = inv_get_source(inv);
+    CLIENT *target = inv_get_target(inv);
+    GAME *game;
+    GAME_ROLE winner;
+    switch (hdr->type) {
+        case JEUX_NO_PKT:
+        case JEUX_MOVED_PKT:
+            //a move shows that the invitation has been accepted, even if the
+            //reply to the ACCEPT has not come back yet
+            inv_accept(inv);
+            game = inv_get_game(inv);
+            if (!game) {
+                return 1;
+            }
+            game_unpack_state(game, state);
+            spectator_publish(game);
+            if (hdr->type == JEUX_MOVED_PKT) {
+                //the target may have dropped the copy while the move was on its way
+                int target_id = table_index(target, inv);
+                if (target_id >= 0) {
+                    hdr->id = target_id;
+                    client_post_notice(target, hdr, data);
+                }
+            }
+            return 0;
+        case JEUX_REVOKED_PKT:
+            if (inv_withdraw(inv) == 0) {
+                send_notice(target, inv, JEUX_REVOKED_PKT, table_remove(target, inv), 0);
+            }
+            return 1;
+        case JEUX_RESIGNED_PKT:
+            winner = role_of(target, inv);
+            if (inv_close(inv, role_of(source, inv)) == 0) {
+                post_result(inv, winner);
+                spectator_game_ended(inv_get_game(inv), winner);
+                send_notice(target, inv, JEUX_RESIGNED_PKT, table_remove(target, inv), 0);
+            }
+            return 1;
+        case JEUX_ENDED_PKT:
+            winner = hdr->role;
+            inv_accept(inv);
+            game = inv_get_game(inv);
+            GAME_ROLE loser = NULL_ROLE;
+            if (game && !game_is_over(game) && winner != NULL_ROLE) {
+                //lost on the clock, which the board does not show
+                loser = winner == FIRST_PLAYER_ROLE ? SECOND_PLAYER_ROLE : FIRST_PLAYER_ROLE;
+            }
+            if (game && inv_close(inv, loser) == 0) {
+                post_result(inv, winner);
+                spectator_game_ended(game, winner);
+                send_notice(target, inv, JEUX_ENDED_PKT, table_remove(target, inv), winner);
+            }
+            return 1;
+        default:
+            return 0;
     }
-    return 0;
-}
\ No newline at end of file
+}
+
+int client_remote_request(INVITATION *inv, int type, char *move, char **strp){
+    CLIENT *client = inv_get_target(inv);
+    switch (type) {
+        case JEUX_ACCEPT_PKT:
+            return accept_invitation(client, inv, strp);
+        case JEUX_DECLINE_PKT:
+            return decline_invitation(client, inv);
+        case JEUX_MOVE_PKT:
+            return make_move(client, inv, move);
+        case JEUX_RESIGN_PKT:
+            return resign_game(client, inv);
+        default:
+            return -1;
+    }
+}
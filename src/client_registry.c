@@ -14,16 +14,32 @@
 #include "invitation.h"
 #include "client.h"
 #include "player.h"
+#include "player_ext.h"
+#include "client_registry_ext.h"
+#include "intern.h"
+#include "id_scan.h"
 
 typedef struct client_node{
     CLIENT *client;
     struct client_node *next;
 } CLIENT_NODE;
 
+/*
+ * Besides the list of all registered clients, the registry keeps the name
+ * ids of the logged-in clients packed in an array, parallel to an array of
+ * the clients themselves, so that finding a client by username is a
+ * vectorized scan rather than a walk of the list comparing strings.  No
+ * more than MAX_CLIENTS clients are ever registered, so the array is at
+ * most four cache lines, and the scan saves only a few nanoseconds over a
+ * scalar one; it is not there to let the registry grow.
+ */
 typedef struct client_registry{
     CLIENT_NODE *head;
     CLIENT_NODE *tail;
     int len;
+    int32_t name_ids[MAX_CLIENTS];  /* Of logged-in clients */
+    CLIENT *named[MAX_CLIENTS];
+    int nnamed;
     pthread_mutex_t len_lock;
     pthread_mutex_t registry_lock;
 }CLIENT_REGISTRY;
@@ -63,6 +79,12 @@ CLIENT *creg_register(CLIENT_REGISTRY *cr, int fd){
     }
     CLIENT_NODE *new_client = (CLIENT_NODE*)malloc(sizeof(CLIENT_NODE));
     new_client->client = client_create(cr, fd);
+    if(new_client->client == NULL){
+        free(new_client);
+        pthread_mutex_unlock(&cr->len_lock);
+        pthread_mutex_unlock(&cr->registry_lock);
+        return NULL;
+    }
     new_client->next = NULL;
     if(cr->head == NULL){
         cr->head = new_client;
@@ -79,6 +101,42 @@ CLIENT *creg_register(CLIENT_REGISTRY *cr, int fd){
     return new_client->client;
 }
 
+/* The following functions must be called with the registry lock held. */
+
+static int named_index(CLIENT_REGISTRY *cr, CLIENT *client){
+    for(int i = 0; i < cr->nnamed; i++){
+        if(cr->named[i] == client){
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void forget_name(CLIENT_REGISTRY *cr, CLIENT *client){
+    int i = named_index(cr, client);
+    if(i >= 0){
+        cr->nnamed--;
+        cr->name_ids[i] = cr->name_ids[cr->nnamed];
+        cr->named[i] = cr->named[cr->nnamed];
+    }
+}
+
+void creg_set_name(CLIENT_REGISTRY *cr, CLIENT *client, int name_id){
+    pthread_mutex_lock(&cr->registry_lock);
+    if(name_id < 0){
+        forget_name(cr, client);
+    }
+    else{
+        int i = named_index(cr, client);
+        if(i < 0){
+            i = cr->nnamed++;
+            cr->named[i] = client;
+        }
+        cr->name_ids[i] = name_id;
+    }
+    pthread_mutex_unlock(&cr->registry_lock);
+}
+
 int creg_unregister(CLIENT_REGISTRY *cr, CLIENT *client){
     if(!cr || !client){
         return -1;
@@ -97,6 +155,7 @@ int creg_unregister(CLIENT_REGISTRY *cr, CLIENT *client){
                 cr->tail = prev;
             }
             free(curr);
+            forget_name(cr, client);
             pthread_mutex_lock(&cr->len_lock);
             cr->len--;
             pthread_mutex_unlock(&cr->len_lock);
@@ -113,24 +172,17 @@ int creg_unregister(CLIENT_REGISTRY *cr, CLIENT *client){
 }
 
 CLIENT *creg_lookup(CLIENT_REGISTRY *cr, char *user){
+    //a name that was never interned cannot belong to any player
+    int name_id = intern_find(user, strlen(user));
+    return name_id < 0 ? NULL : creg_lookup_interned(cr, name_id);
+}
+
+CLIENT *creg_lookup_interned(CLIENT_REGISTRY *cr, int name_id){
     pthread_mutex_lock(&cr->registry_lock);
-    CLIENT_NODE *curr = cr->head;
-    CLIENT *curr_client = NULL;
-    while(curr){
-        curr_client = curr->client;
-        if(curr_client){
-            PLAYER *curr_player = client_get_player(curr_client);
-            if(curr_player){
-                if(strcmp(player_get_name(curr_player), user) == 0){
-                    client_ref(curr_client, "creg_lookup");
-                    break;
-                }
-            }
-        }
-        curr = curr->next;
-    }
+    int i = id_scan(cr->name_ids, cr->nnamed, name_id);
+    CLIENT *found = i < 0 ? NULL : client_ref(cr->named[i], "creg_lookup");
     pthread_mutex_unlock(&cr->registry_lock);
-    return curr_client;
+    return found;
 }
 
 PLAYER **creg_all_players(CLIENT_REGISTRY *cr){
@@ -153,6 +205,17 @@ PLAYER **creg_all_players(CLIENT_REGISTRY *cr){
     return player_list;
 }
 
+CLIENT **creg_all_clients(CLIENT_REGISTRY *cr){
+    pthread_mutex_lock(&cr->registry_lock);
+    CLIENT **client_list = calloc(cr->len + 1, sizeof(CLIENT *));
+    int index = 0;
+    for(CLIENT_NODE *curr = cr->head; curr; curr = curr->next){
+        client_list[index++] = client_ref(curr->client, "added to list of clients");
+    }
+    pthread_mutex_unlock(&cr->registry_lock);
+    return client_list;
+}
+
 void creg_wait_for_empty(CLIENT_REGISTRY *cr){
     while(1){
         pthread_mutex_lock(&cr->registry_lock);
@@ -0,0 +1,884 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+#include "cluster.h"
+#include "peer.h"
+#include "debug.h"
+#include "intern.h"
+#include "csapp.h"
+
+#define CLUSTER_EVENTS 64
+
+/* Longest shared secret. */
+#define CLUSTER_SECRET_MAX 256
+
+/* The directory, as a peer of the nodes. */
+#define CLUSTER_DIRECTORY 0
+
+/*
+ * Operations between a node and the directory, and the first message of
+ * a node on a connection to another node.
+ */
+typedef enum {
+    CLUSTER_HELLO = PEER_OP_TRANSPORT,  /* With the secret as payload; see hello() and node_fd() */
+    CLUSTER_LOGIN,                  /* May a player log in on the node */
+    CLUSTER_LOGOUT,                 /* A player has logged out of the node */
+    CLUSTER_LOOKUP,                 /* Which node is a player on, with its port in tag and host as payload */
+    CLUSTER_NODES,                  /* Lines of "number port host" */
+    CLUSTER_INVALIDATE              /* From the directory: a player has logged out */
+} CLUSTER_OP;
+
+/*
+ * A connection of the directory to a node.
+ */
+typedef struct dir_conn {
+    int fd;
+    int node;                       /* Its number, once it has said hello, or 0 */
+    int port;
+    char host[NI_MAXHOST];
+    size_t fill;
+    char buf[sizeof(PEER_MSG) + UINT16_MAX];
+} DIR_CONN;
+
+/*
+ * The directory.
+ */
+static struct {
+    int epoll_fd;
+    DIR_CONN *nodes[PEER_MAX];      /* By number */
+    int next_node;
+    int *owners;                    /* Node of each player, by the id of the interned name, or 0 */
+    int nowners;
+} directory = {
+    .epoll_fd = -1,
+    .next_node = 1
+};
+
+/* Marks the events of the listening socket in the directory. */
+static char dir_listen;
+
+/*
+ * The secret shared by the directory and the nodes, which the first
+ * message on every connection between them must carry.
+ */
+static struct {
+    char key[CLUSTER_SECRET_MAX];
+    size_t len;
+} secret;
+
+static int set_secret(const char *key){
+    size_t len = strlen(key);
+    if (!len || len > CLUSTER_SECRET_MAX) {
+        return -1;
+    }
+    memcpy(secret.key, key, len);
+    secret.len = len;
+    return 0;
+}
+
+/*
+ * Determine whether a HELLO carries the secret, which ends its payload
+ * or a NUL.  Every byte is compared, so that the time taken does not
+ * tell how much of a guess was right.
+ */
+static int authentic(PEER_MSG *msg, const char *data){
+    size_t len = strnlen(data, msg->size);
+    if (msg->op != CLUSTER_HELLO || len != secret.len) {
+        return 0;
+    }
+    unsigned char diff = 0;
+    for (size_t i = 0; i < len; i++) {
+        diff |= (unsigned char)data[i] ^ (unsigned char)secret.key[i];
+    }
+    return diff == 0;
+}
+
+/*
+ * A connection of a node, to the directory or to another node, with the
+ * thread that reads from it.
+ */
+typedef struct node_conn {
+    int fd;
+    int peer;                       /* Who is at the other end, or -1 until it has said */
+    pthread_t reader;
+    struct node_conn *next;
+} NODE_CONN;
+
+/*
+ * What a node knows of a peer.
+ */
+typedef struct node {
+    int fd;                         /* Where messages to the peer are sent, or -1 */
+    int gone;
+    int port;                       /* For another node, where it listens, or 0 if not known */
+    char host[NI_MAXHOST];
+    pthread_mutex_t send_lock;      /* One sender at a time, connecting if need be */
+} NODE;
+
+/*
+ * This node.
+ */
+static struct {
+    int joined;
+    int self;
+    int listen_fd;
+    pthread_t acceptor;
+    pthread_mutex_t lock;           /* Protects the rest */
+    NODE nodes[PEER_MAX];
+    NODE_CONN *conns;
+    int *cached;                    /* Node of each player, by the id of the interned name, or 0 */
+    int ncached;
+    uint64_t epoch;                 /* Of the last invalidation */
+} cluster = {
+    .listen_fd = -1,
+    .lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+static void set_nodelay(int fd){
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+static int write_msg(int fd, PEER_MSG *msg, const void *data){
+    msg->len = sizeof(PEER_MSG) + msg->size;
+    struct iovec iov[2] = { { msg, sizeof(PEER_MSG) }, { (void *)data, msg->size } };
+    struct msghdr mh = {0};
+    mh.msg_iov = iov;
+    mh.msg_iovlen = msg->size ? 2 : 1;
+    while (mh.msg_iovlen) {
+        ssize_t n = sendmsg(fd, &mh, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        while (mh.msg_iovlen && (size_t)n >= mh.msg_iov->iov_len) {
+            n -= mh.msg_iov->iov_len;
+            mh.msg_iov++;
+            mh.msg_iovlen--;
+        }
+        if (mh.msg_iovlen) {
+            mh.msg_iov->iov_base = (char *)mh.msg_iov->iov_base + n;
+            mh.msg_iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+static int read_full(int fd, void *buf, size_t len){
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = recv(fd, (char *)buf + done, len - done, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+/*
+ * Read a message, with its payload into a buffer of UINT16_MAX bytes.
+ */
+static int read_msg(int fd, PEER_MSG *msg, char *data){
+    if (read_full(fd, msg, sizeof(PEER_MSG)) || msg->len != sizeof(PEER_MSG) + msg->size ||
+        msg->from >= PEER_MAX) {
+        return -1;
+    }
+    return read_full(fd, data, msg->size);
+}
+
+static void dir_send(DIR_CONN *conn, PEER_MSG *msg, const void *data, size_t size){
+    msg->from = CLUSTER_DIRECTORY;
+    msg->size = size;
+    write_msg(conn->fd, msg, data);
+}
+
+static void dir_reply(DIR_CONN *conn, PEER_MSG *req, int ret, uint64_t tag, const void *data, size_t size){
+    PEER_MSG msg = {0};
+    msg.op = PEER_REPLY;
+    msg.seq = req->seq;
+    msg.ret = ret;
+    msg.tag = tag;
+    dir_send(conn, &msg, data, size);
+}
+
+/*
+ * Tell every node that a player has logged out, so that none goes on
+ * looking for it where it was.
+ */
+static void dir_invalidate(int name_id){
+    PEER_MSG msg = {0};
+    msg.op = CLUSTER_INVALIDATE;
+    for (int i = 1; i < directory.next_node; i++) {
+        if (directory.nodes[i]) {
+            dir_send(directory.nodes[i], &msg, intern_name(name_id), intern_len(name_id));
+        }
+    }
+}
+
+static int dir_owner(int name_id){
+    return name_id >= 0 && name_id < directory.nowners ? directory.owners[name_id] : 0;
+}
+
+static int dir_claim(int name_id, int node){
+    if (name_id >= directory.nowners) {
+        int n = directory.nowners ? directory.nowners : 64;
+        while (n <= name_id) {
+            n *= 2;
+        }
+        int *owners = realloc(directory.owners, n * sizeof(int));
+        if (!owners) {
+            return -1;
+        }
+        memset(owners + directory.nowners, 0, (n - directory.nowners) * sizeof(int));
+        directory.owners = owners;
+        directory.nowners = n;
+    }
+    if (directory.owners[name_id] && directory.owners[name_id] != node) {
+        return -1;
+    }
+    directory.owners[name_id] = node;
+    return 0;
+}
+
+/*
+ * Number a node that has said hello with the secret, and note where it
+ * listens: on its port, and on the host after the secret, if it gave
+ * one, or else that of its connection.  Returns -1 if the node is to be
+ * dropped.
+ */
+static int dir_hello(DIR_CONN *conn, PEER_MSG *msg, char *data){
+    if (!authentic(msg, data)) {
+        debug("node on fd %d did not give the secret", conn->fd);
+        return -1;
+    }
+    if (conn->node || directory.next_node >= PEER_MAX) {
+        dir_reply(conn, msg, -1, 0, NULL, 0);
+        return 0;
+    }
+    size_t len = strnlen(data, msg->size);
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    if (len + 1 < msg->size) {
+        snprintf(conn->host, sizeof(conn->host), "%.*s", (int)(msg->size - len - 1), data + len + 1);
+    }
+    else if (getpeername(conn->fd, (SA *)&addr, &addr_len) ||
+             getnameinfo((SA *)&addr, addr_len, conn->host, sizeof(conn->host), NULL, 0, NI_NUMERICHOST)) {
+        dir_reply(conn, msg, -1, 0, NULL, 0);
+        return 0;
+    }
+    conn->port = msg->ret;
+    conn->node = directory.next_node++;
+    directory.nodes[conn->node] = conn;
+    dir_reply(conn, msg, conn->node, 0, NULL, 0);
+    return 0;
+}
+
+static void dir_nodes(DIR_CONN *conn, PEER_MSG *msg){
+    char *lines = malloc(UINT16_MAX);
+    size_t len = 0;
+    for (int i = 1; i < directory.next_node; i++) {
+        DIR_CONN *node = directory.nodes[i];
+        if (node && len + 16 + strlen(node->host) < UINT16_MAX) {
+            len += sprintf(lines + len, "%d %d %s\n", i, node->port, node->host);
+        }
+    }
+    dir_reply(conn, msg, 0, 0, lines, len);
+    free(lines);
+}
+
+/*
+ * Handle a message from a node, returning -1 if the node is to be
+ * dropped: one that has not yet said hello may say nothing else.
+ */
+static int dir_handle(DIR_CONN *conn, PEER_MSG *msg, char *data){
+    if (msg->op == CLUSTER_HELLO || !conn->node) {
+        return dir_hello(conn, msg, data);
+    }
+    size_t len = strnlen(data, msg->size);
+    switch (msg->op) {
+        case CLUSTER_LOGIN: {
+            int name_id = intern(data, len);
+            dir_reply(conn, msg, name_id < 0 ? -1 : dir_claim(name_id, conn->node), 0, NULL, 0);
+            break;
+        }
+        case CLUSTER_LOGOUT: {
+            int name_id = intern_find(data, len);
+            if (dir_owner(name_id) == conn->node) {
+                directory.owners[name_id] = 0;
+                dir_invalidate(name_id);
+            }
+            break;
+        }
+        case CLUSTER_LOOKUP: {
+            DIR_CONN *owner = directory.nodes[dir_owner(intern_find(data, len))];
+            if (owner) {
+                dir_reply(conn, msg, owner->node, owner->port, owner->host, strlen(owner->host));
+            }
+            else {
+                dir_reply(conn, msg, -1, 0, NULL, 0);
+            }
+            break;
+        }
+        case CLUSTER_NODES:
+            dir_nodes(conn, msg);
+            break;
+        default:
+            break;
+    }
+    return 0;
+}
+
+/*
+ * Forget a node that has gone, and every player logged in on it.
+ */
+static void dir_drop(DIR_CONN *conn){
+    epoll_ctl(directory.epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    if (conn->node) {
+        directory.nodes[conn->node] = NULL;
+        for (int i = 0; i < directory.nowners; i++) {
+            if (directory.owners[i] == conn->node) {
+                directory.owners[i] = 0;
+                dir_invalidate(i);
+            }
+        }
+    }
+    free(conn);
+}
+
+/*
+ * Take what a node has sent, handling each message once it has all come.
+ */
+static void dir_read(DIR_CONN *conn){
+    while (1) {
+        ssize_t n = recv(conn->fd, conn->buf + conn->fill, sizeof(conn->buf) - conn->fill, MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (n <= 0) {
+            dir_drop(conn);
+            return;
+        }
+        conn->fill += n;
+        size_t off = 0;
+        PEER_MSG msg;
+        while (conn->fill - off >= sizeof(PEER_MSG)) {
+            memcpy(&msg, conn->buf + off, sizeof(PEER_MSG));
+            if (msg.len != sizeof(PEER_MSG) + msg.size) {
+                dir_drop(conn);
+                return;
+            }
+            if (conn->fill - off < msg.len) {
+                break;
+            }
+            if (dir_handle(conn, &msg, conn->buf + off + sizeof(PEER_MSG))) {
+                dir_drop(conn);
+                return;
+            }
+            off += msg.len;
+        }
+        memmove(conn->buf, conn->buf + off, conn->fill - off);
+        conn->fill -= off;
+    }
+}
+
+static void dir_admit(int listen_fd){
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0) {
+        return;
+    }
+    DIR_CONN *conn = malloc(sizeof(DIR_CONN));
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN;
+    ev.data.ptr = conn;
+    if (!conn || epoll_ctl(directory.epoll_fd, EPOLL_CTL_ADD, fd, &ev)) {
+        free(conn);
+        close(fd);
+        return;
+    }
+    set_nodelay(fd);
+    conn->fd = fd;
+    conn->node = 0;
+    conn->fill = 0;
+}
+
+int cluster_directory(int listen_fd, char *key){
+    if (directory.epoll_fd < 0) {
+        if (set_secret(key)) {
+            return -1;
+        }
+        directory.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        struct epoll_event ev = {0};
+        ev.events = EPOLLIN;
+        ev.data.ptr = &dir_listen;
+        if (directory.epoll_fd < 0 ||
+            epoll_ctl(directory.epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev)) {
+            return -1;
+        }
+    }
+    while (1) {
+        struct epoll_event events[CLUSTER_EVENTS];
+        int n = epoll_wait(directory.epoll_fd, events, CLUSTER_EVENTS, -1);
+        if (n < 0) {
+            return errno == EINTR ? 0 : -1;
+        }
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == &dir_listen) {
+                dir_admit(listen_fd);
+            }
+            else {
+                dir_read(events[i].data.ptr);
+            }
+        }
+    }
+}
+
+static void invalidate(const char *name, size_t len){
+    int name_id = intern_find(name, strnlen(name, len));
+    pthread_mutex_lock(&cluster.lock);
+    cluster.epoch++;
+    if (name_id >= 0 && name_id < cluster.ncached) {
+        cluster.cached[name_id] = 0;
+    }
+    pthread_mutex_unlock(&cluster.lock);
+}
+
+/*
+ * Take messages from a connection until it is closed, leaving them to be
+ * handled by the peer layer's thread.  A connection made by another node
+ * must start with a HELLO that carries the secret and the node's number,
+ * or it is closed.  The node at the other end, if it has no connection
+ * to send on yet, sends on this one.
+ */
+static void *reader_thread(void *arg){
+    NODE_CONN *conn = arg;
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+    char *data = malloc(UINT16_MAX);
+    PEER_MSG msg;
+    while (data && read_msg(conn->fd, &msg, data) == 0) {
+        if (conn->peer < 0) {
+            if (!authentic(&msg, data) || msg.from == CLUSTER_DIRECTORY || msg.from == cluster.self) {
+                debug("node connection on fd %d did not say hello with the secret", conn->fd);
+                break;
+            }
+            pthread_mutex_lock(&cluster.lock);
+            conn->peer = msg.from;
+            if (cluster.nodes[conn->peer].fd < 0) {
+                cluster.nodes[conn->peer].fd = conn->fd;
+            }
+            pthread_mutex_unlock(&cluster.lock);
+            continue;
+        }
+        if (msg.op == CLUSTER_INVALIDATE && conn->peer == CLUSTER_DIRECTORY) {
+            invalidate(data, msg.size);
+        }
+        else {
+            peer_receive(&msg, data);
+        }
+    }
+    free(data);
+    if (conn->peer < 0) {
+        //let the node that made it find out, rather than wait on it
+        shutdown(conn->fd, SHUT_RDWR);
+    }
+    else {
+        //calls to the peer fail from now on, rather than wait for replies
+        pthread_mutex_lock(&cluster.lock);
+        if (cluster.nodes[conn->peer].fd == conn->fd) {
+            cluster.nodes[conn->peer].fd = -1;
+            cluster.nodes[conn->peer].gone = 1;
+        }
+        pthread_mutex_unlock(&cluster.lock);
+    }
+    return NULL;
+}
+
+/*
+ * Start reading from a connection, which is kept until the node leaves.
+ * The lock must be held.
+ */
+static int add_conn(int fd, int peer){
+    NODE_CONN *conn = malloc(sizeof(NODE_CONN));
+    if (!conn) {
+        return -1;
+    }
+    conn->fd = fd;
+    conn->peer = peer;
+    if (pthread_create(&conn->reader, NULL, reader_thread, conn)) {
+        free(conn);
+        return -1;
+    }
+    conn->next = cluster.conns;
+    cluster.conns = conn;
+    return 0;
+}
+
+static void *acceptor_thread(void *arg){
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+    int fd;
+    while ((fd = accept(cluster.listen_fd, NULL, NULL)) >= 0 || errno == EINTR || errno == ECONNABORTED) {
+        if (fd < 0) {
+            continue;
+        }
+        set_nodelay(fd);
+        pthread_mutex_lock(&cluster.lock);
+        if (add_conn(fd, -1)) {
+            close(fd);
+        }
+        pthread_mutex_unlock(&cluster.lock);
+    }
+    return NULL;
+}
+
+/*
+ * Get the connection on which to send to a peer, connecting to it if
+ * there is none yet.  The peer's send lock must be held.
+ */
+static int node_fd(int to){
+    NODE *node = &cluster.nodes[to];
+    pthread_mutex_lock(&cluster.lock);
+    int fd = node->fd;
+    int known = !node->gone && node->port;
+    char host[NI_MAXHOST], port[8];
+    strcpy(host, node->host);
+    snprintf(port, sizeof(port), "%d", node->port);
+    pthread_mutex_unlock(&cluster.lock);
+    if (fd >= 0 || !known) {
+        return fd;
+    }
+    fd = open_clientfd(host, port);
+    if (fd < 0) {
+        return -1;
+    }
+    set_nodelay(fd);
+    //tell the other node who is at this end, and that it belongs here
+    PEER_MSG hello = {0};
+    hello.op = CLUSTER_HELLO;
+    hello.from = cluster.self;
+    hello.size = secret.len;
+    if (write_msg(fd, &hello, secret.key)) {
+        close(fd);
+        return -1;
+    }
+    pthread_mutex_lock(&cluster.lock);
+    if (add_conn(fd, to)) {
+        close(fd);
+    }
+    else if (node->fd < 0) {
+        node->fd = fd;
+    }
+    fd = node->fd;
+    pthread_mutex_unlock(&cluster.lock);
+    return fd;
+}
+
+static int cluster_send(int to, PEER_MSG *msg, const void *data){
+    if (to < 0 || to >= PEER_MAX) {
+        return -1;
+    }
+    NODE *node = &cluster.nodes[to];
+    pthread_mutex_lock(&node->send_lock);
+    int fd = node_fd(to);
+    int ret = fd < 0 ? -1 : write_msg(fd, msg, data);
+    pthread_mutex_unlock(&node->send_lock);
+    return ret;
+}
+
+static int cluster_gone(int peer){
+    pthread_mutex_lock(&cluster.lock);
+    int gone = cluster.nodes[peer].gone;
+    pthread_mutex_unlock(&cluster.lock);
+    return gone;
+}
+
+/*
+ * Note where a node listens, if it is not yet known.  The lock must be
+ * held.
+ */
+static void learn(int node, int port, const char *host){
+    if (node > 0 && node < PEER_MAX && !cluster.nodes[node].port && host) {
+        snprintf(cluster.nodes[node].host, sizeof(cluster.nodes[node].host), "%s", host);
+        cluster.nodes[node].port = port;
+    }
+}
+
+static int cluster_locate(const char *name, size_t len){
+    int name_id = intern_find(name, len);
+    pthread_mutex_lock(&cluster.lock);
+    int on = name_id >= 0 && name_id < cluster.ncached ? cluster.cached[name_id] : 0;
+    if (on && cluster.nodes[on].gone) {
+        on = 0;
+    }
+    uint64_t epoch = cluster.epoch;
+    pthread_mutex_unlock(&cluster.lock);
+    if (on) {
+        return on;
+    }
+    PEER_MSG msg = {0};
+    msg.op = CLUSTER_LOOKUP;
+    char *host = NULL;
+    size_t size;
+    if (peer_call(CLUSTER_DIRECTORY, &msg, name, len, &host, &size) ||
+        msg.ret <= 0 || msg.ret >= PEER_MAX || msg.ret == cluster.self) {
+        free(host);
+        return -1;
+    }
+    on = msg.ret;
+    name_id = intern(name, len);
+    pthread_mutex_lock(&cluster.lock);
+    learn(on, msg.tag, host);
+    //an answer overtaken by an invalidation may be out of date already
+    if (name_id >= 0 && cluster.epoch == epoch) {
+        if (name_id >= cluster.ncached) {
+            int n = cluster.ncached ? cluster.ncached : 64;
+            while (n <= name_id) {
+                n *= 2;
+            }
+            int *cached = realloc(cluster.cached, n * sizeof(int));
+            if (cached) {
+                memset(cached + cluster.ncached, 0, (n - cluster.ncached) * sizeof(int));
+                cluster.cached = cached;
+                cluster.ncached = n;
+            }
+        }
+        if (name_id < cluster.ncached) {
+            cluster.cached[name_id] = on;
+        }
+    }
+    pthread_mutex_unlock(&cluster.lock);
+    free(host);
+    return on;
+}
+
+static int cluster_login(const char *name, size_t len){
+    PEER_MSG msg = {0};
+    msg.op = CLUSTER_LOGIN;
+    if (peer_call(CLUSTER_DIRECTORY, &msg, name, len, NULL, NULL)) {
+        return -1;
+    }
+    return msg.ret;
+}
+
+static void cluster_logout(const char *name, size_t len){
+    PEER_MSG msg = {0};
+    msg.op = CLUSTER_LOGOUT;
+    peer_send(CLUSTER_DIRECTORY, &msg, name, len);
+}
+
+static int cluster_peers(int *peers, int max){
+    PEER_MSG msg = {0};
+    msg.op = CLUSTER_NODES;
+    char *lines = NULL;
+    size_t size;
+    if (peer_call(CLUSTER_DIRECTORY, &msg, NULL, 0, &lines, &size) || !lines) {
+        return 0;
+    }
+    int n = 0;
+    char *line = lines;
+    pthread_mutex_lock(&cluster.lock);
+    while (n < max && *line) {
+        int node, port;
+        char host[NI_MAXHOST];
+        if (sscanf(line, "%d %d %1024s", &node, &port, host) == 3) {
+            learn(node, port, host);
+            if (node != cluster.self && node > 0 && node < PEER_MAX) {
+                peers[n++] = node;
+            }
+        }
+        char *end = strchr(line, '\n');
+        line = end ? end + 1 : line + strlen(line);
+    }
+    pthread_mutex_unlock(&cluster.lock);
+    free(lines);
+    return n;
+}
+
+static const PEER_TRANSPORT transport = {
+    .send = cluster_send,
+    .gone = cluster_gone,
+    .locate = cluster_locate,
+    .login = cluster_login,
+    .logout = cluster_logout,
+    .peers = cluster_peers
+};
+
+/*
+ * Listen for other nodes on an address, on whatever port is free, since
+ * they are told the port by the directory.
+ */
+static int listen_on(const char *host){
+    struct addrinfo hints = {0}, *list, *p;
+    int fd = -1, one = 1;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+    if (getaddrinfo(host, "0", &hints, &list)) {
+        return -1;
+    }
+    for (p = list; p; p = p->ai_next) {
+        if ((fd = socket(p->ai_family, p->ai_socktype | SOCK_CLOEXEC, p->ai_protocol)) < 0) {
+            continue;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, p->ai_addr, p->ai_addrlen) == 0) {
+            break;
+        }
+        close(fd);
+    }
+    freeaddrinfo(list);
+    if (!p) {
+        return -1;
+    }
+    if (listen(fd, LISTENQ) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Connect to the directory, start listening for other nodes on the given
+ * host, or else on the address of this end of the connection, and say
+ * hello with the secret, getting this node's number.
+ */
+static int hello(char *address, char *host){
+    char *colon = strrchr(address, ':');
+    if (!colon) {
+        return -1;
+    }
+    char dir_host[NI_MAXHOST];
+    snprintf(dir_host, sizeof(dir_host), "%.*s", (int)(colon - address), address);
+    int fd = open_clientfd(dir_host, colon + 1);
+    if (fd < 0) {
+        return -1;
+    }
+    set_nodelay(fd);
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    char local[NI_MAXHOST], port[NI_MAXSERV];
+    if (!host && (getsockname(fd, (SA *)&addr, &addr_len) ||
+                  getnameinfo((SA *)&addr, addr_len, local, sizeof(local), NULL, 0, NI_NUMERICHOST))) {
+        close(fd);
+        return -1;
+    }
+    cluster.listen_fd = listen_on(host ? host : local);
+    addr_len = sizeof(addr);
+    if (cluster.listen_fd < 0 ||
+        getsockname(cluster.listen_fd, (SA *)&addr, &addr_len) ||
+        getnameinfo((SA *)&addr, addr_len, NULL, 0, port, sizeof(port), NI_NUMERICSERV)) {
+        close(fd);
+        return -1;
+    }
+    //the directory takes the host of a node that names none from its connection
+    char payload[CLUSTER_SECRET_MAX + 1 + NI_MAXHOST];
+    size_t size = secret.len;
+    memcpy(payload, secret.key, secret.len);
+    if (host) {
+        payload[size++] = '\0';
+        size += snprintf(payload + size, sizeof(payload) - size, "%s", host);
+    }
+    PEER_MSG msg = {0};
+    msg.op = CLUSTER_HELLO;
+    msg.ret = atoi(port);
+    msg.size = size;
+    char *data = malloc(UINT16_MAX);
+    //the reply is read here, before anything else can come from the directory
+    if (!data || write_msg(fd, &msg, payload) || read_msg(fd, &msg, data) || msg.ret <= 0) {
+        free(data);
+        close(fd);
+        return -1;
+    }
+    free(data);
+    cluster.self = msg.ret;
+    cluster.nodes[CLUSTER_DIRECTORY].fd = fd;
+    return fd;
+}
+
+int cluster_join(char *address, char *host, char *key){
+    for (int i = 0; i < PEER_MAX; i++) {
+        cluster.nodes[i].fd = -1;
+        pthread_mutex_init(&cluster.nodes[i].send_lock, NULL);
+    }
+    if (set_secret(key)) {
+        return -1;
+    }
+    int fd = hello(address, host);
+    if (fd < 0 || peer_init(&transport, cluster.self)) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (cluster.listen_fd >= 0) {
+            close(cluster.listen_fd);
+            cluster.listen_fd = -1;
+        }
+        return -1;
+    }
+    pthread_mutex_lock(&cluster.lock);
+    int failed = add_conn(fd, CLUSTER_DIRECTORY);
+    pthread_mutex_unlock(&cluster.lock);
+    if (failed || pthread_create(&cluster.acceptor, NULL, acceptor_thread, NULL)) {
+        //a node that cannot hear from the others is of no use to them
+        cluster.joined = 1;
+        cluster_leave();
+        return -1;
+    }
+    cluster.joined = 1;
+    return 0;
+}
+
+void cluster_leave(void){
+    if (!cluster.joined) {
+        return;
+    }
+    shutdown(cluster.listen_fd, SHUT_RDWR);
+    if (cluster.acceptor) {
+        pthread_join(cluster.acceptor, NULL);
+    }
+    close(cluster.listen_fd);
+    cluster.listen_fd = -1;
+    //no new connections are made once the acceptor has stopped and the
+    //readers have been told to
+    pthread_mutex_lock(&cluster.lock);
+    for (int i = 0; i < PEER_MAX; i++) {
+        cluster.nodes[i].gone = 1;
+    }
+    for (NODE_CONN *conn = cluster.conns; conn; conn = conn->next) {
+        shutdown(conn->fd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&cluster.lock);
+    while (cluster.conns) {
+        NODE_CONN *conn = cluster.conns;
+        cluster.conns = conn->next;
+        pthread_join(conn->reader, NULL);
+        close(conn->fd);
+        free(conn);
+    }
+    peer_fini();
+    free(cluster.cached);
+    cluster.cached = NULL;
+    cluster.ncached = 0;
+    cluster.joined = 0;
+}
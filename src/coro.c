@@ -0,0 +1,366 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "coro.h"
+#include "debug.h"
+
+/*
+ * Usable size of a coroutine stack.  Stacks are mapped lazily, so only
+ * the pages that a coroutine actually touches take up memory, and each
+ * has a guard page below it.
+ */
+#define CORO_STACK_SIZE (64 * 1024)
+
+/* Number of released stacks kept for reuse. */
+#define CORO_STACK_POOL 1024
+
+#define CORO_POLL_EVENTS 256
+
+typedef struct coro {
+    ucontext_t ctx;
+    char *stack;                    /* Base of the mapping, guard page included */
+    void (*fn)(void *);
+    void *arg;
+    int worker;                     /* Worker it last ran on */
+    int wait_fd;                    /* To be left with the poller, or -1 */
+    int polled_fd;                  /* Registered with the poller, or -1 */
+    int done;
+    struct coro *next;
+} CORO;
+
+typedef struct worker {
+    pthread_t thread;
+    pthread_mutex_t lock;           /* Protects the run queue */
+    CORO *head;
+    CORO *tail;
+    ucontext_t ctx;                 /* Where a coroutine gives up the worker to */
+    CORO *current;
+} WORKER;
+
+static struct {
+    int nworkers;
+    WORKER *workers;
+    int running;
+    atomic_int stopping;
+    atomic_int runnable;            /* Coroutines on run queues */
+    atomic_int idle;                /* Workers asleep, or about to be */
+    atomic_uint next_worker;
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+    int epoll_fd;
+    int wake_fd;                    /* Written to stop the poller */
+    pthread_t poller;
+    char *stacks;                   /* Pool of released stacks, linked through their first word */
+    int nstacks;
+    pthread_mutex_t stack_lock;
+    size_t page;
+} coro = {
+    .epoll_fd = -1,
+    .wake_fd = -1,
+    .idle_lock = PTHREAD_MUTEX_INITIALIZER,
+    .idle_cond = PTHREAD_COND_INITIALIZER,
+    .stack_lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+static __thread WORKER *self;
+
+/*
+ * The worker that the caller is running on.  A coroutine may resume on a
+ * different thread from the one it gave up, so this is not inlined, lest
+ * the address of the thread-local variable be kept across the switch.
+ */
+__attribute__((noinline))
+static WORKER *this_worker(void){
+    WORKER *w = self;
+    __asm__ volatile("" ::: "memory");
+    return w;
+}
+
+static char *stack_get(void){
+    pthread_mutex_lock(&coro.stack_lock);
+    char *stack = coro.stacks;
+    if (stack) {
+        coro.stacks = *(char **)(stack + coro.page);
+        coro.nstacks--;
+    }
+    pthread_mutex_unlock(&coro.stack_lock);
+    if (stack) {
+        return stack;
+    }
+    stack = mmap(NULL, CORO_STACK_SIZE + coro.page, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+    if (stack == MAP_FAILED) {
+        return NULL;
+    }
+    mprotect(stack, coro.page, PROT_NONE);
+    return stack;
+}
+
+static void stack_put(char *stack){
+    pthread_mutex_lock(&coro.stack_lock);
+    if (coro.nstacks < CORO_STACK_POOL) {
+        *(char **)(stack + coro.page) = coro.stacks;
+        coro.stacks = stack;
+        coro.nstacks++;
+        stack = NULL;
+    }
+    pthread_mutex_unlock(&coro.stack_lock);
+    if (stack) {
+        munmap(stack, CORO_STACK_SIZE + coro.page);
+    }
+}
+
+/*
+ * Put a coroutine on the run queue of a worker, and wake a worker if any
+ * are asleep.
+ */
+static void push(WORKER *w, CORO *c){
+    c->next = NULL;
+    pthread_mutex_lock(&w->lock);
+    if (w->tail) {
+        w->tail->next = c;
+    }
+    else {
+        w->head = c;
+    }
+    w->tail = c;
+    pthread_mutex_unlock(&w->lock);
+    atomic_fetch_add(&coro.runnable, 1);
+    if (atomic_load(&coro.idle)) {
+        pthread_mutex_lock(&coro.idle_lock);
+        pthread_cond_signal(&coro.idle_cond);
+        pthread_mutex_unlock(&coro.idle_lock);
+    }
+}
+
+static CORO *pop(WORKER *w){
+    pthread_mutex_lock(&w->lock);
+    CORO *c = w->head;
+    if (c) {
+        w->head = c->next;
+        if (!w->head) {
+            w->tail = NULL;
+        }
+    }
+    pthread_mutex_unlock(&w->lock);
+    if (c) {
+        atomic_fetch_sub(&coro.runnable, 1);
+    }
+    return c;
+}
+
+/*
+ * Take a coroutine to run: from the worker's own queue if it has one,
+ * otherwise from another worker's.
+ */
+static CORO *take(WORKER *w){
+    CORO *c = pop(w);
+    int index = w - coro.workers;
+    for (int i = 1; !c && i < coro.nworkers; i++) {
+        c = pop(&coro.workers[(index + i) % coro.nworkers]);
+    }
+    return c;
+}
+
+static void trampoline(void){
+    CORO *c = this_worker()->current;
+    c->fn(c->arg);
+    c->done = 1;
+    swapcontext(&c->ctx, &this_worker()->ctx);
+}
+
+/*
+ * A coroutine that has given up its worker to wait for input is handed
+ * to the poller only now that it is no longer running, so that it cannot
+ * be resumed on another worker while still on this one's stack.
+ */
+static void park(WORKER *w, CORO *c){
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    ev.data.ptr = c;
+    int fd = c->wait_fd;
+    int op = c->polled_fd == fd ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if (op == EPOLL_CTL_ADD && c->polled_fd >= 0) {
+        epoll_ctl(coro.epoll_fd, EPOLL_CTL_DEL, c->polled_fd, NULL);
+    }
+    c->polled_fd = fd;
+    if (epoll_ctl(coro.epoll_fd, op, fd, &ev)) {
+        //not pollable, so just let it try again
+        c->wait_fd = c->polled_fd = -1;
+        push(w, c);
+    }
+}
+
+/*
+ * Signals are left to the threads that are not the runtime's.
+ */
+static void block_signals(void){
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+}
+
+static void *worker_thread(void *arg){
+    WORKER *w = arg;
+    self = w;
+    block_signals();
+    while (1) {
+        CORO *c = take(w);
+        if (!c) {
+            pthread_mutex_lock(&coro.idle_lock);
+            atomic_fetch_add(&coro.idle, 1);
+            while (!atomic_load(&coro.runnable) && !atomic_load(&coro.stopping)) {
+                pthread_cond_wait(&coro.idle_cond, &coro.idle_lock);
+            }
+            atomic_fetch_sub(&coro.idle, 1);
+            pthread_mutex_unlock(&coro.idle_lock);
+            if (atomic_load(&coro.stopping) && !atomic_load(&coro.runnable)) {
+                return NULL;
+            }
+            continue;
+        }
+        c->worker = w - coro.workers;
+        w->current = c;
+        swapcontext(&w->ctx, &c->ctx);
+        w->current = NULL;
+        if (c->done) {
+            stack_put(c->stack);
+            free(c);
+        }
+        else if (c->wait_fd >= 0) {
+            park(w, c);
+        }
+        else {
+            push(w, c);
+        }
+    }
+}
+
+static void *poller_thread(void *arg){
+    struct epoll_event events[CORO_POLL_EVENTS];
+    block_signals();
+    while (!atomic_load(&coro.stopping)) {
+        int n = epoll_wait(coro.epoll_fd, events, CORO_POLL_EVENTS, -1);
+        for (int i = 0; i < n; i++) {
+            CORO *c = events[i].data.ptr;
+            if (c) {
+                c->wait_fd = -1;
+                push(&coro.workers[c->worker], c);
+            }
+        }
+    }
+    return NULL;
+}
+
+int coro_init(int nworkers){
+    coro.page = sysconf(_SC_PAGESIZE);
+    coro.nworkers = nworkers;
+    coro.workers = calloc(nworkers, sizeof(WORKER));
+    coro.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    coro.wake_fd = eventfd(0, EFD_CLOEXEC);
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (!coro.workers || coro.epoll_fd < 0 || coro.wake_fd < 0 ||
+        epoll_ctl(coro.epoll_fd, EPOLL_CTL_ADD, coro.wake_fd, &ev) ||
+        pthread_create(&coro.poller, NULL, poller_thread, NULL)) {
+        free(coro.workers);
+        if (coro.epoll_fd >= 0) {
+            close(coro.epoll_fd);
+        }
+        if (coro.wake_fd >= 0) {
+            close(coro.wake_fd);
+        }
+        coro.epoll_fd = coro.wake_fd = -1;
+        return -1;
+    }
+    atomic_store(&coro.stopping, 0);
+    //every run queue is ready before any worker can steal from it
+    for (int i = 0; i < nworkers; i++) {
+        pthread_mutex_init(&coro.workers[i].lock, NULL);
+    }
+    for (int i = 0; i < nworkers; i++) {
+        pthread_create(&coro.workers[i].thread, NULL, worker_thread, &coro.workers[i]);
+    }
+    coro.running = 1;
+    return 0;
+}
+
+void coro_fini(void){
+    if (!coro.running) {
+        return;
+    }
+    atomic_store(&coro.stopping, 1);
+    pthread_mutex_lock(&coro.idle_lock);
+    pthread_cond_broadcast(&coro.idle_cond);
+    pthread_mutex_unlock(&coro.idle_lock);
+    uint64_t one = 1;
+    if (write(coro.wake_fd, &one, sizeof(one)) < 0) {
+        debug("coroutine poller wakeup failed");
+    }
+    pthread_join(coro.poller, NULL);
+    for (int i = 0; i < coro.nworkers; i++) {
+        pthread_join(coro.workers[i].thread, NULL);
+        pthread_mutex_destroy(&coro.workers[i].lock);
+    }
+    free(coro.workers);
+    coro.workers = NULL;
+    close(coro.epoll_fd);
+    close(coro.wake_fd);
+    coro.epoll_fd = coro.wake_fd = -1;
+    while (coro.stacks) {
+        char *stack = coro.stacks;
+        coro.stacks = *(char **)(stack + coro.page);
+        munmap(stack, CORO_STACK_SIZE + coro.page);
+    }
+    coro.nstacks = 0;
+    coro.running = 0;
+}
+
+int coro_spawn(void (*fn)(void *), void *arg){
+    CORO *c = calloc(1, sizeof(CORO));
+    char *stack = c ? stack_get() : NULL;
+    if (!stack) {
+        free(c);
+        return -1;
+    }
+    c->stack = stack;
+    c->fn = fn;
+    c->arg = arg;
+    c->wait_fd = c->polled_fd = -1;
+    getcontext(&c->ctx);
+    c->ctx.uc_stack.ss_sp = stack + coro.page;
+    c->ctx.uc_stack.ss_size = CORO_STACK_SIZE;
+    c->ctx.uc_link = NULL;
+    makecontext(&c->ctx, trampoline, 0);
+    //spread new coroutines over the workers
+    WORKER *w = this_worker();
+    if (!w) {
+        w = &coro.workers[atomic_fetch_add(&coro.next_worker, 1) % coro.nworkers];
+    }
+    c->worker = w - coro.workers;
+    push(w, c);
+    return 0;
+}
+
+void coro_wait_readable(int fd){
+    WORKER *w = this_worker();
+    CORO *c = w->current;
+    c->wait_fd = fd;
+    swapcontext(&c->ctx, &w->ctx);
+}
+
+void coro_yield(void){
+    WORKER *w = this_worker();
+    CORO *c = w->current;
+    swapcontext(&c->ctx, &w->ctx);
+}
@@ -0,0 +1,47 @@
+#include <stdlib.h>
+#include <stdatomic.h>
+#include "frame.h"
+#include "debug.h"
+
+/*
+ * The reference count is atomic rather than mutex-protected because a
+ * single FRAME may be referenced from thousands of outbound queues, and
+ * taking and dropping those references must stay cheap.
+ */
+typedef struct frame{
+    atomic_int ref_count;
+    size_t size;
+    char *data;
+}FRAME;
+
+FRAME *frame_create(char *data, size_t size){
+    FRAME *frame = calloc(1, sizeof(FRAME));
+    if(!frame){
+        return NULL;
+    }
+    atomic_init(&frame->ref_count, 1);
+    frame->size = size;
+    frame->data = data;
+    return frame;
+}
+
+FRAME *frame_ref(FRAME *frame, char *why){
+    atomic_fetch_add_explicit(&frame->ref_count, 1, memory_order_relaxed);
+    return frame;
+}
+
+void frame_unref(FRAME *frame, char *why){
+    if(atomic_fetch_sub_explicit(&frame->ref_count, 1, memory_order_acq_rel) == 1){
+        free(frame->data);
+        free(frame);
+    }
+    return;
+}
+
+char *frame_data(FRAME *frame){
+    return frame->data;
+}
+
+size_t frame_size(FRAME *frame){
+    return frame->size;
+}
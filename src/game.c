@@ -1,18 +1,38 @@
 #include "jeux_globals.h"
-#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 #include "game.h"
+#include "game_ext.h"
 #include "invitation.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 
+/*
+ * The whole state of a game is packed into one word, so that it is read
+ * with a single load and changed with a single compare-and-swap: the
+ * board in the low 18 bits, two bits per square (0 empty, 1 X, 2 O) with
+ * square k at bit 2k, then the player to move, whether the game is over,
+ * and the winner.  The board and the player to move are laid out as in
+ * game_pack_state().
+ */
+#define GAME_BOARD_MASK 0x3ffffu
+#define GAME_TURN_SHIFT 18
+#define GAME_OVER_BIT (1u << 20)
+#define GAME_WINNER_SHIFT 21
+
+#define SQUARE(state, k) (((state) >> (2 * (k))) & 3)
+#define TURN(state) ((GAME_ROLE)(((state) >> GAME_TURN_SHIFT) & 3))
+#define WINNER(state) ((GAME_ROLE)(((state) >> GAME_WINNER_SHIFT) & 3))
+
 typedef struct game{
-    char** board;    
-    GAME_ROLE player_role;
-    GAME_ROLE game_winner;
-    int over;
-    int ref_count;
-    pthread_mutex_t game_lock;
+    atomic_uint state;
+    atomic_int ref_count;
+    GAME_MSG *_Atomic inbox;        /* Messages posted, most recent first */
+    atomic_int draining;            /* A thread is handling the messages */
 }GAME;
 
 typedef struct game_move{
@@ -24,167 +44,162 @@ typedef struct game_move{
 
 GAME *game_create(void){
     GAME *game= calloc(1, sizeof(GAME));
-    game->player_role = FIRST_PLAYER_ROLE;
-    game->game_winner = NULL_ROLE;
-    game->over = 0;
-    pthread_mutex_init(&game->game_lock, NULL);
+    atomic_init(&game->state, (unsigned)FIRST_PLAYER_ROLE << GAME_TURN_SHIFT);
+    atomic_init(&game->ref_count, 0);
+    atomic_init(&game->inbox, NULL);
+    atomic_init(&game->draining, 0);
 	game_ref(game, "Creating new game");
-    char** board = calloc(3, sizeof(char *));
-    for (int i = 0; i < 3; i++) {
-        board[i] = calloc(3, sizeof(char));
-        for (int j = 0; j < 3; j++) {
-            board[i][j] = ' ';
-        }
-    }
-    game->board = board; 
     return game;
 };
 
 GAME *game_ref(GAME *game, char *why){
-    pthread_mutex_lock(&game->game_lock);
-    game->ref_count++;
-    pthread_mutex_unlock(&game->game_lock);
+    atomic_fetch_add_explicit(&game->ref_count, 1, memory_order_relaxed);
     return game;
 }
 
 void game_unref(GAME *game, char *why){
-    pthread_mutex_lock(&game->game_lock);
-    game->ref_count--;
-    if(game->ref_count == 0) {
-        for (int i = 0; i < 3; i++) {
-            free(game->board[i]);
-        }
-        free(game->board);
-        pthread_mutex_destroy(&game->game_lock);
+    if (atomic_fetch_sub_explicit(&game->ref_count, 1, memory_order_acq_rel) == 1) {
         free(game);
-        return;
     }
-    pthread_mutex_unlock(&game->game_lock);
-    return;
 }
 
-void win_check(GAME *game, char x, GAME_ROLE winner){
-    int win = 0;
-    int row;
-    int col;
-    // Check diagonals
-    if (game->board[0][2] == x && game->board[0][2] == game->board[1][1] && game->board[1][1] == game->board[2][0]) {
-        win = 1;
-    }
-    else if (game->board[0][0] == x && game->board[0][0] == game->board[1][1] && game->board[1][1] == game->board[2][2]) {
-        win = 1;
-    }
-    // Check rows
-    for (row = 0; row < 3; row++) {
-        if (game->board[row][0] == x && game->board[row][0] == game->board[row][1] && game->board[row][1] == game->board[row][2]) {
-            win = 1;
-        }
-    }
-    // Check columns
-    for (col = 0; col < 3; col++) {
-        if (game->board[0][col] == x && game->board[0][col] == game->board[1][col] && game->board[1][col] == game->board[2][col]) {
-            win = 1;
+/*
+ * Determine whether the player with the given mark has won, or the board
+ * is full.
+ *
+ * @return 1 for a win, 2 for a draw, otherwise 0.
+ */
+static int win_check(unsigned state, unsigned mark){
+    static const int lines[8][3] = {
+        {0, 1, 2}, {3, 4, 5}, {6, 7, 8},
+        {0, 3, 6}, {1, 4, 7}, {2, 5, 8},
+        {0, 4, 8}, {2, 4, 6}
+    };
+    for (int i = 0; i < 8; i++) {
+        if (SQUARE(state, lines[i][0]) == mark && SQUARE(state, lines[i][1]) == mark &&
+            SQUARE(state, lines[i][2]) == mark) {
+            return 1;
         }
     }
-    if(!win){
-        int draw = 1;
-        //check for draw
-        for (row = 0; row < 3; row++) {
-            for (col = 0; col < 3; col++) {
-                if (game->board[row][col] == ' ') {
-                    draw = 0;
-                    break;
-                }
-            }
+    for (int k = 0; k < 9; k++) {
+        if (!SQUARE(state, k)) {
+            return 0;
         }
-        if(draw){
-            win = 2;
-        }
-    }
-    if(win == 2) {
-        game->game_winner = NULL_ROLE;
     }
-    else if(win == 1){
-        game->game_winner = winner;
-    }
-    else{
-        return;
-    }
-    game->over = 1;
-    return;
+    return 2;
 }
 
 int game_apply_move(GAME *game, GAME_MOVE *move){
-    pthread_mutex_lock(&game->game_lock);
-    if (game->board[move->row][move->col] != ' ') {
-        pthread_mutex_unlock(&game->game_lock);
+    GAME_ROLE role = move->player_role;
+    if (role != FIRST_PLAYER_ROLE && role != SECOND_PLAYER_ROLE) {
         return -1;
     }
-    GAME_ROLE curr_role = move->player_role;
-    switch(curr_role){
-        case FIRST_PLAYER_ROLE:
-            game->board[move->row][move->col] = 'X';
-            game->player_role = SECOND_PLAYER_ROLE;
-            win_check(game, 'X', FIRST_PLAYER_ROLE);
-            break;
-        case SECOND_PLAYER_ROLE:
-            game->board[move->row][move->col] = 'O';
-            game->player_role = FIRST_PLAYER_ROLE;
-            win_check(game, 'O', SECOND_PLAYER_ROLE);
-            break;
-        default:
-            pthread_mutex_unlock(&game->game_lock);
+    int k = move->row * 3 + move->col;
+    unsigned mark = role == FIRST_PLAYER_ROLE ? 1 : 2;
+    GAME_ROLE next = role == FIRST_PLAYER_ROLE ? SECOND_PLAYER_ROLE : FIRST_PLAYER_ROLE;
+    unsigned state = atomic_load_explicit(&game->state, memory_order_acquire);
+    unsigned after;
+    do {
+        //the game may have been resigned or forfeited since the move was parsed
+        if ((state & GAME_OVER_BIT) || SQUARE(state, k)) {
             return -1;
-    }
-    pthread_mutex_unlock(&game->game_lock);
+        }
+        after = (state & GAME_BOARD_MASK) | (mark << (2 * k)) | ((unsigned)next << GAME_TURN_SHIFT);
+        int result = win_check(after, mark);
+        if (result) {
+            after |= GAME_OVER_BIT | ((result == 1 ? (unsigned)role : NULL_ROLE) << GAME_WINNER_SHIFT);
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&game->state, &state, after,
+                                                    memory_order_acq_rel, memory_order_acquire));
     return 0;
-
 }
 
 int game_resign(GAME *game, GAME_ROLE role) {
-    if (game) {
-        pthread_mutex_lock(&game->game_lock);
-        if (game_is_over(game)) {
-            pthread_mutex_unlock(&game->game_lock);
+    if (!game) {
+        return -1;
+    }
+    GAME_ROLE winner = (role == FIRST_PLAYER_ROLE) ? SECOND_PLAYER_ROLE : FIRST_PLAYER_ROLE;
+    unsigned state = atomic_load_explicit(&game->state, memory_order_acquire);
+    do {
+        if (state & GAME_OVER_BIT) {
             return -1;
         }
-        game->game_winner = (role == FIRST_PLAYER_ROLE) ? SECOND_PLAYER_ROLE : FIRST_PLAYER_ROLE;
-        game->over = 1;
-        pthread_mutex_unlock(&game->game_lock);
-        return 0;
-    }
-    return -1;
+    } while (!atomic_compare_exchange_weak_explicit(&game->state, &state,
+                                                    state | GAME_OVER_BIT | ((unsigned)winner << GAME_WINNER_SHIFT),
+                                                    memory_order_acq_rel, memory_order_acquire));
+    return 0;
 }
 
 char *game_unparse_state(GAME *game){
+    static const char marks[] = { ' ', 'X', 'O', ' ' };
+    unsigned state = atomic_load_explicit(&game->state, memory_order_acquire);
+    char board[9];
+    for (int k = 0; k < 9; k++) {
+        board[k] = marks[SQUARE(state, k)];
+    }
     char *buf;
     size_t s;
     FILE *stream = open_memstream(&buf, &s);
-    char **board = game->board;
     fprintf(stream, "%s\n%c|%c|%c\n-----\n%c|%c|%c\n-----\n%c|%c|%c\n",
             "Game Board:",
-            board[0][0], board[0][1], board[0][2],
-            board[1][0], board[1][1], board[1][2],
-            board[2][0], board[2][1], board[2][2]);
+            board[0], board[1], board[2],
+            board[3], board[4], board[5],
+            board[6], board[7], board[8]);
 
-    fprintf(stream, "player %c turn\n", (game->player_role == FIRST_PLAYER_ROLE) ? 'X' : 'O');
+    fprintf(stream, "player %c turn\n", (TURN(state) == FIRST_PLAYER_ROLE) ? 'X' : 'O');
     fclose(stream);
     return buf;
 }
 
 int game_is_over(GAME *game){
-    return game->over;
+    return (atomic_load_explicit(&game->state, memory_order_acquire) & GAME_OVER_BIT) != 0;
 }
 
 GAME_ROLE game_get_winner(GAME *game){
-    return game->game_winner;
+    return WINNER(atomic_load_explicit(&game->state, memory_order_acquire));
+}
+
+GAME_ROLE game_get_turn(GAME *game){
+    unsigned state = atomic_load_explicit(&game->state, memory_order_acquire);
+    return (state & GAME_OVER_BIT) ? NULL_ROLE : TURN(state);
+}
+
+void game_pack_state(GAME *game, unsigned char *buf){
+    unsigned state = atomic_load_explicit(&game->state, memory_order_acquire);
+    uint32_t packed = state & GAME_BOARD_MASK;
+    if (!(state & GAME_OVER_BIT)) {
+        packed |= (uint32_t)TURN(state) << GAME_TURN_SHIFT;
+    }
+    buf[0] = packed >> 16;
+    buf[1] = packed >> 8;
+    buf[2] = packed;
+}
+
+void game_unpack_state(GAME *game, const unsigned char *buf){
+    uint32_t packed = (uint32_t)buf[0] << 16 | (uint32_t)buf[1] << 8 | buf[2];
+    unsigned state = packed & (GAME_BOARD_MASK | 3u << GAME_TURN_SHIFT);
+    if (!TURN(state)) {
+        if (win_check(state, 1) == 1) {
+            state |= GAME_OVER_BIT | (unsigned)FIRST_PLAYER_ROLE << GAME_WINNER_SHIFT;
+        }
+        else if (win_check(state, 2) == 1) {
+            state |= GAME_OVER_BIT | (unsigned)SECOND_PLAYER_ROLE << GAME_WINNER_SHIFT;
+        }
+        else if (win_check(state, 2) == 2) {
+            state |= GAME_OVER_BIT;
+        }
+    }
+    atomic_store_explicit(&game->state, state, memory_order_release);
 }
 
 GAME_MOVE *game_parse_move(GAME *game, GAME_ROLE role, char *str){
-    if(game->player_role == role) {
-        GAME_MOVE *game_move= calloc(1, sizeof(GAME_MOVE));
+    if(TURN(atomic_load_explicit(&game->state, memory_order_acquire)) == role) {
         char *endptr;
         unsigned long position = strtoul(str, &endptr, 10);
+        if(endptr == str || position < 1 || position > 9) {
+            return NULL;
+        }
+        GAME_MOVE *game_move= calloc(1, sizeof(GAME_MOVE));
         game_move->row = (position-1)/3;
         game_move->col = (position-1)%3;
         game_move->pos = position;
@@ -207,4 +222,91 @@ char *game_unparse_move(GAME_MOVE *move){
     }
     fclose(stream);
     return buf;
-}
\ No newline at end of file
+}
+
+
+/*
+ * A caller of game_call() spins for a while on the done word of its
+ * message, and then sleeps on it as a futex, having marked it so that the
+ * drainer knows to wake it.
+ */
+#define GAME_CALL_SPINS 64
+#define CALL_PENDING 0
+#define CALL_SLEEPING 1
+#define CALL_DONE 2
+
+static void call_done(GAME_MSG *msg){
+    if (atomic_exchange_explicit(&msg->done, CALL_DONE, memory_order_release) == CALL_SLEEPING) {
+        //the message may be gone by now, but a wakeup at a stale address is harmless
+        syscall(SYS_futex, &msg->done, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+
+/*
+ * Handle the messages posted to a game until there are none left.  Only
+ * one thread at a time drains a game's mailbox: whichever posted to it
+ * while it was idle.  Messages are pushed on a stack, so each batch taken
+ * off it is reversed to handle them in the order they were posted.
+ */
+static void game_drain(GAME *game){
+    do {
+        GAME_MSG *batch;
+        while ((batch = atomic_exchange_explicit(&game->inbox, NULL, memory_order_acquire))) {
+            GAME_MSG *fifo = NULL;
+            while (batch) {
+                GAME_MSG *next = batch->next;
+                batch->next = fifo;
+                fifo = batch;
+                batch = next;
+            }
+            while (fifo) {
+                GAME_MSG *next = fifo->next;
+                //a message nobody waits for may be freed by its handler
+                int waited = fifo->waited;
+                fifo->handle(fifo);
+                if (waited) {
+                    call_done(fifo);
+                }
+                fifo = next;
+            }
+        }
+        atomic_store(&game->draining, 0);
+        //a message posted just before the mailbox went idle is still ours
+    } while (atomic_load(&game->inbox) && !atomic_exchange(&game->draining, 1));
+}
+
+static void game_push(GAME *game, GAME_MSG *msg){
+    GAME_MSG *head = atomic_load_explicit(&game->inbox, memory_order_relaxed);
+    do {
+        msg->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&game->inbox, &head, msg,
+                                                    memory_order_release, memory_order_relaxed));
+    if (!atomic_exchange(&game->draining, 1)) {
+        game_drain(game);
+    }
+}
+
+void game_post(GAME *game, GAME_MSG *msg){
+    msg->waited = 0;
+    game_push(game, msg);
+}
+
+void game_call(GAME *game, GAME_MSG *msg){
+    msg->waited = 1;
+    atomic_init(&msg->done, CALL_PENDING);
+    game_push(game, msg);
+    //the drainer is working through the messages posted before this one,
+    //which is usually quick; if not, sleep until it wakes us
+    for (int i = 0; i < GAME_CALL_SPINS; i++) {
+        if (atomic_load_explicit(&msg->done, memory_order_acquire) == CALL_DONE) {
+            return;
+        }
+        sched_yield();
+    }
+    int state = CALL_PENDING;
+    atomic_compare_exchange_strong_explicit(&msg->done, &state, CALL_SLEEPING,
+                                            memory_order_acquire, memory_order_acquire);
+    while (atomic_load_explicit(&msg->done, memory_order_acquire) != CALL_DONE) {
+        syscall(SYS_futex, &msg->done, FUTEX_WAIT_PRIVATE, CALL_SLEEPING, NULL, NULL, 0);
+    }
+}
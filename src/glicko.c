@@ -0,0 +1,201 @@
+#include <stdlib.h>
+#include <math.h>
+
+#include "glicko.h"
+
+/* Conversion between the Glicko-2 scale and the usual rating scale. */
+#define GLICKO_SCALE 173.7178
+#define GLICKO_BASE 1500.0
+
+#define GLICKO_DEFAULT_DEVIATION 350.0
+#define GLICKO_DEFAULT_VOLATILITY 0.06
+
+/* Convergence tolerance of the volatility iteration. */
+#define GLICKO_EPSILON 0.000001
+
+/*
+ * Per-player state, one array per field, indexed by slot.  mu and phi are
+ * on the Glicko-2 scale and stay fixed for the whole of a period; games
+ * played during the period only accumulate into v_inv (the reciprocal of
+ * the estimated variance v) and delta_sum (delta / v).
+ */
+typedef struct glicko {
+    double tau;
+    int nslots;
+    int capacity;
+    double *mu;
+    double *phi;
+    double *sigma;
+    double *v_inv;
+    double *delta_sum;
+} GLICKO;
+
+GLICKO *glicko_create(double tau){
+    GLICKO *glicko = calloc(1, sizeof(GLICKO));
+    if (glicko) {
+        glicko->tau = tau;
+    }
+    return glicko;
+}
+
+void glicko_fini(GLICKO *glicko){
+    free(glicko->mu);
+    free(glicko->phi);
+    free(glicko->sigma);
+    free(glicko->v_inv);
+    free(glicko->delta_sum);
+    free(glicko);
+}
+
+static int grow(double **array, int capacity){
+    double *p = realloc(*array, capacity * sizeof(double));
+    if (!p) {
+        return -1;
+    }
+    *array = p;
+    return 0;
+}
+
+int glicko_reserve(GLICKO *glicko, int nslots){
+    if (nslots <= glicko->nslots) {
+        return 0;
+    }
+    if (nslots > glicko->capacity) {
+        int capacity = glicko->capacity ? glicko->capacity : 64;
+        while (capacity < nslots) {
+            capacity *= 2;
+        }
+        if (grow(&glicko->mu, capacity) || grow(&glicko->phi, capacity) ||
+            grow(&glicko->sigma, capacity) || grow(&glicko->v_inv, capacity) ||
+            grow(&glicko->delta_sum, capacity)) {
+            return -1;
+        }
+        glicko->capacity = capacity;
+    }
+    for (int i = glicko->nslots; i < nslots; i++) {
+        glicko->mu[i] = 0;
+        glicko->phi[i] = GLICKO_DEFAULT_DEVIATION / GLICKO_SCALE;
+        glicko->sigma[i] = GLICKO_DEFAULT_VOLATILITY;
+        glicko->v_inv[i] = 0;
+        glicko->delta_sum[i] = 0;
+    }
+    glicko->nslots = nslots;
+    return 0;
+}
+
+void glicko_set(GLICKO *glicko, int slot, double rating, double deviation, double volatility){
+    glicko->mu[slot] = (rating - GLICKO_BASE) / GLICKO_SCALE;
+    glicko->phi[slot] = deviation / GLICKO_SCALE;
+    glicko->sigma[slot] = volatility;
+}
+
+static double g(double phi){
+    return 1 / sqrt(1 + 3 * phi * phi / (M_PI * M_PI));
+}
+
+static void accumulate(GLICKO *glicko, int self, int opp, double score){
+    double g_opp = g(glicko->phi[opp]);
+    double e = 1 / (1 + exp(-g_opp * (glicko->mu[self] - glicko->mu[opp])));
+    glicko->v_inv[self] += g_opp * g_opp * e * (1 - e);
+    glicko->delta_sum[self] += g_opp * (score - e);
+}
+
+void glicko_record(GLICKO *glicko, int a, int b, double score){
+    accumulate(glicko, a, b, score);
+    accumulate(glicko, b, a, 1 - score);
+}
+
+/*
+ * The function whose root is the logarithm of the new volatility squared,
+ * from step 5 of Glickman's description of the algorithm.
+ */
+static double f(double x, double a, double tau, double phi2, double v, double delta2){
+    double ex = exp(x);
+    double d = phi2 + v + ex;
+    return ex * (delta2 - d) / (2 * d * d) - (x - a) / (tau * tau);
+}
+
+/*
+ * The new volatility of a player who played during the period, found by
+ * the Illinois variant of regula falsi.
+ */
+static double new_volatility(double tau, double phi, double sigma, double v, double delta){
+    double a = log(sigma * sigma);
+    double phi2 = phi * phi;
+    double delta2 = delta * delta;
+    double A = a, B;
+    if (delta2 > phi2 + v) {
+        B = log(delta2 - phi2 - v);
+    }
+    else {
+        int k = 1;
+        while (f(a - k * tau, a, tau, phi2, v, delta2) < 0) {
+            k++;
+        }
+        B = a - k * tau;
+    }
+    double fA = f(A, a, tau, phi2, v, delta2);
+    double fB = f(B, a, tau, phi2, v, delta2);
+    while (fabs(B - A) > GLICKO_EPSILON) {
+        double C = A + (A - B) * fA / (fB - fA);
+        double fC = f(C, a, tau, phi2, v, delta2);
+        if (fC * fB <= 0) {
+            A = B;
+            fA = fB;
+        }
+        else {
+            fA /= 2;
+        }
+        B = C;
+        fB = fC;
+    }
+    return exp(A / 2);
+}
+
+/*
+ * Steps 6 to 8 for every player at once.  A player who did not play has
+ * v_inv and delta_sum of zero, for which the same formulas reduce to just
+ * widening the deviation, so the loop has no branches and vectorizes.
+ * The deviation of an idle player is not allowed to grow past that of a
+ * new player.  The server is built without optimization, so this one
+ * function asks for it explicitly.
+ */
+__attribute__((optimize("O3", "no-math-errno")))
+static void update_all(int n, double *restrict mu, double *restrict phi,
+                       const double *restrict sigma, double *restrict v_inv,
+                       double *restrict delta_sum){
+    const double phi_max = GLICKO_DEFAULT_DEVIATION / GLICKO_SCALE;
+    for (int i = 0; i < n; i++) {
+        double phi_star2 = phi[i] * phi[i] + sigma[i] * sigma[i];
+        double phi_new = 1 / sqrt(1 / phi_star2 + v_inv[i]);
+        phi_new = phi_new < phi_max ? phi_new : phi_max;
+        mu[i] += phi_new * phi_new * delta_sum[i];
+        phi[i] = phi_new;
+        v_inv[i] = 0;
+        delta_sum[i] = 0;
+    }
+}
+
+void glicko_close_period(GLICKO *glicko){
+    for (int i = 0; i < glicko->nslots; i++) {
+        if (glicko->v_inv[i] > 0) {
+            double v = 1 / glicko->v_inv[i];
+            glicko->sigma[i] = new_volatility(glicko->tau, glicko->phi[i], glicko->sigma[i],
+                                              v, v * glicko->delta_sum[i]);
+        }
+    }
+    update_all(glicko->nslots, glicko->mu, glicko->phi, glicko->sigma,
+               glicko->v_inv, glicko->delta_sum);
+}
+
+double glicko_rating(GLICKO *glicko, int slot){
+    return GLICKO_SCALE * glicko->mu[slot] + GLICKO_BASE;
+}
+
+double glicko_deviation(GLICKO *glicko, int slot){
+    return GLICKO_SCALE * glicko->phi[slot];
+}
+
+double glicko_volatility(GLICKO *glicko, int slot){
+    return glicko->sigma[slot];
+}
@@ -0,0 +1,101 @@
+#include <pthread.h>
+
+#include "id_scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ID_SCAN_X86
+#endif
+
+/*
+ * The server is built without optimization, and the vector loops are only
+ * worth having if the intrinsics are compiled inline, so the scans ask for
+ * optimization explicitly.
+ */
+#define ID_SCAN_OPT __attribute__((optimize("O2")))
+
+ID_SCAN_OPT
+int id_scan_scalar(const int32_t *ids, int n, int32_t id){
+    for (int i = 0; i < n; i++) {
+        if (ids[i] == id) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+#ifdef ID_SCAN_X86
+
+ID_SCAN_OPT __attribute__((target("sse2")))
+static int scan_sse2(const int32_t *ids, int n, int32_t id){
+    __m128i key = _mm_set1_epi32(id);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)&ids[i]);
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, key)));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    int j = id_scan_scalar(&ids[i], n - i, id);
+    return j < 0 ? -1 : i + j;
+}
+
+/*
+ * Four vectors are compared per iteration, and their results combined, so
+ * that a miss costs one branch per 32 ids.
+ */
+ID_SCAN_OPT __attribute__((target("avx2")))
+static int scan_avx2(const int32_t *ids, int n, int32_t id){
+    __m256i key = _mm256_set1_epi32(id);
+    int i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i c0 = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *)&ids[i]), key);
+        __m256i c1 = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *)&ids[i + 8]), key);
+        __m256i c2 = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *)&ids[i + 16]), key);
+        __m256i c3 = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *)&ids[i + 24]), key);
+        __m256i any = _mm256_or_si256(_mm256_or_si256(c0, c1), _mm256_or_si256(c2, c3));
+        if (!_mm256_testz_si256(any, any)) {
+            break;
+        }
+    }
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)&ids[i]);
+        int mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, key)));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    int j = id_scan_scalar(&ids[i], n - i, id);
+    return j < 0 ? -1 : i + j;
+}
+
+#endif
+
+static int (*scan)(const int32_t *, int, int32_t) = id_scan_scalar;
+static const char *scan_name = "scalar";
+static pthread_once_t scan_once = PTHREAD_ONCE_INIT;
+
+static void choose_scan(void){
+#ifdef ID_SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        scan = scan_avx2;
+        scan_name = "avx2";
+    }
+    else if (__builtin_cpu_supports("sse2")) {
+        scan = scan_sse2;
+        scan_name = "sse2";
+    }
+#endif
+}
+
+int id_scan(const int32_t *ids, int n, int32_t id){
+    pthread_once(&scan_once, choose_scan);
+    return scan(ids, n, id);
+}
+
+const char *id_scan_impl(void){
+    pthread_once(&scan_once, choose_scan);
+    return scan_name;
+}
@@ -0,0 +1,197 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "intern.h"
+
+/* Names are copied into arena blocks of this size. */
+#define INTERN_BLOCK_SIZE (64 * 1024)
+
+/* Entries are found by id through a directory of fixed-size chunks. */
+#define INTERN_CHUNK_BITS 12
+#define INTERN_CHUNK_SIZE (1 << INTERN_CHUNK_BITS)
+#define INTERN_MAX_CHUNKS 4096
+
+typedef struct interned {
+    uint32_t hash;
+    uint32_t len;
+    char bytes[];
+} INTERNED;
+
+/*
+ * Names are found by hash in an open-addressed table of ids, kept at most
+ * half full.  The table and the arena are guarded by a rwlock, so that
+ * the common case of finding a name that is already interned only takes
+ * the read lock.  Entries never move once interned, and the directory
+ * chunks never move once allocated, so an entry can be reached from its
+ * id without locking.
+ */
+static struct {
+    _Atomic(INTERNED **) chunks[INTERN_MAX_CHUNKS];
+    int count;
+    int *slots;                     /* Id + 1, or 0 if empty */
+    int nslots;
+    char *block;                    /* Current arena block */
+    size_t used;                    /* Bytes used in the current block */
+    pthread_rwlock_t lock;
+} table = {
+    .lock = PTHREAD_RWLOCK_INITIALIZER
+};
+
+static uint32_t hash_name(const char *name, size_t len){
+    //FNV-1a
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static INTERNED *entry(int id){
+    INTERNED **chunk = atomic_load_explicit(&table.chunks[id >> INTERN_CHUNK_BITS],
+                                            memory_order_acquire);
+    return chunk[id & (INTERN_CHUNK_SIZE - 1)];
+}
+
+/* The following functions must be called with the lock held. */
+
+static int lookup(const char *name, size_t len, uint32_t hash){
+    if (!table.nslots) {
+        return -1;
+    }
+    for (int i = hash & (table.nslots - 1); table.slots[i]; i = (i + 1) & (table.nslots - 1)) {
+        INTERNED *e = entry(table.slots[i] - 1);
+        if (e->hash == hash && e->len == len && !memcmp(e->bytes, name, len)) {
+            return table.slots[i] - 1;
+        }
+    }
+    return -1;
+}
+
+static void insert_slot(int *slots, int nslots, int id){
+    int i = entry(id)->hash & (nslots - 1);
+    while (slots[i]) {
+        i = (i + 1) & (nslots - 1);
+    }
+    slots[i] = id + 1;
+}
+
+static int grow_slots(void){
+    int nslots = table.nslots ? table.nslots * 2 : 256;
+    int *slots = calloc(nslots, sizeof(int));
+    if (!slots) {
+        return -1;
+    }
+    for (int id = 0; id < table.count; id++) {
+        insert_slot(slots, nslots, id);
+    }
+    free(table.slots);
+    table.slots = slots;
+    table.nslots = nslots;
+    return 0;
+}
+
+/*
+ * Carve an entry out of the arena.  Each block starts with a pointer to
+ * the previous one, so that all blocks stay reachable.
+ */
+static INTERNED *arena_alloc(size_t len){
+    size_t size = (sizeof(INTERNED) + len + 1 + 7) & ~(size_t)7;
+    if (!table.block || table.used + size > INTERN_BLOCK_SIZE) {
+        size_t block_size = sizeof(char *) + size;
+        if (block_size < INTERN_BLOCK_SIZE) {
+            block_size = INTERN_BLOCK_SIZE;
+        }
+        char *block = malloc(block_size);
+        if (!block) {
+            return NULL;
+        }
+        *(char **)block = table.block;
+        table.block = block;
+        table.used = sizeof(char *);
+    }
+    INTERNED *e = (INTERNED *)(table.block + table.used);
+    table.used += size;
+    return e;
+}
+
+static int add(const char *name, size_t len, uint32_t hash){
+    int id = table.count;
+    if (id >= INTERN_MAX_CHUNKS * INTERN_CHUNK_SIZE) {
+        return -1;
+    }
+    if (2 * (id + 1) > table.nslots && grow_slots()) {
+        return -1;
+    }
+    INTERNED **chunk = atomic_load_explicit(&table.chunks[id >> INTERN_CHUNK_BITS],
+                                            memory_order_relaxed);
+    if (!chunk) {
+        chunk = calloc(INTERN_CHUNK_SIZE, sizeof(INTERNED *));
+        if (!chunk) {
+            return -1;
+        }
+        atomic_store_explicit(&table.chunks[id >> INTERN_CHUNK_BITS], chunk,
+                              memory_order_release);
+    }
+    INTERNED *e = arena_alloc(len);
+    if (!e) {
+        return -1;
+    }
+    e->hash = hash;
+    e->len = len;
+    memcpy(e->bytes, name, len);
+    e->bytes[len] = '\0';
+    chunk[id & (INTERN_CHUNK_SIZE - 1)] = e;
+    table.count++;
+    insert_slot(table.slots, table.nslots, id);
+    return id;
+}
+
+int intern_find(const char *name, size_t len){
+    if (!name) {
+        name = "";
+        len = 0;
+    }
+    len = strnlen(name, len);
+    uint32_t hash = hash_name(name, len);
+    pthread_rwlock_rdlock(&table.lock);
+    int id = lookup(name, len, hash);
+    pthread_rwlock_unlock(&table.lock);
+    return id;
+}
+
+int intern(const char *name, size_t len){
+    if (!name) {
+        name = "";
+        len = 0;
+    }
+    len = strnlen(name, len);
+    uint32_t hash = hash_name(name, len);
+    pthread_rwlock_rdlock(&table.lock);
+    int id = lookup(name, len, hash);
+    pthread_rwlock_unlock(&table.lock);
+    if (id >= 0) {
+        return id;
+    }
+    pthread_rwlock_wrlock(&table.lock);
+    //someone else may have interned the name in the meantime
+    id = lookup(name, len, hash);
+    if (id < 0) {
+        id = add(name, len, hash);
+    }
+    pthread_rwlock_unlock(&table.lock);
+    return id;
+}
+
+const char *intern_name(int id){
+    return entry(id)->bytes;
+}
+
+size_t intern_len(int id){
+    return entry(id)->len;
+}
+
+uint32_t intern_hash(int id){
+    return entry(id)->hash;
+}
@@ -4,8 +4,12 @@
 #include "game.h"
 #include "jeux_globals.h"
 #include "invitation.h"
+#include "invitation_ext.h"
+#include "client_ext.h"
+#include "timer_wheel.h"
 #include <stdlib.h>
-#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 
 /*
  * An INVITATION records the status of an offer, made by one CLIENT
@@ -35,18 +39,32 @@
  * are thread-safe.
  */
 typedef struct invitation{
-    int ref_count;
+    atomic_int ref_count;
     int source_id;
     int target_id;
     CLIENT *source;
     CLIENT *target;
     int source_role;
     int target_role;
-    GAME *game;
-    INVITATION_STATE state;
-    pthread_mutex_t invitation_lock;
+    GAME *_Atomic game;             /* Published with a release store */
+    atomic_int state;               /* INVITATION_STATE, or INV_ACCEPTING */
+    TIMER clock;                    /* Move clock of the game in progress */
+    uint64_t tag;                   /* Set before the invitation is shared */
+    uint64_t serial;                /* Of its game's checkpoints, 0 if none */
 }INVITATION;
 
+/*
+ * State transitions are made by compare-and-swap on the state word, so
+ * that when two clients race to accept, decline or revoke an invitation,
+ * exactly one of them wins and the other fails at once, without either
+ * one blocking.  Accepting goes through the transient INV_ACCEPTING state
+ * while the new GAME is published, so that an INVITATION seen in the
+ * ACCEPTED state always has its GAME.
+ */
+#define INV_ACCEPTING ((int)INV_CLOSED_STATE + 1)
+
+static void inv_clock_expired(void *arg);
+
 /*
  * Create an INVITATION in the OPEN state, containing reference to
  * specified source and target CLIENTs, which cannot be the same CLIENT.
@@ -65,31 +83,28 @@ INVITATION *inv_create(CLIENT *source, CLIENT *target, GAME_ROLE source_role, GA
 		return NULL;
 	}
 	INVITATION *invite = calloc(1, sizeof(INVITATION));
-	pthread_mutex_init(&invite->invitation_lock, NULL);
+	atomic_init(&invite->ref_count, 0);
+	atomic_init(&invite->game, NULL);
+	atomic_init(&invite->state, INV_OPEN_STATE);
 	invite->source_role = source_role;
     invite->source = source;
 	invite->target_role = target_role;
     invite->target = target;
+	timer_init(&invite->clock, inv_clock_expired, invite);
 	inv_ref(invite, "invitation is created");
 	client_ref(source, "client is the source of new inv");
 	client_ref(target, "client is the target of new inv");
-	invite->state = INV_OPEN_STATE;
 	return invite;
 }
 
 INVITATION *inv_ref(INVITATION *inv, char *why) {
-	pthread_mutex_lock(&inv->invitation_lock);
-	inv->ref_count++;
-	pthread_mutex_unlock(&inv->invitation_lock);
+	atomic_fetch_add_explicit(&inv->ref_count, 1, memory_order_relaxed);
 	return inv;
 }
 
 void inv_unref(INVITATION *inv, char *why) {
-	pthread_mutex_lock(&inv->invitation_lock);
-	inv->ref_count--;
-	if (inv->ref_count != 0) {
-		pthread_mutex_unlock(&inv->invitation_lock);
-    	return;
+	if (atomic_fetch_sub_explicit(&inv->ref_count, 1, memory_order_acq_rel) != 1) {
+		return;
 	}
 	if (inv->source) {
 		client_unref(inv->source, "inv freed");
@@ -97,13 +112,11 @@ void inv_unref(INVITATION *inv, char *why) {
 	if (inv->target) {
 		client_unref(inv->target, "inv freed");
 	}
-	if (inv->game) {
-		game_unref(inv->game, "inv of game freed");
-		inv->game = NULL;
+	GAME *game = atomic_load_explicit(&inv->game, memory_order_acquire);
+	if (game) {
+		game_unref(game, "inv of game freed");
 	}
-	pthread_mutex_destroy(&inv->invitation_lock);
 	free(inv);
-	pthread_mutex_unlock(&inv->invitation_lock);
 	return;
 }
 
@@ -124,7 +137,7 @@ GAME_ROLE inv_get_target_role(INVITATION *inv) {
 }
 
 GAME *inv_get_game(INVITATION *inv) {
-	return inv->game;
+	return atomic_load_explicit(&inv->game, memory_order_acquire);
 }
 
 /*
@@ -136,16 +149,14 @@ GAME *inv_get_game(INVITATION *inv) {
  * @return 0 if the INVITATION was successfully accepted, otherwise -1.
  */
 int inv_accept(INVITATION *inv) {
-	pthread_mutex_lock(&inv->invitation_lock);
-	if (inv->state == INV_OPEN_STATE) {
-        inv->state = INV_ACCEPTED_STATE;
-        GAME *game = game_create();
-        inv->game = game;
-        pthread_mutex_unlock(&inv->invitation_lock);
-        return 0;
+	int expected = INV_OPEN_STATE;
+	if (!atomic_compare_exchange_strong_explicit(&inv->state, &expected, INV_ACCEPTING,
+	                                             memory_order_acquire, memory_order_relaxed)) {
+		return -1;
 	}
-    pthread_mutex_unlock(&inv->invitation_lock);
-	return -1;
+	atomic_store_explicit(&inv->game, game_create(), memory_order_release);
+	atomic_store_explicit(&inv->state, INV_ACCEPTED_STATE, memory_order_release);
+	return 0;
 }
 
 /*
@@ -163,22 +174,93 @@ int inv_accept(INVITATION *inv) {
  * @return 0 if the INVITATION was successfully closed, otherwise -1.
  */
 int inv_close(INVITATION *inv, GAME_ROLE role) {
-	pthread_mutex_lock(&inv->invitation_lock);
-    //if already closed state
-	if (inv->state == INV_CLOSED_STATE) {
-		
-		pthread_mutex_unlock(&inv->invitation_lock);
-		return -1;
-	}
-    //if there is a game in progress, close inv and game
-	if(role != NULL_ROLE) {
-		if (game_resign(inv->game, role)) {
-            pthread_mutex_unlock(&inv->invitation_lock);
+	for (;;) {
+		int state = atomic_load_explicit(&inv->state, memory_order_acquire);
+		if (state == INV_CLOSED_STATE) {
 			return -1;
 		}
+		if (state == INV_ACCEPTING) {
+			//the accepting thread is about to publish the game
+			sched_yield();
+			continue;
+		}
+		if (state == INV_OPEN_STATE) {
+			if (role != NULL_ROLE) {
+				//no game to resign
+				return -1;
+			}
+			if (atomic_compare_exchange_weak_explicit(&inv->state, &state, INV_CLOSED_STATE,
+			                                          memory_order_acq_rel, memory_order_relaxed)) {
+				return 0;
+			}
+			continue;
+		}
+		//ACCEPTED: the game decides, by compare-and-swap on its state, who ends it, and
+		//only the player who ended it closes the invitation
+		GAME *game = atomic_load_explicit(&inv->game, memory_order_acquire);
+		if (role != NULL_ROLE ? game_resign(game, role) : !game_is_over(game)) {
+			return -1;
+		}
+		if (!atomic_compare_exchange_strong_explicit(&inv->state, &state, INV_CLOSED_STATE,
+		                                             memory_order_acq_rel, memory_order_relaxed)) {
+			return -1;
+		}
+		inv_stop_clock(inv);
+		return 0;
 	}
-    //if no game is in progress close inv
-	inv->state = INV_CLOSED_STATE;
-	pthread_mutex_unlock(&inv->invitation_lock);
-	return 0;
-}
\ No newline at end of file
+}
+
+int inv_withdraw(INVITATION *inv) {
+	int expected = INV_OPEN_STATE;
+	return atomic_compare_exchange_strong_explicit(&inv->state, &expected, INV_CLOSED_STATE,
+	                                               memory_order_acq_rel, memory_order_relaxed) ? 0 : -1;
+}
+
+static void inv_clock_expired(void *arg) {
+	INVITATION *inv = arg;
+	client_forfeit_game(inv);
+	inv_unref(inv, "move clock expired");
+}
+
+void inv_start_clock(INVITATION *inv, long delay_ms) {
+	//the armed clock holds a reference, taken before it can possibly fire
+	inv_ref(inv, "move clock started");
+	if (atomic_load_explicit(&inv->state, memory_order_acquire) != INV_ACCEPTED_STATE) {
+		inv_unref(inv, "move clock not needed");
+		return;
+	}
+	if (timer_arm(&inv->clock, delay_ms)) {
+		inv_unref(inv, "move clock restarted");
+	}
+	//a close that raced with the start may have missed the clock
+	if (atomic_load_explicit(&inv->state, memory_order_acquire) != INV_ACCEPTED_STATE) {
+		inv_stop_clock(inv);
+	}
+}
+
+int inv_clock_running(INVITATION *inv) {
+	return timer_pending(&inv->clock);
+}
+
+void inv_stop_clock(INVITATION *inv) {
+	//waits only for the callback to post the forfeit, never to handle it
+	if (timer_cancel(&inv->clock)) {
+		inv_unref(inv, "move clock stopped");
+	}
+}
+
+void inv_set_tag(INVITATION *inv, uint64_t tag) {
+	inv->tag = tag;
+}
+
+uint64_t inv_get_tag(INVITATION *inv) {
+	return inv->tag;
+}
+
+void inv_set_serial(INVITATION *inv, uint64_t serial) {
+	inv->serial = serial;
+}
+
+uint64_t inv_get_serial(INVITATION *inv) {
+	return inv->serial;
+}
@@ -12,11 +12,27 @@
 #include "debug.h"
 #include "protocol.h"
 #include "server.h"
+#include "server_ext.h"
 #include "client_registry.h"
 #include "player_registry.h"
 #include "jeux_globals.h"
+#include "spectator.h"
+#include "session.h"
+#include "rating.h"
+#include "client_ext.h"
+#include "timer_wheel.h"
+#include "uring.h"
+#include "coro.h"
+#include "workq.h"
+#include "shard.h"
+#include "cluster.h"
+#include "upgrade.h"
+#include "checkpoint.h"
 #include "csapp.h"
 
+/* Resolution of the server's timer wheel. */
+#define TIMER_TICK_MS 100
+
 #ifdef DEBUG
 int _debug_packets_ = 1;
 #endif
@@ -28,24 +44,220 @@ void sighup_handler(int signum, siginfo_t *siginfo, void *context);
 void sighup_handler(int signum, siginfo_t *siginfo, void *context){
     sighup_flag = 1;
 }
+
+/*
+ * Read the secret of a cluster: the first line of a file, without its
+ * newline.  Returns NULL if there is none.
+ */
+static char *read_secret(char *path){
+    static char secret[257];
+    FILE *file = fopen(path, "r");
+    if(!file){
+        return NULL;
+    }
+    char *line = fgets(secret, sizeof(secret), file);
+    fclose(file);
+    if(!line){
+        return NULL;
+    }
+    secret[strcspn(secret, "\r\n")] = '\0';
+    return *secret ? secret : NULL;
+}
+
 /*
  * "Jeux" game server.
  *
- * Usage: jeux <port>
+ * Usage: jeux -p <port> [-s <spectator interval ms>] [-g <grace seconds>]
+ *             [-l <login seconds>] [-i <idle seconds>] [-m <move seconds>]
+ *             [-G <rating period seconds>] [-b threads|uring|coro]
+ *             [-w <workers>] [-n <shards>]
+ *             [-D | -c <directory host:port> [-a <node address>]]
+ *             [-S <cluster secret file>]
+ *             [-u <upgrade socket path>] [-k <checkpoint file>]
+ *
+ * With -G, ratings are computed with Glicko-2 over rating periods of the
+ * given length, instead of with Elo after every game.
+ *
+ * -b selects how clients are served: by a thread per client (the
+ * default), by an io_uring event loop (see uring.h), or by a coroutine
+ * per client on a pool of worker threads (see coro.h), as many as given
+ * with -w or else one per processor.  With the event loop, -w has the
+ * requests carried out by a pool of that many worker threads (see
+ * workq.h) rather than by the event loop thread, with the two players of
+ * each game served together.  If io_uring is not
+ * available, the server falls back to a thread per client.
+ *
+ * With -n, the server runs as that many processes (see shard.h), each
+ * serving the players whose usernames hash to it, with the backend
+ * selected by -b.  The first process only starts the others, and stops
+ * them on SIGHUP.
+ *
+ * With -D, the process serves only as the directory of a cluster (see
+ * cluster.h), which nodes started with -c connect to on the given port.
+ * The nodes themselves listen for players on their own -p ports, and for
+ * each other on the address given with -a, or else on the one they reach
+ * the directory from.  The directory and every node must be given the
+ * same secret, as the first line of the file named with -S.
+ *
+ * With -u, a server that is already running with the same -u hands its
+ * clients over to this one, without closing their connections, and exits
+ * (see upgrade.h); this server in turn listens for a successor.  Only a
+ * server with a thread per client and Elo ratings can be upgraded.
+ *
+ * With -k, the games in progress are checkpointed after every move to the
+ * given file, from which those of a server that died are restored when it
+ * is started again (see checkpoint.h).  Since the players resume them
+ * through their sessions, -k requires a grace period.
  */
 int main(int argc, char* argv[]){
     // Option processing should be performed here.
     // Option '-p <port>' is required in order to specify the port number
     // on which the server should listen.
     char *PORT = NULL;
-    if(argc < 3 || strcmp(argv[1], "-p") != 0){
+    long spectator_interval = 0;
+    long grace = 0;
+    long login_timeout = 0, idle_timeout = 0, move_timeout = 0;
+    long rating_period = 0;
+    int use_uring = 0, use_coro = 0;
+    long workers = 0;
+    long nshards = 0;
+    int directory = 0;
+    char *cluster = NULL;
+    char *node_address = NULL;
+    char *secret = NULL;
+    char *upgrade = NULL;
+    char *checkpoints = NULL;
+    int opt;
+    while((opt = getopt(argc, argv, "p:s:g:l:i:m:G:b:w:n:Dc:a:S:u:k:")) != -1){
+        switch(opt){
+            case 'p':
+                PORT = optarg;
+                break;
+            case 's':
+                spectator_interval = atol(optarg);
+                break;
+            case 'g':
+                grace = atol(optarg);
+                break;
+            case 'l':
+                login_timeout = atol(optarg);
+                break;
+            case 'i':
+                idle_timeout = atol(optarg);
+                break;
+            case 'm':
+                move_timeout = atol(optarg);
+                break;
+            case 'G':
+                rating_period = atol(optarg);
+                if(rating_period <= 0){
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'b':
+                if(!strcmp(optarg, "uring")){
+                    use_uring = 1;
+                }
+                else if(!strcmp(optarg, "coro")){
+                    use_coro = 1;
+                }
+                else if(strcmp(optarg, "threads")){
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'w':
+                workers = atol(optarg);
+                if(workers <= 0){
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'n':
+                nshards = atol(optarg);
+                if(nshards <= 0){
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'D':
+                directory = 1;
+                break;
+            case 'c':
+                cluster = optarg;
+                break;
+            case 'a':
+                node_address = optarg;
+                break;
+            case 'S':
+                secret = read_secret(optarg);
+                if(!secret){
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'u':
+                upgrade = optarg;
+                break;
+            case 'k':
+                checkpoints = optarg;
+                break;
+            default:
+                return EXIT_FAILURE;
+        }
+    }
+    if(!PORT || spectator_interval < 0 || grace < 0 ||
+       login_timeout < 0 || idle_timeout < 0 || move_timeout < 0 ||
+       (cluster && (nshards || directory)) ||
+       ((cluster || directory) != !!secret) || (node_address && !cluster) ||
+       (upgrade && (use_uring || use_coro || nshards || directory || cluster || rating_period)) ||
+       (checkpoints && (!grace || nshards || directory || cluster || upgrade))){
         return EXIT_FAILURE;
     }
-    PORT = argv[2];
+    struct sigaction sighup = {0};
+    sighup.sa_sigaction = sighup_handler;
+    sigemptyset(&sighup.sa_mask);
+    sighup.sa_flags = 0;
+    sigaction(SIGHUP, &sighup, NULL);
+    if(directory){
+        int listen_fd = Open_listenfd(PORT);
+        while(!sighup_flag){
+            if(cluster_directory(listen_fd, secret)){
+                return EXIT_FAILURE;
+            }
+        }
+        exit(EXIT_SUCCESS);
+    }
+    //the shards are forked before any thread is started
+    if(nshards){
+        int index;
+        if(shard_init(nshards) || (index = shard_fork()) == -2){
+            return EXIT_FAILURE;
+        }
+        if(index < 0){
+            sigset_t hup, old;
+            sigemptyset(&hup);
+            sigaddset(&hup, SIGHUP);
+            sigprocmask(SIG_BLOCK, &hup, &old);
+            while(!sighup_flag){
+                sigsuspend(&old);
+            }
+            shard_finish(SIGHUP);
+            exit(EXIT_SUCCESS);
+        }
+    }
     // Perform required initializations of the client_registry and
     // player_registry.
     client_registry = creg_init();
     player_registry = preg_init();
+    RATING_ENGINE engine = rating_period ? RATING_GLICKO2 : RATING_ELO;
+    if(rating_init(engine, rating_period * 1000) || timer_wheel_init(TIMER_TICK_MS) || spectator_init(spectator_interval)){
+        return EXIT_FAILURE;
+    }
+    session_init(grace * 1000);
+    client_set_timeouts(login_timeout * 1000, idle_timeout * 1000, move_timeout * 1000);
+    if(cluster && cluster_join(cluster, node_address, secret)){
+        return EXIT_FAILURE;
+    }
+    if(checkpoints && checkpoint_init(checkpoints) < 0){
+        return EXIT_FAILURE;
+    }
 
     // TODO: Set up the server socket and enter a loop to accept connections
     // on this socket.  For each connection, a thread should be started to
@@ -53,24 +265,82 @@ int main(int argc, char* argv[]){
     // a SIGHUP handler, so that receipt of SIGHUP will perform a clean
     // shutdown of the server.
 
-    struct sigaction sighup = {0};
-    sighup.sa_sigaction = sighup_handler;
-    sigemptyset(&sighup.sa_mask);
-    sighup.sa_flags = 0;
-    sigaction(SIGHUP, &sighup, NULL);
     int listen_fd;
     struct sockaddr_storage client_addr;
     socklen_t client_len;
-    listen_fd = Open_listenfd(PORT);
+    if(nshards){
+        listen_fd = shard_listen(PORT);
+        if(listen_fd < 0 || shard_start(login_timeout * 1000)){
+            return EXIT_FAILURE;
+        }
+    }
+    else if(upgrade && (listen_fd = upgrade_takeover(upgrade)) != -1){
+        if(listen_fd < 0){
+            return EXIT_FAILURE;
+        }
+    }
+    else{
+        listen_fd = Open_listenfd(PORT);
+    }
+    if(upgrade && upgrade_listen(upgrade, listen_fd)){
+        return EXIT_FAILURE;
+    }
     // debug("Listening on port %s\n", PORT);
+    if(use_uring && workers && workq_init(workers, WORKQ_STEALING)){
+        return EXIT_FAILURE;
+    }
+    if(use_uring && uring_start(nshards ? -1 : listen_fd, workers ? URING_POOLED | URING_AFFINITY : 0) == 0){
+        if(nshards){
+            //the gate accepts connections, and hands them to the event loop
+            while(!sighup_flag){
+                int fd = shard_accept(listen_fd);
+                if(fd >= 0 && uring_adopt(fd)){
+                    close(fd);
+                }
+            }
+            terminate(0);
+        }
+        //the event loop accepts connections, so just wait for SIGHUP
+        sigset_t hup, old;
+        sigemptyset(&hup);
+        sigaddset(&hup, SIGHUP);
+        sigprocmask(SIG_BLOCK, &hup, &old);
+        while(!sighup_flag){
+            sigsuspend(&old);
+        }
+        terminate(0);
+    }
+    else if(use_uring){
+        workq_fini();
+        fprintf(stderr, "io_uring is not available, serving with a thread per client\n");
+    }
+    if(use_coro && coro_init(workers ? workers : sysconf(_SC_NPROCESSORS_ONLN))){
+        return EXIT_FAILURE;
+    }
     while(1){
         client_len = sizeof(struct sockaddr_storage);
         int *conn_fd = malloc(sizeof(int));
-        *conn_fd = accept(listen_fd, (SA *)&client_addr, &client_len);
+        if(nshards){
+            *conn_fd = shard_accept(listen_fd);
+        }
+        else{
+            *conn_fd = accept(listen_fd, (SA *)&client_addr, &client_len);
+        }
 
         if(sighup_flag) {
             terminate(0);
         }
+        if(*conn_fd < 0){
+            free(conn_fd);
+            continue;
+        }
+        if(use_coro){
+            if(*conn_fd >= 0 && coro_spawn(jeux_client_coroutine, (void *)(intptr_t)*conn_fd)){
+                close(*conn_fd);
+            }
+            free(conn_fd);
+            continue;
+        }
         pthread_t thread;
         pthread_create(&thread, NULL, jeux_client_service, conn_fd);
     }
@@ -81,8 +351,18 @@ int main(int argc, char* argv[]){
  * Function called to cleanly shut down the server.
  */
 void terminate(int status) {
+    session_fini();
     creg_shutdown_all(client_registry);
     creg_wait_for_empty(client_registry);
+    checkpoint_fini();
+    shard_stop();
+    cluster_leave();
+    uring_stop();
+    workq_fini();
+    coro_fini();
+    spectator_fini();
+    timer_wheel_fini();
+    rating_fini();
     creg_fini(client_registry);
     preg_fini(player_registry);
     exit(status);
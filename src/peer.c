@@ -0,0 +1,672 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "peer.h"
+#include "debug.h"
+#include "client_ext.h"
+#include "client_registry_ext.h"
+#include "player_ext.h"
+#include "player_registry_ext.h"
+#include "invitation_ext.h"
+#include "game_ext.h"
+#include "jeux_globals.h"
+#include "intern.h"
+#include "frame.h"
+
+/* Buckets of the table of shared invitations; a power of two. */
+#define PEER_LINK_BUCKETS 4096
+
+/* How often a call checks whether the peer it waits on has gone. */
+#define PEER_CALL_WAIT_MS 100
+
+/*
+ * A call waiting for its reply.
+ */
+typedef struct peer_call {
+    uint64_t seq;
+    int done;
+    int ret;
+    uint64_t tag;
+    char *data;
+    size_t size;
+    struct peer_call *next;
+} PEER_CALL;
+
+/*
+ * A message received from a peer, waiting for the handler thread.
+ */
+typedef struct peer_work {
+    struct peer_work *next;
+    PEER_MSG msg;
+    char data[];                    /* The payload, NUL-terminated */
+} PEER_WORK;
+
+/*
+ * An invitation shared with a peer, by its tag and the process that
+ * keeps it.
+ */
+typedef struct peer_link {
+    uint64_t key;
+    INVITATION *inv;
+    struct peer_link *next;
+} PEER_LINK;
+
+/*
+ * The stand-in for a player of a peer, and the peer it was last found on.
+ */
+typedef struct stand_in {
+    CLIENT *client;
+    int peer;
+} STAND_IN;
+
+static struct {
+    const PEER_TRANSPORT *transport;
+    int self;
+    pthread_mutex_t call_lock;      /* Protects the calls */
+    pthread_cond_t call_cond;
+    PEER_CALL *calls;
+    uint64_t next_seq;
+    pthread_mutex_t link_lock;      /* Protects the links */
+    PEER_LINK *links[PEER_LINK_BUCKETS];
+    uint64_t next_tag;
+    pthread_mutex_t stand_in_lock;  /* Protects the stand-ins */
+    STAND_IN *stand_ins;            /* By the id of the interned name */
+    int nstand_ins;
+    pthread_t handler;
+    pthread_mutex_t work_lock;      /* Protects the work and stopping */
+    pthread_cond_t work_cond;
+    PEER_WORK *work_head;           /* Messages received, oldest first */
+    PEER_WORK *work_tail;
+    int stopping;
+} peer = {
+    .call_lock = PTHREAD_MUTEX_INITIALIZER,
+    .call_cond = PTHREAD_COND_INITIALIZER,
+    .link_lock = PTHREAD_MUTEX_INITIALIZER,
+    .stand_in_lock = PTHREAD_MUTEX_INITIALIZER,
+    .work_lock = PTHREAD_MUTEX_INITIALIZER,
+    .work_cond = PTHREAD_COND_INITIALIZER
+};
+
+static void remote_notify(CLIENT *client, INVITATION *inv, JEUX_PACKET_HEADER *hdr, void *data);
+static void remote_moved(CLIENT *client, INVITATION *inv);
+static int remote_request(CLIENT *client, INVITATION *inv, int type, char *move, char **strp);
+
+static const CLIENT_REMOTE stand_in_ops = { remote_notify, remote_moved, remote_request };
+
+int peer_send(int to, PEER_MSG *msg, const void *data, size_t size){
+    msg->from = peer.self;
+    msg->size = size;
+    return peer.transport->send(to, msg, data);
+}
+
+static void reply(PEER_MSG *req, int ret, const void *data, size_t size){
+    if (!req->seq) {
+        return;
+    }
+    PEER_MSG msg = {0};
+    msg.op = PEER_REPLY;
+    msg.seq = req->seq;
+    msg.ret = ret;
+    peer_send(req->from, &msg, data, size);
+}
+
+int peer_call(int to, PEER_MSG *msg, const void *data, size_t size, char **datap, size_t *sizep){
+    PEER_CALL c = {0};
+    pthread_mutex_lock(&peer.call_lock);
+    c.seq = ++peer.next_seq;
+    c.next = peer.calls;
+    peer.calls = &c;
+    pthread_mutex_unlock(&peer.call_lock);
+    msg->seq = c.seq;
+    int sent = peer_send(to, msg, data, size) == 0;
+    pthread_mutex_lock(&peer.call_lock);
+    while (sent && !c.done && !peer.transport->gone(to)) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += PEER_CALL_WAIT_MS * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&peer.call_cond, &peer.call_lock, &ts);
+    }
+    PEER_CALL **cp = &peer.calls;
+    while (*cp != &c) {
+        cp = &(*cp)->next;
+    }
+    *cp = c.next;
+    pthread_mutex_unlock(&peer.call_lock);
+    if (!c.done) {
+        return -1;
+    }
+    msg->ret = c.ret;
+    msg->tag = c.tag;
+    if (datap) {
+        *datap = c.data;
+        *sizep = c.size;
+    }
+    else {
+        free(c.data);
+    }
+    return 0;
+}
+
+static void complete(PEER_MSG *msg, char *data){
+    pthread_mutex_lock(&peer.call_lock);
+    PEER_CALL *c = peer.calls;
+    while (c && c->seq != msg->seq) {
+        c = c->next;
+    }
+    if (c) {
+        if (msg->size) {
+            c->data = malloc(msg->size + 1);
+            memcpy(c->data, data, msg->size);
+            c->data[msg->size] = '\0';
+            c->size = msg->size;
+        }
+        c->ret = msg->ret;
+        c->tag = msg->tag;
+        c->done = 1;
+        pthread_cond_broadcast(&peer.call_cond);
+    }
+    pthread_mutex_unlock(&peer.call_lock);
+}
+
+static uint64_t link_key(int keeper, uint64_t tag){
+    return (uint64_t)keeper << 56 | tag;
+}
+
+static PEER_LINK **link_find(uint64_t key){
+    PEER_LINK **lp = &peer.links[key % PEER_LINK_BUCKETS];
+    while (*lp && (*lp)->key != key) {
+        lp = &(*lp)->next;
+    }
+    return lp;
+}
+
+static void link_put(uint64_t key, INVITATION *inv){
+    PEER_LINK *link = malloc(sizeof(PEER_LINK));
+    link->key = key;
+    link->inv = inv_ref(inv, "shared with a peer");
+    pthread_mutex_lock(&peer.link_lock);
+    PEER_LINK **lp = &peer.links[key % PEER_LINK_BUCKETS];
+    link->next = *lp;
+    *lp = link;
+    pthread_mutex_unlock(&peer.link_lock);
+}
+
+static INVITATION *link_get(uint64_t key){
+    pthread_mutex_lock(&peer.link_lock);
+    PEER_LINK *link = *link_find(key);
+    INVITATION *inv = link ? inv_ref(link->inv, "found by tag") : NULL;
+    pthread_mutex_unlock(&peer.link_lock);
+    return inv;
+}
+
+static void link_remove(uint64_t key){
+    pthread_mutex_lock(&peer.link_lock);
+    PEER_LINK **lp = link_find(key);
+    PEER_LINK *link = *lp;
+    if (link) {
+        *lp = link->next;
+    }
+    pthread_mutex_unlock(&peer.link_lock);
+    if (link) {
+        inv_unref(link->inv, "no longer shared");
+        free(link);
+    }
+}
+
+/*
+ * Get the stand-in for a player of a peer, creating it the first time,
+ * and note the peer that the player is on.  It is kept until peer_fini().
+ */
+static CLIENT *stand_in(const char *name, size_t len, int on){
+    int name_id = intern(name, strnlen(name, len));
+    if (name_id < 0) {
+        return NULL;
+    }
+    pthread_mutex_lock(&peer.stand_in_lock);
+    if (name_id >= peer.nstand_ins) {
+        int n = peer.nstand_ins ? peer.nstand_ins : 64;
+        while (n <= name_id) {
+            n *= 2;
+        }
+        STAND_IN *stand_ins = realloc(peer.stand_ins, n * sizeof(STAND_IN));
+        if (!stand_ins) {
+            pthread_mutex_unlock(&peer.stand_in_lock);
+            return NULL;
+        }
+        memset(stand_ins + peer.nstand_ins, 0, (n - peer.nstand_ins) * sizeof(STAND_IN));
+        peer.stand_ins = stand_ins;
+        peer.nstand_ins = n;
+    }
+    STAND_IN *s = &peer.stand_ins[name_id];
+    if (!s->client) {
+        PLAYER *player = preg_register_interned(player_registry, name_id);
+        s->client = player ? client_create_remote(&stand_in_ops, player) : NULL;
+        if (!s->client) {
+            if (player) {
+                player_unref(player, "stand-in not created");
+            }
+            pthread_mutex_unlock(&peer.stand_in_lock);
+            return NULL;
+        }
+        //the table keeps the reference it was created with
+    }
+    s->peer = on;
+    CLIENT *client = client_ref(s->client, "stand-in found");
+    pthread_mutex_unlock(&peer.stand_in_lock);
+    return client;
+}
+
+/*
+ * The peer that the player a stand-in is for was last found on.
+ */
+static int peer_of(CLIENT *client){
+    int name_id = player_get_name_id(client_get_player(client));
+    pthread_mutex_lock(&peer.stand_in_lock);
+    int on = peer.stand_ins[name_id].peer;
+    pthread_mutex_unlock(&peer.stand_in_lock);
+    return on;
+}
+
+/*
+ * Pass on a notification to the target of an invitation kept here, on
+ * the target's peer.
+ */
+static void remote_notify(CLIENT *client, INVITATION *inv, JEUX_PACKET_HEADER *hdr, void *data){
+    PEER_MSG msg = {0};
+    msg.op = PEER_NOTICE;
+    msg.type = hdr->type;
+    msg.role = hdr->role;
+    size_t size = data ? ntohs(hdr->size) : 0;
+    char *payload = data;
+    if (hdr->type == JEUX_INVITED_PKT) {
+        //the first the target hears of the invitation, which is tagged so
+        //that both processes can refer to it
+        char *target = player_get_name(client_get_player(client));
+        size_t target_len = strlen(target);
+        payload = malloc(size + 1 + target_len);
+        memcpy(payload, data, size);
+        payload[size] = '\0';
+        memcpy(payload + size + 1, target, target_len);
+        size += 1 + target_len;
+        pthread_mutex_lock(&peer.link_lock);
+        uint64_t tag = ++peer.next_tag;
+        pthread_mutex_unlock(&peer.link_lock);
+        inv_set_tag(inv, tag);
+        link_put(link_key(peer.self, tag), inv);
+    }
+    else if (hdr->type == JEUX_MOVED_PKT) {
+        game_pack_state(inv_get_game(inv), msg.state);
+    }
+    msg.tag = inv_get_tag(inv);
+    peer_send(peer_of(client), &msg, payload, size);
+    if (payload != data) {
+        free(payload);
+    }
+    if (hdr->type == JEUX_REVOKED_PKT || hdr->type == JEUX_RESIGNED_PKT || hdr->type == JEUX_ENDED_PKT) {
+        link_remove(link_key(peer.self, msg.tag));
+    }
+}
+
+/*
+ * Pass on the state of a game kept here after a move by its player of a
+ * peer, to that peer.
+ */
+static void remote_moved(CLIENT *client, INVITATION *inv){
+    PEER_MSG msg = {0};
+    msg.op = PEER_SYNC;
+    msg.tag = inv_get_tag(inv);
+    game_pack_state(inv_get_game(inv), msg.state);
+    peer_send(peer_of(client), &msg, NULL, 0);
+}
+
+/*
+ * Have the peer that keeps an invitation, that of its source, carry out
+ * a request of its target, which is served here.
+ */
+static int remote_request(CLIENT *client, INVITATION *inv, int type, char *move, char **strp){
+    int keeper = peer_of(client);
+    PEER_MSG msg = {0};
+    msg.op = PEER_REQUEST;
+    msg.type = type;
+    msg.tag = inv_get_tag(inv);
+    char *str = NULL;
+    size_t size = 0;
+    int closing = type == JEUX_DECLINE_PKT || type == JEUX_RESIGN_PKT;
+    if (peer_call(keeper, &msg, move, move ? strlen(move) : 0, &str, &size)) {
+        //the invitation has gone with the peer, so it may as well be closed
+        if (closing) {
+            link_remove(link_key(keeper, msg.tag));
+        }
+        return closing ? 0 : -1;
+    }
+    if (msg.ret == 0 && closing) {
+        link_remove(link_key(keeper, msg.tag));
+    }
+    if (msg.ret == 0 && strp) {
+        *strp = str;
+    }
+    else {
+        free(str);
+    }
+    return msg.ret;
+}
+
+static void handle_presence(PEER_MSG *msg, char *data){
+    int name_id = intern_find(data, strnlen(data, msg->size));
+    CLIENT *client = name_id < 0 ? NULL : creg_lookup_interned(client_registry, name_id);
+    int caps = -1;
+    if (client) {
+        caps = client_get_caps(client);
+        client_unref(client, "presence checked");
+    }
+    reply(msg, caps, NULL, 0);
+}
+
+static void handle_users(PEER_MSG *msg){
+    PLAYER **players = preg_online_players(player_registry);
+    size_t limit = msg->ret;
+    size_t len = 0;
+    char *buf = malloc(limit ? limit : 1);
+    for (int i = 0; players[i]; i++) {
+        FRAME *fragment = player_get_fragment(players[i]);
+        player_unref(players[i], "player list sent to peer");
+        if (!fragment) {
+            continue;
+        }
+        if (len + frame_size(fragment) <= limit) {
+            memcpy(buf + len, frame_data(fragment), frame_size(fragment));
+            len += frame_size(fragment);
+        }
+        frame_unref(fragment, "player list sent to peer");
+    }
+    free(players);
+    reply(msg, 0, buf, len);
+    free(buf);
+}
+
+/*
+ * Make a copy of an invitation to a player logged in here.  If the
+ * player has logged out since it was looked up, the invitation is
+ * declined on its behalf.
+ */
+static void handle_invited(PEER_MSG *msg, char *data){
+    size_t source_len = strnlen(data, msg->size);
+    char *target_name = data + source_len + 1;
+    size_t target_len = source_len < msg->size ? msg->size - source_len - 1 : 0;
+    int target_id = intern_find(target_name, target_len);
+    CLIENT *target = target_id < 0 ? NULL : creg_lookup_interned(client_registry, target_id);
+    CLIENT *source = target ? stand_in(data, source_len, msg->from) : NULL;
+    GAME_ROLE source_role = msg->role == FIRST_PLAYER_ROLE ? SECOND_PLAYER_ROLE : FIRST_PLAYER_ROLE;
+    INVITATION *inv = source ? inv_create(source, target, source_role, msg->role) : NULL;
+    if (inv) {
+        inv_set_tag(inv, msg->tag);
+        link_put(link_key(msg->from, msg->tag), inv);
+        client_remote_invited(inv);
+        inv_unref(inv, "invitation copied");
+    }
+    else {
+        PEER_MSG decline = {0};
+        decline.op = PEER_REQUEST;
+        decline.type = JEUX_DECLINE_PKT;
+        decline.tag = msg->tag;
+        peer_send(msg->from, &decline, NULL, 0);
+    }
+    if (source) {
+        client_unref(source, "invitation copied");
+    }
+    if (target) {
+        client_unref(target, "invitation copied");
+    }
+}
+
+static void handle_notice(PEER_MSG *msg, char *data){
+    if (msg->op == PEER_NOTICE && msg->type == JEUX_INVITED_PKT) {
+        handle_invited(msg, data);
+        return;
+    }
+    uint64_t key = link_key(msg->from, msg->tag);
+    INVITATION *inv = link_get(key);
+    if (!inv) {
+        //the copy has already been closed here
+        return;
+    }
+    JEUX_PACKET_HEADER hdr = {0};
+    hdr.type = msg->op == PEER_SYNC ? JEUX_NO_PKT : msg->type;
+    hdr.role = msg->role;
+    hdr.size = htons(msg->size);
+    if (client_remote_notice(inv, &hdr, msg->size ? data : NULL, msg->state)) {
+        link_remove(key);
+    }
+    inv_unref(inv, "notice applied");
+}
+
+static void handle_request(PEER_MSG *msg, char *data){
+    uint64_t key = link_key(peer.self, msg->tag);
+    INVITATION *inv = link_get(key);
+    char move[16] = {0};
+    if (msg->size < sizeof(move)) {
+        memcpy(move, data, msg->size);
+    }
+    char *str = NULL;
+    int ret = inv ? client_remote_request(inv, msg->type, move, &str) : -1;
+    size_t size = 0;
+    if (str) {
+        size = client_get_caps(inv_get_target(inv)) & JEUX_CAP_PACKED_STATE ?
+               JEUX_PACKED_STATE_SIZE : strlen(str);
+    }
+    if (ret == 0 && (msg->type == JEUX_DECLINE_PKT || msg->type == JEUX_RESIGN_PKT)) {
+        link_remove(key);
+    }
+    reply(msg, ret, str, size);
+    free(str);
+    if (inv) {
+        inv_unref(inv, "request carried out");
+    }
+}
+
+static void handle(PEER_MSG *msg, char *data){
+    switch (msg->op) {
+        case PEER_REPLY:
+            complete(msg, data);
+            break;
+        case PEER_PRESENCE:
+            handle_presence(msg, data);
+            break;
+        case PEER_USERS:
+            handle_users(msg);
+            break;
+        case PEER_NOTICE:
+        case PEER_SYNC:
+            handle_notice(msg, data);
+            break;
+        case PEER_REQUEST:
+            handle_request(msg, data);
+            break;
+        default:
+            break;
+    }
+}
+
+/*
+ * Handle the messages received from peers, in the order they came.
+ */
+static void *handler_thread(void *arg){
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+    pthread_mutex_lock(&peer.work_lock);
+    while (1) {
+        while (!peer.work_head && !peer.stopping) {
+            pthread_cond_wait(&peer.work_cond, &peer.work_lock);
+        }
+        if (peer.stopping) {
+            break;
+        }
+        PEER_WORK *work = peer.work_head;
+        peer.work_head = NULL;
+        peer.work_tail = NULL;
+        pthread_mutex_unlock(&peer.work_lock);
+        while (work) {
+            PEER_WORK *next = work->next;
+            handle(&work->msg, work->data);
+            free(work);
+            work = next;
+        }
+        pthread_mutex_lock(&peer.work_lock);
+    }
+    pthread_mutex_unlock(&peer.work_lock);
+    return NULL;
+}
+
+/*
+ * The message is copied and left to the handler thread, so that a
+ * transport's receiving thread never waits on a send of its own.
+ */
+void peer_receive(PEER_MSG *msg, char *data){
+    PEER_WORK *work = malloc(sizeof(PEER_WORK) + msg->size + 1);
+    if (!work) {
+        debug("no memory for a message from peer %d, dropped", msg->from);
+        return;
+    }
+    work->next = NULL;
+    work->msg = *msg;
+    memcpy(work->data, data, msg->size);
+    work->data[msg->size] = '\0';
+    pthread_mutex_lock(&peer.work_lock);
+    if (peer.work_tail) {
+        peer.work_tail->next = work;
+    }
+    else {
+        peer.work_head = work;
+        pthread_cond_signal(&peer.work_cond);
+    }
+    peer.work_tail = work;
+    pthread_mutex_unlock(&peer.work_lock);
+}
+
+static void logged_out(PLAYER *player){
+    //the player may still be logged in here on another connection
+    CLIENT *client = creg_lookup_interned(client_registry, player_get_name_id(player));
+    if (client) {
+        client_unref(client, "still logged in");
+        return;
+    }
+    char *name = player_get_name(player);
+    peer.transport->logout(name, strlen(name));
+}
+
+int peer_init(const PEER_TRANSPORT *transport, int self){
+    if (self < 0 || self >= PEER_MAX) {
+        return -1;
+    }
+    peer.transport = transport;
+    peer.self = self;
+    peer.stopping = 0;
+    if (pthread_create(&peer.handler, NULL, handler_thread, NULL)) {
+        peer.transport = NULL;
+        return -1;
+    }
+    if (transport->logout) {
+        client_set_logout_hook(logged_out);
+    }
+    return 0;
+}
+
+void peer_fini(void){
+    if (!peer.transport) {
+        return;
+    }
+    client_set_logout_hook(NULL);
+    pthread_mutex_lock(&peer.work_lock);
+    peer.stopping = 1;
+    pthread_cond_signal(&peer.work_cond);
+    pthread_mutex_unlock(&peer.work_lock);
+    pthread_join(peer.handler, NULL);
+    //whatever came too late to be handled
+    while (peer.work_head) {
+        PEER_WORK *work = peer.work_head;
+        peer.work_head = work->next;
+        free(work);
+    }
+    peer.work_tail = NULL;
+    for (int i = 0; i < PEER_LINK_BUCKETS; i++) {
+        while (peer.links[i]) {
+            PEER_LINK *link = peer.links[i];
+            peer.links[i] = link->next;
+            inv_unref(link->inv, "peers gone");
+            free(link);
+        }
+    }
+    for (int i = 0; i < peer.nstand_ins; i++) {
+        if (peer.stand_ins[i].client) {
+            client_unref(peer.stand_ins[i].client, "peers gone");
+        }
+    }
+    free(peer.stand_ins);
+    peer.stand_ins = NULL;
+    peer.nstand_ins = 0;
+    peer.transport = NULL;
+}
+
+int peer_login(const char *name, size_t len){
+    if (!peer.transport) {
+        return 0;
+    }
+    return peer.transport->login(name, strnlen(name, len));
+}
+
+CLIENT *peer_lookup(const char *name, size_t len){
+    if (!peer.transport) {
+        return NULL;
+    }
+    len = strnlen(name, len);
+    int on = peer.transport->locate(name, len);
+    if (on < 0) {
+        return NULL;
+    }
+    PEER_MSG msg = {0};
+    msg.op = PEER_PRESENCE;
+    if (peer_call(on, &msg, name, len, NULL, NULL) || msg.ret < 0) {
+        return NULL;
+    }
+    CLIENT *client = stand_in(name, len, on);
+    if (client) {
+        client_set_caps(client, msg.ret);
+    }
+    return client;
+}
+
+char *peer_users(size_t limit, size_t *lenp){
+    char *lines = NULL;
+    size_t len = 0;
+    int peers[PEER_MAX];
+    int n = peer.transport ? peer.transport->peers(peers, PEER_MAX) : 0;
+    for (int i = 0; i < n && len < limit; i++) {
+        PEER_MSG msg = {0};
+        msg.op = PEER_USERS;
+        msg.ret = limit - len;
+        char *data;
+        size_t size;
+        if (peer_call(peers[i], &msg, NULL, 0, &data, &size) || !data) {
+            continue;
+        }
+        char *grown = realloc(lines, len + size);
+        if (grown) {
+            lines = grown;
+            memcpy(lines + len, data, size);
+            len += size;
+        }
+        free(data);
+    }
+    *lenp = len;
+    return lines;
+}
@@ -1,8 +1,13 @@
 #include "protocol.h"
 #include "jeux_globals.h"
 #include "player.h"
-#include "math.h"
+#include "player_ext.h"
+#include "rating.h"
+#include "intern.h"
+#include "frame.h"
 #include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
 #include "pthread.h"
 #include "debug.h"
 
@@ -25,14 +30,71 @@
  * You will have to give a complete structure definition in player.c.
  * The precise contents are up to you.  Be sure that all the operations
  * that might be called concurrently are thread-safe.
+ *
+ * The PLAYER structure itself only holds the cold, immutable parts of a
+ * player.  The fields that change, or that are read by scans over every
+ * player, live in the player table: one array per field, indexed by
+ * player id, so that a scan over players reads each field sequentially.
+ * The table is allocated in chunks that never move once allocated, so
+ * it can grow while other threads read it without locking.
  */
 typedef struct player{
-    char *username;
-    int ref_count;
-    double rating;
-    pthread_mutex_t player_lock;
+    int id;                         /* Dense, in order of creation */
+    int name_id;                    /* Interned username */
+    char *username;                 /* Interned bytes, not owned */
+    FRAME *fragment;                /* USERS line, under fragment_lock */
+    pthread_mutex_t fragment_lock;
 }PLAYER;
 
+#define PTAB_CHUNK_BITS 12
+#define PTAB_CHUNK_SIZE (1 << PTAB_CHUNK_BITS)
+#define PTAB_MAX_CHUNKS 4096
+
+typedef struct player_chunk{
+    atomic_int ref_count[PTAB_CHUNK_SIZE];
+    _Atomic double rating[PTAB_CHUNK_SIZE];         /* Written only by the rating service */
+    atomic_int online[PTAB_CHUNK_SIZE];             /* Number of clients logged in */
+}PLAYER_CHUNK;
+
+static struct {
+    atomic_int next_id;
+    _Atomic(PLAYER_CHUNK *) chunks[PTAB_MAX_CHUNKS];
+    pthread_mutex_t grow_lock;
+} ptab = {
+    .grow_lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+static PLAYER_CHUNK *chunk_of(int id){
+    return atomic_load_explicit(&ptab.chunks[id >> PTAB_CHUNK_BITS], memory_order_acquire);
+}
+
+#define PTAB(field, id) (chunk_of(id)->field[(id) & (PTAB_CHUNK_SIZE - 1)])
+
+/*
+ * Render the line that represents a player in a USERS response, and
+ * replace the previous one.  Readers that hold a reference to the
+ * previous line keep it until they are done.
+ */
+static void render_fragment(PLAYER *player, int rating){
+    size_t size = strlen(player->username) + 16;
+    char *data = malloc(size);
+    FRAME *fragment = NULL;
+    if(data){
+        size = snprintf(data, size, "%s\t%d\n", player->username, rating);
+        fragment = frame_create(data, size);
+        if(!fragment){
+            free(data);
+        }
+    }
+    pthread_mutex_lock(&player->fragment_lock);
+    FRAME *old = player->fragment;
+    player->fragment = fragment;
+    pthread_mutex_unlock(&player->fragment_lock);
+    if(old){
+        frame_unref(old, "fragment superseded");
+    }
+}
+
 /*
  * Create a new PLAYER with a specified username.  A private copy is
  * made of the username that is passed.  The newly created PLAYER has
@@ -44,11 +106,34 @@ typedef struct player{
  * was successful, otherwise NULL.
  */
 PLAYER *player_create(char *name){
+    //the bytes are interned, so the string handed over is not kept
+    int name_id = intern(name, strlen(name));
+    free(name);
+    return name_id < 0 ? NULL : player_create_interned(name_id);
+}
+
+PLAYER *player_create_interned(int name_id){
+    int id = atomic_fetch_add_explicit(&ptab.next_id, 1, memory_order_relaxed);
+    if(id >= PTAB_MAX_CHUNKS * PTAB_CHUNK_SIZE){
+        return NULL;
+    }
+    if(!chunk_of(id)){
+        pthread_mutex_lock(&ptab.grow_lock);
+        if(!chunk_of(id)){
+            atomic_store_explicit(&ptab.chunks[id >> PTAB_CHUNK_BITS],
+                                  calloc(1, sizeof(PLAYER_CHUNK)), memory_order_release);
+        }
+        pthread_mutex_unlock(&ptab.grow_lock);
+    }
     PLAYER *player = calloc(1, sizeof(PLAYER));
-    player->username = name;
-    player->ref_count = 1;
-    player->rating = PLAYER_INITIAL_RATING;
-    pthread_mutex_init(&player->player_lock, NULL);
+    player->id = id;
+    player->name_id = name_id;
+    player->username = (char *)intern_name(name_id);
+    pthread_mutex_init(&player->fragment_lock, NULL);
+    atomic_store_explicit(&PTAB(ref_count, id), 1, memory_order_relaxed);
+    atomic_store_explicit(&PTAB(rating, id), PLAYER_INITIAL_RATING, memory_order_relaxed);
+    atomic_store_explicit(&PTAB(online, id), 0, memory_order_relaxed);
+    render_fragment(player, PLAYER_INITIAL_RATING);
     return player;
 }
 
@@ -62,16 +147,15 @@ PLAYER *player_create(char *name){
  * @return  The same PLAYER object that was passed as a parameter.
  */
 PLAYER *player_ref(PLAYER *player, char *why){
-    pthread_mutex_lock(&player->player_lock);
-    player->ref_count++;
-    pthread_mutex_unlock(&player->player_lock);
+    atomic_fetch_add_explicit(&PTAB(ref_count, player->id), 1, memory_order_relaxed);
     return player;
 }
 
 /*
  * Decrease the reference count on a PLAYER by one.
  * If after decrementing, the reference count has reached zero, then the
- * PLAYER and its contents are freed.
+ * PLAYER and its contents are freed.  Its slot in the player table is
+ * not reused.
  *
  * @param player  The PLAYER whose reference count is to be decreased.
  * @param why  A string describing the reason why the reference count is
@@ -80,21 +164,14 @@ PLAYER *player_ref(PLAYER *player, char *why){
  *
  */
 void player_unref(PLAYER *player, char *why){
-    pthread_mutex_lock(&player->player_lock);
-
-    // debug("player ref count went from %d to %d because %s", player->ref_count, player->ref_count -1, why);
-    player->ref_count--;
-    if(player->ref_count == 0) {
-        //free other like refcount?
-        pthread_mutex_destroy(&player->player_lock);
-        free(player->username);
-
+    if(atomic_fetch_sub_explicit(&PTAB(ref_count, player->id), 1, memory_order_acq_rel) == 1) {
         debug("about to free player");
-        free(player);      
-        return;
+        if(player->fragment){
+            frame_unref(player->fragment, "player freed");
+        }
+        pthread_mutex_destroy(&player->fragment_lock);
+        free(player);
     }
-    pthread_mutex_unlock(&player->player_lock);
-    return;
 }
 
 /*
@@ -114,8 +191,54 @@ char *player_get_name(PLAYER *player){
  * @return the rating of the player.
  */
 int player_get_rating(PLAYER *player){
-    return player->rating;
+    return atomic_load_explicit(&PTAB(rating, player->id), memory_order_relaxed);
 }
+
+int player_get_id(PLAYER *player){
+    return player->id;
+}
+
+int player_get_name_id(PLAYER *player){
+    return player->name_id;
+}
+
+double player_get_rating_exact(PLAYER *player){
+    return atomic_load_explicit(&PTAB(rating, player->id), memory_order_relaxed);
+}
+
+void player_set_rating(PLAYER *player, double rating){
+    double old = atomic_exchange_explicit(&PTAB(rating, player->id), rating, memory_order_relaxed);
+    //USERS shows whole points, so most updates leave the line as it is
+    if((int)old != (int)rating){
+        render_fragment(player, rating);
+    }
+}
+
+FRAME *player_get_fragment(PLAYER *player){
+    pthread_mutex_lock(&player->fragment_lock);
+    FRAME *fragment = player->fragment ? frame_ref(player->fragment, "fragment taken") : NULL;
+    pthread_mutex_unlock(&player->fragment_lock);
+    return fragment;
+}
+
+void player_set_online(PLAYER *player, int online){
+    atomic_fetch_add_explicit(&PTAB(online, player->id), online ? 1 : -1, memory_order_relaxed);
+}
+
+int player_is_online(PLAYER *player){
+    return atomic_load_explicit(&PTAB(online, player->id), memory_order_relaxed) > 0;
+}
+
+int player_scan_online(const int *ids, int n, int *hits){
+    int nhits = 0;
+    for(int i = 0; i < n; i++){
+        if(atomic_load_explicit(&PTAB(online, ids[i]), memory_order_relaxed) > 0){
+            hits[nhits++] = i;
+        }
+    }
+    return nhits;
+}
+
 /*
  * Post the result of a game between two players.
  * To update ratings, we use a system of a type devised by Arpad Elo,
@@ -130,45 +253,14 @@ int player_get_rating(PLAYER *player){
  * Update the players ratings to R1' and R2' using the formula:
  *     R1' = R1 + 32*(S1-E1)
  *     R2' = R2 + 32*(S2-E2)
+ * The update is queued and applied asynchronously (see rating.h), so a
+ * player's rating reflects the result shortly after this returns.
  *
  * @param player1  One of the PLAYERs that is to be updated.
  * @param player2  The other PLAYER that is to be updated.
  * @param result   0 if draw, 1 if player1 won, 2 if player2 won.
  */
 void player_post_result(PLAYER *player1, PLAYER *player2, int result){
-    double p1_score = 0;
-    double p2_score = 0;
-    switch(result){
-        case 1:
-            p1_score = 1;
-            break;
-        case 2:
-            p2_score = 1;
-            break;
-        default:
-            p2_score = 0.5;
-            p1_score = 0.5;
-            break;
-    }
-    if (player1 > player2) {
-        pthread_mutex_lock(&player2->player_lock);
-        pthread_mutex_lock(&player1->player_lock);
-    }
-    else {
-        pthread_mutex_lock(&player1->player_lock);
-        pthread_mutex_lock(&player2->player_lock);
-    }
-    double E1 = 1/(1 + pow(10, (player2->rating - player1->rating)/400) );
-    player1->rating = player1->rating + 32 * (p1_score - E1);
-    double E2 = 1/(1 + pow(10, (player1->rating - player2->rating)/400) );
-    player2->rating = player2->rating + 32 * (p2_score - E2);
-    if (player1 > player2) {
-        pthread_mutex_unlock(&player1->player_lock);
-        pthread_mutex_unlock(&player2->player_lock);
-    }
-    else {
-        pthread_mutex_unlock(&player2->player_lock);
-        pthread_mutex_unlock(&player1->player_lock);
-    }
-    return;
+    //applied by the rating service, off the thread that finished the game
+    rating_post(player1, player2, result);
 }
@@ -1,12 +1,22 @@
 #include "player.h"
 #include "jeux_globals.h"
 #include "player_registry.h"
+#include "player_registry_ext.h"
+#include "player_ext.h"
+#include "intern.h"
 #include "pthread.h"
 #include <string.h>
 #include <stdlib.h>
 /*
  * A player registry maintains a mapping from usernames to PLAYER objects.
  * Entries persist for as long as the server is running.
+ *
+ * Usernames are interned (see intern.h), and the registry maps the id of
+ * each interned username directly to the index of its player, so finding
+ * a player is an array lookup.  Players are kept in an array in order of
+ * creation, so their registry indices follow their player ids, and a scan
+ * over the registry reads the player table (see player.c) sequentially as
+ * well.
  */
 
 /*
@@ -16,16 +26,14 @@
  * you.  Be sure that all the operations that might be called
  * concurrently are thread-safe.
  */
-typedef struct player_node{
-    PLAYER *player;
-    struct player_node *next;
-} PLAYER_NODE;
-
 typedef struct player_registry{
-    PLAYER_NODE *head;
-    PLAYER_NODE *tail;
-    size_t len;
-    pthread_mutex_t lock;
+    PLAYER **players;               /* By registry index */
+    int *ids;                       /* Player id, by registry index */
+    int len;
+    int cap;
+    int *by_name;                   /* Registry index + 1, by name id */
+    int nnames;
+    pthread_rwlock_t lock;
 }PLAYER_REGISTRY;
 
 /*
@@ -36,10 +44,7 @@ typedef struct player_registry{
  */
 PLAYER_REGISTRY *preg_init(void) {
     PLAYER_REGISTRY *preg = calloc(1, sizeof(PLAYER_REGISTRY));
-    preg->head = NULL;
-    preg->tail = NULL;
-    preg->len = 0;
-    pthread_mutex_init(&preg->lock, NULL);
+    pthread_rwlock_init(&preg->lock, NULL);
     return preg;
 }
 
@@ -50,17 +55,68 @@ PLAYER_REGISTRY *preg_init(void) {
  * be referenced again.
  */
 void preg_fini(PLAYER_REGISTRY *preg) {
-    PLAYER_NODE *curr = preg->head;
-    while(curr){
-        PLAYER_NODE *prev = curr;
-        player_unref(curr->player, "preg_fini");
-        curr = curr->next;
-        free(prev);
+    for(int i = 0; i < preg->len; i++){
+        player_unref(preg->players[i], "preg_fini");
     }
-    pthread_mutex_destroy(&preg->lock);
+    free(preg->players);
+    free(preg->ids);
+    free(preg->by_name);
+    pthread_rwlock_destroy(&preg->lock);
     free(preg);
 }
 
+/*
+ * Find a registered player.  Must be called with the lock held.
+ */
+static PLAYER *find(PLAYER_REGISTRY *preg, int name_id){
+    if(name_id >= preg->nnames || !preg->by_name[name_id]){
+        return NULL;
+    }
+    return preg->players[preg->by_name[name_id] - 1];
+}
+
+/*
+ * Add a new player.  Must be called with the write lock held.
+ */
+static PLAYER *add(PLAYER_REGISTRY *preg, int name_id){
+    if(name_id >= preg->nnames){
+        int nnames = preg->nnames ? preg->nnames : 64;
+        while(nnames <= name_id){
+            nnames *= 2;
+        }
+        int *by_name = realloc(preg->by_name, nnames * sizeof(int));
+        if(!by_name){
+            return NULL;
+        }
+        memset(&by_name[preg->nnames], 0, (nnames - preg->nnames) * sizeof(int));
+        preg->by_name = by_name;
+        preg->nnames = nnames;
+    }
+    if(preg->len == preg->cap){
+        int cap = preg->cap ? preg->cap * 2 : 64;
+        PLAYER **players = realloc(preg->players, cap * sizeof(PLAYER *));
+        if(players){
+            preg->players = players;
+        }
+        int *ids = realloc(preg->ids, cap * sizeof(int));
+        if(ids){
+            preg->ids = ids;
+        }
+        if(!players || !ids){
+            return NULL;
+        }
+        preg->cap = cap;
+    }
+    PLAYER *player = player_create_interned(name_id);
+    if(!player){
+        return NULL;
+    }
+    preg->ids[preg->len] = player_get_id(player);
+    preg->players[preg->len++] = player;
+    preg->by_name[name_id] = preg->len;
+    return player;
+}
+
 /*
  * Register a player with a specified user name.  If there is already
  * a player registered under that user name, then the existing registered
@@ -76,34 +132,54 @@ void preg_fini(PLAYER_REGISTRY *preg) {
  *
  */
 PLAYER *preg_register(PLAYER_REGISTRY *preg, char *name) {
-    pthread_mutex_lock(&preg->lock);
-    //find if player exists
-    PLAYER_NODE *curr = preg->head;
-    while(curr){
-        if(curr->player){
-            if (strcmp(player_get_name(curr->player), name) == 0){
-                player_ref(curr->player, "logging in as player");
-                pthread_mutex_unlock(&preg->lock);
-                free(name);
-                return curr->player;
-            }
-        }
-        curr = curr->next;
+    int name_id = intern(name, strlen(name));
+    free(name);
+    return name_id < 0 ? NULL : preg_register_interned(preg, name_id);
+}
+
+PLAYER *preg_register_interned(PLAYER_REGISTRY *preg, int name_id) {
+    pthread_rwlock_rdlock(&preg->lock);
+    PLAYER *player = find(preg, name_id);
+    if(player){
+        player_ref(player, "logging in as player");
+        pthread_rwlock_unlock(&preg->lock);
+        return player;
     }
-    //add player
-    PLAYER_NODE *new_player = (PLAYER_NODE*)malloc(sizeof(PLAYER_NODE));
-    new_player->player = player_create(name);
-    new_player->next = NULL;
-    if(preg->head == NULL){
-        preg->head = new_player;
-        preg->tail = new_player;
+    pthread_rwlock_unlock(&preg->lock);
+    pthread_rwlock_wrlock(&preg->lock);
+    //someone else may have registered the name in the meantime
+    player = find(preg, name_id);
+    if(!player){
+        player = add(preg, name_id);
     }
-    else{
-        preg->tail->next = new_player;
-        preg->tail = new_player;
+    if(player){
+        player_ref(player, "logging in as player");
     }
-    preg->len++;
-    player_ref(new_player->player, "logging in as player");
-    pthread_mutex_unlock(&preg->lock);
-    return new_player->player;
-}
\ No newline at end of file
+    pthread_rwlock_unlock(&preg->lock);
+    return player;
+}
+
+PLAYER **preg_online_players(PLAYER_REGISTRY *preg) {
+    pthread_rwlock_rdlock(&preg->lock);
+    //the ids are in increasing order, so the online column is read in order,
+    //and only the players found online are touched
+    int *hits = malloc((preg->len + 1) * sizeof(int));
+    int n = hits ? player_scan_online(preg->ids, preg->len, hits) : 0;
+    PLAYER **list = calloc(n + 1, sizeof(PLAYER *));
+    for(int i = 0; list && i < n; i++){
+        list[i] = player_ref(preg->players[hits[i]], "added to list of players");
+    }
+    pthread_rwlock_unlock(&preg->lock);
+    free(hits);
+    return list;
+}
+
+PLAYER **preg_all_players(PLAYER_REGISTRY *preg) {
+    pthread_rwlock_rdlock(&preg->lock);
+    PLAYER **list = calloc(preg->len + 1, sizeof(PLAYER *));
+    for(int i = 0; i < preg->len; i++){
+        list[i] = player_ref(preg->players[i], "added to list of players");
+    }
+    pthread_rwlock_unlock(&preg->lock);
+    return list;
+}
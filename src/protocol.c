@@ -1,19 +1,57 @@
 #include "protocol.h"
+#include "protocol_ext.h"
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <errno.h>
 #include "jeux_globals.h"
 #include "csapp.h"
 
-int proto_send_packet(int fd, JEUX_PACKET_HEADER *hdr, void *data) {
-    size_t header_size = sizeof(JEUX_PACKET_HEADER);
-    void *header = (void *)hdr;
-    rio_writen(fd, header, header_size);
-    if (data) {
-        rio_writen(fd, data, ntohs(hdr->size));
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/* Initial size of the buffer of a PROTO_READER. */
+#define PROTO_READER_SIZE 8192
+
+struct proto_reader {
+    int fd;                         /* -1 if the reader is only fed */
+    size_t start;                   /* Unconsumed bytes are buf[start..end) */
+    size_t end;
+    size_t cap;
+    char *buf;
+};
+
+int proto_writev(int fd, struct iovec *iov, int iovcnt){
+    while (iovcnt > 0) {
+        ssize_t n = writev(fd, iov, iovcnt < IOV_MAX ? iovcnt : IOV_MAX);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
     }
     return 0;
 }
 
+int proto_send_packet(int fd, JEUX_PACKET_HEADER *hdr, void *data) {
+    //header and payload go out in one write, so never in separate segments
+    struct iovec iov[2] = {
+        { .iov_base = hdr, .iov_len = sizeof(JEUX_PACKET_HEADER) },
+        { .iov_base = data, .iov_len = data ? ntohs(hdr->size) : 0 }
+    };
+    return proto_writev(fd, iov, data ? 2 : 1);
+}
+
 int proto_recv_packet(int fd, JEUX_PACKET_HEADER *hdr, void **payloadp){
     size_t header_size = sizeof(JEUX_PACKET_HEADER);
     ssize_t n = header_size;
@@ -42,4 +80,151 @@ int proto_recv_packet(int fd, JEUX_PACKET_HEADER *hdr, void **payloadp){
         *payloadp = payload;
     }
     return 0; 
-}
\ No newline at end of file
+}
+
+PROTO_READER *proto_reader_create(int fd){
+    PROTO_READER *reader = malloc(sizeof(PROTO_READER));
+    if (reader) {
+        reader->fd = fd;
+        reader->start = reader->end = 0;
+        reader->cap = PROTO_READER_SIZE;
+        reader->buf = malloc(PROTO_READER_SIZE);
+        if (!reader->buf) {
+            free(reader);
+            return NULL;
+        }
+    }
+    return reader;
+}
+
+void proto_reader_free(PROTO_READER *reader){
+    free(reader->buf);
+    free(reader);
+}
+
+/*
+ * Move the unconsumed bytes to the start of the buffer.
+ */
+static void reader_compact(PROTO_READER *reader){
+    if (reader->start) {
+        memmove(reader->buf, reader->buf + reader->start, reader->end - reader->start);
+        reader->end -= reader->start;
+        reader->start = 0;
+    }
+}
+
+int proto_reader_feed(PROTO_READER *reader, void *data, size_t len){
+    reader_compact(reader);
+    if (reader->end + len > reader->cap) {
+        size_t cap = reader->cap;
+        while (cap < reader->end + len) {
+            cap *= 2;
+        }
+        char *buf = realloc(reader->buf, cap);
+        if (!buf) {
+            return -1;
+        }
+        reader->buf = buf;
+        reader->cap = cap;
+    }
+    memcpy(reader->buf + reader->end, data, len);
+    reader->end += len;
+    return 0;
+}
+
+int proto_reader_pull(PROTO_READER *reader){
+    reader_compact(reader);
+    if (reader->end == reader->cap) {
+        char *buf = realloc(reader->buf, 2 * reader->cap);
+        if (!buf) {
+            return -1;
+        }
+        reader->buf = buf;
+        reader->cap *= 2;
+    }
+    ssize_t n;
+    do {
+        n = recv(reader->fd, reader->buf + reader->end, reader->cap - reader->end, MSG_DONTWAIT);
+    } while (n < 0 && errno == EINTR);
+    if (n > 0) {
+        reader->end += n;
+    }
+    return n;
+}
+
+int proto_reader_ready(PROTO_READER *reader){
+    size_t have = reader->end - reader->start;
+    if (have < sizeof(JEUX_PACKET_HEADER)) {
+        return 0;
+    }
+    JEUX_PACKET_HEADER hdr;
+    memcpy(&hdr, reader->buf + reader->start, sizeof(JEUX_PACKET_HEADER));
+    return have >= sizeof(JEUX_PACKET_HEADER) + ntohs(hdr.size);
+}
+
+char *proto_reader_unread(PROTO_READER *reader, size_t *lenp){
+    *lenp = reader->end - reader->start;
+    return reader->buf + reader->start;
+}
+
+/*
+ * Read until at least want bytes are buffered.  Returns 1 if they are,
+ * 0 at end-of-file, or -1 on error.
+ */
+static int reader_fill(PROTO_READER *reader, size_t want){
+    if (reader->end - reader->start >= want) {
+        return 1;
+    }
+    reader_compact(reader);
+    while (reader->end < want) {
+        if (reader->fd < 0) {
+            return 0;
+        }
+        ssize_t n = read(reader->fd, reader->buf + reader->end, reader->cap - reader->end);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            return 0;
+        }
+        reader->end += n;
+    }
+    return 1;
+}
+
+int proto_reader_recv(PROTO_READER *reader, JEUX_PACKET_HEADER *hdr, void **payloadp){
+    int ret = reader_fill(reader, sizeof(JEUX_PACKET_HEADER));
+    if (ret <= 0) {
+        hdr->type = JEUX_NO_PKT;
+        return ret;
+    }
+    memcpy(hdr, reader->buf + reader->start, sizeof(JEUX_PACKET_HEADER));
+    reader->start += sizeof(JEUX_PACKET_HEADER);
+    size_t size = ntohs(hdr->size);
+    if (!size) {
+        return 0;
+    }
+    char *payload = malloc(size);
+    if (!payload) {
+        hdr->type = JEUX_NO_PKT;
+        return -1;
+    }
+    //whatever is buffered, then the rest of a payload too big for the buffer
+    size_t have = reader->end - reader->start;
+    size_t take = have < size ? have : size;
+    memcpy(payload, reader->buf + reader->start, take);
+    reader->start += take;
+    if (take < size) {
+        ssize_t n = reader->fd < 0 ? 0 : rio_readn(reader->fd, payload + take, size - take);
+        if (n < 0 || (size_t)n < size - take) {
+            free(payload);
+            hdr->type = JEUX_NO_PKT;
+            return n < 0 ? -1 : 0;
+        }
+    }
+    *payloadp = payload;
+    return 0;
+}
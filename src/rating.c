@@ -0,0 +1,336 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <math.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+
+#include "player_ext.h"
+#include "rating.h"
+#include "glicko.h"
+#include "debug.h"
+
+/* Elo development coefficient. */
+#define ELO_K 32
+
+/*
+ * The expected score is tabulated at one-point steps of rating difference,
+ * and interpolated between steps.  Beyond ELO_SPAN points the expected
+ * score is within 1% of 0 or 1, and is clamped.
+ */
+#define ELO_SPAN 800
+
+/* Glicko-2 system constant, constraining changes in volatility. */
+#define GLICKO_TAU 0.5
+
+/*
+ * A posted game result, waiting to be applied by the rating thread.
+ */
+typedef struct rating_result {
+    PLAYER *player1;
+    PLAYER *player2;
+    int result;
+    struct rating_result *next;
+} RATING_RESULT;
+
+/*
+ * Posting pushes onto a lock-free stack; the rating thread takes the whole
+ * stack with a single exchange and reverses it, so that each batch is
+ * applied in posting order.  The rating thread is woken through an eventfd
+ * only when a result is pushed onto an empty stack.  apply_lock is held by
+ * whichever thread is applying results, so that ratings have one writer at
+ * a time even before the rating thread has been started.
+ *
+ * With Glicko-2, applying a result only records the game; the rating
+ * thread also wakes at the end of each rating period to close it and
+ * publish every rated player's new rating.  Rated players are kept,
+ * indexed by player id, so that their ratings can be published.
+ */
+static struct {
+    pthread_t thread;
+    int running;
+    atomic_int stopping;
+    int wake_fd;
+    _Atomic(RATING_RESULT *) pending;
+    atomic_long posted;
+    long applied;                   /* Under apply_lock */
+    long period_ms;
+    GLICKO *glicko;                 /* Under apply_lock, NULL for Elo */
+    PLAYER **rated;                 /* Under apply_lock, by player id */
+    int nrated;
+    pthread_mutex_t apply_lock;
+    pthread_cond_t applied_cond;
+} rating = {
+    .wake_fd = -1,
+    .apply_lock = PTHREAD_MUTEX_INITIALIZER,
+    .applied_cond = PTHREAD_COND_INITIALIZER
+};
+
+static double expected[2 * ELO_SPAN + 2];
+static pthread_once_t expected_once = PTHREAD_ONCE_INIT;
+
+static void expected_init(void){
+    for (int i = 0; i < 2 * ELO_SPAN + 2; i++) {
+        expected[i] = 1 / (1 + pow(10, (i - ELO_SPAN) / 400.0));
+    }
+}
+
+/*
+ * Expected score of a player rated diff points below the opponent, that
+ * is 1/(1 + 10**(diff/400)).
+ */
+static double expected_score(double diff){
+    if (diff <= -ELO_SPAN) {
+        return expected[0];
+    }
+    if (diff >= ELO_SPAN) {
+        return expected[2 * ELO_SPAN];
+    }
+    double x = diff + ELO_SPAN;
+    int i = (int)x;
+    double frac = x - i;
+    return expected[i] + frac * (expected[i + 1] - expected[i]);
+}
+
+static double score(int result){
+    return result == 1 ? 1 : result == 2 ? 0 : 0.5;
+}
+
+static void apply_elo(RATING_RESULT *r){
+    double s1 = score(r->result);
+    double r1 = player_get_rating_exact(r->player1);
+    double r2 = player_get_rating_exact(r->player2);
+    double e1 = expected_score(r2 - r1);
+    player_set_rating(r->player1, r1 + ELO_K * (s1 - e1));
+    player_set_rating(r->player2, r2 + ELO_K * ((1 - s1) - (1 - e1)));
+}
+
+/*
+ * Make sure a player has a Glicko-2 slot, and keep a reference to it so
+ * that its rating can be published when the period closes.  Returns the
+ * slot, or -1 if allocation failed.
+ */
+static int glicko_slot(PLAYER *player){
+    int id = player_get_id(player);
+    if (id >= rating.nrated) {
+        int n = rating.nrated ? rating.nrated : 64;
+        while (n <= id) {
+            n *= 2;
+        }
+        PLAYER **rated = realloc(rating.rated, n * sizeof(PLAYER *));
+        if (!rated || glicko_reserve(rating.glicko, n)) {
+            if (rated) {
+                rating.rated = rated;
+            }
+            return -1;
+        }
+        memset(&rated[rating.nrated], 0, (n - rating.nrated) * sizeof(PLAYER *));
+        rating.rated = rated;
+        rating.nrated = n;
+    }
+    if (!rating.rated[id]) {
+        rating.rated[id] = player_ref(player, "rated by glicko");
+    }
+    return id;
+}
+
+static void apply_glicko(RATING_RESULT *r){
+    int a = glicko_slot(r->player1);
+    int b = glicko_slot(r->player2);
+    if (a < 0 || b < 0) {
+        debug("no glicko slot, result dropped");
+        return;
+    }
+    glicko_record(rating.glicko, a, b, score(r->result));
+}
+
+/*
+ * Apply one result.  Must be called with apply_lock held.
+ */
+static void apply_result(RATING_RESULT *r){
+    if (rating.glicko) {
+        apply_glicko(r);
+    }
+    else {
+        apply_elo(r);
+    }
+    player_unref(r->player1, "rating applied");
+    player_unref(r->player2, "rating applied");
+}
+
+/*
+ * Close a Glicko-2 rating period and publish the new ratings.
+ */
+static void close_period(void){
+    pthread_mutex_lock(&rating.apply_lock);
+    glicko_close_period(rating.glicko);
+    for (int i = 0; i < rating.nrated; i++) {
+        if (rating.rated[i]) {
+            player_set_rating(rating.rated[i], glicko_rating(rating.glicko, i));
+        }
+    }
+    pthread_mutex_unlock(&rating.apply_lock);
+}
+
+static long monotonic_ms(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Take and apply everything that has been posted.  Returns the number of
+ * results applied.
+ */
+static long apply_pending(void){
+    RATING_RESULT *batch = atomic_exchange_explicit(&rating.pending, NULL, memory_order_acquire);
+    RATING_RESULT *fifo = NULL;
+    long n = 0;
+    while (batch) {
+        RATING_RESULT *next = batch->next;
+        batch->next = fifo;
+        fifo = batch;
+        batch = next;
+        n++;
+    }
+    if (!n) {
+        return 0;
+    }
+    pthread_mutex_lock(&rating.apply_lock);
+    while (fifo) {
+        RATING_RESULT *next = fifo->next;
+        apply_result(fifo);
+        free(fifo);
+        fifo = next;
+    }
+    rating.applied += n;
+    pthread_cond_broadcast(&rating.applied_cond);
+    pthread_mutex_unlock(&rating.apply_lock);
+    return n;
+}
+
+static void *rating_thread(void *arg){
+    uint64_t count;
+    struct pollfd pfd = { .fd = rating.wake_fd, .events = POLLIN };
+    long deadline = monotonic_ms() + rating.period_ms;
+    while (!atomic_load(&rating.stopping)) {
+        int timeout = -1;
+        if (rating.glicko) {
+            long left = deadline - monotonic_ms();
+            timeout = left > 0 ? left : 0;
+        }
+        if (poll(&pfd, 1, timeout) > 0 && read(rating.wake_fd, &count, sizeof(count)) > 0) {
+            long n = apply_pending();
+            if (n > 1) {
+                debug("applied a batch of %ld results", n);
+            }
+        }
+        if (rating.glicko && monotonic_ms() >= deadline) {
+            close_period();
+            deadline += rating.period_ms;
+        }
+    }
+    apply_pending();
+    return NULL;
+}
+
+int rating_init(RATING_ENGINE engine, long period_ms){
+    pthread_once(&expected_once, expected_init);
+    if (engine == RATING_GLICKO2) {
+        if (period_ms <= 0 || !(rating.glicko = glicko_create(GLICKO_TAU))) {
+            return -1;
+        }
+        rating.period_ms = period_ms;
+    }
+    atomic_store(&rating.stopping, 0);
+    rating.wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (rating.wake_fd >= 0 && !pthread_create(&rating.thread, NULL, rating_thread, NULL)) {
+        rating.running = 1;
+        return 0;
+    }
+    if (rating.wake_fd >= 0) {
+        close(rating.wake_fd);
+        rating.wake_fd = -1;
+    }
+    if (rating.glicko) {
+        glicko_fini(rating.glicko);
+        rating.glicko = NULL;
+    }
+    return -1;
+}
+
+void rating_fini(void){
+    if (!rating.running) {
+        return;
+    }
+    atomic_store(&rating.stopping, 1);
+    uint64_t one = 1;
+    if (write(rating.wake_fd, &one, sizeof(one)) < 0) {
+        debug("rating wakeup failed");
+    }
+    pthread_join(rating.thread, NULL);
+    rating.running = 0;
+    close(rating.wake_fd);
+    rating.wake_fd = -1;
+    //anything posted during shutdown
+    apply_pending();
+    if (!rating.glicko) {
+        return;
+    }
+    close_period();
+    //anything posted from now on is applied with Elo
+    pthread_mutex_lock(&rating.apply_lock);
+    GLICKO *glicko = rating.glicko;
+    PLAYER **rated = rating.rated;
+    int nrated = rating.nrated;
+    rating.glicko = NULL;
+    rating.rated = NULL;
+    rating.nrated = 0;
+    pthread_mutex_unlock(&rating.apply_lock);
+    for (int i = 0; i < nrated; i++) {
+        if (rated[i]) {
+            player_unref(rated[i], "glicko finished");
+        }
+    }
+    free(rated);
+    glicko_fini(glicko);
+}
+
+void rating_post(PLAYER *player1, PLAYER *player2, int result){
+    pthread_once(&expected_once, expected_init);
+    RATING_RESULT *r = malloc(sizeof(RATING_RESULT));
+    r->player1 = player_ref(player1, "rating posted");
+    r->player2 = player_ref(player2, "rating posted");
+    r->result = result;
+    atomic_fetch_add_explicit(&rating.posted, 1, memory_order_relaxed);
+    RATING_RESULT *head = atomic_load_explicit(&rating.pending, memory_order_relaxed);
+    do {
+        r->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&rating.pending, &head, r,
+                                                    memory_order_release, memory_order_relaxed));
+    if (!rating.running || atomic_load(&rating.stopping)) {
+        apply_pending();
+        return;
+    }
+    if (!head) {
+        uint64_t one = 1;
+        if (write(rating.wake_fd, &one, sizeof(one)) < 0) {
+            debug("rating wakeup failed");
+        }
+    }
+}
+
+void rating_flush(void){
+    long target = atomic_load_explicit(&rating.posted, memory_order_relaxed);
+    if (!rating.running) {
+        apply_pending();
+    }
+    pthread_mutex_lock(&rating.apply_lock);
+    while (rating.applied < target) {
+        pthread_cond_wait(&rating.applied_cond, &rating.apply_lock);
+    }
+    pthread_mutex_unlock(&rating.apply_lock);
+}
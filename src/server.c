@@ -4,18 +4,47 @@
 #include <stdio.h>
 #include "debug.h"
 #include "jeux_globals.h"
+#include "protocol_ext.h"
+#include "client_ext.h"
+#include "server_ext.h"
+#include "coro.h"
+#include "player_registry_ext.h"
+#include "client_registry_ext.h"
+#include "intern.h"
+#include "player_ext.h"
+#include "frame.h"
+#include "spectator.h"
+#include "session.h"
+#include "peer.h"
 #include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 
+/*
+ * Number of requests that a client coroutine serves in a row before
+ * letting other coroutines run.
+ */
+#define CORO_BURST 64
+
 void send_invite(CLIENT *client, char *name, int role, size_t len){
     GAME_ROLE src_role;
     GAME_ROLE target_role;
     PLAYER *player = client_get_player(client);
-    char *nameCopy = (char *)calloc(1, len + 1);
-    strncpy(nameCopy, name, len);
-    CLIENT *target = creg_lookup(client_registry, nameCopy);
-    free(nameCopy);
+    int name_id = intern_find(name, len);
+    CLIENT *target = name_id < 0 ? NULL : creg_lookup_interned(client_registry, name_id);
+    if(!target){
+        //the player may be logged in on a peer
+        target = peer_lookup(name, len);
+    }
     if(!target || !player || ((role != FIRST_PLAYER_ROLE) && (role != SECOND_PLAYER_ROLE))){
+        if(target){
+            client_unref(target, "invite target not usable");
+        }
         client_send_nack(client);
         return;
     }
@@ -30,138 +59,539 @@ void send_invite(CLIENT *client, char *name, int role, size_t len){
     if (client_make_invitation(client, target, src_role, target_role) == -1) {
         client_send_nack(client);
     }
+    client_unref(target, "invite target looked up");
     return;
 }
 
+/*
+ * The USERS response is sent straight from the lines that the players
+ * keep rendered, as one gather list.  Lines that would not fit in the
+ * payload of a packet are left out.
+ */
 void show_users(CLIENT *client){
-    size_t s;
-    char *buf;
-    PLAYER **player_list = creg_all_players(client_registry);
-    FILE *stream = open_memstream(&buf, &s);
-    int index = 0;
-    PLAYER *player = player_list[index];
-    while(player){
-        fprintf(stream, "%s\t%d\n", player_get_name(player), player_get_rating(player));
-        player_unref(player, "player list printed");
-        player_list[index] = NULL;
-        player = player_list[++index];
+    PLAYER **player_list = preg_online_players(player_registry);
+    int n = 0;
+    while(player_list[n]){
+        n++;
+    }
+    FRAME **fragments = calloc(n + 1, sizeof(FRAME *));
+    struct iovec *iov = calloc(n + 1, sizeof(struct iovec));
+    int count = 0;
+    size_t total = 0;
+    for(int i = 0; i < n; i++){
+        FRAME *fragment = player_get_fragment(player_list[i]);
+        player_unref(player_list[i], "player list printed");
+        if(!fragment){
+            continue;
+        }
+        if(total + frame_size(fragment) > UINT16_MAX){
+            frame_unref(fragment, "fragment does not fit");
+            continue;
+        }
+        total += frame_size(fragment);
+        iov[count].iov_base = frame_data(fragment);
+        iov[count].iov_len = frame_size(fragment);
+        fragments[count++] = fragment;
     }
     free(player_list);
-    fclose(stream);
-    client_send_ack(client, (void *) buf, s);
-    free(buf);
+    size_t len = 0;
+    char *others = peer_users(UINT16_MAX - total, &len);
+    if(others){
+        iov[count].iov_base = others;
+        iov[count].iov_len = len;
+    }
+    client_send_ack_iov(client, iov, count + (others != NULL));
+    free(others);
+    for(int i = 0; i < count; i++){
+        frame_unref(fragments[i], "player list sent");
+    }
+    free(fragments);
+    free(iov);
     return;
 }
 
-void login(CLIENT *client, char *name, size_t len) {
+/*
+ * Reattach a new connection to the parked CLIENT of a lost one.  Returns
+ * the CLIENT that the connection now belongs to.
+ */
+CLIENT *resume(CLIENT *client, char *name, char *token, size_t token_len, int caps) {
+    CLIENT *parked = session_resume(token, token_len, name);
+    if(!parked){
+        return client;
+    }
+    client_stop_watchdog(client);
+    int fd = client_detach(client);
+    JEUX_PACKET_HEADER hdr = {0};
+    hdr.type = JEUX_ACK_PKT;
+    hdr.size = htons(token_len);
+    client_set_caps(client, caps);
+    client_tag_reply(client, &hdr);
+    proto_send_packet(fd, &hdr, token);
+    //the new connection may speak differently from the lost one
+    client_set_caps(parked, caps);
+    client_unpark(parked, fd);
+    client_move_mailbox(parked, client);
+    client_start_watchdog(parked);
+    creg_unregister(client_registry, client);
+    return parked;
+}
+
+CLIENT *login(CLIENT *client, char *name, size_t len, int caps) {
     if(client_get_player(client)){
         client_send_nack(client);
-        return;
+        return client;
+    }
+    //a resume token may follow the username, separated by a NUL byte
+    size_t name_len = name ? strnlen(name, len) : 0;
+    if(name_len < len){
+        CLIENT *resumed = resume(client, name, name + name_len + 1, len - name_len - 1, caps);
+        if(resumed != client){
+            return resumed;
+        }
+    }
+    int name_id = intern(name, name_len);
+    PLAYER *player = name_id < 0 ? NULL : preg_register_interned(player_registry, name_id);
+    //a player of a shard logs in only at its home, where the gate will have
+    //sent it, and a player of a cluster on one node at a time
+    int ok = client_login(client, player) == 0;
+    if (ok && peer_login(name, name_len) != 0) {
+        client_logout(client);
+        ok = 0;
     }
-    char *nameCopy = (char *)calloc(1, len + 1);
-    strncpy(nameCopy, name, len);
-    PLAYER *player = preg_register(player_registry, nameCopy);
-    if (client_login(client, player) == 0) { //success
-        client_send_ack(client, NULL, 0);
-        // free(nameCopy);
+    if (ok) { //success
+        client_set_caps(client, caps);
+        char token[SESSION_TOKEN_LEN + 1];
+        if(session_begin(client, token) == 0){
+            client_send_ack(client, token, SESSION_TOKEN_LEN);
+        }
+        else{
+            client_send_ack(client, NULL, 0);
+        }
     }
     else{ //fail
-        free(nameCopy);
         client_send_nack(client);
     }
+    return client;
+}
+
+void watch_game(CLIENT *client, char *name, int index, size_t len){
+    int name_id = intern_find(name, len);
+    CLIENT *target = name_id < 0 ? NULL : creg_lookup_interned(client_registry, name_id);
+    if(!target || !client_get_player(client)){
+        if(target){
+            client_unref(target, "watch target not usable");
+        }
+        client_send_nack(client);
+        return;
+    }
+    GAME *game = client_find_game(target, index);
+    client_unref(target, "watch target looked up");
+    int id = game ? spectator_watch(client, game) : -1;
+    if(id == -1){
+        if(game){
+            game_unref(game, "watch failed");
+        }
+        client_send_nack(client);
+        return;
+    }
+    size_t size;
+    char *game_state = client_encode_state(client, game, &size);
+    game_unref(game, "watch started");
+    JEUX_PACKET_HEADER hdr = {0};
+    hdr.type = JEUX_ACK_PKT;
+    hdr.id = id;
+    hdr.size = htons(size);
+    client_tag_reply(client, &hdr);
+    client_send_packet(client, &hdr, game_state);
+    free(game_state);
     return;
 }
 
-void* jeux_client_service(void *vargp) {
-    int connfd = *((int *)vargp);
-    pthread_detach(pthread_self()); 
-    free(vargp);
-    CLIENT *client = creg_register(client_registry, connfd);  
-    while (1) {
-        char *payload = NULL;
-        char *name;
-        JEUX_PACKET_HEADER header = {0};
-        JEUX_PACKET_HEADER *hdr = &header;
-        proto_recv_packet(connfd, hdr, (void **)&payload);
-        JEUX_PACKET_TYPE type = hdr->type;
-        
-        hdr->size = ntohs(hdr->size);
-        // debug("type: %d\n", type);
-        switch(type){
-            case JEUX_LOGIN_PKT:
-                name = payload;
-                login(client, name, hdr->size);
-                break;
-            case JEUX_USERS_PKT:
-                show_users(client);
-                break;
-            case JEUX_INVITE_PKT:
-                name = payload;
-                send_invite(client, name, hdr->role, hdr->size);
-                break;
-            case JEUX_REVOKE_PKT:
-                if (client_revoke_invitation(client, hdr->id) == -1) {
-                    client_send_nack(client);
+CLIENT *jeux_serve_request(CLIENT *client, JEUX_PACKET_HEADER *hdr, void *payload) {
+    char *name;
+    int type = hdr->type;
+    client_set_request(client, hdr);
+    hdr->size = ntohs(hdr->size);
+    // debug("type: %d\n", type);
+    switch(type){
+        case JEUX_LOGIN_PKT:
+            name = payload;
+            client = login(client, name, hdr->size, hdr->role);
+            break;
+        case JEUX_USERS_PKT:
+            show_users(client);
+            break;
+        case JEUX_INVITE_PKT:
+            name = payload;
+            send_invite(client, name, hdr->role, hdr->size);
+            break;
+        case JEUX_REVOKE_PKT:
+            if (client_revoke_invitation(client, hdr->id) == -1) {
+                client_send_nack(client);
+            }
+            else {
+                client_send_ack(client, NULL, 0);
+            }
+            break;
+        case JEUX_ACCEPT_PKT:
+            char *strp = NULL;
+            if (client_accept_invitation(client, hdr->id, &strp) == -1) {
+                client_send_nack(client);
+            }
+            else {
+                if (strp) {
+                    size_t size = client_get_caps(client) & JEUX_CAP_PACKED_STATE ?
+                                  JEUX_PACKED_STATE_SIZE : strlen(strp);
+                    client_send_ack(client, (void *) strp, size);
+                    free(strp);
                 }
                 else {
                     client_send_ack(client, NULL, 0);
                 }
+            }
+            break;
+        case JEUX_DECLINE_PKT:
+            if (client_decline_invitation(client, hdr->id) == -1) {
+                client_send_nack(client);
+            }
+            else {
+                client_send_ack(client, NULL, 0);
+            }
+            break;
+        case JEUX_MOVE_PKT:
+            //the payload is not terminated, and a move is short
+            char move[16] = {0};
+            if (!payload || hdr->size >= sizeof(move)) {
+                client_send_nack(client);
                 break;
-            case JEUX_ACCEPT_PKT:
-                char *strp = NULL;
-                if (client_accept_invitation(client, hdr->id, &strp) == -1) {
-                    client_send_nack(client);
-                }
-                else {
-                    if (strp) {
-                        client_send_ack(client, (void *) strp, strlen(strp));
-                        free(strp);
-                    }
-                    else {
-                        client_send_ack(client, NULL, 0);
-                    }
-                }
-                break;
-            case JEUX_DECLINE_PKT:
-                if (client_decline_invitation(client, hdr->id) == -1) {
-                    client_send_nack(client);
-                }
-                else {
-                    client_send_ack(client, NULL, 0);
-                }
-                break;
-            case JEUX_MOVE_PKT:
-                if (client_make_move(client, hdr->id, payload) == -1)  {
-                    client_send_nack(client);
-                }
-                else {
-                    client_send_ack(client, NULL, 0);
-                }
+            }
+            memcpy(move, payload, hdr->size);
+            if (client_make_move(client, hdr->id, move) == -1)  {
+                client_send_nack(client);
+            }
+            else {
+                client_send_ack(client, NULL, 0);
+            }
+            break;
+        case JEUX_RESIGN_PKT:
+            if (client_resign_game(client, hdr->id) == -1)  {
+                client_send_nack(client);
+            }
+            else {
+                client_send_ack(client, NULL, 0);
+            } 
+            break;
+        case JEUX_WATCH_PKT:
+            name = payload;
+            watch_game(client, name, hdr->id, hdr->size);
+            break;
+        case JEUX_UNWATCH_PKT:
+            if (spectator_unwatch(client, hdr->id) == -1) {
+                client_send_nack(client);
+            }
+            else {
+                client_send_ack(client, NULL, 0);
+            }
+            break;
+        default:
+            // eof
+            return NULL;
+    }
+    return client;
+}
+
+void jeux_end_connection(CLIENT *client) {
+    client_stop_watchdog(client);
+    spectator_unwatch_all(client);
+    int fd = session_park(client);
+    if (fd >= 0) {
+        close(fd);
+        return;
+    }
+    close(client_detach(client));
+    client_logout(client);
+    session_end(client);
+    creg_unregister(client_registry, client);
+}
+
+/*
+ * The threads serving clients, counted so that jeux_quiesce() can tell
+ * when they have all stopped.
+ */
+static struct {
+    int running;
+    atomic_int quiescing;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} service = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER
+};
+
+/*
+ * What a thread stopped by jeux_quiesce() had read of its client's later
+ * requests, kept as the client's io.
+ */
+typedef struct unread {
+    size_t len;
+    char data[];
+} UNREAD;
+
+/*
+ * A client to be served by a thread of its own, with its reader.
+ */
+typedef struct served {
+    CLIENT *client;
+    PROTO_READER *reader;
+} SERVED;
+
+static void service_enter(void) {
+    pthread_mutex_lock(&service.lock);
+    while (atomic_load(&service.quiescing)) {
+        pthread_cond_wait(&service.cond, &service.lock);
+    }
+    service.running++;
+    pthread_mutex_unlock(&service.lock);
+}
+
+static void service_leave(void) {
+    pthread_mutex_lock(&service.lock);
+    service.running--;
+    pthread_cond_broadcast(&service.cond);
+    pthread_mutex_unlock(&service.lock);
+}
+
+/*
+ * Wait until a connection has more of a request to read, writing out the
+ * notifications posted to its client in the meantime, or until the
+ * server quiesces.
+ */
+static void await_request(CLIENT *client, int connfd, int notify_fd) {
+    struct pollfd fds[2] = {{ .fd = connfd, .events = POLLIN }, { .fd = notify_fd, .events = POLLIN }};
+    while (!atomic_load(&service.quiescing)) {
+        int n = poll(fds, 2, -1);
+        if (n < 0 && errno != EINTR) {
+            return;
+        }
+        uint64_t count;
+        if (n > 0 && (fds[1].revents & POLLIN) && eventfd_read(notify_fd, &count) == 0) {
+            client_flush_notices(client);
+        }
+        if (n > 0 && fds[0].revents) {
+            return;
+        }
+    }
+}
+
+/*
+ * Leave a client's connection open for whoever serves it next, keeping
+ * what has been read of its later requests.
+ */
+static void hold_client(CLIENT *client, PROTO_READER *reader) {
+    client_stop_watchdog(client);
+    client_uncork(client);
+    client_flush_notices(client);
+    size_t len;
+    char *data = proto_reader_unread(reader, &len);
+    UNREAD *unread = malloc(sizeof(UNREAD) + len);
+    unread->len = len;
+    memcpy(unread->data, data, len);
+    client_set_io(client, unread);
+}
+
+/*
+ * Serve the requests of a client until its connection ends, or until the
+ * server quiesces.
+ */
+static void serve(CLIENT *client, PROTO_READER *reader) {
+    int connfd = client_get_fd(client);
+    //the eventfd stays the same when the connection resumes another client
+    int notify_fd = client_open_mailbox(client);
+    client_start_watchdog(client);
+    while (client) {
+        void *payload = NULL;
+        JEUX_PACKET_HEADER hdr = {0};
+        //replies are held back only while more requests are waiting, and a
+        //request is only read once it has all arrived, so that the server
+        //can quiesce while a client is halfway through sending one
+        while (!proto_reader_ready(reader) && !atomic_load(&service.quiescing)) {
+            client_uncork(client);
+            await_request(client, connfd, notify_fd);
+            int n = atomic_load(&service.quiescing) ? 1 : proto_reader_pull(reader);
+            if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
                 break;
-            case JEUX_RESIGN_PKT:
-                if (client_resign_game(client, hdr->id) == -1)  {
-                    client_send_nack(client);
+            }
+        }
+        if (atomic_load(&service.quiescing)) {
+            hold_client(client, reader);
+            break;
+        }
+        if (proto_reader_ready(reader) && proto_reader_recv(reader, &hdr, &payload) == 0) {
+            client_touch(client);
+        }
+        if (proto_reader_ready(reader)) {
+            client_cork(client);
+        }
+        CLIENT *next = jeux_serve_request(client, &hdr, payload);
+        if (!next) {
+            jeux_end_connection(client);
+        }
+        client = next;
+        free(payload);
+    }
+    proto_reader_free(reader);
+}
+
+void* jeux_client_service(void *vargp) {
+    int connfd = *((int *)vargp);
+    pthread_detach(pthread_self()); 
+    free(vargp);
+    service_enter();
+    CLIENT *client = creg_register(client_registry, connfd);  
+    if (!client) {
+        //registry is full
+        close(connfd);
+        service_leave();
+        return NULL;
+    }
+    //requests may be pipelined, so they are read through a buffer
+    PROTO_READER *reader = proto_reader_create(connfd);
+    if (!reader) {
+        close(client_detach(client));
+        creg_unregister(client_registry, client);
+        service_leave();
+        return NULL;
+    }
+    serve(client, reader);
+    service_leave();
+    return NULL;
+}
+
+static void *resumed_service(void *arg) {
+    SERVED *served = arg;
+    service_enter();
+    serve(served->client, served->reader);
+    service_leave();
+    free(served);
+    return NULL;
+}
+
+int jeux_serve_client(CLIENT *client, const void *unread, size_t len) {
+    SERVED *served = malloc(sizeof(SERVED));
+    served->client = client;
+    served->reader = proto_reader_create(client_get_fd(client));
+    pthread_t thread;
+    if (!served->reader || (len && proto_reader_feed(served->reader, (void *)unread, len)) ||
+        pthread_create(&thread, NULL, resumed_service, served)) {
+        if (served->reader) {
+            proto_reader_free(served->reader);
+        }
+        free(served);
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+void jeux_quiesce(void) {
+    atomic_store(&service.quiescing, 1);
+    CLIENT **clients = creg_all_clients(client_registry);
+    for (int i = 0; clients[i]; i++) {
+        client_wake(clients[i]);
+        client_unref(clients[i], "client woken");
+    }
+    free(clients);
+    pthread_mutex_lock(&service.lock);
+    while (service.running) {
+        pthread_cond_wait(&service.cond, &service.lock);
+    }
+    pthread_mutex_unlock(&service.lock);
+}
+
+void jeux_resume(void) {
+    pthread_mutex_lock(&service.lock);
+    atomic_store(&service.quiescing, 0);
+    pthread_cond_broadcast(&service.cond);
+    pthread_mutex_unlock(&service.lock);
+}
+
+char *jeux_take_unread(CLIENT *client, size_t *lenp) {
+    UNREAD *unread = client_get_io(client);
+    client_set_io(client, NULL);
+    *lenp = unread ? unread->len : 0;
+    char *data = *lenp ? malloc(*lenp) : NULL;
+    if (data) {
+        memcpy(data, unread->data, *lenp);
+    }
+    free(unread);
+    return data;
+}
+
+void jeux_client_coroutine(void *arg) {
+    int connfd = (intptr_t)arg;
+    CLIENT *client = creg_register(client_registry, connfd);
+    if (!client) {
+        //registry is full
+        close(connfd);
+        return;
+    }
+    PROTO_READER *reader = proto_reader_create(connfd);
+    //a coroutine waits on one descriptor, so it waits on both of these at once
+    int notify_fd = client_open_mailbox(client);
+    int wait_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev = { .events = EPOLLIN };
+    if (!reader || wait_fd < 0 || epoll_ctl(wait_fd, EPOLL_CTL_ADD, connfd, &ev) ||
+        epoll_ctl(wait_fd, EPOLL_CTL_ADD, notify_fd, &ev)) {
+        if (reader) {
+            proto_reader_free(reader);
+        }
+        if (wait_fd >= 0) {
+            close(wait_fd);
+        }
+        close(client_detach(client));
+        creg_unregister(client_registry, client);
+        return;
+    }
+    client_start_watchdog(client);
+    int burst = 0;
+    while (client) {
+        void *payload = NULL;
+        JEUX_PACKET_HEADER hdr = {0};
+        //as in jeux_client_service, except that waiting gives up the worker
+        while (!proto_reader_ready(reader)) {
+            client_uncork(client);
+            burst = 0;
+            int n = proto_reader_pull(reader);
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                coro_wait_readable(wait_fd);
+                uint64_t count;
+                if (eventfd_read(notify_fd, &count) == 0) {
+                    client_flush_notices(client);
                 }
-                else {
-                    client_send_ack(client, NULL, 0);
-                } 
+            }
+            else if (n <= 0) {
                 break;
-            default:
-                // eof
-                close(client_get_fd(client));
-
-                client_logout(client);
-                creg_unregister(client_registry, client);
-                // possibly need to client_unref
-                if(payload) {
-                    free(payload);
-                }
-                return NULL; 
+            }
+        }
+        if (proto_reader_ready(reader) && proto_reader_recv(reader, &hdr, &payload) == 0) {
+            client_touch(client);
+        }
+        if (proto_reader_ready(reader)) {
+            client_cork(client);
         }
-        if(payload) {
-            free(payload);
-            payload = NULL;
+        CLIENT *next = jeux_serve_request(client, &hdr, payload);
+        if (!next) {
+            jeux_end_connection(client);
+        }
+        client = next;
+        free(payload);
+        //a client that keeps pipelining must not starve the others
+        if (client && ++burst == CORO_BURST) {
+            client_uncork(client);
+            burst = 0;
+            coro_yield();
         }
     }
-    return NULL;
-}
\ No newline at end of file
+    proto_reader_free(reader);
+    close(wait_fd);
+}
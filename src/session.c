@@ -0,0 +1,249 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/random.h>
+
+#include "jeux_globals.h"
+#include "client_ext.h"
+#include "session.h"
+#include "spectator.h"
+#include "timer_wheel.h"
+#include "debug.h"
+
+#define SESSION_BUCKETS 256
+
+typedef struct session {
+    uint64_t token;
+    CLIENT *client;
+    int parked;
+    TIMER timer;                    /* Expiry of the grace period */
+    struct session *next_by_token;
+    struct session *next_by_client;
+} SESSION;
+
+/*
+ * Sessions are hashed both by token, for O(1) resumption, and by CLIENT,
+ * for parking and ending a session when a connection is lost.
+ */
+static struct {
+    long grace_ms;
+    int closing;
+    SESSION *by_token[SESSION_BUCKETS];
+    SESSION *by_client[SESSION_BUCKETS];
+    pthread_mutex_t lock;
+} sessions = {
+    .lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+static unsigned token_bucket(uint64_t token){
+    return token % SESSION_BUCKETS;
+}
+
+static unsigned client_bucket(CLIENT *client){
+    return ((uintptr_t)client >> 4) % SESSION_BUCKETS;
+}
+
+/* The following functions must be called with the session lock held. */
+
+static SESSION *find_by_client(CLIENT *client){
+    SESSION *session = sessions.by_client[client_bucket(client)];
+    while (session && session->client != client) {
+        session = session->next_by_client;
+    }
+    return session;
+}
+
+static void remove_session(SESSION *session){
+    SESSION **sp = &sessions.by_token[token_bucket(session->token)];
+    while (*sp != session) {
+        sp = &(*sp)->next_by_token;
+    }
+    *sp = session->next_by_token;
+    sp = &sessions.by_client[client_bucket(session->client)];
+    while (*sp != session) {
+        sp = &(*sp)->next_by_client;
+    }
+    *sp = session->next_by_client;
+}
+
+/*
+ * Log out and unregister a parked CLIENT whose session is over.
+ */
+static void expire_session(SESSION *session){
+    debug("session %016lx expired", session->token);
+    client_logout(session->client);
+    creg_unregister(client_registry, session->client);
+    client_unref(session->client, "session expired");
+    free(session);
+}
+
+static void session_timeout(void *arg){
+    SESSION *session = arg;
+    pthread_mutex_lock(&sessions.lock);
+    if (!session->parked) {
+        //resumed, or claimed by session_fini, while the timer was firing
+        pthread_mutex_unlock(&sessions.lock);
+        return;
+    }
+    remove_session(session);
+    pthread_mutex_unlock(&sessions.lock);
+    expire_session(session);
+}
+
+void session_init(long grace_ms){
+    sessions.grace_ms = grace_ms;
+    sessions.closing = 0;
+}
+
+void session_fini(void){
+    pthread_mutex_lock(&sessions.lock);
+    sessions.closing = 1;
+    pthread_mutex_unlock(&sessions.lock);
+    session_expire_parked();
+}
+
+void session_expire_parked(void){
+    SESSION *parked = NULL;
+    pthread_mutex_lock(&sessions.lock);
+    for (int i = 0; i < SESSION_BUCKETS; i++) {
+        SESSION *session = sessions.by_token[i];
+        while (session) {
+            SESSION *next = session->next_by_token;
+            if (session->parked) {
+                session->parked = 0;
+                remove_session(session);
+                session->next_by_token = parked;
+                parked = session;
+            }
+            session = next;
+        }
+    }
+    pthread_mutex_unlock(&sessions.lock);
+    while (parked) {
+        SESSION *session = parked;
+        parked = session->next_by_token;
+        timer_cancel(&session->timer);
+        expire_session(session);
+    }
+}
+
+/*
+ * Parse a resume token as sent to the client, returning 0 if it is not
+ * one.
+ */
+static uint64_t parse_token(const char *token, size_t len){
+    char buf[SESSION_TOKEN_LEN + 1];
+    if (len != SESSION_TOKEN_LEN) {
+        return 0;
+    }
+    memcpy(buf, token, len);
+    buf[len] = '\0';
+    char *end;
+    uint64_t value = strtoull(buf, &end, 16);
+    return *end ? 0 : value;
+}
+
+/*
+ * Start a session with a given token.
+ */
+static void add_session(CLIENT *client, uint64_t token){
+    SESSION *session = calloc(1, sizeof(SESSION));
+    session->token = token;
+    session->client = client_ref(client, "session started");
+    timer_init(&session->timer, session_timeout, session);
+    pthread_mutex_lock(&sessions.lock);
+    unsigned b = token_bucket(session->token);
+    session->next_by_token = sessions.by_token[b];
+    sessions.by_token[b] = session;
+    b = client_bucket(client);
+    session->next_by_client = sessions.by_client[b];
+    sessions.by_client[b] = session;
+    pthread_mutex_unlock(&sessions.lock);
+}
+
+int session_begin(CLIENT *client, char *token){
+    if (!sessions.grace_ms) {
+        return -1;
+    }
+    uint64_t value;
+    //zero is never a token, so that it can stand for none
+    do {
+        if (getrandom(&value, sizeof(value), 0) != sizeof(value)) {
+            return -1;
+        }
+    } while (!value);
+    add_session(client, value);
+    snprintf(token, SESSION_TOKEN_LEN + 1, "%016lx", value);
+    return 0;
+}
+
+int session_get_token(CLIENT *client, char *token){
+    pthread_mutex_lock(&sessions.lock);
+    SESSION *session = find_by_client(client);
+    if (session) {
+        snprintf(token, SESSION_TOKEN_LEN + 1, "%016lx", session->token);
+    }
+    pthread_mutex_unlock(&sessions.lock);
+    return session ? 0 : -1;
+}
+
+int session_adopt(CLIENT *client, const char *token){
+    uint64_t value = parse_token(token, strlen(token));
+    if (!sessions.grace_ms || !value) {
+        return -1;
+    }
+    add_session(client, value);
+    return 0;
+}
+
+void session_end(CLIENT *client){
+    pthread_mutex_lock(&sessions.lock);
+    SESSION *session = find_by_client(client);
+    if (session) {
+        remove_session(session);
+    }
+    pthread_mutex_unlock(&sessions.lock);
+    if (session) {
+        timer_cancel(&session->timer);
+        client_unref(session->client, "session ended");
+        free(session);
+    }
+}
+
+int session_park(CLIENT *client){
+    pthread_mutex_lock(&sessions.lock);
+    SESSION *session = sessions.closing ? NULL : find_by_client(client);
+    if (!session) {
+        pthread_mutex_unlock(&sessions.lock);
+        return -1;
+    }
+    session->parked = 1;
+    int fd = client_park(client, SESSION_HELD_PACKETS);
+    timer_arm(&session->timer, sessions.grace_ms);
+    pthread_mutex_unlock(&sessions.lock);
+    debug("session %016lx parked", session->token);
+    return fd;
+}
+
+CLIENT *session_resume(char *token, size_t len, char *name){
+    uint64_t value = parse_token(token, len);
+    if (!value) {
+        return NULL;
+    }
+    pthread_mutex_lock(&sessions.lock);
+    SESSION *session = sessions.by_token[token_bucket(value)];
+    while (session && session->token != value) {
+        session = session->next_by_token;
+    }
+    if (!session || !session->parked ||
+        strcmp(player_get_name(client_get_player(session->client)), name)) {
+        pthread_mutex_unlock(&sessions.lock);
+        return NULL;
+    }
+    session->parked = 0;
+    pthread_mutex_unlock(&sessions.lock);
+    timer_cancel(&session->timer);
+    debug("session %016lx resumed", session->token);
+    return session->client;
+}
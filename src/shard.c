@@ -0,0 +1,617 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/wait.h>
+
+#include "shard.h"
+#include "peer.h"
+#include "debug.h"
+#include "csapp.h"
+
+#define SHARD_MAX 64
+
+/* Capacity of each ring, in bytes; a power of two. */
+#define SHARD_RING_SIZE (256 * 1024)
+
+/* How often the gate looks for connections that have waited too long. */
+#define SHARD_GATE_TICK_MS 1000
+
+#define SHARD_GATE_EVENTS 64
+
+/* States of a shard, kept where every shard can see them. */
+enum { SHARD_STARTING, SHARD_RUNNING, SHARD_STOPPED };
+
+/* Fills the end of a ring; not an operation of peer.h. */
+#define SHARD_PAD 0
+
+typedef struct shard_ring {
+    _Atomic uint64_t head;          /* Advanced by the receiver */
+    char pad1[64 - sizeof(uint64_t)];
+    _Atomic uint64_t tail;          /* Advanced by the sender */
+    atomic_int backlogged;          /* Set by the sender while it holds messages back */
+    char pad2[64 - sizeof(uint64_t) - sizeof(atomic_int)];
+    char data[SHARD_RING_SIZE];
+} SHARD_RING;
+
+typedef struct shard_shm {
+    atomic_int state[SHARD_MAX];
+    SHARD_RING rings[];             /* From each shard to each shard */
+} SHARD_SHM;
+
+/*
+ * A message held back until there is room for it in the ring, copied
+ * whole with its payload.
+ */
+typedef struct shard_queued {
+    struct shard_queued *next;
+    PEER_MSG msg;
+    char data[];
+} SHARD_QUEUED;
+
+/*
+ * A connection in the gate, whose first packet has not yet all come.
+ */
+typedef struct gate_conn {
+    int fd;
+    long since;
+    struct gate_conn *next;
+} GATE_CONN;
+
+static struct {
+    int nshards;
+    int self;                       /* Index of this shard, or -1 in the parent */
+    SHARD_SHM *shm;
+    size_t shm_len;
+    int wake_fds[SHARD_MAX];        /* Written when a ring to the shard was empty */
+    int handoff[SHARD_MAX][2];      /* Datagram socket pair for passing connections to the shard */
+    pid_t pids[SHARD_MAX];
+    pthread_mutex_t send_locks[SHARD_MAX];  /* One sender at a time on each ring from here */
+    SHARD_QUEUED *backlog[SHARD_MAX];       /* Held back from each ring, under its send lock */
+    SHARD_QUEUED *backlog_tail[SHARD_MAX];
+    pthread_t receiver;
+    int running;
+    atomic_int stopping;
+    long login_ms;
+    int gate_fd;                    /* Epoll instance of the gate */
+    int listen_fd;                  /* Added to the gate, or -1 */
+    GATE_CONN *waiting;
+    int *ready;                     /* Connections to be served here */
+    int nready;
+    int ready_cap;
+} shard = {
+    .self = -1,
+    .gate_fd = -1,
+    .listen_fd = -1
+};
+
+/* Marks the events of the listening socket and the handoff socket in the gate. */
+static char gate_listen, gate_handoff;
+
+static long now_ms(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * The name ends at its first NUL, as when it is interned.
+ */
+int shard_home(const char *name, size_t len){
+    len = strnlen(name, len);
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return hash % shard.nshards;
+}
+
+static int stopped(int index){
+    return atomic_load(&shard.shm->state[index]) == SHARD_STOPPED;
+}
+
+static SHARD_RING *ring(int from, int to){
+    return &shard.shm->rings[from * shard.nshards + to];
+}
+
+/*
+ * Put a message, whose len has been set, in the ring to another shard,
+ * unless there is no room for it.  The shard's send lock must be held.
+ */
+static int ring_put(int to, PEER_MSG *msg, const void *data){
+    SHARD_RING *r = ring(shard.self, to);
+    size_t len = msg->len;
+    uint64_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    size_t off = tail & (SHARD_RING_SIZE - 1);
+    size_t pad = off + len > SHARD_RING_SIZE ? SHARD_RING_SIZE - off : 0;
+    if (tail + pad + len - atomic_load(&r->head) > SHARD_RING_SIZE) {
+        return -1;
+    }
+    if (pad) {
+        PEER_MSG *filler = (PEER_MSG *)(r->data + off);
+        filler->len = pad;
+        filler->op = SHARD_PAD;
+        off = 0;
+    }
+    memcpy(r->data + off, msg, sizeof(PEER_MSG));
+    if (msg->size) {
+        memcpy(r->data + off + sizeof(PEER_MSG), data, msg->size);
+    }
+    atomic_store(&r->tail, tail + pad + len);
+    //the receiver may be going to sleep only if it had taken everything
+    if (atomic_load(&r->head) == tail) {
+        eventfd_write(shard.wake_fds[to], 1);
+    }
+    return 0;
+}
+
+/*
+ * Put as much of what has been held back for a shard in its ring as
+ * there is room for, or drop it all if the shard has stopped.  If some
+ * is still held back, the receiver is asked to say when it makes room.
+ * The shard's send lock must be held.
+ */
+static void send_backlog(int to){
+    for (int asked = 0; shard.backlog[to]; asked = 1) {
+        SHARD_QUEUED *q;
+        while ((q = shard.backlog[to]) && (stopped(to) || ring_put(to, &q->msg, q->data) == 0)) {
+            shard.backlog[to] = q->next;
+            free(q);
+        }
+        if (!shard.backlog[to] || asked) {
+            break;
+        }
+        //the receiver may have made room before it could see this
+        atomic_store(&ring(shard.self, to)->backlogged, 1);
+    }
+}
+
+/*
+ * Send a message to another shard.  If there is no room in the ring, the
+ * message is held back, after any that already are, to be put there once
+ * the receiver has made room, so a sender never waits on the receiver.
+ * Fails if the shard has stopped.
+ */
+static int ring_send(int to, PEER_MSG *msg, const void *data){
+    msg->len = (sizeof(PEER_MSG) + msg->size + 7) & ~(size_t)7;
+    pthread_mutex_lock(&shard.send_locks[to]);
+    send_backlog(to);
+    int ret = stopped(to) ? -1 : 0;
+    if (!ret && (shard.backlog[to] || ring_put(to, msg, data))) {
+        SHARD_QUEUED *q = malloc(sizeof(SHARD_QUEUED) + msg->size);
+        if (q) {
+            q->next = NULL;
+            q->msg = *msg;
+            memcpy(q->data, data, msg->size);
+            if (shard.backlog[to]) {
+                shard.backlog_tail[to]->next = q;
+            }
+            else {
+                shard.backlog[to] = q;
+            }
+            shard.backlog_tail[to] = q;
+            send_backlog(to);
+        }
+        else {
+            ret = -1;
+        }
+    }
+    pthread_mutex_unlock(&shard.send_locks[to]);
+    return ret;
+}
+
+static int shard_locate(const char *name, size_t len){
+    int home = shard_home(name, len);
+    return home == shard.self ? -1 : home;
+}
+
+static int shard_login(const char *name, size_t len){
+    return shard_home(name, len) == shard.self ? 0 : -1;
+}
+
+static int shard_peers(int *peers, int max){
+    int n = 0;
+    for (int i = 0; i < shard.nshards && n < max; i++) {
+        if (i != shard.self) {
+            peers[n++] = i;
+        }
+    }
+    return n;
+}
+
+/* A player logs in only at its home, so there is nothing to do on logout. */
+static const PEER_TRANSPORT transport = {
+    .send = ring_send,
+    .gone = stopped,
+    .locate = shard_locate,
+    .login = shard_login,
+    .peers = shard_peers
+};
+
+/*
+ * Take messages from the rings to this shard, in the order each was sent,
+ * sleeping on the eventfd once they are all empty.
+ */
+static void *receiver_thread(void *arg){
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+    while (!atomic_load(&shard.stopping)) {
+        int idle = 1;
+        for (int from = 0; from < shard.nshards; from++) {
+            if (from == shard.self) {
+                continue;
+            }
+            SHARD_RING *r = ring(from, shard.self);
+            uint64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+            while (head != atomic_load(&r->tail)) {
+                PEER_MSG *msg = (PEER_MSG *)(r->data + (head & (SHARD_RING_SIZE - 1)));
+                if (msg->op != SHARD_PAD) {
+                    //copied out, to be handled by the peer layer's thread
+                    peer_receive(msg, (char *)(msg + 1));
+                }
+                head += msg->len;
+                atomic_store(&r->head, head);
+                idle = 0;
+            }
+            //tell a sender holding messages back that there is room now
+            if (atomic_load(&r->backlogged) && atomic_exchange(&r->backlogged, 0)) {
+                eventfd_write(shard.wake_fds[from], 1);
+            }
+        }
+        //put in the rings from here what was held back for want of room
+        for (int to = 0; to < shard.nshards; to++) {
+            if (to != shard.self) {
+                pthread_mutex_lock(&shard.send_locks[to]);
+                send_backlog(to);
+                pthread_mutex_unlock(&shard.send_locks[to]);
+            }
+        }
+        if (idle) {
+            eventfd_t count;
+            eventfd_read(shard.wake_fds[shard.self], &count);
+        }
+    }
+    return NULL;
+}
+
+int shard_init(int nshards){
+    if (nshards < 1 || nshards > SHARD_MAX) {
+        return -1;
+    }
+    shard.nshards = nshards;
+    shard.shm_len = sizeof(SHARD_SHM) + (size_t)nshards * nshards * sizeof(SHARD_RING);
+    shard.shm = mmap(NULL, shard.shm_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (shard.shm == MAP_FAILED) {
+        shard.shm = NULL;
+        return -1;
+    }
+    for (int i = 0; i < nshards; i++) {
+        shard.wake_fds[i] = eventfd(0, EFD_CLOEXEC);
+        if (shard.wake_fds[i] < 0 ||
+            socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, shard.handoff[i])) {
+            return -1;
+        }
+        pthread_mutex_init(&shard.send_locks[i], NULL);
+    }
+    return 0;
+}
+
+int shard_fork(void){
+    for (int i = 0; i < shard.nshards; i++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            shard.nshards = i;
+            shard_finish(SIGKILL);
+            return -2;
+        }
+        if (pid == 0) {
+            shard.self = i;
+            for (int j = 0; j < shard.nshards; j++) {
+                //a shard receives only on its own socket, and sends only on the others'
+                close(shard.handoff[j][j == i ? 1 : 0]);
+            }
+            return i;
+        }
+        shard.pids[i] = pid;
+    }
+    for (int i = 0; i < shard.nshards; i++) {
+        close(shard.wake_fds[i]);
+        close(shard.handoff[i][0]);
+        close(shard.handoff[i][1]);
+    }
+    return -1;
+}
+
+void shard_finish(int sig){
+    for (int i = 0; i < shard.nshards; i++) {
+        kill(shard.pids[i], sig);
+    }
+    for (int i = 0; i < shard.nshards; i++) {
+        while (waitpid(shard.pids[i], NULL, 0) < 0 && errno == EINTR) {
+            continue;
+        }
+    }
+    munmap(shard.shm, shard.shm_len);
+    shard.shm = NULL;
+}
+
+int shard_listen(char *port){
+    struct addrinfo hints = {0}, *list, *p;
+    int fd = -1, one = 1;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG | AI_NUMERICSERV;
+    if (getaddrinfo(NULL, port, &hints, &list)) {
+        return -1;
+    }
+    for (p = list; p; p = p->ai_next) {
+        if ((fd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK, p->ai_protocol)) < 0) {
+            continue;
+        }
+        //every shard listens on the port, and the kernel spreads connections over them
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+        if (bind(fd, p->ai_addr, p->ai_addrlen) == 0) {
+            break;
+        }
+        close(fd);
+    }
+    freeaddrinfo(list);
+    if (!p) {
+        return -1;
+    }
+    if (listen(fd, LISTENQ) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int shard_start(long login_ms){
+    shard.login_ms = login_ms;
+    shard.gate_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN;
+    ev.data.ptr = &gate_handoff;
+    if (shard.gate_fd < 0 ||
+        epoll_ctl(shard.gate_fd, EPOLL_CTL_ADD, shard.handoff[shard.self][0], &ev)) {
+        return -1;
+    }
+    if (peer_init(&transport, shard.self)) {
+        return -1;
+    }
+    atomic_store(&shard.stopping, 0);
+    if (pthread_create(&shard.receiver, NULL, receiver_thread, NULL)) {
+        return -1;
+    }
+    shard.running = 1;
+    atomic_store(&shard.shm->state[shard.self], SHARD_RUNNING);
+    return 0;
+}
+
+void shard_stop(void){
+    if (!shard.running) {
+        return;
+    }
+    //calls to this shard fail from now on, rather than wait for replies
+    atomic_store(&shard.shm->state[shard.self], SHARD_STOPPED);
+    atomic_store(&shard.stopping, 1);
+    eventfd_write(shard.wake_fds[shard.self], 1);
+    pthread_join(shard.receiver, NULL);
+    shard.running = 0;
+    for (int i = 0; i < shard.nshards; i++) {
+        pthread_mutex_lock(&shard.send_locks[i]);
+        while (shard.backlog[i]) {
+            SHARD_QUEUED *q = shard.backlog[i];
+            shard.backlog[i] = q->next;
+            free(q);
+        }
+        pthread_mutex_unlock(&shard.send_locks[i]);
+    }
+    while (shard.waiting) {
+        GATE_CONN *conn = shard.waiting;
+        shard.waiting = conn->next;
+        close(conn->fd);
+        free(conn);
+    }
+    while (shard.nready) {
+        close(shard.ready[--shard.nready]);
+    }
+    free(shard.ready);
+    shard.ready = NULL;
+    close(shard.gate_fd);
+    shard.gate_fd = -1;
+    peer_fini();
+}
+
+static void gate_ready(int fd){
+    if (shard.nready == shard.ready_cap) {
+        int cap = shard.ready_cap ? 2 * shard.ready_cap : 16;
+        int *ready = realloc(shard.ready, cap * sizeof(int));
+        if (!ready) {
+            close(fd);
+            return;
+        }
+        shard.ready = ready;
+        shard.ready_cap = cap;
+    }
+    shard.ready[shard.nready++] = fd;
+}
+
+/*
+ * Take a connection out of the gate, returning its socket.
+ */
+static int gate_release(GATE_CONN *conn){
+    GATE_CONN **cp = &shard.waiting;
+    while (*cp != conn) {
+        cp = &(*cp)->next;
+    }
+    *cp = conn->next;
+    int fd = conn->fd;
+    epoll_ctl(shard.gate_fd, EPOLL_CTL_DEL, fd, NULL);
+    free(conn);
+    return fd;
+}
+
+static void gate_admit(int listen_fd){
+    int fd;
+    while ((fd = accept(listen_fd, NULL, NULL)) >= 0) {
+        GATE_CONN *conn = malloc(sizeof(GATE_CONN));
+        if (!conn) {
+            gate_ready(fd);
+            continue;
+        }
+        conn->fd = fd;
+        conn->since = now_ms();
+        conn->next = shard.waiting;
+        shard.waiting = conn;
+        struct epoll_event ev = {0};
+        ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = conn;
+        if (epoll_ctl(shard.gate_fd, EPOLL_CTL_ADD, fd, &ev)) {
+            gate_ready(gate_release(conn));
+        }
+    }
+}
+
+/*
+ * Pass a connection to another shard.
+ */
+static int gate_pass(int to, int fd){
+    char byte = 0;
+    struct iovec iov = { &byte, 1 };
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control = {0};
+    struct msghdr mh = {0};
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control.buf;
+    mh.msg_controllen = sizeof(control.buf);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    return sendmsg(shard.handoff[to][1], &mh, MSG_DONTWAIT | MSG_NOSIGNAL) < 0 ? -1 : 0;
+}
+
+static void gate_receive(void){
+    while (1) {
+        char byte;
+        struct iovec iov = { &byte, 1 };
+        union {
+            struct cmsghdr hdr;
+            char buf[CMSG_SPACE(sizeof(int))];
+        } control;
+        struct msghdr mh = {0};
+        mh.msg_iov = &iov;
+        mh.msg_iovlen = 1;
+        mh.msg_control = control.buf;
+        mh.msg_controllen = sizeof(control.buf);
+        if (recvmsg(shard.handoff[shard.self][0], &mh, MSG_DONTWAIT) < 0) {
+            return;
+        }
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+        if (cmsg && cmsg->cmsg_type == SCM_RIGHTS) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+            gate_ready(fd);
+        }
+    }
+}
+
+/*
+ * Look at what a connection in the gate has sent so far, without taking
+ * it from the socket.  Once its first packet has come, the connection is
+ * passed to the home of the player if it is a LOGIN, and is otherwise
+ * served here, as it is if it has been closed.
+ */
+static void gate_examine(GATE_CONN *conn){
+    static char buf[sizeof(JEUX_PACKET_HEADER) + UINT16_MAX];
+    ssize_t n = recv(conn->fd, buf, sizeof(buf), MSG_PEEK | MSG_DONTWAIT);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return;
+    }
+    JEUX_PACKET_HEADER *hdr = (JEUX_PACKET_HEADER *)buf;
+    int to = shard.self;
+    if (n > 0 && (size_t)n < sizeof(JEUX_PACKET_HEADER)) {
+        return;
+    }
+    if (n > 0 && hdr->type == JEUX_LOGIN_PKT) {
+        size_t size = ntohs(hdr->size);
+        if ((size_t)n < sizeof(JEUX_PACKET_HEADER) + size) {
+            return;
+        }
+        to = shard_home(buf + sizeof(JEUX_PACKET_HEADER), size);
+    }
+    int fd = gate_release(conn);
+    if (to != shard.self && gate_pass(to, fd) == 0) {
+        close(fd);
+        return;
+    }
+    gate_ready(fd);
+}
+
+static void gate_expire(void){
+    if (!shard.login_ms) {
+        return;
+    }
+    long now = now_ms();
+    GATE_CONN *conn = shard.waiting;
+    while (conn) {
+        GATE_CONN *next = conn->next;
+        if (now - conn->since >= shard.login_ms) {
+            close(gate_release(conn));
+        }
+        conn = next;
+    }
+}
+
+int shard_accept(int listen_fd){
+    if (shard.listen_fd != listen_fd) {
+        struct epoll_event ev = {0};
+        ev.events = EPOLLIN;
+        ev.data.ptr = &gate_listen;
+        if (epoll_ctl(shard.gate_fd, EPOLL_CTL_ADD, listen_fd, &ev)) {
+            return -1;
+        }
+        shard.listen_fd = listen_fd;
+    }
+    while (!shard.nready) {
+        struct epoll_event events[SHARD_GATE_EVENTS];
+        int timeout = !shard.login_ms || !shard.waiting ? -1 :
+                      shard.login_ms < SHARD_GATE_TICK_MS ? shard.login_ms : SHARD_GATE_TICK_MS;
+        int n = epoll_wait(shard.gate_fd, events, SHARD_GATE_EVENTS, timeout);
+        if (n < 0) {
+            return -1;
+        }
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == &gate_listen) {
+                gate_admit(listen_fd);
+            }
+            else if (events[i].data.ptr == &gate_handoff) {
+                gate_receive();
+            }
+            else {
+                gate_examine(events[i].data.ptr);
+            }
+        }
+        gate_expire();
+    }
+    return shard.ready[--shard.nready];
+}
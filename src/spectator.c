@@ -0,0 +1,484 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/eventfd.h>
+
+#include "protocol_ext.h"
+#include "client_ext.h"
+#include "game_ext.h"
+#include "spectator.h"
+#include "debug.h"
+
+/*
+ * A published move or game ending, waiting to be fanned out by the
+ * service thread.
+ */
+typedef struct spectator_event {
+    GAME *game;
+    FRAME *frame;                   /* NULL if the game has ended */
+    FRAME *packed;                  /* For JEUX_CAP_PACKED_STATE */
+    GAME_ROLE winner;
+    struct spectator_event *next;
+} SPECTATOR_EVENT;
+
+/*
+ * A subscriber holds at most one pending board: a newer state replaces
+ * one that has not been sent yet, so the memory used by a slow spectator
+ * is bounded by a single FRAME however far behind the game it falls.
+ */
+typedef struct subscription {
+    CLIENT *client;
+    int id;
+    struct spectator_hub *hub;      /* NULL once the game has ended */
+    FRAME *latest;                  /* Newest unsent game state */
+    int ended;                      /* WATCH_ENDED is pending */
+    GAME_ROLE winner;
+    int blocked;                    /* Last send would have blocked */
+    struct timespec next_send;      /* Rate limit for this subscriber */
+    struct subscription *hub_next;
+    struct subscription *next;
+} SUBSCRIPTION;
+
+/*
+ * The set of subscriptions to one GAME.
+ */
+typedef struct spectator_hub {
+    GAME *game;
+    SUBSCRIPTION *subs;
+    struct spectator_hub *next;
+} SPECTATOR_HUB;
+
+/*
+ * Publishers only touch the event queue and its lock, so that a move never
+ * waits for the service thread to finish fanning out a previous one.
+ * Hubs and subscriptions are protected by spec_lock.
+ */
+static struct {
+    pthread_t thread;
+    int running;
+    long interval_ms;
+    int wake_fd;
+    atomic_int nhubs;
+    pthread_mutex_t queue_lock;
+    SPECTATOR_EVENT *events_head;
+    SPECTATOR_EVENT *events_tail;
+    pthread_mutex_t spec_lock;
+    SPECTATOR_HUB *hubs;
+    SUBSCRIPTION *subs;
+} spec = {
+    .wake_fd = -1,
+    .queue_lock = PTHREAD_MUTEX_INITIALIZER,
+    .spec_lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+static void spectator_wake(void){
+    uint64_t one = 1;
+    if (write(spec.wake_fd, &one, sizeof(one)) < 0) {
+        debug("spectator wakeup failed");
+    }
+}
+
+/*
+ * Queue an event.  The event takes over the caller's references to the
+ * FRAMEs.
+ */
+static void enqueue_event(GAME *game, FRAME *frame, FRAME *packed, GAME_ROLE winner){
+    SPECTATOR_EVENT *event = malloc(sizeof(SPECTATOR_EVENT));
+    event->game = game_ref(game, "spectator event");
+    event->frame = frame;
+    event->packed = packed;
+    event->winner = winner;
+    event->next = NULL;
+    pthread_mutex_lock(&spec.queue_lock);
+    if (spec.events_tail) {
+        spec.events_tail->next = event;
+    }
+    else {
+        spec.events_head = event;
+    }
+    spec.events_tail = event;
+    pthread_mutex_unlock(&spec.queue_lock);
+    spectator_wake();
+}
+
+/* The following functions must be called with spec_lock held. */
+
+static SPECTATOR_HUB *find_hub(GAME *game){
+    SPECTATOR_HUB *hub = spec.hubs;
+    while (hub && hub->game != game) {
+        hub = hub->next;
+    }
+    return hub;
+}
+
+static void free_hub(SPECTATOR_HUB *hub){
+    SPECTATOR_HUB **hp = &spec.hubs;
+    while (*hp != hub) {
+        hp = &(*hp)->next;
+    }
+    *hp = hub->next;
+    atomic_fetch_sub(&spec.nhubs, 1);
+    game_unref(hub->game, "spectator hub removed");
+    free(hub);
+}
+
+static void set_latest(SUBSCRIPTION *sub, FRAME *frame){
+    if (sub->latest) {
+        frame_unref(sub->latest, "superseded for spectator");
+    }
+    sub->latest = frame ? frame_ref(frame, "latest for spectator") : NULL;
+}
+
+static long ms_until(struct timespec *when, struct timespec *now){
+    return (when->tv_sec - now->tv_sec) * 1000 + (when->tv_nsec - now->tv_nsec) / 1000000;
+}
+
+static void free_subscription(SUBSCRIPTION *sub){
+    SUBSCRIPTION **sp = &spec.subs;
+    while (*sp != sub) {
+        sp = &(*sp)->next;
+    }
+    *sp = sub->next;
+    if (sub->hub) {
+        SPECTATOR_HUB *hub = sub->hub;
+        sp = &hub->subs;
+        while (*sp != sub) {
+            sp = &(*sp)->hub_next;
+        }
+        *sp = sub->hub_next;
+        if (!hub->subs) {
+            free_hub(hub);
+        }
+    }
+    set_latest(sub, NULL);
+    client_unref(sub->client, "spectator subscription removed");
+    free(sub);
+}
+
+static void fan_out(SPECTATOR_EVENT *event){
+    SPECTATOR_HUB *hub = find_hub(event->game);
+    if (!hub) {
+        return;
+    }
+    for (SUBSCRIPTION *sub = hub->subs; sub; sub = sub->hub_next) {
+        if (event->frame) {
+            int packed = client_get_caps(sub->client) & JEUX_CAP_PACKED_STATE;
+            set_latest(sub, packed ? event->packed : event->frame);
+        }
+        else {
+            sub->ended = 1;
+            sub->winner = event->winner;
+            sub->hub = NULL;
+        }
+    }
+    if (!event->frame) {
+        hub->subs = NULL;
+        free_hub(hub);
+    }
+}
+
+/*
+ * Send a subscriber's pending board, and then the end of the game if that
+ * is pending too, unless the socket would block or the subscriber's rate
+ * limit has not yet expired.  Returns nonzero if the subscription has been
+ * removed.
+ */
+static int flush_subscription(SUBSCRIPTION *sub, struct timespec *now){
+    while ((sub->latest || sub->ended) && !sub->blocked) {
+        if (sub->latest && ms_until(&sub->next_send, now) > 0) {
+            break;
+        }
+        JEUX_PACKET_HEADER hdr = {0};
+        hdr.id = sub->id;
+        void *data = NULL;
+        if (sub->latest) {
+            hdr.type = JEUX_WATCH_MOVED_PKT;
+            hdr.size = htons(frame_size(sub->latest));
+            data = frame_data(sub->latest);
+        }
+        else {
+            hdr.type = JEUX_WATCH_ENDED_PKT;
+            hdr.role = sub->winner;
+        }
+        int ret = client_try_send_packet(sub->client, &hdr, data);
+        if (ret == 1) {
+            sub->blocked = 1;
+            break;
+        }
+        if (ret == -1 || hdr.type == JEUX_WATCH_ENDED_PKT) {
+            //the connection is gone or the game is over; either way we are done
+            free_subscription(sub);
+            return 1;
+        }
+        set_latest(sub, NULL);
+        sub->next_send = *now;
+        sub->next_send.tv_nsec += spec.interval_ms * 1000000;
+        sub->next_send.tv_sec += sub->next_send.tv_nsec / 1000000000;
+        sub->next_send.tv_nsec %= 1000000000;
+    }
+    return 0;
+}
+
+static void *spectator_service(void *arg){
+    struct pollfd *fds = NULL;
+    size_t nfds_max = 0;
+    while (1) {
+        pthread_mutex_lock(&spec.queue_lock);
+        SPECTATOR_EVENT *events = spec.events_head;
+        spec.events_head = spec.events_tail = NULL;
+        int running = spec.running;
+        pthread_mutex_unlock(&spec.queue_lock);
+        if (!running) {
+            break;
+        }
+
+        pthread_mutex_lock(&spec.spec_lock);
+        while (events) {
+            SPECTATOR_EVENT *event = events;
+            events = event->next;
+            fan_out(event);
+            if (event->frame) {
+                frame_unref(event->frame, "spectator event done");
+                frame_unref(event->packed, "spectator event done");
+            }
+            game_unref(event->game, "spectator event done");
+            free(event);
+        }
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        size_t nfds = 1;
+        long timeout = -1;
+        SUBSCRIPTION *sub = spec.subs;
+        while (sub) {
+            SUBSCRIPTION *next = sub->next;
+            if (!flush_subscription(sub, &now)) {
+                if (sub->blocked) {
+                    nfds++;
+                }
+                else if (sub->latest) {
+                    //held back by the rate limit
+                    long wait = ms_until(&sub->next_send, &now);
+                    if (timeout == -1 || wait < timeout) {
+                        timeout = wait < 1 ? 1 : wait;
+                    }
+                }
+            }
+            sub = next;
+        }
+        if (nfds > nfds_max) {
+            nfds_max = nfds * 2;
+            fds = realloc(fds, nfds_max * sizeof(struct pollfd));
+        }
+        fds[0].fd = spec.wake_fd;
+        fds[0].events = POLLIN;
+        nfds = 1;
+        for (sub = spec.subs; sub; sub = sub->next) {
+            if (sub->blocked) {
+                fds[nfds].fd = client_get_fd(sub->client);
+                fds[nfds].events = POLLOUT;
+                nfds++;
+            }
+        }
+        pthread_mutex_unlock(&spec.spec_lock);
+
+        //a subscriber is also "blocked" if another thread held its write
+        //lock, so poll with a timeout rather than wait only for POLLOUT
+        if (nfds > 1 && (timeout == -1 || timeout > 10)) {
+            timeout = 10;
+        }
+        int ret = poll(fds, nfds, timeout);
+        if (ret < 0 && errno != EINTR) {
+            break;
+        }
+        if (fds[0].revents & POLLIN) {
+            uint64_t count;
+            if (read(spec.wake_fd, &count, sizeof(count)) < 0) {
+                debug("spectator wakeup read failed");
+            }
+        }
+        pthread_mutex_lock(&spec.spec_lock);
+        for (sub = spec.subs; sub; sub = sub->next) {
+            sub->blocked = 0;
+        }
+        pthread_mutex_unlock(&spec.spec_lock);
+    }
+    free(fds);
+    return NULL;
+}
+
+int spectator_init(long interval_ms){
+    spec.interval_ms = interval_ms;
+    spec.wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (spec.wake_fd < 0) {
+        return -1;
+    }
+    spec.running = 1;
+    if (pthread_create(&spec.thread, NULL, spectator_service, NULL)) {
+        spec.running = 0;
+        close(spec.wake_fd);
+        spec.wake_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+void spectator_fini(void){
+    if (!spec.running) {
+        return;
+    }
+    pthread_mutex_lock(&spec.queue_lock);
+    spec.running = 0;
+    SPECTATOR_EVENT *events = spec.events_head;
+    spec.events_head = spec.events_tail = NULL;
+    pthread_mutex_unlock(&spec.queue_lock);
+    spectator_wake();
+    pthread_join(spec.thread, NULL);
+    while (events) {
+        SPECTATOR_EVENT *event = events;
+        events = event->next;
+        if (event->frame) {
+            frame_unref(event->frame, "spectator shutdown");
+            frame_unref(event->packed, "spectator shutdown");
+        }
+        game_unref(event->game, "spectator shutdown");
+        free(event);
+    }
+    pthread_mutex_lock(&spec.spec_lock);
+    while (spec.subs) {
+        free_subscription(spec.subs);
+    }
+    pthread_mutex_unlock(&spec.spec_lock);
+    close(spec.wake_fd);
+    spec.wake_fd = -1;
+}
+
+/*
+ * Determine whether a CLIENT has a subscription with a given watch ID.
+ * Must be called with spec_lock held.
+ */
+static int id_taken(CLIENT *client, int id){
+    for (SUBSCRIPTION *sub = spec.subs; sub; sub = sub->next) {
+        if (sub->client == client && sub->id == id) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Subscribe a CLIENT to a GAME under a watch ID that it does not have
+ * yet.  Must be called with spec_lock held.
+ */
+static int subscribe(CLIENT *client, GAME *game, int id){
+    //game endings are published after the game is marked over, so checking
+    //here under spec_lock guarantees that a new hub will see the ending
+    if (game_is_over(game) || id < 0 || id > UINT8_MAX) {
+        return -1;
+    }
+    SPECTATOR_HUB *hub = find_hub(game);
+    if (!hub) {
+        hub = calloc(1, sizeof(SPECTATOR_HUB));
+        hub->game = game_ref(game, "spectator hub created");
+        hub->next = spec.hubs;
+        spec.hubs = hub;
+        atomic_fetch_add(&spec.nhubs, 1);
+    }
+    SUBSCRIPTION *sub = calloc(1, sizeof(SUBSCRIPTION));
+    sub->client = client_ref(client, "spectator subscription");
+    sub->id = id;
+    sub->hub = hub;
+    sub->hub_next = hub->subs;
+    hub->subs = sub;
+    sub->next = spec.subs;
+    spec.subs = sub;
+    return id;
+}
+
+int spectator_watch(CLIENT *client, GAME *game){
+    if (!spec.running) {
+        return -1;
+    }
+    pthread_mutex_lock(&spec.spec_lock);
+    int id = 0;
+    while (id_taken(client, id)) {
+        id++;
+    }
+    id = subscribe(client, game, id);
+    pthread_mutex_unlock(&spec.spec_lock);
+    return id;
+}
+
+int spectator_watch_id(CLIENT *client, GAME *game, int id){
+    if (!spec.running) {
+        return -1;
+    }
+    pthread_mutex_lock(&spec.spec_lock);
+    int ret = id_taken(client, id) ? -1 : subscribe(client, game, id);
+    pthread_mutex_unlock(&spec.spec_lock);
+    return ret < 0 ? -1 : 0;
+}
+
+int spectator_list(CLIENT *client, GAME **games, int *ids, int max){
+    int n = 0;
+    pthread_mutex_lock(&spec.spec_lock);
+    for (SUBSCRIPTION *sub = spec.subs; sub && n < max; sub = sub->next) {
+        if (sub->client == client && sub->hub && !sub->ended) {
+            games[n] = game_ref(sub->hub->game, "subscription listed");
+            ids[n++] = sub->id;
+        }
+    }
+    pthread_mutex_unlock(&spec.spec_lock);
+    return n;
+}
+
+int spectator_unwatch(CLIENT *client, int id){
+    int ret = -1;
+    pthread_mutex_lock(&spec.spec_lock);
+    for (SUBSCRIPTION *sub = spec.subs; sub; sub = sub->next) {
+        if (sub->client == client && sub->id == id) {
+            free_subscription(sub);
+            ret = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&spec.spec_lock);
+    return ret;
+}
+
+void spectator_unwatch_all(CLIENT *client){
+    pthread_mutex_lock(&spec.spec_lock);
+    SUBSCRIPTION *sub = spec.subs;
+    while (sub) {
+        SUBSCRIPTION *next = sub->next;
+        if (sub->client == client) {
+            free_subscription(sub);
+        }
+        sub = next;
+    }
+    pthread_mutex_unlock(&spec.spec_lock);
+}
+
+void spectator_publish(GAME *game){
+    //nobody is watching anything: the common case costs one atomic load
+    if (!spec.running || atomic_load_explicit(&spec.nhubs, memory_order_relaxed) == 0) {
+        return;
+    }
+    //one encoding of each kind, shared by every subscriber
+    char *state = game_unparse_state(game);
+    FRAME *frame = frame_create(state, strlen(state));
+    unsigned char *packed = malloc(JEUX_PACKED_STATE_SIZE);
+    game_pack_state(game, packed);
+    enqueue_event(game, frame, frame_create((char *)packed, JEUX_PACKED_STATE_SIZE), NULL_ROLE);
+}
+
+void spectator_game_ended(GAME *game, GAME_ROLE winner){
+    if (!spec.running) {
+        return;
+    }
+    enqueue_event(game, NULL, NULL, winner);
+}
@@ -0,0 +1,235 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+
+#include "timer_wheel.h"
+#include "debug.h"
+
+/*
+ * A hierarchical timing wheel.  Timers due within TVR_SIZE ticks live in
+ * the root wheel, one slot per tick.  Timers further out live in one of
+ * the outer wheels, whose slots each cover a whole revolution of the wheel
+ * inside them.  Each time an inner wheel wraps around, the next slot of
+ * the wheel outside it is "cascaded": its timers are re-linked into the
+ * inner wheels according to their remaining time.  A timer is therefore
+ * moved at most once per level, and arming, cancelling and firing are all
+ * constant time no matter how many timers are armed.  With a 100ms tick
+ * the wheels span about 77 days; longer delays are clamped to that.
+ */
+#define TVR_BITS 8
+#define TVN_BITS 6
+#define TVN_LEVELS 3
+#define TVR_SIZE (1 << TVR_BITS)
+#define TVN_SIZE (1 << TVN_BITS)
+#define TVR_MASK (TVR_SIZE - 1)
+#define TVN_MASK (TVN_SIZE - 1)
+#define TW_MAX_TICKS ((1ULL << (TVR_BITS + TVN_LEVELS * TVN_BITS)) - 1)
+
+static struct {
+    pthread_t thread;
+    int running;
+    long tick_ms;
+    uint64_t now;                   /* Next tick to be processed */
+    TIMER tvr[TVR_SIZE];            /* Circular list heads, root wheel */
+    TIMER tvn[TVN_LEVELS][TVN_SIZE];        /* Outer wheels */
+    TIMER *firing;                  /* Timer whose callback is running */
+    pthread_mutex_t lock;
+    pthread_cond_t fired;
+} wheel = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .fired = PTHREAD_COND_INITIALIZER
+};
+
+/* The following functions must be called with the wheel lock held. */
+
+static void list_init(TIMER *head){
+    head->next = head->prev = head;
+}
+
+static void list_add(TIMER *head, TIMER *timer){
+    timer->next = head;
+    timer->prev = head->prev;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+static void link_timer(TIMER *timer){
+    uint64_t delta = timer->expires - wheel.now;
+    if ((int64_t)delta < 0) {
+        //already due: fire on the next tick
+        timer->expires = wheel.now;
+        delta = 0;
+    }
+    if (delta > TW_MAX_TICKS) {
+        timer->expires = wheel.now + TW_MAX_TICKS;
+        delta = TW_MAX_TICKS;
+    }
+    if (delta < TVR_SIZE) {
+        list_add(&wheel.tvr[timer->expires & TVR_MASK], timer);
+        return;
+    }
+    for (int level = 0; level < TVN_LEVELS; level++) {
+        int shift = TVR_BITS + level * TVN_BITS;
+        if (level == TVN_LEVELS - 1 || delta < (1ULL << (shift + TVN_BITS))) {
+            list_add(&wheel.tvn[level][(timer->expires >> shift) & TVN_MASK], timer);
+            return;
+        }
+    }
+}
+
+static void unlink_timer(TIMER *timer){
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = timer->prev = NULL;
+}
+
+/*
+ * Re-link every timer in one slot of an outer wheel.  Returns the slot
+ * index, so that a cascade into the next wheel out happens only when this
+ * one has also wrapped around.
+ */
+static int cascade(int level){
+    int index = (wheel.now >> (TVR_BITS + level * TVN_BITS)) & TVN_MASK;
+    TIMER *head = &wheel.tvn[level][index];
+    TIMER *timer = head->next;
+    list_init(head);
+    while (timer != head) {
+        TIMER *next = timer->next;
+        link_timer(timer);
+        timer = next;
+    }
+    return index;
+}
+
+static void run_tick(void){
+    int index = wheel.now & TVR_MASK;
+    if (!index) {
+        for (int level = 0; level < TVN_LEVELS && !cascade(level); level++)
+            ;
+    }
+    wheel.now++;
+    //detach the slot first: callbacks may arm timers that land in it again
+    TIMER expired;
+    TIMER *head = &wheel.tvr[index];
+    if (head->next == head) {
+        return;
+    }
+    expired.next = head->next;
+    expired.prev = head->prev;
+    expired.next->prev = &expired;
+    expired.prev->next = &expired;
+    list_init(head);
+    while (expired.next != &expired && wheel.running) {
+        TIMER *timer = expired.next;
+        unlink_timer(timer);
+        wheel.firing = timer;
+        pthread_mutex_unlock(&wheel.lock);
+        timer->func(timer->arg);
+        pthread_mutex_lock(&wheel.lock);
+        wheel.firing = NULL;
+        pthread_cond_broadcast(&wheel.fired);
+    }
+    //if stopping, leave the rest unarmed
+    while (expired.next != &expired) {
+        unlink_timer(expired.next);
+    }
+}
+
+static void *timer_wheel_thread(void *arg){
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    pthread_mutex_lock(&wheel.lock);
+    while (wheel.running) {
+        pthread_mutex_unlock(&wheel.lock);
+        deadline.tv_nsec += wheel.tick_ms * 1000000;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR)
+            ;
+        pthread_mutex_lock(&wheel.lock);
+        run_tick();
+    }
+    pthread_mutex_unlock(&wheel.lock);
+    return NULL;
+}
+
+int timer_wheel_init(long tick_ms){
+    if (tick_ms <= 0) {
+        return -1;
+    }
+    wheel.tick_ms = tick_ms;
+    wheel.now = 0;
+    for (int i = 0; i < TVR_SIZE; i++) {
+        list_init(&wheel.tvr[i]);
+    }
+    for (int level = 0; level < TVN_LEVELS; level++) {
+        for (int i = 0; i < TVN_SIZE; i++) {
+            list_init(&wheel.tvn[level][i]);
+        }
+    }
+    wheel.running = 1;
+    if (pthread_create(&wheel.thread, NULL, timer_wheel_thread, NULL)) {
+        wheel.running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+void timer_wheel_fini(void){
+    pthread_mutex_lock(&wheel.lock);
+    if (!wheel.running) {
+        pthread_mutex_unlock(&wheel.lock);
+        return;
+    }
+    wheel.running = 0;
+    pthread_mutex_unlock(&wheel.lock);
+    pthread_join(wheel.thread, NULL);
+}
+
+void timer_init(TIMER *timer, TIMER_FUNC *func, void *arg){
+    timer->next = timer->prev = NULL;
+    timer->expires = 0;
+    timer->func = func;
+    timer->arg = arg;
+}
+
+int timer_arm(TIMER *timer, long delay_ms){
+    if (!wheel.tick_ms) {
+        //the wheel was never started, so nothing would ever fire
+        return 0;
+    }
+    uint64_t ticks = (delay_ms + wheel.tick_ms - 1) / wheel.tick_ms;
+    int armed = 0;
+    pthread_mutex_lock(&wheel.lock);
+    if (timer->next) {
+        unlink_timer(timer);
+        armed = 1;
+    }
+    //the current tick may be nearly over, so count whole ticks after it
+    timer->expires = wheel.now + ticks;
+    link_timer(timer);
+    pthread_mutex_unlock(&wheel.lock);
+    return armed;
+}
+
+int timer_pending(TIMER *timer){
+    pthread_mutex_lock(&wheel.lock);
+    int armed = timer->next != NULL;
+    pthread_mutex_unlock(&wheel.lock);
+    return armed;
+}
+
+int timer_cancel(TIMER *timer){
+    int ret = 0;
+    pthread_mutex_lock(&wheel.lock);
+    if (timer->next) {
+        unlink_timer(timer);
+        ret = 1;
+    }
+    while (wheel.firing == timer && !pthread_equal(pthread_self(), wheel.thread)) {
+        pthread_cond_wait(&wheel.fired, &wheel.lock);
+    }
+    pthread_mutex_unlock(&wheel.lock);
+    return ret;
+}
@@ -0,0 +1,624 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "upgrade.h"
+#include "protocol_ext.h"
+#include "jeux_globals.h"
+#include "client_ext.h"
+#include "client_registry_ext.h"
+#include "player_registry_ext.h"
+#include "player_ext.h"
+#include "invitation_ext.h"
+#include "game_ext.h"
+#include "server_ext.h"
+#include "session.h"
+#include "spectator.h"
+#include "rating.h"
+#include "intern.h"
+#include "debug.h"
+#include "csapp.h"
+
+#define UPGRADE_MAGIC 0x4a585550    /* "JXUP" */
+#define UPGRADE_VERSION 1
+
+/* Most descriptors passed with one message. */
+#define UPGRADE_FD_BATCH 250
+
+/* How long the old server waits for the new one to have taken over. */
+#define UPGRADE_COMMIT_MS 10000
+
+/* Most watches listed for one client. */
+#define UPGRADE_WATCHES 256
+
+/*
+ * The state of the server as it is handed over, in the byte order of the
+ * host, since both servers run on it:
+ *
+ *   magic, version, number of descriptors that follow
+ *   players: count, then name and rating of each
+ *   clients: count, then for each whether it is logged in, its name,
+ *            caps, resume token (empty if none) and unread bytes
+ *   invitations: count, then for each the indices of its source and
+ *            target among the clients, their roles, whether it has been
+ *            accepted and the packed state of its game
+ *   tables: for each client, the number of its invitations and their
+ *            indices, in the order of their IDs
+ *   watches: count, then for each the index of the client, the index
+ *            of the invitation of the game and the watch ID
+ *
+ * The descriptors are the listening socket and then the connection of
+ * each client.
+ */
+typedef struct blob {
+    char *buf;
+    size_t len;                     /* Written, or read so far */
+    size_t cap;                     /* Allocated, or the size to read */
+    int failed;                     /* Read past the end */
+} BLOB;
+
+/*
+ * The server listening for a successor.
+ */
+static struct {
+    int sock;
+    int listen_fd;
+    pthread_t thread;
+} upgrade = {
+    .sock = -1,
+    .listen_fd = -1
+};
+
+static void put(BLOB *b, const void *data, size_t len){
+    if (b->len + len > b->cap) {
+        size_t cap = b->cap ? b->cap : 4096;
+        while (cap < b->len + len) {
+            cap *= 2;
+        }
+        b->buf = realloc(b->buf, cap);
+        b->cap = cap;
+    }
+    memcpy(b->buf + b->len, data, len);
+    b->len += len;
+}
+
+static void put_u32(BLOB *b, uint32_t value){
+    put(b, &value, sizeof(value));
+}
+
+static void put_bytes(BLOB *b, const void *data, size_t len){
+    put_u32(b, len);
+    put(b, data, len);
+}
+
+static void get(BLOB *b, void *data, size_t len){
+    if (b->failed || b->cap - b->len < len) {
+        b->failed = 1;
+        memset(data, 0, len);
+        return;
+    }
+    memcpy(data, b->buf + b->len, len);
+    b->len += len;
+}
+
+static uint32_t get_u32(BLOB *b){
+    uint32_t value;
+    get(b, &value, sizeof(value));
+    return value;
+}
+
+/*
+ * Get bytes that were put with put_bytes(), returning a pointer into the
+ * blob.
+ */
+static char *get_bytes(BLOB *b, uint32_t *lenp){
+    *lenp = get_u32(b);
+    if (b->failed || b->cap - b->len < *lenp) {
+        b->failed = 1;
+        *lenp = 0;
+        return NULL;
+    }
+    char *data = b->buf + b->len;
+    b->len += *lenp;
+    return data;
+}
+
+/*
+ * Send all of a buffer, without being killed by SIGPIPE if the other end
+ * has gone.
+ */
+static int send_all(int sock, const void *buf, size_t len){
+    while (len) {
+        ssize_t n = send(sock, buf, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        buf = (const char *)buf + n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int send_fds(int sock, int *fds, int n){
+    for (int i = 0; i < n; i += UPGRADE_FD_BATCH) {
+        int k = n - i < UPGRADE_FD_BATCH ? n - i : UPGRADE_FD_BATCH;
+        char byte = 0;
+        struct iovec iov = { &byte, 1 };
+        union {
+            struct cmsghdr hdr;
+            char buf[CMSG_SPACE(UPGRADE_FD_BATCH * sizeof(int))];
+        } control;
+        struct msghdr msg = {0};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(k * sizeof(int));
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(k * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds + i, k * sizeof(int));
+        if (sendmsg(sock, &msg, MSG_NOSIGNAL) != 1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int recv_fds(int sock, int *fds, int n){
+    for (int i = 0; i < n; ) {
+        char byte;
+        struct iovec iov = { &byte, 1 };
+        union {
+            struct cmsghdr hdr;
+            char buf[CMSG_SPACE(UPGRADE_FD_BATCH * sizeof(int))];
+        } control;
+        struct msghdr msg = {0};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        ssize_t r = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        struct cmsghdr *cmsg = r == 1 ? CMSG_FIRSTHDR(&msg) : NULL;
+        if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS || (msg.msg_flags & MSG_CTRUNC)) {
+            return -1;
+        }
+        int k = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        if (k > n - i) {
+            return -1;
+        }
+        memcpy(fds + i, CMSG_DATA(cmsg), k * sizeof(int));
+        i += k;
+    }
+    return 0;
+}
+
+static int compare_ptr(const void *a, const void *b){
+    uintptr_t x = (uintptr_t)*(void **)a, y = (uintptr_t)*(void **)b;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Find the index of a pointer in a sorted array, or -1.
+ */
+static int find_ptr(void **sorted, int n, void *ptr){
+    void **found = bsearch(&ptr, sorted, n, sizeof(void *), compare_ptr);
+    return found ? found - sorted : -1;
+}
+
+/*
+ * Find the index of a CLIENT among those handed over, or -1.  There are
+ * no more than MAX_CLIENTS of them.
+ */
+static int client_index(CLIENT **clients, int nclients, CLIENT *client){
+    for (int i = 0; i < nclients; i++) {
+        if (clients[i] == client) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Write out the state of the server, for the given clients, with what
+ * their threads had read of their requests.
+ */
+static void serialize(BLOB *b, CLIENT **clients, int nclients, char **unread, size_t *unread_len){
+    put_u32(b, UPGRADE_MAGIC);
+    put_u32(b, UPGRADE_VERSION);
+    put_u32(b, nclients + 1);
+    PLAYER **players = preg_all_players(player_registry);
+    uint32_t nplayers = 0;
+    while (players[nplayers]) {
+        nplayers++;
+    }
+    put_u32(b, nplayers);
+    for (uint32_t i = 0; i < nplayers; i++) {
+        char *name = player_get_name(players[i]);
+        put_bytes(b, name, strlen(name));
+        double rating = player_get_rating_exact(players[i]);
+        put(b, &rating, sizeof(rating));
+        player_unref(players[i], "player handed over");
+    }
+    free(players);
+    put_u32(b, nclients);
+    INVITATION ***tables = malloc(nclients * sizeof(INVITATION **));
+    size_t ninvs = 0;
+    for (int i = 0; i < nclients; i++) {
+        PLAYER *player = client_get_player(clients[i]);
+        char *name = player ? player_get_name(player) : "";
+        char token[SESSION_TOKEN_LEN + 1] = "";
+        session_get_token(clients[i], token);
+        put(b, &(uint8_t){ player != NULL }, 1);
+        put_bytes(b, name, strlen(name));
+        put_u32(b, client_get_caps(clients[i]));
+        put_bytes(b, token, strlen(token));
+        put_bytes(b, unread[i], unread_len[i]);
+        tables[i] = client_get_invitations(clients[i]);
+        for (int j = 0; tables[i][j]; j++) {
+            ninvs++;
+        }
+    }
+    //each invitation is in two tables, and is listed once
+    INVITATION **invs = malloc((ninvs + 1) * sizeof(INVITATION *));
+    size_t n = 0;
+    for (int i = 0; i < nclients; i++) {
+        for (int j = 0; tables[i][j]; j++) {
+            invs[n++] = tables[i][j];
+        }
+    }
+    qsort(invs, n, sizeof(INVITATION *), compare_ptr);
+    ninvs = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (!ninvs || invs[ninvs - 1] != invs[i]) {
+            invs[ninvs++] = invs[i];
+        }
+    }
+    put_u32(b, ninvs);
+    for (size_t i = 0; i < ninvs; i++) {
+        GAME *game = inv_get_game(invs[i]);
+        uint8_t state[JEUX_PACKED_STATE_SIZE] = {0};
+        if (game) {
+            game_pack_state(game, state);
+        }
+        put_u32(b, client_index(clients, nclients, inv_get_source(invs[i])));
+        put_u32(b, client_index(clients, nclients, inv_get_target(invs[i])));
+        put(b, &(uint8_t){ inv_get_source_role(invs[i]) }, 1);
+        put(b, &(uint8_t){ inv_get_target_role(invs[i]) }, 1);
+        put(b, &(uint8_t){ game != NULL }, 1);
+        put(b, state, sizeof(state));
+    }
+    for (int i = 0; i < nclients; i++) {
+        uint32_t len = 0;
+        while (tables[i][len]) {
+            len++;
+        }
+        put_u32(b, len);
+        for (uint32_t j = 0; j < len; j++) {
+            put_u32(b, find_ptr((void **)invs, ninvs, tables[i][j]));
+        }
+    }
+    //a game is found through the invitation it belongs to
+    BLOB watches = {0};
+    uint32_t nwatches = 0;
+    for (int i = 0; i < nclients; i++) {
+        GAME *games[UPGRADE_WATCHES];
+        int ids[UPGRADE_WATCHES];
+        int k = spectator_list(clients[i], games, ids, UPGRADE_WATCHES);
+        for (int j = 0; j < k; j++) {
+            for (size_t m = 0; m < ninvs; m++) {
+                if (inv_get_game(invs[m]) == games[j]) {
+                    put_u32(&watches, i);
+                    put_u32(&watches, m);
+                    put_u32(&watches, ids[j]);
+                    nwatches++;
+                    break;
+                }
+            }
+            game_unref(games[j], "watch handed over");
+        }
+    }
+    put_u32(b, nwatches);
+    put(b, watches.buf, watches.len);
+    free(watches.buf);
+    for (int i = 0; i < nclients; i++) {
+        for (int j = 0; tables[i][j]; j++) {
+            inv_unref(tables[i][j], "invitation handed over");
+        }
+        free(tables[i]);
+    }
+    free(tables);
+    free(invs);
+}
+
+/*
+ * Register the clients of a blob on their connections, with their
+ * invitations, games and watches, storing them and their unread bytes.
+ * Returns 0 if successful, otherwise -1.
+ */
+static int restore(BLOB *b, int *fds, CLIENT **clients, int nclients, char **unread, uint32_t *unread_len){
+    uint32_t nplayers = get_u32(b);
+    for (uint32_t i = 0; i < nplayers && !b->failed; i++) {
+        uint32_t len;
+        char *name = get_bytes(b, &len);
+        double rating;
+        get(b, &rating, sizeof(rating));
+        int name_id = b->failed ? -1 : intern(name, len);
+        PLAYER *player = name_id < 0 ? NULL : preg_register_interned(player_registry, name_id);
+        if (!player) {
+            return -1;
+        }
+        //no result can have been posted yet for the rating service to apply
+        player_set_rating(player, rating);
+        player_unref(player, "player taken over");
+    }
+    if (get_u32(b) != (uint32_t)nclients) {
+        return -1;
+    }
+    for (int i = 0; i < nclients && !b->failed; i++) {
+        uint8_t logged_in;
+        get(b, &logged_in, 1);
+        uint32_t name_len, token_len;
+        char *name = get_bytes(b, &name_len);
+        int caps = get_u32(b);
+        char *token = get_bytes(b, &token_len);
+        unread[i] = get_bytes(b, &unread_len[i]);
+        clients[i] = b->failed ? NULL : creg_register(client_registry, fds[i]);
+        if (!clients[i]) {
+            return -1;
+        }
+        client_set_caps(clients[i], caps);
+        if (logged_in) {
+            int name_id = intern(name, name_len);
+            PLAYER *player = name_id < 0 ? NULL : preg_register_interned(player_registry, name_id);
+            if (!player || client_login(clients[i], player)) {
+                return -1;
+            }
+        }
+        if (logged_in && token_len == SESSION_TOKEN_LEN) {
+            char buf[SESSION_TOKEN_LEN + 1];
+            memcpy(buf, token, token_len);
+            buf[token_len] = '\0';
+            session_adopt(clients[i], buf);
+        }
+    }
+    uint32_t ninvs = get_u32(b);
+    if (b->failed || ninvs > (b->cap - b->len) / 4) {
+        return -1;
+    }
+    INVITATION **invs = calloc(ninvs + 1, sizeof(INVITATION *));
+    int ret = 0;
+    for (uint32_t i = 0; i < ninvs && !ret; i++) {
+        uint32_t source = get_u32(b);
+        uint32_t target = get_u32(b);
+        uint8_t roles[3];
+        uint8_t state[JEUX_PACKED_STATE_SIZE];
+        get(b, roles, sizeof(roles));
+        get(b, state, sizeof(state));
+        if (b->failed) {
+            ret = -1;
+        }
+        else if (source >= (uint32_t)nclients || target >= (uint32_t)nclients) {
+            //with a client that was not handed over
+            continue;
+        }
+        else if (!(invs[i] = inv_create(clients[source], clients[target], roles[0], roles[1]))) {
+            ret = -1;
+        }
+        else if (roles[2]) {
+            inv_accept(invs[i]);
+            game_unpack_state(inv_get_game(invs[i]), state);
+        }
+    }
+    for (int i = 0; i < nclients && !ret; i++) {
+        uint32_t len = get_u32(b);
+        for (uint32_t j = 0; j < len && !b->failed; j++) {
+            uint32_t k = get_u32(b);
+            if (k < ninvs && invs[k]) {
+                client_add_invitation(clients[i], invs[k]);
+            }
+        }
+        ret = b->failed ? -1 : 0;
+    }
+    uint32_t nwatches = ret ? 0 : get_u32(b);
+    for (uint32_t i = 0; i < nwatches && !b->failed; i++) {
+        uint32_t client = get_u32(b);
+        uint32_t inv = get_u32(b);
+        int id = get_u32(b);
+        if (!b->failed && client < (uint32_t)nclients && inv < ninvs && invs[inv] && inv_get_game(invs[inv])) {
+            spectator_watch_id(clients[client], inv_get_game(invs[inv]), id);
+        }
+    }
+    for (uint32_t i = 0; i < ninvs; i++) {
+        if (invs[i]) {
+            inv_unref(invs[i], "invitation taken over");
+        }
+    }
+    free(invs);
+    return ret || b->failed ? -1 : 0;
+}
+
+int upgrade_takeover(char *path){
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return -2;
+    }
+    strcpy(addr.sun_path, path);
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        return -2;
+    }
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+        //nobody listens, so this is the first server
+        close(sock);
+        return -1;
+    }
+    BLOB b = {0};
+    uint32_t len;
+    if (rio_readn(sock, &len, sizeof(len)) != sizeof(len) || !(b.buf = malloc(len)) ||
+        rio_readn(sock, b.buf, len) != len) {
+        free(b.buf);
+        close(sock);
+        return -2;
+    }
+    b.cap = len;
+    uint32_t nfds = 0;
+    if (get_u32(&b) == UPGRADE_MAGIC && get_u32(&b) == UPGRADE_VERSION) {
+        nfds = get_u32(&b);
+    }
+    int *fds = nfds ? malloc(nfds * sizeof(int)) : NULL;
+    int nclients = nfds - 1;
+    CLIENT **clients = calloc(nfds, sizeof(CLIENT *));
+    char **unread = calloc(nfds, sizeof(char *));
+    uint32_t *unread_len = calloc(nfds, sizeof(uint32_t));
+    //once the new server has said so, the old one leaves the clients to it
+    if (!fds || b.failed || recv_fds(sock, fds, nfds) ||
+        restore(&b, fds + 1, clients, nclients, unread, unread_len) ||
+        send_all(sock, "", 1)) {
+        //the old server goes on serving the clients, so nothing is undone
+        debug("takeover from %s failed", path);
+        free(fds);
+        free(clients);
+        free(unread);
+        free(unread_len);
+        free(b.buf);
+        close(sock);
+        return -2;
+    }
+    close(sock);
+    for (int i = 0; i < nclients; i++) {
+        client_start_clocks(clients[i]);
+    }
+    for (int i = 0; i < nclients; i++) {
+        if (jeux_serve_client(clients[i], unread[i], unread_len[i])) {
+            close(client_detach(clients[i]));
+            client_logout(clients[i]);
+            session_end(clients[i]);
+            creg_unregister(client_registry, clients[i]);
+        }
+    }
+    debug("took over %d clients from %s", nclients, path);
+    int listen_fd = fds[0];
+    free(fds);
+    free(clients);
+    free(unread);
+    free(unread_len);
+    free(b.buf);
+    return listen_fd;
+}
+
+/*
+ * Hand the server over to a successor that has connected, exiting once it
+ * has taken over, or else going on serving the clients.
+ */
+static void hand_over(int sock){
+    jeux_quiesce();
+    session_expire_parked();
+    rating_flush();
+    CLIENT **all = creg_all_clients(client_registry);
+    int n = 0;
+    while (all[n]) {
+        n++;
+    }
+    //only clients attached to their connections can be handed over
+    CLIENT **clients = malloc(n * sizeof(CLIENT *));
+    int *fds = malloc((n + 1) * sizeof(int));
+    char **unread = malloc(n * sizeof(char *));
+    size_t *unread_len = malloc(n * sizeof(size_t));
+    int nclients = 0;
+    fds[0] = upgrade.listen_fd;
+    for (int i = 0; i < n; i++) {
+        if (client_get_fd(all[i]) < 0) {
+            client_unref(all[i], "client not handed over");
+            continue;
+        }
+        clients[nclients] = all[i];
+        client_stop_clocks(all[i]);
+        unread[nclients] = jeux_take_unread(all[i], &unread_len[nclients]);
+        nclients++;
+    }
+    free(all);
+    //nothing more is written to a parked connection, whatever happens meanwhile
+    for (int i = 0; i < nclients; i++) {
+        client_flush_notices(clients[i]);
+        fds[i + 1] = client_park(clients[i], SESSION_HELD_PACKETS);
+    }
+    BLOB b = {0};
+    serialize(&b, clients, nclients, unread, unread_len);
+    uint32_t len = b.len;
+    struct pollfd pfd = { .fd = sock, .events = POLLIN };
+    char byte;
+    if (send_all(sock, &len, sizeof(len)) == 0 && send_all(sock, b.buf, len) == 0 &&
+        send_fds(sock, fds, nclients + 1) == 0 && poll(&pfd, 1, UPGRADE_COMMIT_MS) == 1 &&
+        read(sock, &byte, 1) == 1) {
+        debug("handed over %d clients", nclients);
+        _exit(EXIT_SUCCESS);
+    }
+    debug("handover failed, serving on");
+    free(b.buf);
+    for (int i = 0; i < nclients; i++) {
+        client_unpark(clients[i], fds[i + 1]);
+    }
+    jeux_resume();
+    for (int i = 0; i < nclients; i++) {
+        client_start_clocks(clients[i]);
+        if (jeux_serve_client(clients[i], unread[i], unread_len[i])) {
+            jeux_end_connection(clients[i]);
+        }
+        free(unread[i]);
+        client_unref(clients[i], "client kept");
+    }
+    free(clients);
+    free(fds);
+    free(unread);
+    free(unread_len);
+}
+
+static void *upgrade_service(void *arg){
+    while (1) {
+        int fd = accept(upgrade.sock, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            return NULL;
+        }
+        hand_over(fd);
+        close(fd);
+    }
+}
+
+int upgrade_listen(char *path, int listen_fd){
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    //the old server, if any, keeps listening on the file it has until it exits
+    unlink(path);
+    upgrade.sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    upgrade.listen_fd = listen_fd;
+    if (upgrade.sock < 0 || bind(upgrade.sock, (struct sockaddr *)&addr, sizeof(addr)) ||
+        listen(upgrade.sock, 1) || pthread_create(&upgrade.thread, NULL, upgrade_service, NULL)) {
+        if (upgrade.sock >= 0) {
+            close(upgrade.sock);
+        }
+        upgrade.sock = -1;
+        return -1;
+    }
+    pthread_detach(upgrade.thread);
+    return 0;
+}
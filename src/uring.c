@@ -0,0 +1,831 @@
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+
+#include "uring.h"
+#include "server_ext.h"
+#include "client_ext.h"
+#include "protocol_ext.h"
+#include "workq.h"
+#include "debug.h"
+
+#define URING_SQ_ENTRIES 256
+#define URING_CQ_ENTRIES 4096
+
+/* Provided buffers for recv; the count must be a power of two. */
+#define URING_BUFFERS 512
+#define URING_BUFFER_SIZE 4096
+#define URING_BUFFER_GROUP 0
+
+/*
+ * What a completion is for, kept in the low bits of its user data, the
+ * rest being the connection, if any.
+ */
+typedef enum {
+    URING_ACCEPT, URING_WAKE, URING_RECV, URING_SEND, URING_NOTIFY
+} URING_OP;
+
+#define URING_OP_MASK 7
+
+/*
+ * A strand shared by the connections of the two players of a game, so
+ * that the requests of both are carried out one at a time by one worker,
+ * rather than by two contending for the game, its invitation and each
+ * other's clients.  Once nothing refers to it, it is freed by a last task
+ * on its strand.
+ */
+typedef struct uring_group {
+    WORKQ_STRAND strand;
+    WORKQ_TASK end;
+    int refs;                       /* Under group_lock */
+} URING_GROUP;
+
+/*
+ * A connection served by the event loop.  Only the event loop thread
+ * touches it, except that when requests are carried out by workers, the
+ * client is touched only by the tasks that the connection posts, which in
+ * the end release the connection.  A connection whose player is in a game
+ * joins the game's group, and posts to the group's strand from the first
+ * time it has no requests in flight, until its games have ended.  The
+ * event loop reads the eventfd of the client's mailbox along with the
+ * connection, and has what is posted to it written out in turn with the
+ * replies to the client's requests.
+ */
+typedef struct uring_conn {
+    int fd;
+    CLIENT *client;
+    PROTO_READER *reader;           /* Bytes received, not yet served */
+    char *send_buf;                 /* Output being sent, if any */
+    size_t send_len;
+    size_t send_off;
+    int recv_armed;                 /* A multishot recv is outstanding */
+    int notify_fd;                  /* Eventfd of the client's mailbox */
+    uint64_t notify_count;
+    int notify_armed;               /* A read of it is outstanding */
+    int notify_ended;               /* It has been written to end that read */
+    int notified;                   /* The mailbox has something to write */
+    int closed;                     /* Nothing more will be received */
+    atomic_int done;                /* A request ended the connection */
+    int queued;                     /* On the list of connections to process */
+    struct uring_conn *next;
+    WORKQ_STRAND strand;            /* Requests handed to workers */
+    atomic_int in_flight;           /* Requests on the strand, not yet carried out */
+    WORKQ_TASK end;                 /* Releases the connection */
+    WORKQ_TASK flush;               /* Writes out the mailbox */
+    atomic_int flush_posted;
+    URING_GROUP *joined;            /* Group to post to, under group_lock */
+    int games;                      /* Games in progress, under group_lock */
+    atomic_int regroup;             /* joined has changed */
+    URING_GROUP *group;             /* Group being posted to, if any */
+} URING_CONN;
+
+/*
+ * A request handed to a worker.
+ */
+typedef struct uring_request {
+    WORKQ_TASK task;
+    URING_CONN *conn;
+    JEUX_PACKET_HEADER hdr;
+    void *payload;
+} URING_REQUEST;
+
+static struct {
+    pthread_t thread;
+    int running;
+    int pooled;                     /* Requests are carried out by workers */
+    pthread_mutex_t group_lock;     /* Protects groups and what connections have joined */
+    atomic_int stopping;
+    int ring_fd;
+    int listen_fd;
+    int wake_fd;                    /* Written to stop the event loop, or to hand it connections */
+    uint64_t wake_count;
+    pthread_mutex_t adopt_lock;     /* Protects the connections handed over */
+    int *adopted;
+    int nadopted;
+    int adopted_cap;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    unsigned to_submit;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_map;
+    void *cq_map;
+    size_t sq_map_len;
+    size_t cq_map_len;
+    size_t sqes_len;
+    struct io_uring_buf_ring *buf_ring;
+    char *buffers;
+    unsigned short buf_tail;
+    URING_CONN *queue;              /* Connections with something to do */
+    atomic_long enters;
+} uring = {
+    .ring_fd = -1,
+    .wake_fd = -1,
+    .group_lock = PTHREAD_MUTEX_INITIALIZER,
+    .adopt_lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+static int ring_enter(unsigned to_submit, unsigned min_complete, unsigned flags){
+    atomic_fetch_add_explicit(&uring.enters, 1, memory_order_relaxed);
+    return syscall(__NR_io_uring_enter, uring.ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+/*
+ * Get a zeroed submission queue entry, handing the queued ones to the
+ * kernel first if the queue is full.
+ */
+static struct io_uring_sqe *get_sqe(URING_OP op, URING_CONN *conn){
+    unsigned tail = *uring.sq_tail;
+    while (tail - __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE) == uring.sq_entries) {
+        int n = ring_enter(uring.to_submit, 0, 0);
+        if (n > 0) {
+            uring.to_submit -= n;
+        }
+    }
+    unsigned index = tail & *uring.sq_mask;
+    struct io_uring_sqe *sqe = &uring.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = (uintptr_t)conn | op;
+    uring.sq_array[index] = index;
+    __atomic_store_n(uring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    uring.to_submit++;
+    return sqe;
+}
+
+static void arm_accept(void){
+    struct io_uring_sqe *sqe = get_sqe(URING_ACCEPT, NULL);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = uring.listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+}
+
+static void arm_wake(void){
+    struct io_uring_sqe *sqe = get_sqe(URING_WAKE, NULL);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = uring.wake_fd;
+    sqe->addr = (uintptr_t)&uring.wake_count;
+    sqe->len = sizeof(uring.wake_count);
+    sqe->off = -1;
+}
+
+static void arm_recv(URING_CONN *conn){
+    struct io_uring_sqe *sqe = get_sqe(URING_RECV, conn);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    conn->recv_armed = 1;
+}
+
+static void arm_notify(URING_CONN *conn){
+    struct io_uring_sqe *sqe = get_sqe(URING_NOTIFY, conn);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = conn->notify_fd;
+    sqe->addr = (uintptr_t)&conn->notify_count;
+    sqe->len = sizeof(conn->notify_count);
+    sqe->off = -1;
+    conn->notify_armed = 1;
+}
+
+static void submit_send(URING_CONN *conn){
+    struct io_uring_sqe *sqe = get_sqe(URING_SEND, conn);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->fd;
+    sqe->addr = (uintptr_t)(conn->send_buf + conn->send_off);
+    sqe->len = conn->send_len - conn->send_off;
+    sqe->msg_flags = MSG_NOSIGNAL;
+}
+
+/*
+ * Give a provided buffer back to the kernel.
+ */
+static void recycle(unsigned short bid){
+    struct io_uring_buf *buf = &uring.buf_ring->bufs[uring.buf_tail & (URING_BUFFERS - 1)];
+    buf->addr = (uintptr_t)(uring.buffers + (size_t)bid * URING_BUFFER_SIZE);
+    buf->len = URING_BUFFER_SIZE;
+    buf->bid = bid;
+    uring.buf_tail++;
+    __atomic_store_n(&uring.buf_ring->tail, uring.buf_tail, __ATOMIC_RELEASE);
+}
+
+static void queue(URING_CONN *conn){
+    if (!conn->queued) {
+        conn->queued = 1;
+        conn->next = uring.queue;
+        uring.queue = conn;
+    }
+}
+
+static void accepted(int fd){
+    CLIENT *client = creg_register(client_registry, fd);
+    if (!client) {
+        //registry is full
+        close(fd);
+        return;
+    }
+    if (uring.pooled) {
+        //workers write notifications as they go, and Nagle's algorithm would
+        //hold back the second of two until the client acknowledged the first
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    URING_CONN *conn = calloc(1, sizeof(URING_CONN));
+    PROTO_READER *reader = conn ? proto_reader_create(-1) : NULL;
+    if (!reader) {
+        free(conn);
+        close(client_detach(client));
+        creg_unregister(client_registry, client);
+        return;
+    }
+    conn->fd = fd;
+    conn->client = client;
+    conn->reader = reader;
+    conn->notify_fd = client_open_mailbox(client);
+    workq_strand_init(&conn->strand);
+    pthread_mutex_lock(&uring.group_lock);
+    client_set_io(client, conn);
+    pthread_mutex_unlock(&uring.group_lock);
+    client_start_watchdog(client);
+    arm_recv(conn);
+    arm_notify(conn);
+}
+
+/*
+ * Start serving the connections handed over by uring_adopt().
+ */
+static void adopt_all(void){
+    pthread_mutex_lock(&uring.adopt_lock);
+    int *fds = uring.adopted;
+    int n = uring.nadopted;
+    uring.adopted = NULL;
+    uring.nadopted = uring.adopted_cap = 0;
+    pthread_mutex_unlock(&uring.adopt_lock);
+    for (int i = 0; i < n; i++) {
+        accepted(fds[i]);
+    }
+    free(fds);
+}
+
+static void complete(struct io_uring_cqe *cqe){
+    URING_OP op = cqe->user_data & URING_OP_MASK;
+    URING_CONN *conn = (URING_CONN *)(uintptr_t)(cqe->user_data & ~(uint64_t)URING_OP_MASK);
+    int more = cqe->flags & IORING_CQE_F_MORE;
+    switch (op) {
+        case URING_ACCEPT:
+            if (cqe->res >= 0) {
+                accepted(cqe->res);
+            }
+            if (!more && !atomic_load(&uring.stopping)) {
+                arm_accept();
+            }
+            break;
+        case URING_WAKE:
+            adopt_all();
+            if (!atomic_load(&uring.stopping)) {
+                arm_wake();
+            }
+            break;
+        case URING_RECV:
+            if (cqe->res > 0) {
+                unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+                if (proto_reader_feed(conn->reader, uring.buffers + (size_t)bid * URING_BUFFER_SIZE, cqe->res)) {
+                    conn->closed = 1;
+                    shutdown(conn->fd, SHUT_RD);
+                }
+                recycle(bid);
+            }
+            else if (cqe->res != -ENOBUFS) {
+                //end-of-file, or the connection failed
+                conn->closed = 1;
+            }
+            if (!more) {
+                conn->recv_armed = 0;
+                if (!conn->closed && !conn->done) {
+                    arm_recv(conn);
+                }
+            }
+            queue(conn);
+            break;
+        case URING_SEND:
+            if (cqe->res < 0) {
+                //the recv will see the connection end
+                shutdown(conn->fd, SHUT_RDWR);
+                conn->send_off = conn->send_len;
+            }
+            else {
+                conn->send_off += cqe->res;
+            }
+            if (conn->send_off < conn->send_len) {
+                submit_send(conn);
+                break;
+            }
+            free(conn->send_buf);
+            conn->send_buf = NULL;
+            queue(conn);
+            break;
+        case URING_NOTIFY:
+            conn->notify_armed = 0;
+            conn->notified = 1;
+            if (!conn->closed && !conn->done) {
+                arm_notify(conn);
+            }
+            queue(conn);
+            break;
+    }
+}
+
+/*
+ * Determine whether a connection that has ended has nothing outstanding
+ * on the ring, getting the read of its eventfd to complete if need be.
+ */
+static int drained(URING_CONN *conn){
+    if (conn->notify_armed && !conn->notify_ended) {
+        conn->notify_ended = 1;
+        eventfd_write(conn->notify_fd, 1);
+    }
+    return !conn->recv_armed && !conn->notify_armed;
+}
+
+/*
+ * Count a task on a connection's strand as done, sending the replies held
+ * back if it was the last in flight.  The replies go out first: once the
+ * count drops to zero, regroup() may move the connection to another
+ * strand, whose tasks must not find it still being uncorked here.  A task
+ * posted in between corks the client again.
+ */
+static void finish(URING_CONN *conn){
+    if (atomic_load(&conn->in_flight) == 1) {
+        client_uncork(conn->client);
+    }
+    atomic_fetch_sub(&conn->in_flight, 1);
+}
+
+/*
+ * Carry out a request on a worker.  The replies to the requests that
+ * were handed over together are held back until the last of them has
+ * been carried out, and are then written together by the worker.
+ */
+static void serve(WORKQ_TASK *task){
+    URING_REQUEST *req = (URING_REQUEST *)task;
+    URING_CONN *conn = req->conn;
+    if (!conn->done) {
+        client_touch(conn->client);
+        client_cork(conn->client);
+        CLIENT *next = jeux_serve_request(conn->client, &req->hdr, req->payload);
+        if (next && next != conn->client) {
+            //a resumed session; the client that logged in to resume it is gone
+            pthread_mutex_lock(&uring.group_lock);
+            client_set_io(next, conn);
+            pthread_mutex_unlock(&uring.group_lock);
+        }
+        if (next) {
+            conn->client = next;
+        }
+        else {
+            //the event loop discards whatever else is received
+            conn->done = 1;
+            shutdown(conn->fd, SHUT_RD);
+        }
+    }
+    finish(conn);
+    free(req->payload);
+    free(req);
+}
+
+/*
+ * Write out a connection's mailbox on a worker, in turn with its requests.
+ */
+static void flush(WORKQ_TASK *task){
+    URING_CONN *conn = (URING_CONN *)((char *)task - offsetof(URING_CONN, flush));
+    atomic_store(&conn->flush_posted, 0);
+    client_flush_notices(conn->client);
+    finish(conn);
+}
+
+static void group_free(WORKQ_TASK *task){
+    free((char *)task - offsetof(URING_GROUP, end));
+}
+
+/*
+ * Drop a reference to a group.  Must be called with group_lock held.
+ */
+static void group_unref(URING_GROUP *group){
+    if (--group->refs == 0) {
+        group->end.run = group_free;
+        workq_strand_finish(&group->strand, &group->end);
+    }
+}
+
+static void join(URING_CONN *conn, URING_GROUP *group){
+    conn->games++;
+    if (!conn->joined) {
+        conn->joined = group;
+        group->refs++;
+        conn->regroup = 1;
+    }
+}
+
+static void leave(URING_CONN *conn){
+    if (!conn || !conn->games || --conn->games || !conn->joined) {
+        return;
+    }
+    group_unref(conn->joined);
+    conn->joined = NULL;
+    conn->regroup = 1;
+}
+
+/*
+ * Hooks called by client.c as games start and end.  The connections of
+ * the two players join the group of whichever of them is in one already,
+ * or else a new one.
+ */
+static void game_started(CLIENT *source, CLIENT *target){
+    pthread_mutex_lock(&uring.group_lock);
+    URING_CONN *a = client_get_io(source);
+    URING_CONN *b = client_get_io(target);
+    URING_GROUP *group = NULL;
+    if (a && b) {
+        group = a->joined ? a->joined : b->joined;
+    }
+    if (a && b && !group && (group = calloc(1, sizeof(URING_GROUP)))) {
+        workq_strand_init(&group->strand);
+    }
+    if (group) {
+        join(a, group);
+        join(b, group);
+    }
+    pthread_mutex_unlock(&uring.group_lock);
+}
+
+static void game_ended(CLIENT *source, CLIENT *target){
+    pthread_mutex_lock(&uring.group_lock);
+    leave(client_get_io(source));
+    leave(client_get_io(target));
+    pthread_mutex_unlock(&uring.group_lock);
+}
+
+/*
+ * Start posting to the group that a connection has joined or left, once
+ * nothing it has posted elsewhere is still in flight, so that its requests
+ * stay in order.
+ */
+static void regroup(URING_CONN *conn){
+    if (!conn->regroup || conn->in_flight) {
+        return;
+    }
+    conn->regroup = 0;
+    pthread_mutex_lock(&uring.group_lock);
+    URING_GROUP *group = conn->joined;
+    if (group != conn->group) {
+        if (group) {
+            group->refs++;
+        }
+        if (conn->group) {
+            group_unref(conn->group);
+        }
+        conn->group = group;
+    }
+    pthread_mutex_unlock(&uring.group_lock);
+}
+
+static void release(WORKQ_TASK *task){
+    URING_CONN *conn = (URING_CONN *)((char *)task - offsetof(URING_CONN, end));
+    pthread_mutex_lock(&uring.group_lock);
+    client_set_io(conn->client, NULL);
+    if (conn->joined) {
+        group_unref(conn->joined);
+    }
+    if (conn->group) {
+        group_unref(conn->group);
+        //its own strand is idle, and was not finished
+        pthread_mutex_destroy(&conn->strand.lock);
+    }
+    pthread_mutex_unlock(&uring.group_lock);
+    jeux_end_connection(conn->client);
+    proto_reader_free(conn->reader);
+    free(conn);
+}
+
+/*
+ * Hand the requests that a connection has received to its strand, and
+ * once it has ended and nothing is outstanding on it, have the strand
+ * release it after the last of them.
+ */
+static void dispatch(URING_CONN *conn){
+    regroup(conn);
+    WORKQ_STRAND *strand = conn->group ? &conn->group->strand : &conn->strand;
+    while (!conn->done && proto_reader_ready(conn->reader)) {
+        URING_REQUEST *req = malloc(sizeof(URING_REQUEST));
+        if (!req) {
+            conn->closed = 1;
+            shutdown(conn->fd, SHUT_RD);
+            break;
+        }
+        req->task.run = serve;
+        req->conn = conn;
+        req->payload = NULL;
+        proto_reader_recv(conn->reader, &req->hdr, &req->payload);
+        atomic_fetch_add(&conn->in_flight, 1);
+        workq_strand_post(strand, &req->task);
+    }
+    if (conn->notified) {
+        conn->notified = 0;
+        //one flush on the strand at a time; one already posted writes it all
+        if (!atomic_exchange(&conn->flush_posted, 1)) {
+            conn->flush.run = flush;
+            atomic_fetch_add(&conn->in_flight, 1);
+            workq_strand_post(strand, &conn->flush);
+        }
+    }
+    if ((conn->closed || conn->done) && drained(conn)) {
+        conn->end.run = release;
+        if (conn->group) {
+            workq_strand_post(strand, &conn->end);
+        }
+        else {
+            workq_strand_finish(strand, &conn->end);
+        }
+    }
+}
+
+/*
+ * Carry out the requests that a connection has received, send the
+ * output that has built up for it, and release it once it has ended and
+ * nothing is outstanding on it.
+ */
+static void process(URING_CONN *conn){
+    if (uring.pooled) {
+        dispatch(conn);
+        return;
+    }
+    if (conn->send_buf) {
+        //the rest waits until the output in progress has been sent
+        return;
+    }
+    while (!conn->done && proto_reader_ready(conn->reader)) {
+        JEUX_PACKET_HEADER hdr = {0};
+        void *payload = NULL;
+        proto_reader_recv(conn->reader, &hdr, &payload);
+        client_touch(conn->client);
+        client_cork(conn->client);
+        CLIENT *next = jeux_serve_request(conn->client, &hdr, payload);
+        free(payload);
+        if (next) {
+            conn->client = next;
+        }
+        else {
+            //whatever else was received is discarded
+            conn->done = 1;
+            shutdown(conn->fd, SHUT_RD);
+        }
+    }
+    if (conn->notified) {
+        conn->notified = 0;
+        client_cork(conn->client);
+        client_flush_notices(conn->client);
+    }
+    if (client_take_output(conn->client, &conn->send_buf, &conn->send_len)) {
+        conn->send_off = 0;
+        submit_send(conn);
+        return;
+    }
+    client_uncork(conn->client);
+    if ((conn->closed || conn->done) && drained(conn)) {
+        jeux_end_connection(conn->client);
+        proto_reader_free(conn->reader);
+        free(conn);
+    }
+}
+
+static void *uring_loop(void *arg){
+    //signals are left to the main thread
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+    if (uring.listen_fd >= 0) {
+        arm_accept();
+    }
+    arm_wake();
+    while (!atomic_load(&uring.stopping)) {
+        int n = ring_enter(uring.to_submit, 1, IORING_ENTER_GETEVENTS);
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                continue;
+            }
+            debug("io_uring_enter failed: %s", strerror(errno));
+            break;
+        }
+        uring.to_submit -= n;
+        unsigned head = *uring.cq_head;
+        unsigned tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            complete(&uring.cqes[head & *uring.cq_mask]);
+            head++;
+        }
+        __atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+        while (uring.queue) {
+            URING_CONN *conn = uring.queue;
+            uring.queue = conn->next;
+            conn->queued = 0;
+            process(conn);
+        }
+    }
+    return NULL;
+}
+
+static int map_rings(struct io_uring_params *p){
+    uring.sq_map_len = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+    uring.cq_map_len = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+    int single = p->features & IORING_FEAT_SINGLE_MMAP;
+    if (single && uring.cq_map_len > uring.sq_map_len) {
+        uring.sq_map_len = uring.cq_map_len;
+    }
+    uring.sq_map = mmap(NULL, uring.sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        uring.ring_fd, IORING_OFF_SQ_RING);
+    if (uring.sq_map == MAP_FAILED) {
+        uring.sq_map = NULL;
+        return -1;
+    }
+    if (single) {
+        uring.cq_map = uring.sq_map;
+    }
+    else {
+        uring.cq_map = mmap(NULL, uring.cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            uring.ring_fd, IORING_OFF_CQ_RING);
+        if (uring.cq_map == MAP_FAILED) {
+            uring.cq_map = NULL;
+            return -1;
+        }
+    }
+    uring.sqes_len = p->sq_entries * sizeof(struct io_uring_sqe);
+    uring.sqes = mmap(NULL, uring.sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      uring.ring_fd, IORING_OFF_SQES);
+    if (uring.sqes == MAP_FAILED) {
+        uring.sqes = NULL;
+        return -1;
+    }
+    char *sq = uring.sq_map;
+    char *cq = uring.cq_map;
+    uring.sq_head = (unsigned *)(sq + p->sq_off.head);
+    uring.sq_tail = (unsigned *)(sq + p->sq_off.tail);
+    uring.sq_mask = (unsigned *)(sq + p->sq_off.ring_mask);
+    uring.sq_array = (unsigned *)(sq + p->sq_off.array);
+    uring.sq_entries = p->sq_entries;
+    uring.cq_head = (unsigned *)(cq + p->cq_off.head);
+    uring.cq_tail = (unsigned *)(cq + p->cq_off.tail);
+    uring.cq_mask = (unsigned *)(cq + p->cq_off.ring_mask);
+    uring.cqes = (struct io_uring_cqe *)(cq + p->cq_off.cqes);
+    return 0;
+}
+
+static int provide_buffers(void){
+    size_t len = URING_BUFFERS * sizeof(struct io_uring_buf);
+    if (posix_memalign((void **)&uring.buf_ring, sysconf(_SC_PAGESIZE), len)) {
+        uring.buf_ring = NULL;
+        return -1;
+    }
+    memset(uring.buf_ring, 0, len);
+    uring.buffers = malloc((size_t)URING_BUFFERS * URING_BUFFER_SIZE);
+    if (!uring.buffers) {
+        return -1;
+    }
+    struct io_uring_buf_reg reg = {0};
+    reg.ring_addr = (uintptr_t)uring.buf_ring;
+    reg.ring_entries = URING_BUFFERS;
+    reg.bgid = URING_BUFFER_GROUP;
+    if (syscall(__NR_io_uring_register, uring.ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        return -1;
+    }
+    for (int i = 0; i < URING_BUFFERS; i++) {
+        recycle(i);
+    }
+    return 0;
+}
+
+/*
+ * Release everything that uring_start() set up.  Closing the ring cancels
+ * whatever is still outstanding on it.
+ */
+static void teardown(void){
+    if (uring.sqes) {
+        munmap(uring.sqes, uring.sqes_len);
+    }
+    if (uring.cq_map && uring.cq_map != uring.sq_map) {
+        munmap(uring.cq_map, uring.cq_map_len);
+    }
+    if (uring.sq_map) {
+        munmap(uring.sq_map, uring.sq_map_len);
+    }
+    if (uring.ring_fd >= 0) {
+        close(uring.ring_fd);
+    }
+    if (uring.wake_fd >= 0) {
+        close(uring.wake_fd);
+    }
+    free(uring.buf_ring);
+    free(uring.buffers);
+    uring.sqes = NULL;
+    uring.sq_map = uring.cq_map = NULL;
+    uring.ring_fd = uring.wake_fd = -1;
+    uring.buf_ring = NULL;
+    uring.buffers = NULL;
+    uring.buf_tail = 0;
+    uring.to_submit = 0;
+}
+
+int uring_start(int listen_fd, int flags){
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL;
+    p.cq_entries = URING_CQ_ENTRIES;
+    uring.ring_fd = syscall(__NR_io_uring_setup, URING_SQ_ENTRIES, &p);
+    if (uring.ring_fd < 0) {
+        debug("io_uring_setup failed: %s", strerror(errno));
+        uring.ring_fd = -1;
+        return -1;
+    }
+    uring.listen_fd = listen_fd;
+    uring.pooled = flags & URING_POOLED;
+    atomic_store(&uring.stopping, 0);
+    //before any connection, so that workers see them
+    if ((flags & URING_POOLED) && (flags & URING_AFFINITY)) {
+        client_set_game_hooks(game_started, game_ended);
+    }
+    if (map_rings(&p) || provide_buffers() ||
+        (uring.wake_fd = eventfd(0, EFD_CLOEXEC)) < 0 ||
+        pthread_create(&uring.thread, NULL, uring_loop, NULL)) {
+        debug("io_uring backend unavailable");
+        client_set_game_hooks(NULL, NULL);
+        teardown();
+        return -1;
+    }
+    uring.running = 1;
+    return 0;
+}
+
+void uring_stop(void){
+    if (!uring.running) {
+        return;
+    }
+    atomic_store(&uring.stopping, 1);
+    uint64_t one = 1;
+    if (write(uring.wake_fd, &one, sizeof(one)) < 0) {
+        debug("io_uring wakeup failed");
+    }
+    pthread_join(uring.thread, NULL);
+    client_set_game_hooks(NULL, NULL);
+    uring.running = 0;
+    teardown();
+    //handed over too late to be served
+    for (int i = 0; i < uring.nadopted; i++) {
+        close(uring.adopted[i]);
+    }
+    free(uring.adopted);
+    uring.adopted = NULL;
+    uring.nadopted = uring.adopted_cap = 0;
+}
+
+int uring_adopt(int fd){
+    pthread_mutex_lock(&uring.adopt_lock);
+    if (uring.nadopted == uring.adopted_cap) {
+        int cap = uring.adopted_cap ? 2 * uring.adopted_cap : 16;
+        int *adopted = realloc(uring.adopted, cap * sizeof(int));
+        if (!adopted) {
+            pthread_mutex_unlock(&uring.adopt_lock);
+            return -1;
+        }
+        uring.adopted = adopted;
+        uring.adopted_cap = cap;
+    }
+    uring.adopted[uring.nadopted++] = fd;
+    pthread_mutex_unlock(&uring.adopt_lock);
+    uint64_t one = 1;
+    if (write(uring.wake_fd, &one, sizeof(one)) < 0) {
+        debug("io_uring wakeup failed");
+    }
+    return 0;
+}
+
+long uring_enter_count(void){
+    return atomic_load_explicit(&uring.enters, memory_order_relaxed);
+}
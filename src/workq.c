@@ -0,0 +1,311 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+
+#include "workq.h"
+#include "debug.h"
+
+/* Capacity of a worker's deque; a power of two. */
+#define WORKQ_DEQUE_SIZE 4096
+
+/*
+ * Chase-Lev deque, as formulated for C11 atomics by Le, Pop, Cohen and
+ * Zappa Nardelli.  Only the worker that owns it pushes and pops at the
+ * bottom; any worker steals from the top.
+ */
+typedef struct deque {
+    atomic_long top;
+    char pad[64 - sizeof(atomic_long)];      /* Keep thieves off the owner's line */
+    atomic_long bottom;
+    _Atomic(WORKQ_TASK *) tasks[WORKQ_DEQUE_SIZE];
+} DEQUE;
+
+typedef struct worker {
+    pthread_t thread;
+    DEQUE deque;
+    unsigned seed;                  /* For picking a victim to steal from */
+} WORKER;
+
+static struct {
+    int nworkers;
+    WORKER *workers;
+    WORKQ_MODE mode;
+    int running;
+    atomic_int stopping;
+    atomic_long pending;            /* Tasks submitted, not yet taken */
+    atomic_int idle;                /* Workers asleep, or about to be */
+    atomic_int searching;           /* Workers woken, not yet having found a task */
+    pthread_mutex_t lock;           /* Protects the shared queue and sleeping */
+    pthread_cond_t wakeup;
+    WORKQ_TASK *head;               /* Shared queue */
+    WORKQ_TASK *tail;
+} workq = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wakeup = PTHREAD_COND_INITIALIZER
+};
+
+static __thread WORKER *self;
+
+static int deque_push(DEQUE *d, WORKQ_TASK *task){
+    long b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    long t = atomic_load_explicit(&d->top, memory_order_acquire);
+    if (b - t >= WORKQ_DEQUE_SIZE) {
+        return -1;
+    }
+    atomic_store_explicit(&d->tasks[b & (WORKQ_DEQUE_SIZE - 1)], task, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    return 0;
+}
+
+static WORKQ_TASK *deque_pop(DEQUE *d){
+    long b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long t = atomic_load_explicit(&d->top, memory_order_relaxed);
+    if (t > b) {
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+        return NULL;
+    }
+    WORKQ_TASK *task = atomic_load_explicit(&d->tasks[b & (WORKQ_DEQUE_SIZE - 1)], memory_order_relaxed);
+    if (t == b) {
+        //the last one, which a thief may be taking too
+        if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+                                                     memory_order_seq_cst, memory_order_relaxed)) {
+            task = NULL;
+        }
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    }
+    return task;
+}
+
+static WORKQ_TASK *deque_steal(DEQUE *d){
+    long t = atomic_load_explicit(&d->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+    if (t >= b) {
+        return NULL;
+    }
+    WORKQ_TASK *task = atomic_load_explicit(&d->tasks[t & (WORKQ_DEQUE_SIZE - 1)], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+                                                 memory_order_seq_cst, memory_order_relaxed)) {
+        //lost to the owner or another thief
+        return NULL;
+    }
+    return task;
+}
+
+static WORKQ_TASK *shared_take(void){
+    pthread_mutex_lock(&workq.lock);
+    WORKQ_TASK *task = workq.head;
+    if (task) {
+        //read without the lock by take()
+        __atomic_store_n(&workq.head, task->next, __ATOMIC_RELAXED);
+        if (!workq.head) {
+            workq.tail = NULL;
+        }
+    }
+    pthread_mutex_unlock(&workq.lock);
+    return task;
+}
+
+/*
+ * Take a task to run: from the worker's own deque, then from the shared
+ * queue, then from the other workers' deques.
+ */
+static WORKQ_TASK *take(WORKER *w){
+    WORKQ_TASK *task = deque_pop(&w->deque);
+    if (!task && __atomic_load_n(&workq.head, __ATOMIC_RELAXED)) {
+        task = shared_take();
+    }
+    if (!task && workq.mode == WORKQ_STEALING && workq.nworkers > 1) {
+        int start = rand_r(&w->seed) % workq.nworkers;
+        for (int i = 0; !task && i < workq.nworkers; i++) {
+            WORKER *victim = &workq.workers[(start + i) % workq.nworkers];
+            if (victim != w) {
+                task = deque_steal(&victim->deque);
+            }
+        }
+    }
+    if (task) {
+        atomic_fetch_sub(&workq.pending, 1);
+    }
+    return task;
+}
+
+static void *worker_thread(void *arg){
+    WORKER *w = arg;
+    self = w;
+    //signals are left to the threads that are not the pool's
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+    int searching = 0;
+    while (1) {
+        WORKQ_TASK *task = take(w);
+        if (searching) {
+            atomic_fetch_sub(&workq.searching, 1);
+            searching = 0;
+        }
+        if (task) {
+            task->run(task);
+            continue;
+        }
+        pthread_mutex_lock(&workq.lock);
+        atomic_fetch_add(&workq.idle, 1);
+        int waited = 0;
+        while (!atomic_load(&workq.pending) && !atomic_load(&workq.stopping)) {
+            pthread_cond_wait(&workq.wakeup, &workq.lock);
+            waited = 1;
+        }
+        atomic_fetch_sub(&workq.idle, 1);
+        atomic_fetch_add(&workq.searching, 1);
+        searching = 1;
+        pthread_mutex_unlock(&workq.lock);
+        if (atomic_load(&workq.stopping) && !atomic_load(&workq.pending)) {
+            return NULL;
+        }
+        if (!waited) {
+            //what is pending is still being pushed, or lost to other thieves
+            sched_yield();
+        }
+    }
+}
+
+int workq_init(int nworkers, WORKQ_MODE mode){
+    workq.workers = calloc(nworkers, sizeof(WORKER));
+    if (!workq.workers) {
+        return -1;
+    }
+    workq.nworkers = nworkers;
+    workq.mode = mode;
+    atomic_store(&workq.stopping, 0);
+    for (int i = 0; i < nworkers; i++) {
+        workq.workers[i].seed = i + 1;
+        if (pthread_create(&workq.workers[i].thread, NULL, worker_thread, &workq.workers[i])) {
+            workq.nworkers = i;
+            workq.running = 1;
+            workq_fini();
+            return -1;
+        }
+    }
+    workq.running = 1;
+    return 0;
+}
+
+void workq_fini(void){
+    if (!workq.running) {
+        return;
+    }
+    pthread_mutex_lock(&workq.lock);
+    atomic_store(&workq.stopping, 1);
+    pthread_cond_broadcast(&workq.wakeup);
+    pthread_mutex_unlock(&workq.lock);
+    for (int i = 0; i < workq.nworkers; i++) {
+        pthread_join(workq.workers[i].thread, NULL);
+    }
+    free(workq.workers);
+    workq.workers = NULL;
+    workq.nworkers = 0;
+    workq.running = 0;
+}
+
+void workq_submit(WORKQ_TASK *task){
+    atomic_fetch_add(&workq.pending, 1);
+    WORKER *w = self;
+    if (!w || workq.mode == WORKQ_SHARED || deque_push(&w->deque, task)) {
+        task->next = NULL;
+        pthread_mutex_lock(&workq.lock);
+        if (workq.tail) {
+            workq.tail->next = task;
+        }
+        else {
+            __atomic_store_n(&workq.head, task, __ATOMIC_RELAXED);
+        }
+        workq.tail = task;
+        if (atomic_load(&workq.idle)) {
+            pthread_cond_signal(&workq.wakeup);
+        }
+        pthread_mutex_unlock(&workq.lock);
+        return;
+    }
+    if (atomic_load(&workq.idle) && !atomic_load(&workq.searching)) {
+        //wake a worker to steal it, unless one is already looking
+        pthread_mutex_lock(&workq.lock);
+        pthread_cond_signal(&workq.wakeup);
+        pthread_mutex_unlock(&workq.lock);
+    }
+}
+
+/*
+ * Run what has been posted to a strand, one batch at a time.  After each
+ * batch the strand goes back to the pool if more has been posted, so that
+ * a busy strand does not keep a worker to itself.
+ */
+static void strand_run(WORKQ_TASK *task){
+    WORKQ_STRAND *strand = (WORKQ_STRAND *)task;
+    pthread_mutex_lock(&strand->lock);
+    WORKQ_TASK *batch = strand->head;
+    WORKQ_TASK *last = strand->last;
+    strand->head = strand->tail = NULL;
+    pthread_mutex_unlock(&strand->lock);
+    if (last) {
+        pthread_mutex_destroy(&strand->lock);
+    }
+    while (batch) {
+        WORKQ_TASK *next = batch->next;
+        int done = batch == last;
+        batch->run(batch);
+        if (done) {
+            //the strand may be gone
+            return;
+        }
+        batch = next;
+    }
+    pthread_mutex_lock(&strand->lock);
+    int more = strand->head != NULL;
+    strand->scheduled = more;
+    pthread_mutex_unlock(&strand->lock);
+    if (more) {
+        workq_submit(&strand->task);
+    }
+}
+
+void workq_strand_init(WORKQ_STRAND *strand){
+    strand->task.run = strand_run;
+    strand->task.next = NULL;
+    pthread_mutex_init(&strand->lock, NULL);
+    strand->head = strand->tail = strand->last = NULL;
+    strand->scheduled = 0;
+}
+
+static void strand_post(WORKQ_STRAND *strand, WORKQ_TASK *task, int last){
+    task->next = NULL;
+    pthread_mutex_lock(&strand->lock);
+    if (strand->tail) {
+        strand->tail->next = task;
+    }
+    else {
+        strand->head = task;
+    }
+    strand->tail = task;
+    if (last) {
+        strand->last = task;
+    }
+    int idle = !strand->scheduled;
+    strand->scheduled = 1;
+    pthread_mutex_unlock(&strand->lock);
+    if (idle) {
+        workq_submit(&strand->task);
+    }
+}
+
+void workq_strand_post(WORKQ_STRAND *strand, WORKQ_TASK *task){
+    strand_post(strand, task, 0);
+}
+
+void workq_strand_finish(WORKQ_STRAND *strand, WORKQ_TASK *task){
+    strand_post(strand, task, 1);
+}
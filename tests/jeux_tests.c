@@ -1,10 +1,48 @@
 #include <criterion/criterion.h>
 #include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <signal.h>
 #include <wait.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/prctl.h>
+
+#include "jeux_globals.h"
+#include "protocol_ext.h"
+#include "server.h"
+#include "server_ext.h"
+#include "client_registry.h"
+#include "client.h"
+#include "client_ext.h"
+#include "player.h"
+#include "player_ext.h"
+#include "game.h"
+#include "game_ext.h"
+#include "invitation.h"
+#include "checkpoint.h"
+#include "cluster.h"
+#include "coro.h"
+#include "glicko.h"
+#include "id_scan.h"
+#include "intern.h"
+#include "peer.h"
+#include "rating.h"
+#include "session.h"
+#include "shard.h"
+#include "spectator.h"
+#include "timer_wheel.h"
+#include "upgrade.h"
+#include "uring.h"
+#include "workq.h"
 
 /* Directory in which to create test output files. */
 #define TEST_OUTPUT "test_output/"
@@ -74,3 +112,1986 @@ Test(student_suite, 01_connect, .init = init, .fini = fini, .timeout = 5) {
     int ret = system("util/jclient -p 9999 </dev/null | grep 'Connected to server'");
     cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
 }
+
+/*
+ * Protocol tests.  Each connection is served by jeux_client_service(), as
+ * the server would serve it, on one end of a socket pair, and the test
+ * speaks the protocol on the other end.  Every packet that a client is
+ * sent is checked, in the order in which it arrives.
+ */
+#define PROTO_WAIT_MS 5000
+
+static void proto_setup(void) {
+    client_registry = creg_init();
+    player_registry = preg_init();
+}
+
+static int proto_connect(void) {
+    int sv[2];
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0, "no socket pair");
+    int *fdp = malloc(sizeof(int));
+    *fdp = sv[0];
+    pthread_t tid;
+    cr_assert_eq(pthread_create(&tid, NULL, jeux_client_service, fdp), 0, "no service thread");
+    return sv[1];
+}
+
+static void proto_send(int fd, int type, int id, int role, char *payload, size_t size) {
+    JEUX_PACKET_HEADER hdr = {0};
+    hdr.type = type;
+    hdr.id = id;
+    hdr.role = role;
+    hdr.size = htons(size);
+    cr_assert_eq(proto_send_packet(fd, &hdr, payload), 0, "request of type %d not sent", type);
+}
+
+//the position is sent as a string, its NUL included
+static void proto_move(int fd, int id, int pos) {
+    char move[4];
+    snprintf(move, sizeof(move), "%d", pos);
+    proto_send(fd, JEUX_MOVE_PKT, id, 0, move, strlen(move) + 1);
+}
+
+/*
+ * Receive the next packet, whose payload, if wanted, is returned as a
+ * string that the caller must free.
+ */
+static int proto_next(int fd, JEUX_PACKET_HEADER *hdr, char **payloadp) {
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    cr_assert_eq(poll(&pfd, 1, PROTO_WAIT_MS), 1, "no packet within %dms", PROTO_WAIT_MS);
+    void *payload = NULL;
+    cr_assert_eq(proto_recv_packet(fd, hdr, &payload), 0, "connection closed");
+    size_t size = ntohs(hdr->size);
+    char *str = malloc(size + 1);
+    memcpy(str, payload ? payload : "", size);
+    str[size] = '\0';
+    free(payload);
+    if (payloadp) {
+        *payloadp = str;
+    }
+    else {
+        free(str);
+    }
+    return hdr->type;
+}
+
+static void proto_expect(int fd, int type, JEUX_PACKET_HEADER *hdr, char **payloadp) {
+    JEUX_PACKET_HEADER unused;
+    hdr = hdr ? hdr : &unused;
+    int got = proto_next(fd, hdr, payloadp);
+    cr_assert_eq(got, type, "packet of type %d, expected %d", got, type);
+}
+
+//nothing arrives for a while
+static void proto_quiet(int fd, int ms) {
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    cr_assert_eq(poll(&pfd, 1, ms), 0, "unexpected packet");
+}
+
+static void proto_login(int fd, char *name) {
+    proto_send(fd, JEUX_LOGIN_PKT, 0, 0, name, strlen(name));
+    proto_expect(fd, JEUX_ACK_PKT, NULL, NULL);
+}
+
+/*
+ * Start a game, the first player inviting the second, who accepts.  The
+ * IDs of the game for each of them are stored.
+ */
+static void proto_start_game(int first, int second, char *second_name, int *first_id, int *second_id) {
+    JEUX_PACKET_HEADER hdr;
+    proto_send(first, JEUX_INVITE_PKT, 0, SECOND_PLAYER_ROLE, second_name, strlen(second_name));
+    proto_expect(first, JEUX_ACK_PKT, &hdr, NULL);
+    *first_id = hdr.id;
+    proto_expect(second, JEUX_INVITED_PKT, &hdr, NULL);
+    cr_assert_eq(hdr.role, SECOND_PLAYER_ROLE, "invited as %d", hdr.role);
+    *second_id = hdr.id;
+    proto_send(second, JEUX_ACCEPT_PKT, *second_id, 0, NULL, 0);
+    proto_expect(second, JEUX_ACK_PKT, NULL, NULL);
+    proto_expect(first, JEUX_ACCEPTED_PKT, NULL, NULL);
+}
+
+//the mover is ACKed, and the state that the opponent is sent is returned
+static char *proto_play(int mover, int mover_id, int opponent, int pos) {
+    char *state;
+    proto_move(mover, mover_id, pos);
+    proto_expect(mover, JEUX_ACK_PKT, NULL, NULL);
+    proto_expect(opponent, JEUX_MOVED_PKT, NULL, &state);
+    return state;
+}
+
+/*
+ * Spectators (see spectator.h).  Several clients watch a game, and after
+ * each move every one of them is sent the state that the opponent is
+ * sent; when the game ends they are told who won.  A spectator that stops
+ * watching is sent nothing further.
+ */
+#define SPECTATORS 3
+
+static void spectator_clients(int *watchers, int *watch_ids, int n, char *player) {
+    for (int i = 0; i < n; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "spec_watcher_%d", i);
+        watchers[i] = proto_connect();
+        proto_login(watchers[i], name);
+        JEUX_PACKET_HEADER hdr;
+        char *state;
+        proto_send(watchers[i], JEUX_WATCH_PKT, 0, 0, player, strlen(player));
+        proto_expect(watchers[i], JEUX_ACK_PKT, &hdr, &state);
+        watch_ids[i] = hdr.id;
+        free(state);
+    }
+}
+
+Test(spectator_suite, fan_out, .timeout = 10) {
+    proto_setup();
+    cr_assert_eq(spectator_init(0), 0, "spectator service not started");
+    int alice = proto_connect(), bob = proto_connect();
+    proto_login(alice, "spec_alice");
+    proto_login(bob, "spec_bob");
+    int alice_id, bob_id;
+    proto_start_game(alice, bob, "spec_bob", &alice_id, &bob_id);
+    int watchers[SPECTATORS], watch_ids[SPECTATORS];
+    spectator_clients(watchers, watch_ids, SPECTATORS, "spec_alice");
+    JEUX_PACKET_HEADER hdr;
+    char *seen;
+    //the last spectator leaves after two moves
+    int leaver = SPECTATORS - 1;
+    int moves[] = { 1, 4, 2, 5 };
+    for (int m = 0; m < 4; m++) {
+        char *state = m % 2 ? proto_play(bob, bob_id, alice, moves[m]) : proto_play(alice, alice_id, bob, moves[m]);
+        for (int i = 0; i < SPECTATORS; i++) {
+            if (i == leaver && m >= 2) {
+                continue;
+            }
+            proto_expect(watchers[i], JEUX_WATCH_MOVED_PKT, &hdr, &seen);
+            cr_assert_eq(hdr.id, watch_ids[i], "spectator %d sent watch ID %d", i, hdr.id);
+            cr_assert_str_eq(seen, state, "spectator %d after move %d sent\n%s", i, m, seen);
+            free(seen);
+        }
+        free(state);
+        if (m == 1) {
+            proto_send(watchers[leaver], JEUX_UNWATCH_PKT, watch_ids[leaver], 0, NULL, 0);
+            proto_expect(watchers[leaver], JEUX_ACK_PKT, NULL, NULL);
+        }
+    }
+    //alice wins along the top row
+    char *state;
+    proto_move(alice, alice_id, 3);
+    proto_expect(alice, JEUX_ENDED_PKT, &hdr, NULL);
+    cr_assert_eq(hdr.role, FIRST_PLAYER_ROLE, "winner %d", hdr.role);
+    proto_expect(alice, JEUX_ACK_PKT, NULL, NULL);
+    proto_expect(bob, JEUX_MOVED_PKT, NULL, &state);
+    proto_expect(bob, JEUX_ENDED_PKT, NULL, NULL);
+    for (int i = 0; i < leaver; i++) {
+        proto_expect(watchers[i], JEUX_WATCH_MOVED_PKT, NULL, &seen);
+        cr_assert_str_eq(seen, state, "spectator %d sent final state\n%s", i, seen);
+        free(seen);
+        proto_expect(watchers[i], JEUX_WATCH_ENDED_PKT, &hdr, NULL);
+        cr_assert_eq(hdr.id, watch_ids[i], "spectator %d sent watch ID %d", i, hdr.id);
+        cr_assert_eq(hdr.role, FIRST_PLAYER_ROLE, "spectator %d sent winner %d", i, hdr.role);
+    }
+    free(state);
+    proto_quiet(watchers[leaver], 100);
+}
+
+/*
+ * Spectator rate limit.  A spectator is sent a state at once, and states
+ * published within the interval that follows are coalesced: only the
+ * newest of them is sent, once the interval has passed.
+ */
+#define SPECTATOR_INTERVAL_MS 500
+
+static double spectator_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+Test(spectator_suite, coalesced, .timeout = 10) {
+    proto_setup();
+    cr_assert_eq(spectator_init(SPECTATOR_INTERVAL_MS), 0, "spectator service not started");
+    int alice = proto_connect(), bob = proto_connect();
+    proto_login(alice, "spec_alice");
+    proto_login(bob, "spec_bob");
+    int alice_id, bob_id;
+    proto_start_game(alice, bob, "spec_bob", &alice_id, &bob_id);
+    int watcher, watch_id;
+    spectator_clients(&watcher, &watch_id, 1, "spec_bob");
+    JEUX_PACKET_HEADER hdr;
+    char *seen;
+    char *state = proto_play(alice, alice_id, bob, 1);
+    proto_expect(watcher, JEUX_WATCH_MOVED_PKT, NULL, &seen);
+    double first_ms = spectator_now_ms();
+    cr_assert_str_eq(seen, state, "first state sent\n%s", seen);
+    free(seen);
+    free(state);
+    //three moves within the interval
+    free(proto_play(bob, bob_id, alice, 4));
+    free(proto_play(alice, alice_id, bob, 2));
+    state = proto_play(bob, bob_id, alice, 5);
+    proto_expect(watcher, JEUX_WATCH_MOVED_PKT, &hdr, &seen);
+    double second_ms = spectator_now_ms();
+    cr_assert_eq(hdr.id, watch_id, "watch ID %d", hdr.id);
+    cr_assert_str_eq(seen, state, "coalesced state sent\n%s", seen);
+    cr_assert_geq(second_ms - first_ms, SPECTATOR_INTERVAL_MS * 0.9, "second state sent after %.1fms",
+                  second_ms - first_ms);
+    free(seen);
+    free(state);
+    //the states in between were dropped, not held back
+    proto_quiet(watcher, 2 * SPECTATOR_INTERVAL_MS);
+    //the end of the game follows the last state
+    proto_move(alice, alice_id, 3);
+    proto_expect(alice, JEUX_ENDED_PKT, NULL, NULL);
+    proto_expect(alice, JEUX_ACK_PKT, NULL, NULL);
+    proto_expect(bob, JEUX_MOVED_PKT, NULL, &state);
+    proto_expect(watcher, JEUX_WATCH_MOVED_PKT, NULL, &seen);
+    cr_assert_str_eq(seen, state, "final state sent\n%s", seen);
+    free(seen);
+    free(state);
+    proto_expect(watcher, JEUX_WATCH_ENDED_PKT, &hdr, NULL);
+    cr_assert_eq(hdr.role, FIRST_PLAYER_ROLE, "winner %d", hdr.role);
+}
+
+/*
+ * Session resumption (see session.h).  A client logs in over one end of a
+ * socket pair and its connection is lost, parking it.  Only its own token,
+ * presented under its own name, reclaims it, and only until the grace
+ * period expires, after which it has been logged out.
+ */
+#define SESSION_GRACE_MS 200
+
+static CLIENT *session_client(char *name, char *token) {
+    int sv[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    close(sv[1]);
+    CLIENT *client = creg_register(client_registry, sv[0]);
+    cr_assert_not_null(client, "client not registered");
+    cr_assert_eq(client_login(client, preg_register(player_registry, strdup(name))), 0, "login failed");
+    cr_assert_eq(session_begin(client, token), 0, "session not started");
+    cr_assert_eq(strlen(token), SESSION_TOKEN_LEN, "token is %zu bytes", strlen(token));
+    int fd = session_park(client);
+    cr_assert_eq(fd, sv[0], "parked fd %d, expected %d", fd, sv[0]);
+    close(fd);
+    return client;
+}
+
+static void session_setup(void) {
+    client_registry = creg_init();
+    player_registry = preg_init();
+    cr_assert_eq(timer_wheel_init(10), 0, "timer wheel not started");
+    session_init(SESSION_GRACE_MS);
+}
+
+Test(session_suite, resume_bad_token, .timeout = 5) {
+    session_setup();
+    char token[SESSION_TOKEN_LEN + 1];
+    CLIENT *client = session_client("session_alice", token);
+    char wrong[SESSION_TOKEN_LEN + 1];
+    memcpy(wrong, token, sizeof(wrong));
+    wrong[0] = wrong[0] == '0' ? '1' : '0';
+    cr_assert_null(session_resume(wrong, SESSION_TOKEN_LEN, "session_alice"),
+                   "resumed with another token");
+    cr_assert_null(session_resume(token, SESSION_TOKEN_LEN - 1, "session_alice"),
+                   "resumed with a short token");
+    cr_assert_null(session_resume("0123456789abcdeg", SESSION_TOKEN_LEN, "session_alice"),
+                   "resumed with a token that is not hex");
+    cr_assert_null(session_resume("0000000000000000", SESSION_TOKEN_LEN, "session_alice"),
+                   "resumed with the null token");
+    cr_assert_null(session_resume(token, SESSION_TOKEN_LEN, "session_bob"),
+                   "resumed under another name");
+    //the failed attempts left the session parked for its owner
+    cr_assert_eq(session_resume(token, SESSION_TOKEN_LEN, "session_alice"), client,
+                 "session not resumed with its own token");
+    //and a session is resumed only once
+    cr_assert_null(session_resume(token, SESSION_TOKEN_LEN, "session_alice"),
+                   "session resumed twice");
+    session_end(client);
+    client_logout(client);
+    creg_unregister(client_registry, client);
+    timer_wheel_fini();
+}
+
+Test(session_suite, resume_after_grace, .timeout = 5) {
+    session_setup();
+    char token[SESSION_TOKEN_LEN + 1];
+    session_client("session_carol", token);
+    CLIENT *parked = creg_lookup(client_registry, "session_carol");
+    cr_assert_not_null(parked, "parked client not logged in");
+    client_unref(parked, "parked client looked up");
+    usleep(3 * SESSION_GRACE_MS * 1000);
+    cr_assert_null(session_resume(token, SESSION_TOKEN_LEN, "session_carol"),
+                   "session resumed after its grace period");
+    //the expired client was logged out and unregistered
+    cr_assert_null(creg_lookup(client_registry, "session_carol"),
+                   "expired client still logged in");
+    timer_wheel_fini();
+}
+
+/*
+ * Timer wheel (see timer_wheel.h).  Timers armed for delays on either side
+ * of a revolution of the root wheel must each fire once, no earlier than
+ * their delays and in order; cancelled timers must never fire.
+ */
+#define WHEEL_TICK_MS 1
+#define WHEEL_TIMERS 8
+
+static long wheel_delays[WHEEL_TIMERS] = { 1, 5, 40, 120, 255, 256, 300, 700 };
+
+typedef struct wheel_probe {
+    TIMER timer;
+    long delay_ms;
+    int fired;
+    double at_ms;
+    int order;
+} WHEEL_PROBE;
+
+static double wheel_start_ms;
+static int wheel_fired;
+
+static double wheel_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+//runs on the timer wheel thread, one callback at a time
+static void wheel_fire(void *arg) {
+    WHEEL_PROBE *probe = arg;
+    probe->fired++;
+    probe->at_ms = wheel_now_ms() - wheel_start_ms;
+    probe->order = wheel_fired++;
+}
+
+Test(timer_wheel_suite, expiry, .timeout = 10) {
+    cr_assert_eq(timer_wheel_init(WHEEL_TICK_MS), 0, "timer wheel not started");
+    WHEEL_PROBE probes[WHEEL_TIMERS] = {0};
+    wheel_start_ms = wheel_now_ms();
+    //armed out of order, so that the order of firing is the wheel's doing
+    for (int i = WHEEL_TIMERS - 1; i >= 0; i--) {
+        probes[i].delay_ms = wheel_delays[i];
+        timer_init(&probes[i].timer, wheel_fire, &probes[i]);
+        cr_assert_eq(timer_arm(&probes[i].timer, probes[i].delay_ms), 0, "timer %d already armed", i);
+        cr_assert_eq(timer_pending(&probes[i].timer), 1, "timer %d not pending", i);
+    }
+    usleep((wheel_delays[WHEEL_TIMERS - 1] + 200) * 1000);
+    timer_wheel_fini();
+    for (int i = 0; i < WHEEL_TIMERS; i++) {
+        cr_assert_eq(probes[i].fired, 1, "timer of %ldms fired %d times", probes[i].delay_ms, probes[i].fired);
+        cr_assert_eq(timer_pending(&probes[i].timer), 0, "timer of %ldms still pending", probes[i].delay_ms);
+        cr_assert_geq(probes[i].at_ms, probes[i].delay_ms, "timer of %ldms fired at %.1fms",
+                      probes[i].delay_ms, probes[i].at_ms);
+        cr_assert_eq(probes[i].order, i, "timer of %ldms fired %d-th", probes[i].delay_ms, probes[i].order);
+    }
+}
+
+Test(timer_wheel_suite, cancel, .timeout = 10) {
+    cr_assert_eq(timer_wheel_init(WHEEL_TICK_MS), 0, "timer wheel not started");
+    WHEEL_PROBE probes[WHEEL_TIMERS] = {0};
+    wheel_start_ms = wheel_now_ms();
+    for (int i = 0; i < WHEEL_TIMERS; i++) {
+        probes[i].delay_ms = wheel_delays[i] + 50;
+        timer_init(&probes[i].timer, wheel_fire, &probes[i]);
+        timer_arm(&probes[i].timer, probes[i].delay_ms);
+    }
+    //every other timer is cancelled, and one re-armed further out first
+    cr_assert_eq(timer_arm(&probes[3].timer, 2000), 1, "re-armed timer was not armed");
+    for (int i = 1; i < WHEEL_TIMERS; i += 2) {
+        cr_assert_eq(timer_cancel(&probes[i].timer), 1, "timer %d was not armed", i);
+        cr_assert_eq(timer_pending(&probes[i].timer), 0, "cancelled timer %d pending", i);
+        cr_assert_eq(timer_cancel(&probes[i].timer), 0, "timer %d cancelled twice", i);
+    }
+    usleep((wheel_delays[WHEEL_TIMERS - 1] + 250) * 1000);
+    timer_wheel_fini();
+    for (int i = 0; i < WHEEL_TIMERS; i++) {
+        cr_assert_eq(probes[i].fired, !(i % 2), "timer %d fired %d times", i, probes[i].fired);
+    }
+    //a timer that has fired is no longer armed
+    cr_assert_eq(timer_cancel(&probes[0].timer), 0, "fired timer cancelled");
+}
+
+/*
+ * A timer armed between two ticks of a coarse wheel must still wait out
+ * its whole delay, however little of the current tick is left: the delay
+ * is rounded up to whole ticks, counted from the next one.
+ */
+#define COARSE_TICK_MS 10
+#define COARSE_DELAY_MS 15
+#define COARSE_ROUNDS 20
+
+Test(timer_wheel_suite, coarse_tick, .timeout = 10) {
+    cr_assert_eq(timer_wheel_init(COARSE_TICK_MS), 0, "timer wheel not started");
+    WHEEL_PROBE probes[COARSE_ROUNDS] = {0};
+    double due_ms[COARSE_ROUNDS];
+    wheel_start_ms = wheel_now_ms();
+    //armed at every kind of offset into a tick
+    for (int i = 0; i < COARSE_ROUNDS; i++) {
+        due_ms[i] = wheel_now_ms() - wheel_start_ms + COARSE_DELAY_MS;
+        timer_init(&probes[i].timer, wheel_fire, &probes[i]);
+        timer_arm(&probes[i].timer, COARSE_DELAY_MS);
+        usleep(COARSE_TICK_MS * 1000 / 7);
+    }
+    usleep((COARSE_ROUNDS * COARSE_TICK_MS / 7 + COARSE_DELAY_MS + 5 * COARSE_TICK_MS) * 1000);
+    timer_wheel_fini();
+    for (int i = 0; i < COARSE_ROUNDS; i++) {
+        cr_assert_eq(probes[i].fired, 1, "timer %d fired %d times", i, probes[i].fired);
+        cr_assert_geq(probes[i].at_ms, due_ms[i], "timer %d due at %.1fms fired at %.1fms",
+                      i, due_ms[i], probes[i].at_ms);
+    }
+}
+
+/*
+ * Invitation tables (see client.c).  Clients with no connection (fd -1,
+ * so packets sent to them are discarded) stand in a ring, and each has a
+ * thread that invites both its neighbours and revokes the invitations
+ * again, over and over, so that every pair of neighbours has invitations
+ * crossing in both directions while their tables change under them.  No
+ * invitation may be lost or left behind.
+ */
+#define CROSS_CLIENTS 8
+#define CROSS_ROUNDS 2000
+
+typedef struct cross {
+    CLIENT *clients[CROSS_CLIENTS];
+    int index;
+    int failures;
+} CROSS;
+
+static void *cross_thread(void *arg) {
+    CROSS *cross = arg;
+    CLIENT *self = cross->clients[cross->index];
+    CLIENT *left = cross->clients[(cross->index + CROSS_CLIENTS - 1) % CROSS_CLIENTS];
+    CLIENT *right = cross->clients[(cross->index + 1) % CROSS_CLIENTS];
+    for (int r = 0; r < CROSS_ROUNDS; r++) {
+        cross->failures += client_make_invitation(self, left, FIRST_PLAYER_ROLE, SECOND_PLAYER_ROLE) < 0;
+        cross->failures += client_make_invitation(self, right, SECOND_PLAYER_ROLE, FIRST_PLAYER_ROLE) < 0;
+        //the IDs of its own invitations shift as its neighbours' come and
+        //go, so look for them until both have been revoked
+        int revoked = 0;
+        for (int pass = 0; revoked < 2 && pass < 1000; pass++) {
+            for (int id = 0; revoked < 2 && id < 8; id++) {
+                revoked += client_revoke_invitation(self, id) == 0;
+            }
+        }
+        cross->failures += 2 - revoked;
+    }
+    return NULL;
+}
+
+Test(invitation_suite, crossed_invitations, .timeout = 60) {
+    CROSS crosses[CROSS_CLIENTS];
+    CLIENT *clients[CROSS_CLIENTS];
+    for (int i = 0; i < CROSS_CLIENTS; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "cross_%d", i);
+        clients[i] = client_ref(client_create(NULL, -1), "cross client");
+        client_login(clients[i], player_create(strdup(name)));
+    }
+    pthread_t tids[CROSS_CLIENTS];
+    for (int i = 0; i < CROSS_CLIENTS; i++) {
+        memcpy(crosses[i].clients, clients, sizeof(clients));
+        crosses[i].index = i;
+        crosses[i].failures = 0;
+        pthread_create(&tids[i], NULL, cross_thread, &crosses[i]);
+    }
+    for (int i = 0; i < CROSS_CLIENTS; i++) {
+        pthread_join(tids[i], NULL);
+        cr_assert_eq(crosses[i].failures, 0, "client %d: %d invitations not made or not revoked", i,
+                     crosses[i].failures);
+    }
+    //every table is empty
+    for (int i = 0; i < CROSS_CLIENTS; i++) {
+        cr_assert_eq(client_revoke_invitation(clients[i], 0), -1, "client %d: invitation left", i);
+        cr_assert_eq(client_decline_invitation(clients[i], 0), -1, "client %d: invitation left", i);
+    }
+    for (int i = 0; i < CROSS_CLIENTS; i++) {
+        client_logout(clients[i]);
+        client_unref(clients[i], "cross over");
+    }
+}
+
+/*
+ * Invitation races.  Two clients with no connection (fd -1, so packets sent
+ * to them are discarded) race to accept, decline and revoke the same
+ * invitation.  Exactly one of the racers must win each round, and the
+ * invitation tables must agree with the winner.
+ */
+#define RACE_ROUNDS 5000
+
+typedef struct race {
+    CLIENT *client;
+    int (*op)(CLIENT *client, int id);
+    int ret;
+    pthread_barrier_t *go;
+} RACE;
+
+static int race_accept(CLIENT *client, int id) {
+    char *strp = NULL;
+    int ret = client_accept_invitation(client, id, &strp);
+    free(strp);
+    return ret;
+}
+
+static void *race_thread(void *arg) {
+    RACE *race = arg;
+    pthread_barrier_wait(race->go);
+    race->ret = race->op(race->client, 0);
+    return NULL;
+}
+
+static CLIENT *race_client(char *name) {
+    CLIENT *client = client_ref(client_create(NULL, -1), "race client");
+    client_login(client, player_create(strdup(name)));
+    return client;
+}
+
+Test(invitation_suite, accept_revoke_race, .timeout = 60) {
+    CLIENT *source = race_client("racer_source");
+    CLIENT *target = race_client("racer_target");
+    int accepted = 0;
+    for (int i = 0; i < RACE_ROUNDS; i++) {
+        cr_assert_eq(client_make_invitation(source, target, FIRST_PLAYER_ROLE, SECOND_PLAYER_ROLE), 0);
+        pthread_barrier_t go;
+        RACE races[3] = {
+            { target, race_accept, -1, &go },
+            { source, client_revoke_invitation, -1, &go },
+            { target, client_decline_invitation, -1, &go },
+        };
+        //every other round the target also races to decline
+        int nracers = (i % 2) ? 3 : 2;
+        pthread_barrier_init(&go, NULL, nracers);
+        pthread_t tids[3];
+        for (int j = 0; j < nracers; j++) {
+            pthread_create(&tids[j], NULL, race_thread, &races[j]);
+        }
+        int wins = 0;
+        for (int j = 0; j < nracers; j++) {
+            pthread_join(tids[j], NULL);
+            wins += (races[j].ret == 0);
+        }
+        pthread_barrier_destroy(&go);
+        cr_assert_eq(wins, 1, "round %d: accept %d, revoke %d, decline %d", i,
+                     races[0].ret, races[1].ret, races[2].ret);
+        GAME *game = client_find_game(source, 0);
+        if (races[0].ret == 0) {
+            accepted++;
+            cr_assert_not_null(game, "round %d: accepted without a game", i);
+            game_unref(game, "race checked");
+            cr_assert_eq(client_resign_game(source, 0), 0, "round %d: game not resignable", i);
+        }
+        else {
+            cr_assert_null(game, "round %d: game without an accept", i);
+        }
+        //the winner removed the invitation from both tables
+        cr_assert_eq(client_revoke_invitation(source, 0), -1, "round %d: source table not empty", i);
+        cr_assert_eq(client_decline_invitation(target, 0), -1, "round %d: target table not empty", i);
+    }
+    //otherwise the rounds were not races
+    cr_assert(accepted > 0 && accepted < RACE_ROUNDS, "%d of %d rounds accepted", accepted, RACE_ROUNDS);
+    client_logout(source);
+    client_logout(target);
+    client_unref(source, "race over");
+    client_unref(target, "race over");
+}
+
+/*
+ * Elo ratings (see rating.h).  The expected score, looked up in a table
+ * and interpolated, must agree with 1/(1 + 10**(d/400)) at differences
+ * that fall between the steps of the table, and be clamped beyond its
+ * span.  Results applied in batches by the rating thread must come out as
+ * if applied one at a time in the order they were posted.
+ */
+#define ELO_K 32
+#define ELO_SPAN 800
+#define ELO_BATCH_GAMES 2000
+#define ELO_BATCH_PLAYERS 8
+
+static double elo_expected(double diff) {
+    diff = diff < -ELO_SPAN ? -ELO_SPAN : diff > ELO_SPAN ? ELO_SPAN : diff;
+    return 1 / (1 + pow(10, diff / 400));
+}
+
+Test(elo_suite, expected_score_table, .timeout = 5) {
+    PLAYER *p1 = player_create(strdup("elo_one"));
+    PLAYER *p2 = player_create(strdup("elo_two"));
+    for (double diff = -1000; diff <= 1000; diff += 0.37) {
+        for (int result = 0; result <= 2; result++) {
+            player_set_rating(p1, 1500);
+            player_set_rating(p2, 1500 + diff);
+            rating_post(p1, p2, result);
+            double s1 = result == 1 ? 1 : result == 2 ? 0 : 0.5;
+            double r1 = 1500 + ELO_K * (s1 - elo_expected(diff));
+            cr_assert_float_eq(player_get_rating_exact(p1), r1, 1e-4,
+                               "difference %.2f, result %d: rated %f, expected %f",
+                               diff, result, player_get_rating_exact(p1), r1);
+            //what one player gains, the other loses
+            cr_assert_float_eq(player_get_rating_exact(p1) + player_get_rating_exact(p2),
+                               3000 + diff, 1e-9, "difference %.2f, result %d: sum %f", diff, result,
+                               player_get_rating_exact(p1) + player_get_rating_exact(p2));
+        }
+    }
+    player_unref(p1, "elo test over");
+    player_unref(p2, "elo test over");
+}
+
+Test(elo_suite, batches_in_order, .timeout = 10) {
+    PLAYER *players[ELO_BATCH_PLAYERS];
+    double expected[ELO_BATCH_PLAYERS];
+    for (int i = 0; i < ELO_BATCH_PLAYERS; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "elo_batch_%d", i);
+        players[i] = player_create(strdup(name));
+        expected[i] = player_get_rating_exact(players[i]);
+    }
+    cr_assert_eq(rating_init(RATING_ELO, 0), 0, "rating thread not started");
+    unsigned seed = 1;
+    for (int g = 0; g < ELO_BATCH_GAMES; g++) {
+        int a = rand_r(&seed) % ELO_BATCH_PLAYERS;
+        int b = (a + 1 + rand_r(&seed) % (ELO_BATCH_PLAYERS - 1)) % ELO_BATCH_PLAYERS;
+        //the lower-numbered player usually wins, so that ratings spread out
+        int result = rand_r(&seed) % 4 ? (a < b ? 1 : 2) : 0;
+        rating_post(players[a], players[b], result);
+        double s = result == 1 ? 1 : result == 2 ? 0 : 0.5;
+        double e = elo_expected(expected[b] - expected[a]);
+        expected[a] += ELO_K * (s - e);
+        expected[b] -= ELO_K * (s - e);
+    }
+    rating_flush();
+    for (int i = 0; i < ELO_BATCH_PLAYERS; i++) {
+        cr_assert_float_eq(player_get_rating_exact(players[i]), expected[i], 0.01,
+                           "player %d rated %f, expected %f", i,
+                           player_get_rating_exact(players[i]), expected[i]);
+    }
+    rating_fini();
+    for (int i = 0; i < ELO_BATCH_PLAYERS; i++) {
+        player_unref(players[i], "elo test over");
+    }
+}
+
+/*
+ * Glicko-2 (see glicko.h), against the example worked in Glickman's
+ * "Example of the Glicko-2 system": a player rated 1500, with deviation
+ * 200 and volatility 0.06, beats a player rated 1400 (deviation 30) and
+ * loses to players rated 1550 (100) and 1700 (300), with tau 0.5.
+ */
+Test(glicko_suite, reference_example, .timeout = 5) {
+    GLICKO *glicko = glicko_create(0.5);
+    cr_assert_eq(glicko_reserve(glicko, 5), 0, "no slots");
+    glicko_set(glicko, 0, 1500, 200, 0.06);
+    glicko_set(glicko, 1, 1400, 30, 0.06);
+    glicko_set(glicko, 2, 1550, 100, 0.06);
+    glicko_set(glicko, 3, 1700, 300, 0.06);
+    glicko_set(glicko, 4, 1500, 200, 0.06);
+    glicko_record(glicko, 0, 1, 1);
+    glicko_record(glicko, 2, 0, 1);
+    glicko_record(glicko, 0, 3, 0);
+    glicko_close_period(glicko);
+    cr_assert_float_eq(glicko_rating(glicko, 0), 1464.06, 0.01, "rating %f", glicko_rating(glicko, 0));
+    cr_assert_float_eq(glicko_deviation(glicko, 0), 151.52, 0.01, "deviation %f",
+                       glicko_deviation(glicko, 0));
+    cr_assert_float_eq(glicko_volatility(glicko, 0), 0.05999, 0.00001, "volatility %f",
+                       glicko_volatility(glicko, 0));
+    //a player who did not play keeps its rating, and its deviation grows
+    //by its volatility
+    cr_assert_float_eq(glicko_rating(glicko, 4), 1500, 1e-9, "idle rating %f", glicko_rating(glicko, 4));
+    cr_assert_float_eq(glicko_deviation(glicko, 4), sqrt(200 * 200 + pow(0.06 * 173.7178, 2)), 1e-6,
+                       "idle deviation %f", glicko_deviation(glicko, 4));
+    glicko_fini(glicko);
+}
+
+Test(glicko_suite, idle_deviation_capped, .timeout = 5) {
+    GLICKO *glicko = glicko_create(0.5);
+    cr_assert_eq(glicko_reserve(glicko, 2), 0, "no slots");
+    //some 64 periods take a deviation of 340 to the cap
+    glicko_set(glicko, 1, 1500, 340, 0.06);
+    for (int i = 0; i < 100; i++) {
+        glicko_close_period(glicko);
+    }
+    for (int i = 0; i < 2; i++) {
+        cr_assert_float_eq(glicko_deviation(glicko, i), 350, 1e-9, "slot %d deviation %f", i,
+                           glicko_deviation(glicko, i));
+        cr_assert_float_eq(glicko_rating(glicko, i), 1500, 1e-9, "slot %d rating %f", i,
+                           glicko_rating(glicko, i));
+    }
+    glicko_fini(glicko);
+}
+
+/*
+ * Interned names (see intern.h).  Threads intern the same names at once,
+ * each in its own order, and must all be given the same id for each name,
+ * the ids being dense.  A name ends at its first NUL, and is found again
+ * from any copy of its bytes.
+ */
+#define INTERN_THREADS 4
+#define INTERN_NAMES 5000
+
+typedef struct intern_run {
+    int ids[INTERN_NAMES];
+    int offset;
+} INTERN_RUN;
+
+static void intern_test_name(int i, char *buf, size_t size) {
+    snprintf(buf, size, "intern_%d", i);
+}
+
+static void *intern_thread(void *arg) {
+    INTERN_RUN *run = arg;
+    for (int k = 0; k < INTERN_NAMES; k++) {
+        int i = (k * 7 + run->offset) % INTERN_NAMES;
+        char name[32];
+        intern_test_name(i, name, sizeof(name));
+        run->ids[i] = intern(name, strlen(name));
+    }
+    return NULL;
+}
+
+Test(intern_suite, concurrent, .timeout = 10) {
+    INTERN_RUN *runs = calloc(INTERN_THREADS, sizeof(INTERN_RUN));
+    pthread_t tids[INTERN_THREADS];
+    for (int t = 0; t < INTERN_THREADS; t++) {
+        runs[t].offset = t * (INTERN_NAMES / INTERN_THREADS);
+        pthread_create(&tids[t], NULL, intern_thread, &runs[t]);
+    }
+    for (int t = 0; t < INTERN_THREADS; t++) {
+        pthread_join(tids[t], NULL);
+    }
+    char *seen = calloc(INTERN_NAMES, 1);
+    for (int i = 0; i < INTERN_NAMES; i++) {
+        int id = runs[0].ids[i];
+        cr_assert(id >= 0 && id < INTERN_NAMES, "name %d given id %d", i, id);
+        cr_assert_eq(seen[id], 0, "id %d given twice", id);
+        seen[id] = 1;
+        for (int t = 1; t < INTERN_THREADS; t++) {
+            cr_assert_eq(runs[t].ids[i], id, "name %d given ids %d and %d", i, id, runs[t].ids[i]);
+        }
+        char name[32];
+        intern_test_name(i, name, sizeof(name));
+        cr_assert_str_eq(intern_name(id), name, "id %d is %s", id, intern_name(id));
+        cr_assert_eq(intern_len(id), strlen(name), "id %d of length %zu", id, intern_len(id));
+        cr_assert_eq(intern_find(name, strlen(name)), id, "name %d not found", i);
+    }
+    free(seen);
+    free(runs);
+}
+
+Test(intern_suite, lookups, .timeout = 5) {
+    int id = intern("intern_alice", 12);
+    cr_assert_geq(id, 0, "not interned");
+    const char *bytes = intern_name(id);
+    //found from a copy, and out of a longer buffer
+    char copy[] = "intern_alice";
+    cr_assert_eq(intern(copy, strlen(copy)), id, "interned twice");
+    cr_assert_eq(intern_find("intern_alice_and_bob", 12), id, "not found by length");
+    //a name ends at its first NUL
+    cr_assert_eq(intern("intern_alice\0bob", 16), id, "NUL not taken as the end");
+    cr_assert_eq(intern_find("intern_alice\0", 13), id, "NUL not taken as the end");
+    cr_assert_eq(intern_hash(id), intern_hash(intern(copy, strlen(copy))), "hash changed");
+    //names never interned are not found, and finding does not intern them
+    cr_assert_eq(intern_find("intern_carol", 12), -1, "found a name never interned");
+    cr_assert_eq(intern_find("intern_carol", 12), -1, "finding interned the name");
+    cr_assert_eq(intern_find("intern_alic", 11), -1, "found a prefix");
+    cr_assert_eq(intern("intern_carol", 12), id + 1, "ids not dense");
+    //the bytes of a name stay where they are
+    cr_assert_eq(intern_name(id), bytes, "name moved");
+}
+
+/*
+ * Id scan (see id_scan.h).  Whichever vector implementation the CPU
+ * supports must find the same first match as a scan one id at a time, at
+ * every length up to past MAX_CLIENTS, so that the tails shorter than a
+ * vector are covered, and from unaligned starts.  Ids are drawn from a
+ * small range so that there are duplicates, and include negative ones.
+ */
+#define SCAN_IDS (MAX_CLIENTS + 17)
+
+Test(id_scan_suite, matches_scalar, .timeout = 10) {
+    int32_t ids[SCAN_IDS + 8];
+    unsigned seed = 37;
+    for (int round = 0; round < 200; round++) {
+        for (int i = 0; i < SCAN_IDS + 8; i++) {
+            ids[i] = (int32_t)(rand_r(&seed) % 96) - 8;
+        }
+        for (int start = 0; start < 8; start++) {
+            for (int n = 0; n <= SCAN_IDS; n++) {
+                for (int32_t id = -9; id < 90; id += 7) {
+                    int expected = id_scan_scalar(ids + start, n, id);
+                    int found = id_scan(ids + start, n, id);
+                    cr_assert_eq(found, expected, "round %d, start %d, %d ids, id %d: found at %d, not %d",
+                                 round, start, n, id, found, expected);
+                }
+                //the last id of the array is found
+                if (n > 0) {
+                    int32_t last = ids[start + n - 1];
+                    cr_assert_eq(id_scan(ids + start, n, last), id_scan_scalar(ids + start, n, last),
+                                 "round %d, start %d, %d ids: last id %d", round, start, n, last);
+                }
+            }
+        }
+    }
+}
+
+/*
+ * USERS (see player_ext.h).  The response holds one "name\trating\n" line
+ * for every player who is logged in, and no other, and a player's line
+ * follows the player's rating as games are rated.
+ */
+#define USERS_PLAYERS 40
+
+static int users_count(char *users, char *name, int rating) {
+    char line[64];
+    int len = snprintf(line, sizeof(line), "%s\t%d\n", name, rating);
+    int count = 0;
+    for (char *p = users; *p; p = strchr(p, '\n') + 1) {
+        count += !strncmp(p, line, len);
+    }
+    return count;
+}
+
+static int users_lines(char *users) {
+    int lines = 0;
+    for (char *p = users; *p; p++) {
+        lines += *p == '\n';
+    }
+    return lines;
+}
+
+static char *users_get(int fd) {
+    char *users;
+    proto_send(fd, JEUX_USERS_PKT, 0, 0, NULL, 0);
+    proto_expect(fd, JEUX_ACK_PKT, NULL, &users);
+    return users;
+}
+
+Test(users_suite, lines, .timeout = 10) {
+    proto_setup();
+    int fds[USERS_PLAYERS];
+    char names[USERS_PLAYERS][32];
+    for (int i = 0; i < USERS_PLAYERS; i++) {
+        snprintf(names[i], sizeof(names[i]), "users_%d", i);
+        fds[i] = proto_connect();
+        proto_login(fds[i], names[i]);
+    }
+    char *users = users_get(fds[0]);
+    cr_assert_eq(users_lines(users), USERS_PLAYERS, "%d lines:\n%s", users_lines(users), users);
+    for (int i = 0; i < USERS_PLAYERS; i++) {
+        cr_assert_eq(users_count(users, names[i], 1500), 1, "%s not listed once:\n%s", names[i], users);
+    }
+    free(users);
+    //the first player beats the second, who resigns
+    int first_id, second_id;
+    proto_start_game(fds[0], fds[1], names[1], &first_id, &second_id);
+    proto_send(fds[1], JEUX_RESIGN_PKT, second_id, 0, NULL, 0);
+    proto_expect(fds[1], JEUX_ACK_PKT, NULL, NULL);
+    proto_expect(fds[0], JEUX_RESIGNED_PKT, NULL, NULL);
+    users = users_get(fds[2]);
+    cr_assert_eq(users_count(users, names[0], 1516), 1, "winner not rerated:\n%s", users);
+    cr_assert_eq(users_count(users, names[1], 1484), 1, "loser not rerated:\n%s", users);
+    cr_assert_eq(users_lines(users), USERS_PLAYERS, "%d lines:\n%s", users_lines(users), users);
+    free(users);
+    //a player whose connection is gone is no longer listed, once logged out
+    close(fds[3]);
+    int listed = 1;
+    for (int tries = 0; listed && tries < 500; tries++) {
+        usleep(10000);
+        users = users_get(fds[0]);
+        listed = users_count(users, names[3], 1500);
+        free(users);
+    }
+    cr_assert_eq(listed, 0, "%s still listed", names[3]);
+}
+
+/*
+ * Capabilities (see protocol_ext.h).  The role byte of a LOGIN asks for
+ * capabilities: flags that the server knows are granted, and others are
+ * ignored rather than refused.  A client granted the packed state is sent
+ * the state as three bytes, and others still as text.
+ */
+static CLIENT *caps_login(int fd, char *name, int caps) {
+    proto_send(fd, JEUX_LOGIN_PKT, 0, caps, name, strlen(name));
+    proto_expect(fd, JEUX_ACK_PKT, NULL, NULL);
+    CLIENT *client = creg_lookup(client_registry, name);
+    cr_assert_not_null(client, "%s not logged in", name);
+    client_unref(client, "caps looked up");
+    return client;
+}
+
+Test(caps_suite, login_role_byte, .timeout = 5) {
+    proto_setup();
+    int plain = proto_connect(), packed = proto_connect(), unknown = proto_connect();
+    CLIENT *plain_client = caps_login(plain, "caps_plain", 0);
+    CLIENT *packed_client = caps_login(packed, "caps_packed", JEUX_CAP_PACKED_STATE);
+    CLIENT *unknown_client = caps_login(unknown, "caps_unknown", 0xf0);
+    cr_assert_eq(client_get_caps(plain_client), 0, "caps %x", client_get_caps(plain_client));
+    cr_assert_eq(client_get_caps(packed_client) & JEUX_CAP_PACKED_STATE, JEUX_CAP_PACKED_STATE,
+                 "caps %x", client_get_caps(packed_client));
+    cr_assert_eq(client_get_caps(unknown_client) & JEUX_CAP_PACKED_STATE, 0,
+                 "caps %x", client_get_caps(unknown_client));
+}
+
+Test(caps_suite, packed_state, .timeout = 5) {
+    proto_setup();
+    int plain = proto_connect(), packed = proto_connect();
+    caps_login(plain, "caps_plain", 0);
+    caps_login(packed, "caps_packed", JEUX_CAP_PACKED_STATE);
+    JEUX_PACKET_HEADER hdr;
+    char *state;
+    //the packed client moves first, so the ACK of its ACCEPT shows the board
+    proto_send(plain, JEUX_INVITE_PKT, 0, FIRST_PLAYER_ROLE, "caps_packed", 11);
+    proto_expect(plain, JEUX_ACK_PKT, NULL, NULL);
+    proto_expect(packed, JEUX_INVITED_PKT, &hdr, NULL);
+    proto_send(packed, JEUX_ACCEPT_PKT, hdr.id, 0, NULL, 0);
+    proto_expect(packed, JEUX_ACK_PKT, &hdr, &state);
+    cr_assert_eq(ntohs(hdr.size), JEUX_PACKED_STATE_SIZE, "state of %d bytes", ntohs(hdr.size));
+    unsigned char *bytes = (unsigned char *)state;
+    uint32_t bits = bytes[0] << 16 | bytes[1] << 8 | bytes[2];
+    //an empty board, with the first player to move
+    cr_assert_eq(bits, FIRST_PLAYER_ROLE << 18, "packed state %06x", bits);
+    free(state);
+    proto_expect(plain, JEUX_ACCEPTED_PKT, NULL, NULL);
+    //and the other way round, the plain client is shown the board as text
+    proto_send(packed, JEUX_INVITE_PKT, 0, FIRST_PLAYER_ROLE, "caps_plain", 10);
+    proto_expect(packed, JEUX_ACK_PKT, NULL, NULL);
+    proto_expect(plain, JEUX_INVITED_PKT, &hdr, NULL);
+    proto_send(plain, JEUX_ACCEPT_PKT, hdr.id, 0, NULL, 0);
+    proto_expect(plain, JEUX_ACK_PKT, &hdr, &state);
+    cr_assert_gt(ntohs(hdr.size), JEUX_PACKED_STATE_SIZE, "state of %d bytes", ntohs(hdr.size));
+    cr_assert_not_null(strchr(state, '|'), "state is not text");
+    free(state);
+}
+
+/*
+ * Correlation tags (see protocol_ext.h).  A client that asks for them at
+ * LOGIN finds the timestamps of each request echoed in its ACK or NACK,
+ * the LOGIN's own included; a client that does not, never does.  Replies
+ * to requests that arrive together come in order, each with its own tag.
+ */
+#define TAG_BASE 0x5eed0000
+
+static void tag_request(JEUX_PACKET_HEADER *hdr, int type, int id, int role, size_t size, uint32_t tag) {
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->type = type;
+    hdr->id = id;
+    hdr->role = role;
+    hdr->size = htons(size);
+    hdr->timestamp_sec = htonl(tag);
+    hdr->timestamp_nsec = htonl(~tag);
+}
+
+static void tag_check(int fd, int type, int id, int role, char *payload, uint32_t tag,
+                      int expected, int echoed) {
+    JEUX_PACKET_HEADER hdr;
+    tag_request(&hdr, type, id, role, payload ? strlen(payload) : 0, tag);
+    cr_assert_eq(proto_send_packet(fd, &hdr, payload), 0, "request not sent");
+    proto_expect(fd, expected, &hdr, NULL);
+    int match = ntohl(hdr.timestamp_sec) == tag && ntohl(hdr.timestamp_nsec) == ~tag;
+    cr_assert_eq(match, echoed, "request of type %d tagged %x: reply tagged %x/%x", type, tag,
+                 ntohl(hdr.timestamp_sec), ntohl(hdr.timestamp_nsec));
+}
+
+static int tag_login(char *name, int caps, uint32_t tag, JEUX_PACKET_HEADER *ack) {
+    int fd = proto_connect();
+    tag_request(ack, JEUX_LOGIN_PKT, 0, caps, strlen(name), tag);
+    cr_assert_eq(proto_send_packet(fd, ack, name), 0, "LOGIN not sent");
+    proto_expect(fd, JEUX_ACK_PKT, ack, NULL);
+    return fd;
+}
+
+Test(tag_suite, echo, .timeout = 5) {
+    proto_setup();
+    JEUX_PACKET_HEADER ack;
+    int tagged = tag_login("tag_tagged", JEUX_CAP_CORRELATION, TAG_BASE, &ack);
+    cr_assert_eq(ntohl(ack.timestamp_sec), TAG_BASE, "LOGIN ACK tagged %x", ntohl(ack.timestamp_sec));
+    cr_assert_eq(ntohl(ack.timestamp_nsec), ~TAG_BASE, "LOGIN ACK tagged %x", ntohl(ack.timestamp_nsec));
+    int other = tag_login("tag_other", 0, TAG_BASE, &ack);
+    //requests answered with ACK, with NACK, and with an ACK sent from
+    //inside the invitation code, each with a tag of its own
+    tag_check(tagged, JEUX_USERS_PKT, 0, 0, NULL, TAG_BASE + 1, JEUX_ACK_PKT, 1);
+    tag_check(tagged, JEUX_ACCEPT_PKT, 7, 0, NULL, TAG_BASE + 2, JEUX_NACK_PKT, 1);
+    tag_check(tagged, JEUX_INVITE_PKT, 0, FIRST_PLAYER_ROLE, "tag_other", TAG_BASE + 3, JEUX_ACK_PKT, 1);
+    tag_check(tagged, JEUX_REVOKE_PKT, 0, 0, NULL, TAG_BASE + 4, JEUX_ACK_PKT, 1);
+    //a client that did not ask is not echoed
+    proto_expect(other, JEUX_INVITED_PKT, NULL, NULL);
+    proto_expect(other, JEUX_REVOKED_PKT, NULL, NULL);
+    tag_check(other, JEUX_USERS_PKT, 0, 0, NULL, TAG_BASE + 5, JEUX_ACK_PKT, 0);
+    tag_check(other, JEUX_ACCEPT_PKT, 7, 0, NULL, TAG_BASE + 6, JEUX_NACK_PKT, 0);
+}
+
+Test(tag_suite, pipelined, .timeout = 5) {
+    proto_setup();
+    JEUX_PACKET_HEADER hdr;
+    int fd = tag_login("tag_tagged", JEUX_CAP_CORRELATION, TAG_BASE, &hdr);
+    //three requests written back to back, the last arriving in two pieces
+    JEUX_PACKET_HEADER reqs[3];
+    for (int i = 0; i < 3; i++) {
+        tag_request(&reqs[i], i == 1 ? JEUX_ACCEPT_PKT : JEUX_USERS_PKT, 9, 0, 0, TAG_BASE + 10 + i);
+    }
+    size_t split = 2 * sizeof(JEUX_PACKET_HEADER) + 3;
+    cr_assert_eq(write(fd, reqs, split), (ssize_t)split, "requests not written");
+    usleep(50000);
+    cr_assert_eq(write(fd, (char *)reqs + split, sizeof(reqs) - split), (ssize_t)(sizeof(reqs) - split),
+                 "requests not written");
+    for (int i = 0; i < 3; i++) {
+        int type = proto_next(fd, &hdr, NULL);
+        cr_assert_eq(type, i == 1 ? JEUX_NACK_PKT : JEUX_ACK_PKT, "reply %d of type %d", i, type);
+        cr_assert_eq(ntohl(hdr.timestamp_sec), TAG_BASE + 10 + i, "reply %d tagged %x", i,
+                     ntohl(hdr.timestamp_sec));
+    }
+}
+
+/*
+ * Backends.  Whatever serves the connections, two clients that log in
+ * list each other, and play a short game in which each sees the other's
+ * moves, and both see its end, the winner ahead of the ACK of its move.
+ */
+static void proto_round_trip(int alice, int bob) {
+    proto_login(alice, "trip_alice");
+    proto_login(bob, "trip_bob");
+    char *users;
+    proto_send(bob, JEUX_USERS_PKT, 0, 0, NULL, 0);
+    proto_expect(bob, JEUX_ACK_PKT, NULL, &users);
+    cr_assert(strstr(users, "trip_alice\t") && strstr(users, "trip_bob\t"), "USERS sent\n%s", users);
+    free(users);
+    int alice_id, bob_id;
+    proto_start_game(alice, bob, "trip_bob", &alice_id, &bob_id);
+    free(proto_play(alice, alice_id, bob, 1));
+    free(proto_play(bob, bob_id, alice, 4));
+    free(proto_play(alice, alice_id, bob, 2));
+    free(proto_play(bob, bob_id, alice, 5));
+    JEUX_PACKET_HEADER hdr;
+    proto_move(alice, alice_id, 3);
+    proto_expect(alice, JEUX_ENDED_PKT, &hdr, NULL);
+    cr_assert_eq(hdr.role, FIRST_PLAYER_ROLE, "winner %d", hdr.role);
+    proto_expect(alice, JEUX_ACK_PKT, NULL, NULL);
+    proto_expect(bob, JEUX_MOVED_PKT, NULL, NULL);
+    proto_expect(bob, JEUX_ENDED_PKT, &hdr, NULL);
+    cr_assert_eq(hdr.role, FIRST_PLAYER_ROLE, "winner %d", hdr.role);
+}
+
+static int uring_connect(int port) {
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port) };
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    cr_assert_eq(connect(fd, (struct sockaddr *)&addr, sizeof(addr)), 0, "not connected");
+    return fd;
+}
+
+Test(uring_suite, round_trip, .timeout = 10) {
+    proto_setup();
+    struct sockaddr_in addr = { .sin_family = AF_INET };
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    cr_assert_eq(bind(listen_fd, (struct sockaddr *)&addr, len), 0, "not bound");
+    cr_assert_eq(listen(listen_fd, 8), 0, "not listening");
+    getsockname(listen_fd, (struct sockaddr *)&addr, &len);
+    if (uring_start(listen_fd, 0)) {
+        cr_skip_test("io_uring is not available");
+    }
+    proto_round_trip(uring_connect(ntohs(addr.sin_port)), uring_connect(ntohs(addr.sin_port)));
+}
+
+static int coro_connect(void) {
+    int sv[2];
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0, "no socket pair");
+    cr_assert_eq(coro_spawn(jeux_client_coroutine, (void *)(intptr_t)sv[0]), 0, "no coroutine");
+    return sv[1];
+}
+
+Test(coro_suite, round_trip, .timeout = 10) {
+    proto_setup();
+    cr_assert_eq(coro_init(2), 0, "workers not started");
+    int alice = coro_connect(), bob = coro_connect();
+    proto_round_trip(alice, bob);
+    //the coroutines finish once their clients have hung up
+    close(alice);
+    close(bob);
+    creg_wait_for_empty(client_registry);
+    coro_fini();
+}
+
+/*
+ * Work stealing (see workq.h).  A task submitted from outside the pool
+ * runs on some worker and there submits a round of leaf tasks, which go on
+ * that worker's deque.  Either the worker returns and pops them from the
+ * bottom while idle workers steal from the top, racing for the last one,
+ * or it waits for them, so that every one of them has to be stolen.  Each
+ * leaf must run exactly once.  A round larger than a deque spills over
+ * into the shared queue.
+ */
+#define STEAL_WORKERS 4
+#define STEAL_ROUNDS 20000
+#define STEAL_FANOUT 8
+#define STEAL_WAITING_ROUNDS 500
+#define STEAL_WAITING_FANOUT 64
+#define STEAL_OVERFLOW 10000
+
+typedef struct steal_leaf {
+    WORKQ_TASK task;
+    struct steal_round *round;
+    atomic_int runs;
+    pthread_t ran_on;
+} STEAL_LEAF;
+
+typedef struct steal_round {
+    WORKQ_TASK task;
+    STEAL_LEAF *leaves;
+    int nleaves;
+    int wait;                       /* The spawner waits for its leaves */
+    pthread_t spawner;
+    atomic_int left;                /* Leaves not yet run, and the spawner */
+    sem_t done;
+} STEAL_ROUND;
+
+static void steal_finish(STEAL_ROUND *round) {
+    if (atomic_fetch_sub(&round->left, 1) == 1) {
+        sem_post(&round->done);
+    }
+}
+
+static void steal_leaf_run(WORKQ_TASK *task) {
+    STEAL_LEAF *leaf = (STEAL_LEAF *)task;
+    leaf->ran_on = pthread_self();
+    atomic_fetch_add(&leaf->runs, 1);
+    steal_finish(leaf->round);
+}
+
+static void steal_spawn_run(WORKQ_TASK *task) {
+    STEAL_ROUND *round = (STEAL_ROUND *)task;
+    round->spawner = pthread_self();
+    for (int i = 0; i < round->nleaves; i++) {
+        workq_submit(&round->leaves[i].task);
+    }
+    while (round->wait && atomic_load(&round->left) > 1) {
+        sched_yield();
+    }
+    steal_finish(round);
+}
+
+static void steal_round(STEAL_ROUND *round, STEAL_LEAF *leaves, int nleaves, int wait) {
+    for (int i = 0; i < nleaves; i++) {
+        leaves[i].task.run = steal_leaf_run;
+        leaves[i].round = round;
+        atomic_store(&leaves[i].runs, 0);
+    }
+    round->task.run = steal_spawn_run;
+    round->leaves = leaves;
+    round->nleaves = nleaves;
+    round->wait = wait;
+    atomic_store(&round->left, nleaves + 1);
+    workq_submit(&round->task);
+    sem_wait(&round->done);
+    for (int i = 0; i < nleaves; i++) {
+        cr_assert_eq(atomic_load(&leaves[i].runs), 1, "leaf %d of %d ran %d times", i, nleaves,
+                     atomic_load(&leaves[i].runs));
+    }
+}
+
+Test(workq_suite, pop_steal_race, .timeout = 60) {
+    cr_assert_eq(workq_init(STEAL_WORKERS, WORKQ_STEALING), 0, "workers not started");
+    STEAL_ROUND round;
+    sem_init(&round.done, 0, 0);
+    STEAL_LEAF *leaves = calloc(STEAL_OVERFLOW, sizeof(STEAL_LEAF));
+    for (int r = 0; r < STEAL_ROUNDS; r++) {
+        steal_round(&round, leaves, 1 + r % STEAL_FANOUT, 0);
+    }
+    steal_round(&round, leaves, STEAL_OVERFLOW, 0);
+    workq_fini();
+    free(leaves);
+    sem_destroy(&round.done);
+}
+
+Test(workq_suite, all_stolen, .timeout = 60) {
+    cr_assert_eq(workq_init(STEAL_WORKERS, WORKQ_STEALING), 0, "workers not started");
+    STEAL_ROUND round;
+    sem_init(&round.done, 0, 0);
+    STEAL_LEAF leaves[STEAL_WAITING_FANOUT];
+    for (int r = 0; r < STEAL_WAITING_ROUNDS; r++) {
+        steal_round(&round, leaves, STEAL_WAITING_FANOUT, 1);
+        for (int i = 0; i < STEAL_WAITING_FANOUT; i++) {
+            cr_assert(!pthread_equal(leaves[i].ran_on, round.spawner),
+                      "round %d: leaf %d ran on the worker that was waiting for it", r, i);
+        }
+    }
+    workq_fini();
+    sem_destroy(&round.done);
+}
+
+/*
+ * Game mailboxes (see game_ext.h).  Threads post to one game at once,
+ * some waiting for their messages to be handled and some not.  The
+ * messages must be handled one at a time, each thread's in the order in
+ * which it posted them.
+ */
+#define MAILBOX_THREADS 4
+#define MAILBOX_MSGS 20000
+
+typedef struct mailbox_msg {
+    GAME_MSG msg;
+    int thread;
+    int seq;
+} MAILBOX_MSG;
+
+typedef struct mailbox_poster {
+    GAME *game;
+    int thread;
+} MAILBOX_POSTER;
+
+static struct {
+    atomic_int inside;
+    atomic_int handled;
+    int overlaps;
+    int disorders;
+    int last[MAILBOX_THREADS];
+} mailbox;
+
+static void mailbox_handle(GAME_MSG *msg) {
+    MAILBOX_MSG *m = (MAILBOX_MSG *)msg;
+    mailbox.overlaps += atomic_fetch_add(&mailbox.inside, 1) != 0;
+    mailbox.disorders += m->seq != mailbox.last[m->thread] + 1;
+    mailbox.last[m->thread] = m->seq;
+    atomic_fetch_sub(&mailbox.inside, 1);
+    //a message that nobody waits for is the handler's to free
+    if (!msg->waited) {
+        free(m);
+    }
+    atomic_fetch_add(&mailbox.handled, 1);
+}
+
+static void *mailbox_thread(void *arg) {
+    MAILBOX_POSTER *poster = arg;
+    for (int i = 0; i < MAILBOX_MSGS; i++) {
+        if (poster->thread % 2) {
+            MAILBOX_MSG *m = calloc(1, sizeof(MAILBOX_MSG));
+            m->msg.handle = mailbox_handle;
+            m->thread = poster->thread;
+            m->seq = i;
+            game_post(poster->game, &m->msg);
+        }
+        else {
+            MAILBOX_MSG m = { .msg.handle = mailbox_handle, .thread = poster->thread, .seq = i };
+            game_call(poster->game, &m.msg);
+        }
+    }
+    return NULL;
+}
+
+Test(mailbox_suite, handled_in_order, .timeout = 30) {
+    GAME *game = game_create();
+    MAILBOX_POSTER posters[MAILBOX_THREADS];
+    pthread_t tids[MAILBOX_THREADS];
+    for (int t = 0; t < MAILBOX_THREADS; t++) {
+        mailbox.last[t] = -1;
+    }
+    for (int t = 0; t < MAILBOX_THREADS; t++) {
+        posters[t].game = game;
+        posters[t].thread = t;
+        pthread_create(&tids[t], NULL, mailbox_thread, &posters[t]);
+    }
+    for (int t = 0; t < MAILBOX_THREADS; t++) {
+        pthread_join(tids[t], NULL);
+    }
+    //the messages that were only posted may still be being handled
+    for (int tries = 0; atomic_load(&mailbox.handled) < MAILBOX_THREADS * MAILBOX_MSGS && tries < 1000; tries++) {
+        usleep(1000);
+    }
+    cr_assert_eq(atomic_load(&mailbox.handled), MAILBOX_THREADS * MAILBOX_MSGS, "%d messages handled",
+                 atomic_load(&mailbox.handled));
+    cr_assert_eq(mailbox.overlaps, 0, "%d messages handled at once with another", mailbox.overlaps);
+    cr_assert_eq(mailbox.disorders, 0, "%d messages handled out of order", mailbox.disorders);
+    for (int t = 0; t < MAILBOX_THREADS; t++) {
+        cr_assert_eq(mailbox.last[t], MAILBOX_MSGS - 1, "thread %d: last message %d", t, mailbox.last[t]);
+    }
+    game_unref(game, "mailbox test over");
+}
+
+/*
+ * The notifications that come of a game follow the order in which its
+ * mailbox handles the moves.  A winning move races its opponent's
+ * resignation, over and over.  Whichever is handled first wins, and each
+ * player is told so consistently: the opponent of a winning move is sent
+ * the move before the end of the game, and the mover is sent the end
+ * before the ACK of its move.
+ */
+#define MAILBOX_GAMES 200
+
+//the next two packets, which may come in either order
+static void mailbox_expect_two(int fd, int type1, int type2, int game) {
+    JEUX_PACKET_HEADER hdr;
+    int first = proto_next(fd, &hdr, NULL);
+    cr_assert(first == type1 || first == type2, "game %d: packet of type %d", game, first);
+    proto_expect(fd, first == type1 ? type2 : type1, NULL, NULL);
+}
+
+Test(mailbox_suite, move_resign_race, .timeout = 60) {
+    proto_setup();
+    int alice = proto_connect(), bob = proto_connect();
+    proto_login(alice, "mailbox_alice");
+    proto_login(bob, "mailbox_bob");
+    for (int g = 0; g < MAILBOX_GAMES; g++) {
+        int alice_id, bob_id;
+        proto_start_game(alice, bob, "mailbox_bob", &alice_id, &bob_id);
+        free(proto_play(alice, alice_id, bob, 1));
+        free(proto_play(bob, bob_id, alice, 4));
+        free(proto_play(alice, alice_id, bob, 2));
+        free(proto_play(bob, bob_id, alice, 5));
+        proto_move(alice, alice_id, 3);
+        proto_send(bob, JEUX_RESIGN_PKT, bob_id, 0, NULL, 0);
+        JEUX_PACKET_HEADER hdr;
+        int first = proto_next(alice, &hdr, NULL);
+        if (first == JEUX_ENDED_PKT) {
+            //the move won
+            cr_assert_eq(hdr.role, FIRST_PLAYER_ROLE, "game %d: winner %d", g, hdr.role);
+            proto_expect(alice, JEUX_ACK_PKT, NULL, NULL);
+            proto_expect(bob, JEUX_MOVED_PKT, NULL, NULL);
+            mailbox_expect_two(bob, JEUX_ENDED_PKT, JEUX_NACK_PKT, g);
+        }
+        else {
+            //the resignation won, and the move was refused
+            cr_assert(first == JEUX_RESIGNED_PKT || first == JEUX_NACK_PKT, "game %d: packet of type %d",
+                      g, first);
+            proto_expect(alice, first == JEUX_NACK_PKT ? JEUX_RESIGNED_PKT : JEUX_NACK_PKT, NULL, NULL);
+            proto_expect(bob, JEUX_ACK_PKT, NULL, NULL);
+        }
+    }
+}
+
+/*
+ * Client mailboxes (see client_ext.h).  While a client's mailbox is open,
+ * notifications posted to it are not written to its connection, but wake
+ * its eventfd, and are written when the thread serving the connection
+ * flushes them: each thread's in the order in which it posted them, and
+ * none lost, however many threads post at once.
+ */
+#define NOTICE_THREADS 4
+#define NOTICE_COUNT 5000
+
+typedef struct notice_poster {
+    CLIENT *client;
+    int thread;
+} NOTICE_POSTER;
+
+typedef struct notice_reader {
+    int fd;
+    int last[NOTICE_THREADS];
+    int disorders;
+    atomic_int received;
+} NOTICE_READER;
+
+static void notice_post(CLIENT *client, int thread, uint32_t seq) {
+    JEUX_PACKET_HEADER hdr = {0};
+    hdr.type = JEUX_MOVED_PKT;
+    hdr.id = thread;
+    hdr.size = htons(sizeof(seq));
+    seq = htonl(seq);
+    cr_assert_eq(client_post_notice(client, &hdr, &seq), 0, "notice not posted");
+}
+
+static void *notice_poster(void *arg) {
+    NOTICE_POSTER *poster = arg;
+    for (int i = 0; i < NOTICE_COUNT; i++) {
+        notice_post(poster->client, poster->thread, i);
+    }
+    return NULL;
+}
+
+static void *notice_reader(void *arg) {
+    NOTICE_READER *reader = arg;
+    while (atomic_load(&reader->received) < NOTICE_THREADS * NOTICE_COUNT) {
+        JEUX_PACKET_HEADER hdr;
+        void *payload = NULL;
+        if (proto_recv_packet(reader->fd, &hdr, &payload)) {
+            break;
+        }
+        uint32_t seq;
+        memcpy(&seq, payload, sizeof(seq));
+        free(payload);
+        reader->disorders += hdr.id >= NOTICE_THREADS || (int)ntohl(seq) != reader->last[hdr.id] + 1;
+        if (hdr.id < NOTICE_THREADS) {
+            reader->last[hdr.id] = ntohl(seq);
+        }
+        atomic_fetch_add(&reader->received, 1);
+    }
+    return NULL;
+}
+
+Test(notice_suite, eventfd_mailbox, .timeout = 30) {
+    proto_setup();
+    int sv[2];
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0, "no socket pair");
+    CLIENT *client = creg_register(client_registry, sv[0]);
+    int efd = client_open_mailbox(client);
+    cr_assert_geq(efd, 0, "no eventfd");
+    //a notice wakes the eventfd, and is held until it is flushed
+    notice_post(client, 0, 0);
+    struct pollfd pfd = { .fd = efd, .events = POLLIN };
+    cr_assert_eq(poll(&pfd, 1, 1000), 1, "eventfd not woken");
+    proto_quiet(sv[1], 50);
+    uint64_t count;
+    cr_assert_eq(read(efd, &count, sizeof(count)), sizeof(count), "eventfd not read");
+    client_flush_notices(client);
+    JEUX_PACKET_HEADER hdr;
+    proto_expect(sv[1], JEUX_MOVED_PKT, &hdr, NULL);
+    cr_assert_eq(hdr.id, 0, "notice of ID %d", hdr.id);
+    //then threads post at once, while this one serves the connection
+    NOTICE_READER reader = { .fd = sv[1] };
+    for (int t = 0; t < NOTICE_THREADS; t++) {
+        reader.last[t] = -1;
+    }
+    pthread_t reader_tid, tids[NOTICE_THREADS];
+    NOTICE_POSTER posters[NOTICE_THREADS];
+    pthread_create(&reader_tid, NULL, notice_reader, &reader);
+    for (int t = 0; t < NOTICE_THREADS; t++) {
+        posters[t].client = client;
+        posters[t].thread = t;
+        pthread_create(&tids[t], NULL, notice_poster, &posters[t]);
+    }
+    for (int idle = 0; atomic_load(&reader.received) < NOTICE_THREADS * NOTICE_COUNT && idle < 100; ) {
+        if (poll(&pfd, 1, 10) == 1) {
+            cr_assert_eq(read(efd, &count, sizeof(count)), sizeof(count), "eventfd not read");
+            client_flush_notices(client);
+            idle = 0;
+        }
+        else {
+            idle++;
+        }
+    }
+    for (int t = 0; t < NOTICE_THREADS; t++) {
+        pthread_join(tids[t], NULL);
+    }
+    int received = atomic_load(&reader.received);
+    cr_assert_eq(received, NOTICE_THREADS * NOTICE_COUNT, "%d notices received", received);
+    pthread_join(reader_tid, NULL);
+    cr_assert_eq(reader.disorders, 0, "%d notices out of order", reader.disorders);
+}
+
+/*
+ * Shard rings (see shard.h).  Shard 1 logs in players of its own, and
+ * shard 0 asks it for their USERS lines over and over, each time with a
+ * different limit, so that the replies are of many sizes and wrap around
+ * the ring from shard 1 many times, at every kind of offset.  Each reply
+ * must be exactly what the limit allows of the full listing.
+ * Then shard 0 sends more than its ring to shard 1 can hold in one go,
+ * which must be held back rather than lost or reordered: a last call,
+ * sent after it, must still be answered.
+ * The shards report through a pipe, as they are not the test's own
+ * process.
+ */
+#define SHARD_TEST_PLAYERS (MAX_CLIENTS - 8)
+#define SHARD_TEST_CALLS 3000
+#define SHARD_TEST_FLOOD 64
+#define SHARD_TEST_FLOOD_SIZE 60000
+
+//the lines that handle_users() fits within a limit, as it picks them
+static size_t shard_expected(const char *full, size_t full_len, size_t limit, char *out) {
+    size_t len = 0;
+    for (size_t i = 0; i < full_len; ) {
+        size_t line = (const char *)memchr(full + i, '\n', full_len - i) - (full + i) + 1;
+        if (len + line <= limit) {
+            memcpy(out + len, full + i, line);
+            len += line;
+        }
+        i += line;
+    }
+    return len;
+}
+
+static int shard_check_users(const char *full, size_t full_len, size_t limit, char *expected) {
+    size_t len = 0;
+    char *lines = peer_users(limit, &len);
+    size_t expected_len = shard_expected(full, full_len, limit, expected);
+    int ok = len == expected_len && (!len || !memcmp(lines, expected, len));
+    free(lines);
+    return ok;
+}
+
+static int shard_asker(void) {
+    size_t full_len = 0;
+    char *full = peer_users(UINT16_MAX, &full_len);
+    int lines = 0;
+    for (size_t i = 0; i < full_len; i++) {
+        lines += full[i] == '\n';
+    }
+    if (lines != SHARD_TEST_PLAYERS) {
+        return -1;
+    }
+    char *expected = malloc(full_len);
+    int failures = 0;
+    for (int i = 0; i < SHARD_TEST_CALLS; i++) {
+        failures += !shard_check_users(full, full_len, (i * 37) % (full_len + 1), expected);
+    }
+    //notices for a game that does not exist, which shard 1 ignores
+    char *flood = calloc(1, SHARD_TEST_FLOOD_SIZE);
+    for (int i = 0; i < SHARD_TEST_FLOOD; i++) {
+        PEER_MSG msg = {0};
+        msg.op = PEER_SYNC;
+        msg.tag = ~(uint64_t)i;
+        failures += peer_send(1, &msg, flood, SHARD_TEST_FLOOD_SIZE) != 0;
+    }
+    free(flood);
+    failures += !shard_check_users(full, full_len, full_len, expected);
+    free(expected);
+    free(full);
+    return failures;
+}
+
+Test(shard_suite, ring_wraparound, .timeout = 60) {
+    int ready[2], result[2];
+    cr_assert_eq(pipe(ready) | pipe(result), 0, "no pipes");
+    cr_assert_eq(shard_init(2), 0, "shards not set up");
+    int self = shard_fork();
+    if (self >= 0) {
+        //each end is left open only where it is used, so that the death
+        //of a shard is seen as end-of-file rather than waited out
+        close(self == 1 ? ready[0] : ready[1]);
+        close(result[0]);
+        client_registry = creg_init();
+        player_registry = preg_init();
+        int failures = shard_start(0) ? -1 : 0;
+        if (!failures && self == 1) {
+            close(result[1]);
+            int n = 0;
+            for (int i = 0; n < SHARD_TEST_PLAYERS; i++) {
+                char name[32];
+                int len = snprintf(name, sizeof(name), "shard_player_%d", i);
+                if (shard_home(name, len) == 1) {
+                    CLIENT *client = creg_register(client_registry, -1);
+                    client_login(client, preg_register(player_registry, strdup(name)));
+                    n++;
+                }
+            }
+            write(ready[1], "", 1);
+        }
+        else if (!failures) {
+            char c;
+            failures = read(ready[0], &c, 1) == 1 ? shard_asker() : -1;
+        }
+        //shard 0 reports, unless shard 1 could not start
+        if (failures || self == 0) {
+            write(result[1], &failures, sizeof(failures));
+        }
+        //until the test is over
+        pause();
+        _exit(0);
+    }
+    cr_assert_eq(self, -1, "shards not forked");
+    close(ready[0]);
+    close(ready[1]);
+    close(result[1]);
+    int failures = -1;
+    int got = read(result[0], &failures, sizeof(failures));
+    shard_finish(SIGKILL);
+    cr_assert_eq(got, sizeof(failures), "no result from the shards");
+    cr_assert_eq(failures, 0, "%d of %d calls between shards failed", failures, SHARD_TEST_CALLS + 1);
+}
+
+/*
+ * Copies of cross-shard invitations (see client_ext.h).  The test stands
+ * in for the shard that keeps the invitation, which grants every request
+ * forwarded to it.  A MOVED that was on its way when the local player
+ * resigned finds the copy gone from the player's table, and must not be
+ * sent on.
+ */
+static int remote_request(CLIENT *client, INVITATION *inv, int type, char *move, char **strp) {
+    if (strp) {
+        *strp = NULL;
+    }
+    return 0;
+}
+
+static void remote_notify(CLIENT *client, INVITATION *inv, JEUX_PACKET_HEADER *hdr, void *data) {
+}
+
+static void remote_moved(CLIENT *client, INVITATION *inv) {
+}
+
+static const CLIENT_REMOTE remote_shard = { remote_notify, remote_moved, remote_request };
+
+static void remote_moved_notice(INVITATION *inv, GAME *game) {
+    unsigned char state[3];
+    game_pack_state(game, state);
+    char *text = game_unparse_state(game);
+    JEUX_PACKET_HEADER hdr = {0};
+    hdr.type = JEUX_MOVED_PKT;
+    hdr.size = htons(strlen(text));
+    cr_assert_eq(client_remote_notice(inv, &hdr, text, state), 0, "copy closed by a move");
+    free(text);
+}
+
+Test(shard_suite, moved_after_resign, .timeout = 10) {
+    proto_setup();
+    int bob = proto_connect();
+    proto_login(bob, "remote_bob");
+    CLIENT *target = creg_lookup(client_registry, "remote_bob");
+    CLIENT *source = client_create_remote(&remote_shard, player_create(strdup("remote_alice")));
+    INVITATION *inv = inv_create(source, target, FIRST_PLAYER_ROLE, SECOND_PLAYER_ROLE);
+    int id = client_remote_invited(inv);
+    JEUX_PACKET_HEADER hdr;
+    proto_expect(bob, JEUX_INVITED_PKT, &hdr, NULL);
+    cr_assert_eq(hdr.id, id, "invited with ID %d, not %d", hdr.id, id);
+    proto_send(bob, JEUX_ACCEPT_PKT, id, 0, NULL, 0);
+    proto_expect(bob, JEUX_ACK_PKT, NULL, NULL);
+    //the keeper's game, one move in
+    GAME *game = game_create();
+    GAME_MOVE *move = game_parse_move(game, FIRST_PLAYER_ROLE, "1");
+    cr_assert_eq(game_apply_move(game, move), 0, "move not applied");
+    free(move);
+    remote_moved_notice(inv, game);
+    proto_expect(bob, JEUX_MOVED_PKT, &hdr, NULL);
+    cr_assert_eq(hdr.id, id, "MOVED with ID %d, not %d", hdr.id, id);
+    proto_send(bob, JEUX_RESIGN_PKT, id, 0, NULL, 0);
+    proto_expect(bob, JEUX_ACK_PKT, NULL, NULL);
+    //a second move, sent before the resignation reached the keeper
+    move = game_parse_move(game, SECOND_PLAYER_ROLE, "5");
+    cr_assert_eq(game_apply_move(game, move), 0, "move not applied");
+    free(move);
+    remote_moved_notice(inv, game);
+    proto_quiet(bob, 100);
+    game_unref(game, "keeper's game checked");
+    inv_unref(inv, "copy checked");
+    client_unref(source, "stand-in checked");
+    client_unref(target, "copy checked");
+}
+
+/*
+ * Cluster (see cluster.h).  A directory and three nodes, each a process
+ * of its own, whose clients the test speaks for.  Bob, on node B, invites
+ * Alice on node A, which B must ask the directory about.  Alice then logs
+ * out of A and in on C, after which B must not go on sending to A what
+ * it kept from the directory: an invitation from Bob must reach her on C.
+ */
+#define CLUSTER_NODES 3
+#define CLUSTER_TRIES 200
+#define CLUSTER_SECRET "cluster test secret"
+
+static int cluster_listen(int *portp) {
+    struct sockaddr_in addr = { .sin_family = AF_INET };
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    cr_assert_eq(bind(fd, (struct sockaddr *)&addr, len), 0, "not bound");
+    cr_assert_eq(listen(fd, 8), 0, "not listening");
+    getsockname(fd, (struct sockaddr *)&addr, &len);
+    *portp = ntohs(addr.sin_port);
+    return fd;
+}
+
+//a process that dies with the test
+static pid_t cluster_fork(void) {
+    pid_t pid = fork();
+    cr_assert_neq(pid, -1, "not forked");
+    if (!pid) {
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+    }
+    return pid;
+}
+
+/*
+ * A node, whose one client is served on the first end of a socket pair,
+ * the test speaking on the second.  The test's ends of its pair and of
+ * those of the nodes before it are closed in it, so that the test can
+ * close a connection for good.
+ */
+static pid_t cluster_node(char *directory, int *sv, int *fds, int n) {
+    pid_t pid = cluster_fork();
+    if (!pid) {
+        close(sv[1]);
+        for (int i = 0; i < n; i++) {
+            close(fds[i]);
+        }
+        proto_setup();
+        if (cluster_join(directory, NULL, CLUSTER_SECRET)) {
+            _exit(1);
+        }
+        int *fdp = malloc(sizeof(int));
+        *fdp = sv[0];
+        pthread_t tid;
+        pthread_create(&tid, NULL, jeux_client_service, fdp);
+        for (;;) {
+            pause();
+        }
+    }
+    close(sv[0]);
+    return pid;
+}
+
+//a request repeated while it is NACKed, as it is until the directory catches up
+static void cluster_retry(int fd, int type, int role, char *name, JEUX_PACKET_HEADER *hdr) {
+    for (int i = 0; i < CLUSTER_TRIES; i++) {
+        proto_send(fd, type, 0, role, name, strlen(name));
+        if (proto_next(fd, hdr, NULL) == JEUX_ACK_PKT) {
+            return;
+        }
+        cr_assert_eq(hdr->type, JEUX_NACK_PKT, "packet of type %d", hdr->type);
+        usleep(10000);
+    }
+    cr_assert_fail("request of type %d for %s NACKed %d times", type, name, CLUSTER_TRIES);
+}
+
+Test(cluster_suite, directory_cache, .timeout = 30) {
+    int port;
+    int listen_fd = cluster_listen(&port);
+    pid_t pids[CLUSTER_NODES + 1];
+    pids[0] = cluster_fork();
+    if (!pids[0]) {
+        for (;;) {
+            cluster_directory(listen_fd, CLUSTER_SECRET);
+        }
+    }
+    close(listen_fd);
+    char directory[32];
+    snprintf(directory, sizeof(directory), "127.0.0.1:%d", port);
+    int fds[CLUSTER_NODES];
+    for (int n = 0; n < CLUSTER_NODES; n++) {
+        int sv[2];
+        cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0, "no socket pair");
+        pids[n + 1] = cluster_node(directory, sv, fds, n);
+        fds[n] = sv[1];
+    }
+    int alice = fds[0], bob = fds[1], alice_again = fds[2];
+    JEUX_PACKET_HEADER hdr;
+    proto_login(alice, "cluster_alice");
+    proto_login(bob, "cluster_bob");
+    cluster_retry(bob, JEUX_INVITE_PKT, FIRST_PLAYER_ROLE, "cluster_alice", &hdr);
+    int bob_id = hdr.id;
+    proto_expect(alice, JEUX_INVITED_PKT, &hdr, NULL);
+    cr_assert_eq(hdr.role, FIRST_PLAYER_ROLE, "invited as %d", hdr.role);
+    proto_send(bob, JEUX_REVOKE_PKT, bob_id, 0, NULL, 0);
+    proto_expect(bob, JEUX_ACK_PKT, NULL, NULL);
+    proto_expect(alice, JEUX_REVOKED_PKT, NULL, NULL);
+    //Alice moves from A to C
+    close(alice);
+    cluster_retry(alice_again, JEUX_LOGIN_PKT, 0, "cluster_alice", &hdr);
+    cluster_retry(bob, JEUX_INVITE_PKT, FIRST_PLAYER_ROLE, "cluster_alice", &hdr);
+    proto_expect(alice_again, JEUX_INVITED_PKT, &hdr, NULL);
+    cr_assert_eq(hdr.role, FIRST_PLAYER_ROLE, "invited as %d", hdr.role);
+    for (int n = 0; n <= CLUSTER_NODES; n++) {
+        kill(pids[n], SIGKILL);
+        waitpid(pids[n], NULL, 0);
+    }
+}
+
+/*
+ * Upgrade (see upgrade.h).  Two clients log in on an old server and start
+ * a game, and one of them has sent half a request when a new server takes
+ * over.  The old server must exit, and the new one must serve the rest of
+ * the request and the rest of the game, over the same connections.  Each
+ * server is a process of its own, as it would be.
+ */
+static void upgrade_services(void) {
+    proto_setup();
+    cr_assert_eq(timer_wheel_init(10), 0, "timer wheel not started");
+    cr_assert_eq(spectator_init(0), 0, "spectator service not started");
+    cr_assert_eq(rating_init(RATING_ELO, 0), 0, "rating thread not started");
+    session_init(0);
+}
+
+static pid_t upgrade_fork(void) {
+    pid_t pid = fork();
+    cr_assert_neq(pid, -1, "not forked");
+    if (!pid) {
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+    }
+    return pid;
+}
+
+Test(upgrade_suite, handoff, .timeout = 30) {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/jeux_upgrade_test_%d.sock", getpid());
+    int alice_sv[2], bob_sv[2], ready[2];
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, alice_sv), 0, "no socket pair");
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, bob_sv), 0, "no socket pair");
+    cr_assert_eq(pipe(ready), 0, "no pipe");
+    pid_t old = upgrade_fork();
+    if (!old) {
+        close(alice_sv[1]);
+        close(bob_sv[1]);
+        close(ready[0]);
+        upgrade_services();
+        int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+        int fds[2] = { alice_sv[0], bob_sv[0] };
+        for (int i = 0; i < 2; i++) {
+            int *fdp = malloc(sizeof(int));
+            *fdp = fds[i];
+            pthread_t tid;
+            pthread_create(&tid, NULL, jeux_client_service, fdp);
+        }
+        if (listen_fd < 0 || listen(listen_fd, 8) || upgrade_listen(path, listen_fd)) {
+            _exit(1);
+        }
+        write(ready[1], "", 1);
+        for (;;) {
+            pause();
+        }
+    }
+    close(alice_sv[0]);
+    close(bob_sv[0]);
+    close(ready[1]);
+    int alice = alice_sv[1], bob = bob_sv[1];
+    char c;
+    cr_assert_eq(read(ready[0], &c, 1), 1, "old server not started");
+    proto_login(alice, "upgrade_alice");
+    proto_login(bob, "upgrade_bob");
+    int alice_id, bob_id;
+    proto_start_game(alice, bob, "upgrade_bob", &alice_id, &bob_id);
+    free(proto_play(alice, alice_id, bob, 1));
+    //half a request, of which the old server has read what it could
+    JEUX_PACKET_HEADER hdr = {0};
+    hdr.type = JEUX_USERS_PKT;
+    size_t half = sizeof(hdr) / 2;
+    cr_assert_eq(write(alice, &hdr, half), (ssize_t)half, "request not written");
+    usleep(50000);
+    pid_t new = upgrade_fork();
+    if (!new) {
+        close(alice);
+        close(bob);
+        upgrade_services();
+        if (upgrade_takeover(path) < 0) {
+            _exit(1);
+        }
+        for (;;) {
+            pause();
+        }
+    }
+    int status;
+    cr_assert_eq(waitpid(old, &status, 0), old, "old server not reaped");
+    cr_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0, "old server ended with status %x", status);
+    cr_assert_eq(write(alice, (char *)&hdr + half, sizeof(hdr) - half), (ssize_t)(sizeof(hdr) - half),
+                 "request not written");
+    char *users;
+    proto_expect(alice, JEUX_ACK_PKT, NULL, &users);
+    cr_assert(strstr(users, "upgrade_alice\t") && strstr(users, "upgrade_bob\t"), "USERS sent\n%s", users);
+    free(users);
+    free(proto_play(bob, bob_id, alice, 4));
+    free(proto_play(alice, alice_id, bob, 2));
+    free(proto_play(bob, bob_id, alice, 5));
+    proto_move(alice, alice_id, 3);
+    proto_expect(alice, JEUX_ENDED_PKT, &hdr, NULL);
+    cr_assert_eq(hdr.role, FIRST_PLAYER_ROLE, "winner %d", hdr.role);
+    proto_expect(alice, JEUX_ACK_PKT, NULL, NULL);
+    proto_expect(bob, JEUX_MOVED_PKT, NULL, NULL);
+    proto_expect(bob, JEUX_ENDED_PKT, &hdr, NULL);
+    kill(new, SIGKILL);
+    waitpid(new, NULL, 0);
+    unlink(path);
+}
+
+/*
+ * Checkpoint recovery (see checkpoint.h).  Two games are recorded, one of
+ * them after its first move, and the writer is stopped as if the server
+ * had died.  The file is then torn as a crash in the middle of a write
+ * would leave it: the second game's only record is damaged, and a later
+ * record of the first game is half written into a free slot.  On restart
+ * the first game must come back as it was after its first move, and the
+ * second must be dropped rather than restored from a damaged record.
+ */
+#define CKPT_SLOT_SIZE 128          /* Of a record, after a header of the same size */
+#define CKPT_SCAN_SLOTS 64
+
+static CLIENT *ckpt_player(char *name) {
+    char token[SESSION_TOKEN_LEN + 1];
+    CLIENT *client = creg_register(client_registry, -1);
+    client_login(client, preg_register(player_registry, strdup(name)));
+    cr_assert_eq(session_begin(client, token), 0, "no session for %s", name);
+    return client;
+}
+
+//where a record names a player, or NULL
+static char *ckpt_name(char *slot, char *name) {
+    size_t len = strlen(name);
+    for (size_t i = 0; i + len <= CKPT_SLOT_SIZE; i++) {
+        if (!memcmp(slot + i, name, len)) {
+            return slot + i;
+        }
+    }
+    return NULL;
+}
+
+//the slot of the record naming a player, or -1
+static long ckpt_find(char (*slots)[CKPT_SLOT_SIZE], char *name) {
+    for (long i = 1; i < CKPT_SCAN_SLOTS; i++) {
+        if (*(uint64_t *)slots[i] && ckpt_name(slots[i], name)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+Test(checkpoint_suite, torn_write, .timeout = 10) {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/jeux_tests_%d.ckpt", getpid());
+    unlink(path);
+    client_registry = creg_init();
+    player_registry = preg_init();
+    cr_assert_eq(timer_wheel_init(100), 0, "timer wheel not started");
+    session_init(3600000);
+    cr_assert_eq(checkpoint_init(path), 0, "new checkpoint file not empty");
+    CLIENT *players[4] = {
+        ckpt_player("ckpt_alice"), ckpt_player("ckpt_bob"),
+        ckpt_player("ckpt_carol"), ckpt_player("ckpt_dave")
+    };
+    INVITATION *invs[2];
+    for (int i = 0; i < 2; i++) {
+        invs[i] = inv_create(players[2 * i], players[2 * i + 1], FIRST_PLAYER_ROLE, SECOND_PLAYER_ROLE);
+        cr_assert_eq(inv_accept(invs[i]), 0, "game %d not started", i);
+        checkpoint_game(invs[i]);
+    }
+    GAME *game = inv_get_game(invs[0]);
+    GAME_MOVE *move = game_parse_move(game, FIRST_PLAYER_ROLE, "5");
+    cr_assert_eq(game_apply_move(game, move), 0, "move not made");
+    free(move);
+    unsigned char moved[JEUX_PACKED_STATE_SIZE];
+    game_pack_state(game, moved);
+    checkpoint_game(invs[0]);
+    checkpoint_fini();
+    for (int i = 0; i < 2; i++) {
+        inv_unref(invs[i], "game recorded");
+    }
+    for (int i = 0; i < 4; i++) {
+        session_end(players[i]);
+        client_logout(players[i]);
+        creg_unregister(client_registry, players[i]);
+    }
+
+    int fd = open(path, O_RDWR);
+    cr_assert_geq(fd, 0, "checkpoint file not there");
+    char (*slots)[CKPT_SLOT_SIZE] = calloc(CKPT_SCAN_SLOTS, CKPT_SLOT_SIZE);
+    pread(fd, slots, CKPT_SCAN_SLOTS * CKPT_SLOT_SIZE, 0);
+    long first = ckpt_find(slots, "ckpt_alice");
+    long second = ckpt_find(slots, "ckpt_carol");
+    cr_assert(first > 0 && second > 0, "records not found: %ld, %ld", first, second);
+    long spare = 1;
+    while (spare < CKPT_SCAN_SLOTS && *(uint64_t *)slots[spare]) {
+        spare++;
+    }
+    cr_assert_lt(spare, CKPT_SCAN_SLOTS, "no free slot");
+    //a successor of the first game's record, of which only the start was written
+    memcpy(slots[spare], slots[first], CKPT_SLOT_SIZE / 2);
+    *(uint64_t *)slots[spare] += 100;
+    pwrite(fd, slots[spare], CKPT_SLOT_SIZE, spare * CKPT_SLOT_SIZE);
+    //the second game's only record, damaged
+    *ckpt_name(slots[second], "ckpt_carol") ^= 0xff;
+    pwrite(fd, slots[second], CKPT_SLOT_SIZE, second * CKPT_SLOT_SIZE);
+
+    cr_assert_eq(checkpoint_init(path), 1, "not just the intact game restored");
+    CLIENT *alice = creg_lookup(client_registry, "ckpt_alice");
+    cr_assert_not_null(alice, "first game's player not restored");
+    game = client_find_game(alice, 0);
+    cr_assert_not_null(game, "first game not restored");
+    unsigned char restored[JEUX_PACKED_STATE_SIZE];
+    game_pack_state(game, restored);
+    cr_assert_arr_eq(restored, moved, JEUX_PACKED_STATE_SIZE, "first game not restored as after its move");
+    game_unref(game, "restored game checked");
+    client_unref(alice, "restored player checked");
+    CLIENT *carol = creg_lookup(client_registry, "ckpt_carol");
+    cr_assert_null(carol, "damaged game's player restored");
+    checkpoint_fini();
+    //and the damaged records have been cleared
+    pread(fd, slots, CKPT_SCAN_SLOTS * CKPT_SLOT_SIZE, 0);
+    cr_assert_eq(*(uint64_t *)slots[spare], 0, "torn successor not cleared");
+    cr_assert_eq(*(uint64_t *)slots[second], 0, "damaged record not cleared");
+    cr_assert_neq(*(uint64_t *)slots[first], 0, "intact record cleared");
+    free(slots);
+    close(fd);
+    unlink(path);
+    session_expire_parked();
+    timer_wheel_fini();
+}